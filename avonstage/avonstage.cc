@@ -191,6 +191,7 @@ int RangerGet(Stg::Model *mod, av_msg_t *data)
   Stg::ModelRanger *r = dynamic_cast<Stg::ModelRanger *>(mod);
 
   const std::vector<Stg::ModelRanger::Sensor> &sensors = r->GetSensors();
+  const Stg::ModelRanger::Scan scan = r->GetScan();
 
   rgr.transducer_count = sensors.size();
 
@@ -232,19 +233,16 @@ int RangerGet(Stg::Model *mod, av_msg_t *data)
     t.pose[4] = 0.0;
     t.pose[5] = s.pose.a;
 
-    const std::vector<Stg::meters_t> &ranges = s.ranges;
-    const std::vector<double> &intensities = s.intensities;
+    // the samples of this sensor in the ranger's scan, which is
+    // empty until the ranger has updated
+    t.sample_count = s.offset + s.sample_count <= scan.count ? s.sample_count : 0;
 
-    assert(ranges.size() == intensities.size());
-
-    t.sample_count = ranges.size();
-
-    const double fov_max = s.fov / 2.0;
-    const double fov_min = -fov_max;
-    const double delta = (fov_max - fov_min) / (double)t.sample_count;
+    const float *ranges = scan.ranges + s.offset;
+    const float *intensities = scan.intensities + s.offset;
+    const float *bearings = scan.bearings + s.offset;
 
     for (unsigned int r = 0; r < t.sample_count; r++) {
-      t.samples[r][AV_SAMPLE_BEARING] = fov_min + r * delta;
+      t.samples[r][AV_SAMPLE_BEARING] = bearings[r];
       t.samples[r][AV_SAMPLE_AZIMUTH] = 0.0; // linear scanner
       t.samples[r][AV_SAMPLE_RANGE] = ranges[r];
       t.samples[r][AV_SAMPLE_INTENSITY] = intensities[r];
@@ -0,0 +1,13 @@
+#ifndef _CONFIG_H
+#define _CONFIG_H
+
+#define PROJECT "Stage"
+#define VERSION "4.3.0"
+#define FULL_VERSION 4-3-0
+#define APIVERSION "4.3"
+#define INSTALL_PREFIX "/usr/local"
+#define PLUGIN_PATH "/usr/local/lib/Stage-4.3"
+
+/* #undef BUILD_GUI */
+
+#endif
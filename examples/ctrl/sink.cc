@@ -14,8 +14,8 @@ int Delivery(Model *, void *)
   total,
 //	dynamic_cast<WorldGui*>(mod->GetWorld())->EnergyString().c_str() );
 
-          Stg::PowerPack::global_input / 1e3,
-          Stg::PowerPack::global_dissipated / 1e3 );
+          mod->GetWorld()->GetEnergy().input / 1e3,
+          mod->GetWorld()->GetEnergy().dissipated / 1e3 );
   */
 
   return 0; // run again
@@ -0,0 +1,199 @@
+/////////////////////////////////
+// File: statetest.cc
+// Desc: Stage library test program for saving and restoring world
+//       state. Drives every position model of a world in a circle,
+//       then runs one check on it and exits non-zero if the check
+//       fails. The checks are:
+//         snapshot - a restored snapshot puts the robots back where
+//                    they were, and they go on to repeat their run
+//         clone    - a clone starts where its world is and makes the
+//                    same run
+//         replay   - replaying a trajectory log of a run poses the
+//                    robots as they were logged
+// License: GPL
+/////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "stage.hh"
+
+// poses closer than this are the same
+static const double tolerance = 1e-6;
+
+// find the names of the position models of a world, in order
+static std::vector<std::string> robot_names(const Stg::World &world)
+{
+  std::vector<std::string> names;
+
+  const std::set<Stg::Model *> models(world.GetAllModels());
+  for (std::set<Stg::Model *>::const_iterator it = models.begin(); it != models.end(); ++it)
+    if (dynamic_cast<Stg::ModelPosition *>(*it))
+      names.push_back((*it)->Token());
+
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+static std::vector<Stg::Pose> poses(const Stg::World &world,
+                                    const std::vector<std::string> &names)
+{
+  std::vector<Stg::Pose> result;
+  for (unsigned int idx = 0; idx < names.size(); idx++)
+    result.push_back(world.GetModel(names[idx])->GetGlobalPose());
+  return result;
+}
+
+static void step(Stg::World &world, unsigned int updates)
+{
+  for (unsigned int u = 0; u < updates; u++)
+    world.Update();
+}
+
+// print how far apart two sets of poses are, and return true iff
+// they are the same
+static bool compare(const char *what, const std::vector<Stg::Pose> &expected,
+                    const std::vector<Stg::Pose> &actual)
+{
+  double worst = 0;
+  for (unsigned int idx = 0; idx < expected.size(); idx++) {
+    const double dist = hypot(expected[idx].x - actual[idx].x, expected[idx].y - actual[idx].y);
+    const double turn = fabs(Stg::normalize(expected[idx].a - actual[idx].a));
+    worst = std::max(worst, std::max(dist, turn));
+  }
+
+  const bool same = worst <= tolerance;
+  printf("%-24s %s (largest difference %g)\n", what, same ? "ok" : "FAILED", worst);
+  return same;
+}
+
+static bool check_snapshot(Stg::World &world, const std::vector<std::string> &names,
+                           unsigned int updates)
+{
+  step(world, updates);
+
+  Stg::Snapshot snap;
+  world.SaveSnapshot(snap);
+  const std::vector<Stg::Pose> start = poses(world, names);
+
+  step(world, updates);
+  const std::vector<Stg::Pose> ahead = poses(world, names);
+
+  // go back to the snapshot and do it all again
+  if (!world.RestoreSnapshot(snap)) {
+    puts("failed to restore the snapshot");
+    return false;
+  }
+  bool ok = compare("restored snapshot", start, poses(world, names));
+
+  step(world, updates);
+  ok &= compare("rerun from snapshot", ahead, poses(world, names));
+
+  return ok;
+}
+
+static bool check_clone(Stg::World &world, const std::vector<std::string> &names,
+                        unsigned int updates)
+{
+  step(world, updates);
+
+  Stg::World *clone = world.Clone();
+  if (clone == NULL) {
+    puts("failed to clone the world");
+    return false;
+  }
+
+  bool ok = compare("clone", poses(world, names), poses(*clone, names));
+
+  // the clone carries on from the same point
+  step(world, updates);
+  step(*clone, updates);
+  ok &= compare("clone run", poses(world, names), poses(*clone, names));
+
+  delete clone;
+  return ok;
+}
+
+static bool check_replay(Stg::World &world, const std::vector<std::string> &names,
+                         unsigned int updates, const char *worldfile)
+{
+  const std::string logfile = "statetest.log";
+
+  // log the pose of every robot at every update
+  for (unsigned int idx = 0; idx < names.size(); idx++)
+    world.GetModel(names[idx])->SetLogInterval(1);
+
+  if (!world.StartLog(logfile)) {
+    puts("failed to start the trajectory log");
+    return false;
+  }
+
+  step(world, updates);
+  world.StopLog();
+
+  Stg::World replay("statetest replay");
+  if (!replay.StartReplay(logfile, false)) {
+    puts("failed to read the trajectory log");
+    unlink(logfile.c_str());
+    return false;
+  }
+  replay.Load(worldfile);
+
+  step(replay, updates);
+  const bool ok = compare("replay", poses(world, names), poses(replay, names));
+
+  unlink(logfile.c_str());
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  // check and handle the argumets
+  if (argc < 3) {
+    puts("Usage: statetest <worldfile> snapshot|clone|replay [number of updates]");
+    exit(0);
+  }
+
+  const std::string check = argv[2];
+  const unsigned int updates = argc > 3 ? atoi(argv[3]) : 100;
+
+  // initialize libstage
+  Stg::Init(&argc, &argv);
+
+  // create the world, without a GUI so that it can be stepped here
+  Stg::World world("statetest");
+  world.Load(argv[1]);
+
+  const std::vector<std::string> names = robot_names(world);
+  if (names.empty()) {
+    puts("the world has no position models");
+    exit(1);
+  }
+
+  // drive every robot in a circle
+  for (unsigned int idx = 0; idx < names.size(); idx++) {
+    Stg::ModelPosition *pos = dynamic_cast<Stg::ModelPosition *>(world.GetModel(names[idx]));
+    pos->Subscribe();
+    pos->SetSpeed(0.4, 0, 0.3);
+  }
+
+  bool ok;
+  if (check == "snapshot")
+    ok = check_snapshot(world, names, updates);
+  else if (check == "clone")
+    ok = check_clone(world, names, updates);
+  else if (check == "replay")
+    ok = check_replay(world, names, updates, argv[1]);
+  else {
+    printf("unknown check \"%s\"\n", check.c_str());
+    exit(1);
+  }
+
+  return ok ? 0 : 1;
+}
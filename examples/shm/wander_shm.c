@@ -0,0 +1,137 @@
+/*
+  wander_shm.c
+  the wander controller of examples/ctrl/wander.cc, run in its own
+  process and driving every robot of a world through shared memory.
+
+  USAGE: wander_shm [name]
+
+  Start Stage with worlds/shm.world first, or any world with the
+  shm_name property. name defaults to "/stage".
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stageshm.h"
+
+static const double cruisespeed = 0.4;
+static const double avoidspeed = 0.05;
+static const double avoidturn = 0.5;
+static const double minfrontdistance = 1.0; /* 0.6 */
+static const double stopdist = 0.3;
+static const int avoidduration = 10;
+
+typedef struct {
+  int laser; /* index of the ranger used, or -1 */
+  int avoidcount;
+  double turn; /* the turn speed while avoiding */
+} robot_t;
+
+/* inspect the ranger data and decide what to do */
+static void wander(stg_shm_t *shm, const stg_shm_frame_t *frame, unsigned int index,
+                   robot_t *robot)
+{
+  const stg_shm_ranger_info_t *laser = stg_shm_ranger_infos(shm->header) + robot->laser;
+  const float *scan = stg_shm_frame_ranges(shm->header, frame) + laser->first_range;
+  const unsigned int sample_count = laser->range_count;
+
+  int obstruction = 0;
+  int stop = 0;
+
+  /* find the closest distance to the left and right and check if
+     there's anything in front */
+  double minleft = 1e6;
+  double minright = 1e6;
+  unsigned int i;
+
+  for (i = 0; i < sample_count; i++) {
+    if ((i > (sample_count / 3)) && (i < (sample_count - (sample_count / 3)))
+        && scan[i] < minfrontdistance)
+      obstruction = 1;
+
+    if (scan[i] < stopdist)
+      stop = 1;
+
+    if (i > sample_count / 2)
+      minleft = scan[i] < minleft ? scan[i] : minleft;
+    else
+      minright = scan[i] < minright ? scan[i] : minright;
+  }
+
+  if (obstruction || stop || (robot->avoidcount > 0)) {
+    /* once we start avoiding, select a turn direction and stick
+       with it for a few iterations */
+    if (robot->avoidcount < 1) {
+      robot->avoidcount = random() % avoidduration + avoidduration;
+      robot->turn = minleft < minright ? -avoidturn : avoidturn;
+    }
+
+    stg_shm_command(shm, index, stop ? 0.0 : avoidspeed, 0, robot->turn);
+    robot->avoidcount--;
+  } else {
+    robot->avoidcount = 0;
+    stg_shm_command(shm, index, cruisespeed, 0, 0);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  stg_shm_t *shm = stg_shm_open(argc > 1 ? argv[1] : "/stage");
+  if (shm == NULL)
+    return 1;
+
+  const stg_shm_header_t *header = shm->header;
+  const stg_shm_robot_info_t *info = stg_shm_robot_infos(header);
+  const stg_shm_ranger_info_t *rangers = stg_shm_ranger_infos(header);
+  robot_t *robots = (robot_t *)calloc(header->robot_count, sizeof(robot_t));
+  unsigned int r, i;
+
+  /* find the range finder with the most samples, if more than 8,
+     for each robot: a laser rather than sonars */
+  for (r = 0; r < header->robot_count; ++r) {
+    robots[r].laser = -1;
+
+    for (i = info[r].first_ranger; i < info[r].first_ranger + info[r].ranger_count; ++i)
+      if (rangers[i].range_count > 8
+          && (robots[r].laser < 0 || rangers[i].range_count > rangers[robots[r].laser].range_count))
+        robots[r].laser = i;
+
+    printf("Wander ctrl for robot %s: %s\n", info[r].name,
+           robots[r].laser < 0 ? "no ranger with more than 8 samples" : rangers[robots[r].laser].name);
+  }
+
+  /* in lockstep the latest frame can be read in place, otherwise it
+     is copied so that the world can overwrite it meanwhile */
+  stg_shm_frame_t *copy = (stg_shm_frame_t *)malloc(header->frame_size);
+  uint64_t tick = 0;
+
+  for (;;) {
+    const stg_shm_frame_t *frame;
+
+    if (header->lockstep)
+      frame = stg_shm_latest(shm);
+    else if (stg_shm_read(shm, copy) == 0)
+      frame = copy;
+    else
+      break;
+
+    if (frame == NULL)
+      break;
+
+    tick = frame->tick;
+
+    for (r = 0; r < header->robot_count; ++r)
+      if (robots[r].laser >= 0)
+        wander(shm, frame, r, &robots[r]);
+
+    if (header->lockstep ? stg_shm_step(shm) != 0 : stg_shm_wait(shm, tick) != 0)
+      break;
+  }
+
+  printf("world gone after %llu updates\n", (unsigned long long)tick);
+
+  free(copy);
+  free(robots);
+  stg_shm_close(shm);
+  return 0;
+}
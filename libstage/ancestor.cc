@@ -8,7 +8,10 @@ Ancestor::Ancestor() : child_type_counts(), children(), debug(false), props(), t
 
 Ancestor::~Ancestor()
 {
-  FOR_EACH (it, children)
+  // each child removes itself from children as it is deleted
+  std::vector<Model *> doomed;
+  doomed.swap(children);
+  FOR_EACH (it, doomed)
     delete (*it);
 }
 
@@ -7,24 +7,12 @@ using std::vector;
 static void canonicalize_winding(vector<point_t> &pts);
 
 /** Create a new block. A model's body is a list of these
-    blocks. The point data is copied, so pts can safely be freed
-    after calling this.*/
-Block::Block(BlockGroup *group, const std::vector<point_t> &pts, const Bounds &zrange)
-    : group(group), pts(pts), local_z(zrange), global_z(), rendered_cells()
+    blocks. The block refers to the polygon at the same index in its
+    group's shape.*/
+Block::Block(BlockGroup *group, unsigned int index)
+    : group(group), index(index), global_z(), rendered_cells(), evicted_in()
 {
   assert(group);
-  // canonicalize_winding(this->pts);
-}
-
-/** A from-file  constructor */
-Block::Block(BlockGroup *group, Worldfile *wf, int entity)
-    : group(group), pts(), local_z(), global_z(), rendered_cells()
-{
-  assert(group);
-  assert(wf);
-  assert(entity);
-
-  Load(wf, entity);
 }
 
 Block::~Block()
@@ -35,12 +23,12 @@ Block::~Block()
 
 void Block::Translate(double x, double y)
 {
+  std::vector<point_t> &pts(group->MutableShape().pts[index]);
+
   FOR_EACH (it, pts) {
     it->x += x;
     it->y += y;
   }
-
-  group->BuildDisplayList();
 }
 
 /** Return the value half way between the min and max Y position of
@@ -52,7 +40,7 @@ double Block::CenterY()
   double min = billion;
   double max = -billion;
 
-  FOR_EACH (it, pts) {
+  FOR_EACH (it, Points()) {
     if (it->y > max)
       max = it->y;
     if (it->y < min)
@@ -72,7 +60,7 @@ double Block::CenterX()
   double min = billion;
   double max = -billion;
 
-  FOR_EACH (it, pts) {
+  FOR_EACH (it, Points()) {
     if (it->x > max)
       max = it->x;
     if (it->x < min)
@@ -106,11 +94,9 @@ void Block::SetCenterX(double x)
 
 void Block::SetZ(double min, double max)
 {
+  Bounds &local_z(group->MutableShape().z[index]);
   local_z.min = min;
   local_z.max = max;
-
-  // force redraw
-  group->BuildDisplayList();
 }
 
 void Block::AppendTouchingModels(std::set<Model *> &touchers)
@@ -126,6 +112,24 @@ void Block::AppendTouchingModels(std::set<Model *> &touchers)
     }
 }
 
+void Block::AppendContacts(unsigned int layer, std::vector<Model *> &contacts)
+{
+  const Model &mod(group->mod);
+
+  // for every cell we are rendered into
+  FOR_EACH (cell_it, rendered_cells[layer])
+    // for every block rendered into that cell
+    FOR_EACH (block_it, (*cell_it)->GetBlocks(layer)) {
+      Model *other(&(*block_it)->group->mod);
+
+      if (((mod.watts_give > 0 && other->watts_take > 0)
+           || (mod.watts_take > 0 && other->watts_give > 0))
+          && !mod.IsRelated(other)
+          && std::find(contacts.begin(), contacts.end(), other) == contacts.end())
+        contacts.push_back(other);
+    }
+}
+
 Model *Block::TestCollision()
 {
   // printf( "model %s block %p test collision...\n", mod->Token(), this );
@@ -171,11 +175,13 @@ void Block::Map(unsigned int layer)
 {
   // calculate the global pixel coords of the block vertices
   // and render this block's polygon into the world
-  group->mod.world->MapPoly(group->mod.LocalToPixels(pts), this, layer);
+  group->mod.world->MapPoly(group->mod.LocalToPixels(Points()), this, layer);
+  __sync_fetch_and_add(&group->mod.world->stats.remaps, 1);
 
   // update the block's absolute z bounds at this rendering
   Pose gpose(group->mod.GetGlobalPose());
   gpose.z += group->mod.geom.pose.z;
+  const Bounds &local_z(LocalZ());
   global_z.min = local_z.min + gpose.z;
   global_z.max = local_z.max + gpose.z;
 }
@@ -186,6 +192,9 @@ void Block::UnMap(unsigned int layer)
     (*it)->RemoveBlock(this, layer);
 
   rendered_cells[layer].clear();
+
+  if (!evicted_in.empty())
+    group->mod.world->PurgeEvicted(this, layer);
 }
 
 void swap(int &a, int &b)
@@ -202,6 +211,7 @@ void Block::Rasterize(uint8_t *data, unsigned int width, unsigned int height, me
   // %.2f\n",
   //	 this, width, height, scalex, scaley, offsetx, offsety );
 
+  const std::vector<point_t> &pts(Points());
   const size_t pt_count = pts.size();
   for (size_t i = 0; i < pt_count; ++i) {
     // convert points from local to model coords
@@ -270,15 +280,19 @@ void Block::DrawTop()
 {
   // draw the top of the block - a polygon at the highest vertical
   // extent
+  const double zmax(LocalZ().max);
 
   glBegin(GL_POLYGON);
-  FOR_EACH (it, pts)
-    glVertex3f(it->x, it->y, local_z.max);
+  FOR_EACH (it, Points())
+    glVertex3f(it->x, it->y, zmax);
   glEnd();
 }
 
 void Block::DrawSides()
 {
+  const std::vector<point_t> &pts(Points());
+  const Bounds &local_z(LocalZ());
+
   // construct a strip that wraps around the polygon
   glBegin(GL_QUAD_STRIP);
 
@@ -295,7 +309,7 @@ void Block::DrawSides()
 void Block::DrawFootPrint()
 {
   glBegin(GL_POLYGON);
-  FOR_EACH (it, pts)
+  FOR_EACH (it, Points())
     glVertex2f(it->x, it->y);
   glEnd();
 }
@@ -310,6 +324,8 @@ void Block::Load(Worldfile *wf, int entity)
 {
   const size_t pt_count = wf->ReadInt(entity, "points", 0);
 
+  std::vector<point_t> pts;
+
   char key[256];
   for (size_t p = 0; p < pt_count; ++p) {
     snprintf(key, sizeof(key), "point[%d]", (int)p);
@@ -321,7 +337,9 @@ void Block::Load(Worldfile *wf, int entity)
 
   canonicalize_winding(pts);
 
-  wf->ReadTuple(entity, "z", 0, 2, "ll", &local_z.min, &local_z.max);
+  BlockShape &shape(group->MutableShape());
+  shape.pts[index].swap(pts);
+  wf->ReadTuple(entity, "z", 0, 2, "ll", &shape.z[index].min, &shape.z[index].max);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
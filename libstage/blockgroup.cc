@@ -10,26 +10,214 @@
 using namespace Stg;
 using namespace std;
 
-BlockGroup::BlockGroup(Model &mod) : blocks(), displaylist(0), mod(mod)
+/** Shapes offered to the cache by BlockGroup::Share(), indexed by
+    model type, size and a hash of the geometry. The cache is shared
+    by all worlds, so it is protected by a mutex. */
+static std::map<std::string, BlockShape *> shape_cache;
+static pthread_mutex_t shape_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Display lists of shapes and groups that have been deleted, which
+    can only be freed by the thread that owns the GL context. Protected
+    by shape_cache_mutex. */
+static std::vector<int> freed_displaylists;
+
+bool BlockShape::SameGeometry(const BlockShape &other) const
+{
+  if (pts != other.pts || z.size() != other.z.size())
+    return false;
+
+  for (size_t i = 0; i < z.size(); ++i)
+    if (z[i].min != other.z[i].min || z[i].max != other.z[i].max)
+      return false;
+
+  return true;
+}
+
+BlockGroup::BlockGroup(Model &mod) : blocks(), shape(new BlockShape), displaylist(0), mod(mod)
 { /* empty */
 }
 
 BlockGroup::~BlockGroup()
 {
-  Clear();
+  blocks.clear();
+  Release(shape);
+
+  if (displaylist) {
+    pthread_mutex_lock(&shape_cache_mutex);
+    freed_displaylists.push_back(displaylist);
+    pthread_mutex_unlock(&shape_cache_mutex);
+  }
 }
 
-void BlockGroup::AppendBlock(const Block &block)
+void BlockGroup::AppendBlock(const std::vector<point_t> &pts, const Bounds &zrange)
 {
-  blocks.push_back(block);
+  BlockShape &s(MutableShape());
+  s.pts.push_back(pts);
+  s.z.push_back(zrange);
+
+  blocks.push_back(Block(this, blocks.size()));
+  mod.world->bvh_dirty = true; // the set of blocks has changed
 }
 
 void BlockGroup::Clear()
 {
-  // FOR_EACH( it, blocks )
-  // delete *it;
+  blocks.clear();
+
+  if (shape->refcount > 1 || !shape->key.empty()) {
+    Release(shape);
+    shape = new BlockShape;
+  } else {
+    shape->pts.clear();
+    shape->z.clear();
+    shape->fitted = false;
+    shape->rebuild = true;
+  }
+
+  mod.NeedRedraw();
+  mod.world->bvh_dirty = true; // the blocks are gone
+}
+
+BlockShape &BlockGroup::MutableShape()
+{
+  if (shape->refcount > 1 || !shape->key.empty()) {
+    pthread_mutex_lock(&shape_cache_mutex);
+
+    if (shape->refcount > 1) {
+      // others are using it, so make our own copy
+      BlockShape *copy(new BlockShape);
+      copy->pts = shape->pts;
+      copy->z = shape->z;
+      --shape->refcount;
+      shape = copy;
+    } else {
+      // we are the only user, so just withdraw it from the cache
+      shape_cache.erase(shape->key);
+      shape->key.clear();
+    }
+
+    pthread_mutex_unlock(&shape_cache_mutex);
+  }
+
+  shape->fitted = false;
+  shape->rebuild = true;
+  mod.NeedRedraw();
+
+  // the dynamic hierarchy is refit from the blocks every update, so
+  // only the static one needs rebuilding when a block changes
+  if (World::IsStatic(&mod))
+    mod.world->bvh_dirty = true;
+
+  return *shape;
+}
+
+void BlockGroup::Share()
+{
+  if (shape->refcount > 1 || !shape->key.empty() || blocks.empty())
+    return; // already shared, or nothing worth sharing
+
+  // hash the geometry (FNV-1a) so that groups with the same type and
+  // size but different blocks don't collide too often
+  uint64_t hash(14695981039346656037ULL);
+  const uint64_t prime(1099511628211ULL);
+
+  for (size_t i = 0; i < shape->pts.size(); ++i) {
+    const unsigned char *b;
+
+    if (!shape->pts[i].empty()) {
+      b = (const unsigned char *)&shape->pts[i][0];
+      for (size_t j = 0; j < shape->pts[i].size() * sizeof(point_t); ++j)
+        hash = (hash ^ b[j]) * prime;
+    }
+
+    b = (const unsigned char *)&shape->z[i];
+    for (size_t j = 0; j < sizeof(Bounds); ++j)
+      hash = (hash ^ b[j]) * prime;
+  }
+
+  char key[512];
+  snprintf(key, sizeof(key), "%s %.6f %.6f %.6f %lu %llx", mod.GetModelType().c_str(),
+           mod.geom.size.x, mod.geom.size.y, mod.geom.size.z, (unsigned long)shape->pts.size(),
+           (unsigned long long)hash);
+
+  pthread_mutex_lock(&shape_cache_mutex);
+
+  std::map<std::string, BlockShape *>::iterator it(shape_cache.find(key));
+
+  if (it == shape_cache.end()) {
+    // we are the first with this geometry
+    shape->key = key;
+    shape_cache[key] = shape;
+  } else if (it->second->SameGeometry(*shape)) {
+    // use the existing copy and drop ours
+    BlockShape *found(it->second);
+    ++found->refcount;
+
+    if (shape->displaylist)
+      freed_displaylists.push_back(shape->displaylist);
+    delete shape; // refcount is 1 and it is not in the cache
+    shape = found;
+
+    mod.rebuild_displaylist = true;
+  }
+  // else a hash collision: just keep our own copy
+
+  pthread_mutex_unlock(&shape_cache_mutex);
+}
+
+void BlockGroup::ShareShape(const BlockGroup &other)
+{
+  if (other.shape == shape)
+    return;
+
+  pthread_mutex_lock(&shape_cache_mutex);
+  ++other.shape->refcount;
+  pthread_mutex_unlock(&shape_cache_mutex);
+
+  Release(shape);
+  shape = other.shape;
 
   blocks.clear();
+  for (size_t i = 0; i < shape->pts.size(); ++i)
+    blocks.push_back(Block(this, i));
+
+  mod.NeedRedraw();
+  mod.world->bvh_dirty = true;
+}
+
+void BlockGroup::Reference(BlockShape *shape)
+{
+  pthread_mutex_lock(&shape_cache_mutex);
+  ++shape->refcount;
+  pthread_mutex_unlock(&shape_cache_mutex);
+}
+
+void BlockGroup::Release(BlockShape *shape)
+{
+  pthread_mutex_lock(&shape_cache_mutex);
+
+  if (--shape->refcount == 0) {
+    if (!shape->key.empty())
+      shape_cache.erase(shape->key);
+
+    // we may not have a GL context, so the canvas frees the list
+    if (shape->displaylist)
+      freed_displaylists.push_back(shape->displaylist);
+    delete shape;
+  }
+
+  pthread_mutex_unlock(&shape_cache_mutex);
+}
+
+void BlockGroup::DeleteFreedDisplayLists()
+{
+  std::vector<int> lists;
+
+  pthread_mutex_lock(&shape_cache_mutex);
+  lists.swap(freed_displaylists);
+  pthread_mutex_unlock(&shape_cache_mutex);
+
+  FOR_EACH (it, lists)
+    glDeleteLists(*it, 1);
 }
 
 void BlockGroup::AppendTouchingModels(std::set<Model *> &v)
@@ -38,6 +226,12 @@ void BlockGroup::AppendTouchingModels(std::set<Model *> &v)
     it->AppendTouchingModels(v);
 }
 
+void BlockGroup::AppendContacts(unsigned int layer, std::vector<Model *> &contacts)
+{
+  FOR_EACH (it, blocks)
+    it->AppendContacts(layer, contacts);
+}
+
 Model *BlockGroup::TestCollision()
 {
   Model *hitmod = NULL;
@@ -57,9 +251,9 @@ bounds3d_t BlockGroup::BoundingBox() const
   minx = miny = minz = billion;
   maxx = maxy = maxz = -billion;
 
-  FOR_EACH (it, blocks) {
+  for (size_t i = 0; i < shape->pts.size(); ++i) {
     // examine all the points in the polygon
-    FOR_EACH (pit, it->pts) {
+    FOR_EACH (pit, shape->pts[i]) {
       if (pit->x < minx)
         minx = pit->x;
       if (pit->y < miny)
@@ -70,10 +264,10 @@ bounds3d_t BlockGroup::BoundingBox() const
         maxy = pit->y;
     }
 
-    if (it->local_z.min < minz)
-      minz = it->local_z.min;
-    if (it->local_z.max > maxz)
-      maxz = it->local_z.max;
+    if (shape->z[i].min < minz)
+      minz = shape->z[i].min;
+    if (shape->z[i].max > maxz)
+      maxz = shape->z[i].max;
   }
 
   return bounds3d_t(Bounds(minx, maxx), Bounds(miny, maxy), Bounds(minz, maxz));
@@ -82,6 +276,14 @@ bounds3d_t BlockGroup::BoundingBox() const
 // scale all blocks to fit into the bounding box of this group's model
 void BlockGroup::CalcSize()
 {
+  const Size modsize = mod.geom.size;
+
+  // nothing to do if the points already fit the model, which is
+  // always the case for shapes shared between models
+  if (shape->fitted && shape->fitted_size.x == modsize.x && shape->fitted_size.y == modsize.y
+      && shape->fitted_size.z == modsize.z)
+    return;
+
   const bounds3d_t b = BoundingBox();
 
 // Prevents creating (-)NaNs when dividing by size.{x,y,z}:
@@ -96,19 +298,22 @@ void BlockGroup::CalcSize()
 
   // now scale the blocks to fit in the model's 3d bounding box, so
   // that the original points are now in model coordinates
-  const Size modsize = mod.geom.size;
+  BlockShape &s(MutableShape());
 
-  FOR_EACH (it, blocks) {
+  for (size_t i = 0; i < s.pts.size(); ++i) {
     // polygon edges
-    FOR_EACH (pit, it->pts) {
+    FOR_EACH (pit, s.pts[i]) {
       pit->x = (pit->x - offset.x) * (modsize.x / size.x);
       pit->y = (pit->y - offset.y) * (modsize.y / size.y);
     }
 
     // vertical bounds
-    it->local_z.min = (it->local_z.min - offset.z) * (modsize.z / size.z);
-    it->local_z.max = (it->local_z.max - offset.z) * (modsize.z / size.z);
+    s.z[i].min = (s.z[i].min - offset.z) * (modsize.z / size.z);
+    s.z[i].max = (s.z[i].max - offset.z) * (modsize.z / size.z);
   }
+
+  s.fitted_size = modsize;
+  s.fitted = true;
 }
 
 void BlockGroup::Map(unsigned int layer)
@@ -149,6 +354,39 @@ void BlockGroup::DrawFootPrint(const Geom &)
     it->DrawFootPrint();
 }
 
+void BlockGroup::DrawFootPrint(const BlockShape *shape)
+{
+  FOR_EACH (it, shape->pts) {
+    glBegin(GL_POLYGON);
+    FOR_EACH (pt, *it)
+      glVertex2f(pt->x, pt->y);
+    glEnd();
+  }
+}
+
+void BlockGroup::AppendFootPrint(Gl::VertexBatch &batch, const Pose &pose) const
+{
+  AppendFootPrint(shape, batch, pose);
+}
+
+void BlockGroup::AppendFootPrint(const BlockShape *shape, Gl::VertexBatch &batch, const Pose &pose)
+{
+  const double cosa(cos(pose.a));
+  const double sina(sin(pose.a));
+
+  FOR_EACH (it, shape->pts) {
+    const std::vector<point_t> &pts(*it);
+
+    // a fan, as GL_POLYGON would draw it
+    for (size_t i(2); i < pts.size(); ++i) {
+      const point_t *tri[3] = { &pts[0], &pts[i - 1], &pts[i] };
+      for (unsigned int v(0); v < 3; ++v)
+        batch.Vertex(pose.x + tri[v]->x * cosa - tri[v]->y * sina,
+                     pose.y + tri[v]->x * sina + tri[v]->y * cosa, pose.z);
+    }
+  }
+}
+
 // tesselation callbacks used in BlockGroup::BuildDisplayListTess()------------
 
 static void errorCallback(GLenum errorCode)
@@ -172,21 +410,12 @@ static void combineCallback(GLdouble coords[3],
   // data, and doesn't happen much, but it would be tidy.
 }
 
-// render each block as a polygon extruded into Z
-void BlockGroup::BuildDisplayList()
+// render each block of a shape as a polygon extruded into Z
+static void BuildShapeDisplayList(BlockShape *shape)
 {
   static GLUtesselator *tobj = NULL;
 
-  if (!mod.world->IsGUI())
-    return;
-
-  if (displaylist == 0) {
-    CalcSize(); // todo: is this redundant? count calls per model to figure this
-    // out.
-
-    displaylist = glGenLists(1);
-    assert(displaylist != 0);
-
+  if (tobj == NULL) {
     // Stage polygons need not be convex, so we have to tesselate them for
     // rendering in OpenGL.
     tobj = gluNewTess();
@@ -203,28 +432,24 @@ void BlockGroup::BuildDisplayList()
     gluTessCallback(tobj, GLU_TESS_COMBINE, (GLvoid(*)()) & combineCallback);
   }
 
+  if (shape->displaylist == 0) {
+    shape->displaylist = glGenLists(1);
+    assert(shape->displaylist != 0);
+  }
+
   std::vector<std::vector<GLdouble> > contours;
 
-  FOR_EACH (blk, blocks) {
+  for (size_t i = 0; i < shape->pts.size(); ++i) {
     std::vector<GLdouble> verts;
-    FOR_EACH (it, blk->pts) {
+    FOR_EACH (it, shape->pts[i]) {
       verts.push_back(it->x);
       verts.push_back(it->y);
-      verts.push_back(blk->local_z.max);
+      verts.push_back(shape->z[i].max);
     }
     contours.push_back(verts);
   }
 
-  glNewList(displaylist, GL_COMPILE);
-
-  Gl::pose_shift(mod.GetGeom().pose);
-
-  // draw filled polys
-  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-  glEnable(GL_POLYGON_OFFSET_FILL);
-  glPolygonOffset(0.5, 0.5);
-
-  mod.PushColor(mod.color);
+  glNewList(shape->displaylist, GL_COMPILE);
 
   gluTessBeginPolygon(tobj, NULL);
 
@@ -237,47 +462,87 @@ void BlockGroup::BuildDisplayList()
 
   gluTessEndPolygon(tobj);
 
-  FOR_EACH (blk, blocks)
-    blk->DrawSides();
+  // a strip that wraps around each polygon
+  for (size_t i = 0; i < shape->pts.size(); ++i) {
+    const std::vector<point_t> &pts(shape->pts[i]);
+    const Bounds &local_z(shape->z[i]);
+
+    if (pts.empty())
+      continue;
+
+    glBegin(GL_QUAD_STRIP);
+    FOR_EACH (it, pts) {
+      glVertex3f(it->x, it->y, local_z.max);
+      glVertex3f(it->x, it->y, local_z.min);
+    }
+    glVertex3f(pts[0].x, pts[0].y, local_z.max);
+    glVertex3f(pts[0].x, pts[0].y, local_z.min);
+    glEnd();
+  }
+
+  glEndList();
+
+  shape->rebuild = false;
+}
+
+void BlockGroup::DrawShape(BlockShape *shape, const Geom &geom, const Color &color)
+{
+  // the shape is tesselated once, however many models share it
+  if (shape->displaylist == 0 || shape->rebuild)
+    BuildShapeDisplayList(shape);
+
+  glPushMatrix();
+  Gl::pose_shift(geom.pose);
+
+  // draw filled polys
+  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+  glEnable(GL_POLYGON_OFFSET_FILL);
+  glPolygonOffset(0.5, 0.5);
 
-  mod.PopColor();
+  glColor4f(color.r, color.g, color.b, color.a);
+  glCallList(shape->displaylist);
 
   // now outline the polys
   glDisable(GL_POLYGON_OFFSET_FILL);
   glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
   glDepthMask(GL_FALSE);
 
-  Color c = mod.color;
-  c.r /= 2.0;
-  c.g /= 2.0;
-  c.b /= 2.0;
-  mod.PushColor(c);
+  glColor4f(color.r / 2.0, color.g / 2.0, color.b / 2.0, color.a);
+  glCallList(shape->displaylist);
 
-  gluTessBeginPolygon(tobj, NULL);
+  glDepthMask(GL_TRUE);
+  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 
-  FOR_EACH (contour, contours) {
-    gluTessBeginContour(tobj);
-    for (size_t v = 0; v < contour->size(); v += 3)
-      gluTessVertex(tobj, &(*contour)[v], &(*contour)[v]);
-    gluTessEndContour(tobj);
-  }
+  glPopMatrix();
+}
 
-  gluTessEndPolygon(tobj);
+void BlockGroup::BuildDisplayList()
+{
+  if (!mod.world->IsGUI())
+    return;
 
-  FOR_EACH (blk, blocks)
-    blk->DrawSides();
+  if (displaylist == 0)
+    CalcSize(); // todo: is this redundant? count calls per model to figure this
+                // out.
 
-  glDepthMask(GL_TRUE);
-  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+  // lists cannot be compiled inside each other
+  if (shape->displaylist == 0 || shape->rebuild)
+    BuildShapeDisplayList(shape);
 
-  mod.PopColor();
+  if (displaylist == 0) {
+    displaylist = glGenLists(1);
+    assert(displaylist != 0);
+  }
 
+  // our own list just adds the model's pose and color to the shape
+  glNewList(displaylist, GL_COMPILE);
+  DrawShape(shape, mod.GetGeom(), mod.color);
   glEndList();
 }
 
 void BlockGroup::CallDisplayList()
 {
-  if (displaylist == 0 || mod.rebuild_displaylist) {
+  if (displaylist == 0 || mod.rebuild_displaylist || shape->rebuild) {
     BuildDisplayList();
     mod.rebuild_displaylist = 0;
   }
@@ -287,23 +552,31 @@ void BlockGroup::CallDisplayList()
 
 void BlockGroup::LoadBlock(Worldfile *wf, int entity)
 {
-  AppendBlock(Block(this, wf, entity));
+  AppendBlock(std::vector<point_t>(), Bounds());
+  blocks.back().Load(wf, entity);
   // CalcSize(); // adjust the blocks so they fit in our bounding box
 }
 
+std::string BlockGroup::BitmapPath(const std::string &bitmapfile, Worldfile *wf)
+{
+  if (bitmapfile[0] == '/')
+    return bitmapfile;
+
+  char *workaround_const = strdup(wf->filename.c_str());
+  const std::string full(std::string(dirname(workaround_const)) + "/" + bitmapfile);
+  free(workaround_const);
+  return full;
+}
+
 void BlockGroup::LoadBitmap(const std::string &bitmapfile, Worldfile *wf)
 {
   PRINT_DEBUG1("attempting to load bitmap \"%s\n", bitmapfile.c_str());
 
-  std::string full;
+  // a clone takes the geometry of the world it copies once loaded
+  if (mod.world->clone_source)
+    return;
 
-  if (bitmapfile[0] == '/')
-    full = bitmapfile;
-  else {
-    char *workaround_const = strdup(wf->filename.c_str());
-    full = std::string(dirname(workaround_const)) + "/" + bitmapfile;
-    free(workaround_const);
-  }
+  const std::string full(BitmapPath(bitmapfile, wf));
 
   char buf[512];
   snprintf(buf, 512, "[Image \"%s\"", bitmapfile.c_str());
@@ -316,13 +589,24 @@ void BlockGroup::LoadBitmap(const std::string &bitmapfile, Worldfile *wf)
 
   std::vector<std::vector<point_t> > polys;
 
-  if (polys_from_image_file(full, polys)) {
+  // use the polygons decoded in parallel at load time if we have
+  // them, otherwise decode the image now. The last model to use them
+  // takes them, and the others copy them.
+  std::map<std::string, World::DecodedBitmap>::iterator it(mod.world->bitmap_polys.find(full));
+
+  if (it != mod.world->bitmap_polys.end()) {
+    if (--it->second.users == 0) {
+      polys.swap(it->second.polys);
+      mod.world->bitmap_polys.erase(it);
+    } else
+      polys = it->second.polys;
+  } else if (polys_from_image_file(full, polys)) {
     PRINT_ERR1("failed to load polys from image file \"%s\"", full.c_str());
     return;
   }
 
   FOR_EACH (it, polys)
-    AppendBlock(Block(this, *it, Bounds(0, 1)));
+    AppendBlock(*it, Bounds(0, 1));
 
   CalcSize();
 
@@ -0,0 +1,257 @@
+/*
+  bvh.cc
+  bounding volume hierarchy of block edges, supporting exact ray
+  tracing in world class.
+*/
+
+#include "bvh.hh"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace Stg;
+
+// the most edges in a leaf
+static const uint32_t LEAF_SIZE(4);
+
+// deep enough for any hierarchy that fits in memory, since the
+// edges are split in half at each level
+static const unsigned int STACK_SIZE(64);
+
+/** Orders edge indices by the x or y coordinate of the edges' centres */
+class CentreLess {
+  const std::vector<BvhEdge> &edges;
+  bool y;
+
+public:
+  CentreLess(const std::vector<BvhEdge> &edges, bool y) : edges(edges), y(y) {}
+  bool operator()(uint32_t a, uint32_t b) const
+  {
+    const BvhEdge &ea(edges[a]), &eb(edges[b]);
+    return y ? ea.y0 + ea.y1 < eb.y0 + eb.y1 : ea.x0 + ea.x1 < eb.x0 + eb.x1;
+  }
+};
+
+Bvh::Bvh() : nodes(), edges(), order()
+{
+}
+
+void Bvh::Build(const std::vector<BvhEdge> &src)
+{
+  nodes.clear();
+  edges.clear();
+  order.resize(src.size());
+
+  for (uint32_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+
+  if (src.empty())
+    return;
+
+  // the leaf boxes are fitted to the edges below
+  edges = src;
+  BuildNode(0, order.size());
+
+  // store the edges in leaf order so leaves are contiguous
+  for (uint32_t i = 0; i < order.size(); ++i)
+    edges[i] = src[order[i]];
+
+  Fit();
+}
+
+uint32_t Bvh::BuildNode(uint32_t first, uint32_t last)
+{
+  const uint32_t index(nodes.size());
+  nodes.push_back(Node());
+
+  if (last - first <= LEAF_SIZE) {
+    nodes[index].start = first;
+    nodes[index].count = last - first;
+    return index;
+  }
+
+  // split at the median along the longer side of the edges' centres
+  double xmin(edges[order[first]].x0 + edges[order[first]].x1), xmax(xmin);
+  double ymin(edges[order[first]].y0 + edges[order[first]].y1), ymax(ymin);
+
+  for (uint32_t i = first + 1; i < last; ++i) {
+    const BvhEdge &e(edges[order[i]]);
+    xmin = std::min(xmin, e.x0 + e.x1);
+    xmax = std::max(xmax, e.x0 + e.x1);
+    ymin = std::min(ymin, e.y0 + e.y1);
+    ymax = std::max(ymax, e.y0 + e.y1);
+  }
+
+  const uint32_t mid((first + last) / 2);
+  std::nth_element(order.begin() + first, order.begin() + mid, order.begin() + last,
+                   CentreLess(edges, ymax - ymin > xmax - xmin));
+
+  BuildNode(first, mid);
+  const uint32_t second(BuildNode(mid, last));
+
+  nodes[index].start = second;
+  nodes[index].count = 0;
+  return index;
+}
+
+void Bvh::Refit(const std::vector<BvhEdge> &src)
+{
+  assert(src.size() == edges.size());
+
+  for (uint32_t i = 0; i < order.size(); ++i)
+    edges[i] = src[order[i]];
+
+  Fit();
+}
+
+void Bvh::Fit()
+{
+  // children follow their parents, so fit from the back
+  for (size_t i = nodes.size(); i-- > 0;) {
+    Node &node(nodes[i]);
+
+    if (node.count) {
+      const BvhEdge *e(&edges[node.start]);
+      node.x0 = std::min(e->x0, e->x1);
+      node.x1 = std::max(e->x0, e->x1);
+      node.y0 = std::min(e->y0, e->y1);
+      node.y1 = std::max(e->y0, e->y1);
+
+      for (const BvhEdge *end(e + node.count); ++e < end;) {
+        node.x0 = std::min(node.x0, std::min(e->x0, e->x1));
+        node.x1 = std::max(node.x1, std::max(e->x0, e->x1));
+        node.y0 = std::min(node.y0, std::min(e->y0, e->y1));
+        node.y1 = std::max(node.y1, std::max(e->y0, e->y1));
+      }
+    } else {
+      const Node &a(nodes[i + 1]), &b(nodes[node.start]);
+      node.x0 = std::min(a.x0, b.x0);
+      node.x1 = std::max(a.x1, b.x1);
+      node.y0 = std::min(a.y0, b.y0);
+      node.y1 = std::max(a.y1, b.y1);
+    }
+  }
+}
+
+double Bvh::Entry(const Node &node, double ox, double oy, double ix, double iy, double range)
+{
+  double tx0((node.x0 - ox) * ix), tx1((node.x1 - ox) * ix);
+  if (tx0 > tx1)
+    std::swap(tx0, tx1);
+
+  double ty0((node.y0 - oy) * iy), ty1((node.y1 - oy) * iy);
+  if (ty0 > ty1)
+    std::swap(ty0, ty1);
+
+  const double tmin(std::max(tx0, ty0));
+  const double tmax(std::min(tx1, ty1));
+
+  if (tmax < 0 || tmin > tmax || tmin >= range)
+    return -1; // missed, or further than we care about
+
+  return std::max(tmin, 0.0);
+}
+
+bool Bvh::Intersect(const Ray &r, meters_t &range, const BvhEdge *&hit) const
+{
+  if (nodes.empty())
+    return false;
+
+  const double ox(r.origin.x);
+  const double oy(r.origin.y);
+
+  // eliminate a potential divide by zero in the box tests
+  double dx(cos(r.origin.a));
+  double dy(sin(r.origin.a));
+  if (fabs(dx) < 1e-12)
+    dx = dx < 0 ? -1e-12 : 1e-12;
+  if (fabs(dy) < 1e-12)
+    dy = dy < 0 ? -1e-12 : 1e-12;
+
+  const double ix(1.0 / dx);
+  const double iy(1.0 / dy);
+
+  bool found(false);
+
+  if (Entry(nodes[0], ox, oy, ix, iy, range) < 0)
+    return false;
+
+  // nodes whose boxes the ray enters, with their entry distances
+  uint32_t stack[STACK_SIZE];
+  double entry[STACK_SIZE];
+  unsigned int depth(0);
+
+  stack[depth] = 0;
+  entry[depth++] = 0;
+
+  while (depth) {
+    --depth;
+
+    // a nearer hit may have been found since this node was pushed
+    if (entry[depth] >= range)
+      continue;
+
+    const Node &node(nodes[stack[depth]]);
+
+    if (node.count == 0) {
+      const uint32_t a(stack[depth] + 1), b(node.start);
+      const double ta(Entry(nodes[a], ox, oy, ix, iy, range));
+      const double tb(Entry(nodes[b], ox, oy, ix, iy, range));
+
+      assert(depth + 2 <= STACK_SIZE);
+
+      // push the nearer child last so it is visited first
+      if (ta >= 0 && tb >= 0) {
+        const bool a_first(ta <= tb);
+        stack[depth] = a_first ? b : a;
+        entry[depth++] = a_first ? tb : ta;
+        stack[depth] = a_first ? a : b;
+        entry[depth++] = a_first ? ta : tb;
+      } else if (ta >= 0) {
+        stack[depth] = a;
+        entry[depth++] = ta;
+      } else if (tb >= 0) {
+        stack[depth] = b;
+        entry[depth++] = tb;
+      }
+      continue;
+    }
+
+    for (const BvhEdge *e(&edges[node.start]), *end(e + node.count); e < end; ++e) {
+      if (e->mod == NULL)
+        continue;
+
+      // skip if not in the right z range
+      if (r.ztest && (r.origin.z < e->z.min || r.origin.z > e->z.max))
+        continue;
+
+      // solve origin + t * (dx,dy) == (x0,y0) + u * (ex,ey)
+      const double ex(e->x1 - e->x0);
+      const double ey(e->y1 - e->y0);
+      const double denom(dx * ey - dy * ex);
+
+      if (denom == 0.0) // parallel
+        continue;
+
+      const double wx(e->x0 - ox);
+      const double wy(e->y0 - oy);
+
+      const double t((wx * ey - wy * ex) / denom);
+      if (t < 0.0 || t >= range)
+        continue;
+
+      const double u((wx * dy - wy * dx) / denom);
+      if (u < 0.0 || u > 1.0)
+        continue;
+
+      // test the predicate we were passed
+      if ((*r.func)(e->mod, r.mod, r.arg)) {
+        range = t;
+        hit = e;
+        found = true;
+      }
+    }
+  }
+
+  return found;
+}
@@ -0,0 +1,84 @@
+#pragma once
+/*
+  bvh.hh
+  bounding volume hierarchy of block edges, supporting exact ray
+  tracing in world class.
+*/
+
+#include "stage.hh"
+
+namespace Stg {
+
+/** An edge of a block polygon, in global coordinates */
+class BvhEdge {
+public:
+  double x0, y0, x1, y1;
+  Bounds z; ///< the z extent of the block
+  Model *mod; ///< the model that owns the block, or NULL to ignore the edge
+
+  BvhEdge() : x0(0), y0(0), x1(0), y1(0), z(), mod(NULL) {}
+  BvhEdge(double x0, double y0, double x1, double y1, const Bounds &z, Model *mod)
+      : x0(x0), y0(y0), x1(x1), y1(y1), z(z), mod(mod)
+  {
+  }
+};
+
+/** A hierarchy of axis-aligned boxes over the edges of block polygons
+    in global coordinates, so that a ray can be intersected with the
+    polygons exactly instead of with the cells of the world's
+    grid. The hierarchy keeps its own copy of the edges, so rays can
+    be traced while models move. */
+class Bvh {
+public:
+  Bvh();
+
+  /** Build the hierarchy from scratch over these edges. */
+  void Build(const std::vector<BvhEdge> &edges);
+
+  /** Replace the edges with new positions of the same edges, in the
+  order they were passed to Build(), and fit the boxes around them
+  without changing the hierarchy. Cheap, but the boxes overlap more as
+  the edges move further from where they were built. */
+  void Refit(const std::vector<BvhEdge> &edges);
+
+  /** Returns the number of edges in the hierarchy */
+  size_t EdgeCount() const { return edges.size(); }
+
+  /** Returns the bytes used by the hierarchy */
+  size_t MemoryUsed() const
+  {
+    return nodes.capacity() * sizeof(Node) + edges.capacity() * sizeof(BvhEdge)
+           + order.capacity() * sizeof(uint32_t);
+  }
+
+  /** Intersect the ray with the edges nearer than range. If an edge
+  of a model accepted by the ray's predicate is found, set range to
+  its distance and hit to the edge. Returns true iff there was a hit. */
+  bool Intersect(const Ray &ray, meters_t &range, const BvhEdge *&hit) const;
+
+private:
+  class Node {
+  public:
+    double x0, y0, x1, y1; ///< bounding box
+    /** for a leaf, the index of its first edge. For an inner node,
+    the index of its second child: the first child is the next node. */
+    uint32_t start;
+    uint32_t count; ///< the number of edges in a leaf, 0 for an inner node
+  };
+
+  std::vector<Node> nodes; ///< depth first, so children follow their parents
+  std::vector<BvhEdge> edges; ///< in leaf order
+  std::vector<uint32_t> order; ///< the Build() index of each edge
+
+  uint32_t BuildNode(uint32_t first, uint32_t last);
+
+  /** Fit every box around its edges or children */
+  void Fit();
+
+  /** Returns the distance along the ray (origin ox,oy and inverse
+  direction ix,iy) at which it enters the node's box, or -1 if it does
+  not do so within range. */
+  static double Entry(const Node &node, double ox, double oy, double ix, double iy, double range);
+};
+
+} // namespace Stg
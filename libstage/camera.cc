@@ -47,6 +47,27 @@ void PerspectiveCamera::Draw(void) const
   // zooming needs to happen in the Projection code (don't use glScale for zoom)
 }
 
+void PerspectiveCamera::realDistance(const GLfloat *z_buf, GLfloat *out, size_t count) const
+{
+  const GLfloat num(_z_near * _z_far);
+  const GLfloat far(_z_far);
+  const GLfloat span(_z_far - _z_near);
+
+  // four at a time, loaded before any is stored, so the compiler
+  // turns each group into vector instructions even when out is z_buf
+  size_t i(0);
+  for (; i + 4 <= count; i += 4) {
+    const GLfloat z0(z_buf[i]), z1(z_buf[i + 1]), z2(z_buf[i + 2]), z3(z_buf[i + 3]);
+    out[i] = num / (far - z0 * span);
+    out[i + 1] = num / (far - z1 * span);
+    out[i + 2] = num / (far - z2 * span);
+    out[i + 3] = num / (far - z3 * span);
+  }
+
+  for (; i < count; ++i)
+    out[i] = num / (far - z_buf[i] * span);
+}
+
 void PerspectiveCamera::SetProjection(void) const
 {
   //	SetProjection( pixels_width/pixels_height );
@@ -214,3 +235,91 @@ void OrthoCamera::Save(Worldfile *wf, int sec)
 
   wf->WriteFloat(sec, "scale", scale());
 }
+
+// Frustum
+Frustum::Frustum() : half_width(0), half_height(0)
+{
+  for (int i = 0; i < 16; i++)
+    m[i] = (i % 5 == 0) ? 1 : 0;
+
+  for (int p = 0; p < 6; p++)
+    for (int i = 0; i < 4; i++)
+      planes[p][i] = 0;
+}
+
+void Frustum::Update()
+{
+  GLdouble proj[16], model[16];
+  glGetDoublev(GL_PROJECTION_MATRIX, proj);
+  glGetDoublev(GL_MODELVIEW_MATRIX, model);
+
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  half_width = viewport[2] / 2.0;
+  half_height = viewport[3] / 2.0;
+
+  for (int c = 0; c < 4; c++)
+    for (int r = 0; r < 4; r++) {
+      m[c * 4 + r] = 0;
+      for (int k = 0; k < 4; k++)
+        m[c * 4 + r] += proj[k * 4 + r] * model[c * 4 + k];
+    }
+
+  // each plane is the last row of m plus or minus one of the others
+  // (Gribb and Hartmann)
+  for (int p = 0; p < 6; p++) {
+    const int row = p / 2;
+    const double sign = (p % 2) ? -1 : 1;
+
+    double length = 0;
+    for (int i = 0; i < 4; i++) {
+      planes[p][i] = m[i * 4 + 3] + sign * m[i * 4 + row];
+      if (i < 3)
+        length += planes[p][i] * planes[p][i];
+    }
+
+    length = sqrt(length);
+    if (length > 0)
+      for (int i = 0; i < 4; i++)
+        planes[p][i] /= length;
+  }
+}
+
+bool Frustum::Sees(const bounds3d_t &box) const
+{
+  for (int p = 0; p < 6; p++) {
+    const double *pl = planes[p];
+
+    // the corner furthest inside the plane
+    const double x = pl[0] > 0 ? box.x.max : box.x.min;
+    const double y = pl[1] > 0 ? box.y.max : box.y.min;
+    const double z = pl[2] > 0 ? box.z.max : box.z.min;
+
+    if (pl[0] * x + pl[1] * y + pl[2] * z + pl[3] < 0)
+      return false;
+  }
+
+  return true;
+}
+
+double Frustum::Pixels(const bounds3d_t &box) const
+{
+  const double x = (box.x.min + box.x.max) / 2.0;
+  const double y = (box.y.min + box.y.max) / 2.0;
+  const double z = (box.z.min + box.z.max) / 2.0;
+
+  // the clip coordinate w is 1 everywhere for orthographic cameras,
+  // and grows with the distance for perspective ones
+  const double w = m[3] * x + m[7] * y + m[11] * z + m[15];
+  if (w <= 1e-6)
+    return 1e6; // at or behind the eye: close enough to be big
+
+  const double size = hypot(hypot(box.x.max - box.x.min, box.y.max - box.y.min),
+                            box.z.max - box.z.min);
+
+  // how far a meter moves in x and y of the screen, at most
+  const double sx = sqrt(m[0] * m[0] + m[4] * m[4] + m[8] * m[8]) * half_width;
+  const double sy = sqrt(m[1] * m[1] + m[5] * m[5] + m[9] * m[9]) * half_height;
+
+  return size * std::max(sx, sy) / w;
+}
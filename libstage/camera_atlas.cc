@@ -0,0 +1,232 @@
+/*
+  camera_atlas.cc
+  the offscreen framebuffer that the GUI cameras draw their frames
+  into, read back asynchronously through pixel buffer objects.
+*/
+
+// for the framebuffer and buffer object functions in glext.h
+#define GL_GLEXT_PROTOTYPES 1
+
+#include "canvas.hh"
+
+using namespace Stg;
+
+// tiles are placed in rows no wider than this, unless a tile is
+static const int ATLAS_WIDTH(1024);
+
+// framebuffer objects are core from GL 3.0, pixel buffer objects from
+// 2.1. Returns -1 if there is no GL context to ask yet.
+static int gl_supports_atlas()
+{
+  const char *version(reinterpret_cast<const char *>(glGetString(GL_VERSION)));
+  if (version == NULL)
+    return -1;
+
+  int major(0), minor(0);
+  sscanf(version, "%d.%d", &major, &minor);
+
+  if (major >= 3)
+    return 1;
+
+  const char *extensions(reinterpret_cast<const char *>(glGetString(GL_EXTENSIONS)));
+  return (major == 2 && minor >= 1 && extensions
+          && strstr(extensions, "GL_ARB_framebuffer_object") != NULL);
+}
+
+CameraAtlas::CameraAtlas()
+    : tiles(), width(0), height(0), shelf_x(0), shelf_y(0), shelf_height(0), supported(-1),
+      fbo(0), color_rb(0), depth_rb(0), next(0), mapped(-1), mapped_data(NULL), window_fbo(0)
+{
+  pbo[0] = pbo[1] = 0;
+  viewport[0] = viewport[1] = viewport[2] = viewport[3] = 0;
+}
+
+int CameraAtlas::AddTile(int w, int h)
+{
+  if (supported < 0) {
+    supported = gl_supports_atlas();
+    if (supported == 0)
+      PRINT_WARN("no framebuffer objects in this GL, so cameras draw in the window");
+  }
+
+  if (supported < 1)
+    return -1;
+
+  // start a new row if the tile does not fit on this one
+  int x(shelf_x), y(shelf_y), row_height(shelf_height);
+  if (x > 0 && x + w > std::max(ATLAS_WIDTH, width)) {
+    x = 0;
+    y += row_height;
+    row_height = 0;
+  }
+
+  const int new_width(std::max(width, x + w));
+  const int new_height(std::max(height, y + std::max(row_height, h)));
+
+  GLint max_size(0);
+  glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &max_size);
+  if (new_width > max_size || new_height > max_size) {
+    PRINT_WARN2("a %dx%d camera does not fit in the framebuffer, so it draws in the window", w,
+                h);
+    return -1;
+  }
+
+  if (new_width != width || new_height != height)
+    Resize(new_width, new_height);
+
+  if (supported < 1)
+    return -1;
+
+  Tile tile;
+  tile.x = x;
+  tile.y = y;
+  tile.width = w;
+  tile.height = h;
+  tile.drawn = false;
+  tiles.push_back(tile);
+
+  shelf_x = x + w;
+  shelf_y = y;
+  shelf_height = std::max(row_height, h);
+
+  return tiles.size() - 1;
+}
+
+void CameraAtlas::Resize(int w, int h)
+{
+  Unmap();
+
+  if (fbo == 0) {
+    glGenFramebuffers(1, &fbo);
+    glGenRenderbuffers(1, &color_rb);
+    glGenRenderbuffers(1, &depth_rb);
+    glGenBuffers(2, pbo);
+  }
+
+  glBindRenderbuffer(GL_RENDERBUFFER, color_rb);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, w, h);
+  glBindRenderbuffer(GL_RENDERBUFFER, depth_rb);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w, h);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &window_fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color_rb);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_rb);
+  const GLenum status(glCheckFramebufferStatus(GL_FRAMEBUFFER));
+  glBindFramebuffer(GL_FRAMEBUFFER, window_fbo);
+
+  if (status != GL_FRAMEBUFFER_COMPLETE) {
+    PRINT_WARN1("camera framebuffer is incomplete (0x%x), so cameras draw in the window", status);
+    supported = 0;
+    return;
+  }
+
+  // a read is the depth of every pixel as a float, then their RGBA
+  for (unsigned int i(0); i < 2; ++i) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[i]);
+    glBufferData(GL_PIXEL_PACK_BUFFER, w * h * (sizeof(GLfloat) + 4), NULL, GL_STREAM_READ);
+    read_tiles[i].clear();
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  width = w;
+  height = h;
+}
+
+void CameraAtlas::Begin(int tile)
+{
+  Tile &t(tiles[tile]);
+
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &window_fbo);
+  glGetIntegerv(GL_VIEWPORT, viewport);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glViewport(t.x, t.y, t.width, t.height);
+
+  glScissor(t.x, t.y, t.width, t.height);
+  glEnable(GL_SCISSOR_TEST);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  glDisable(GL_SCISSOR_TEST);
+
+  t.drawn = true;
+}
+
+void CameraAtlas::End()
+{
+  glBindFramebuffer(GL_FRAMEBUFFER, window_fbo);
+  glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+}
+
+void CameraAtlas::Readback()
+{
+  bool drawn(false);
+  FOR_EACH (it, tiles)
+    drawn |= it->drawn;
+
+  // keep the mapped read until there is a newer one
+  if (!drawn)
+    return;
+
+  // the last call mapped the pbo read into the call before it
+  if (mapped == static_cast<int>(next))
+    Unmap();
+
+  read_tiles[next].resize(tiles.size());
+  for (size_t i(0); i < tiles.size(); ++i) {
+    read_tiles[next][i] = tiles[i].drawn;
+    tiles[i].drawn = false;
+  }
+
+  // with a pixel pack buffer bound, glReadPixels() returns at once
+  // and the pointers are offsets into the buffer
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &window_fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[next]);
+  glReadPixels(0, 0, width, height, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+  glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE,
+               reinterpret_cast<GLvoid *>(width * height * sizeof(GLfloat)));
+  glBindFramebuffer(GL_FRAMEBUFFER, window_fbo);
+
+  // the previous read has had an update to complete, so mapping it
+  // should not wait
+  const unsigned int last(next ^ 1);
+  if (mapped < 0 && !read_tiles[last].empty()) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[last]);
+    mapped_data = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    if (mapped_data)
+      mapped = last;
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  next = last;
+}
+
+int CameraAtlas::Fetch(int tile, const GLfloat *&depth, const GLubyte *&rgba) const
+{
+  if (mapped < 0 || tile >= static_cast<int>(read_tiles[mapped].size())
+      || !read_tiles[mapped][tile])
+    return 0;
+
+  const Tile &t(tiles[tile]);
+  const size_t first(t.x + t.y * width);
+
+  depth = static_cast<const GLfloat *>(mapped_data) + first;
+  rgba = reinterpret_cast<const GLubyte *>(static_cast<const GLfloat *>(mapped_data)
+                                           + width * height)
+         + 4 * first;
+  return width;
+}
+
+void CameraAtlas::Unmap()
+{
+  if (mapped < 0)
+    return;
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[mapped]);
+  glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  mapped = -1;
+  mapped_data = NULL;
+}
@@ -33,19 +33,199 @@ static const int checkImageHeight = 2;
 static GLubyte checkImage[checkImageHeight][checkImageWidth][4];
 static bool blur = true;
 
+// models less than this many pixels across are drawn as points
+static const GLfloat LOD_PIXELS = 2;
+
+// speech bubble colors
+static const Color BUBBLE_FILL(1.0, 0.8, 0.8); // light blue/grey
+static const Color BUBBLE_BORDER(0, 0, 0); // black
+static const Color BUBBLE_TEXT(0, 0, 0); // black
+
+// the height per usec of age of the risen trails
+static const double TRAIL_TIMESCALE(1e-7);
+
 static bool init_done = false;
 static bool texture_load_done = false;
 
 // GLuint glowTex;
 GLuint checkTex;
 
+RenderModel::RenderModel()
+    : mod(NULL), descendants(0), token(), pose(), geom(), color(), bounds(), height(0), shape(NULL),
+      stall(false), grid(false), say(), flags(), trail(), trail_index(0), data(), live(),
+      live_data(false)
+{
+}
+
+RenderModel::RenderModel(const RenderModel &other)
+    : mod(other.mod), descendants(other.descendants), token(other.token), pose(other.pose),
+      geom(other.geom), color(other.color), bounds(other.bounds), height(other.height), shape(NULL),
+      stall(other.stall), grid(other.grid), say(other.say), flags(other.flags), trail(other.trail),
+      trail_index(other.trail_index), data(), live(other.live), live_data(other.live_data)
+{
+  SetShape(other.shape);
+
+  FOR_EACH (it, other.data)
+    data.push_back((*it)->Clone());
+}
+
+RenderModel &RenderModel::operator=(const RenderModel &other)
+{
+  mod = other.mod;
+  descendants = other.descendants;
+  token = other.token;
+  pose = other.pose;
+  geom = other.geom;
+  color = other.color;
+  bounds = other.bounds;
+  height = other.height;
+  SetShape(other.shape);
+  stall = other.stall;
+  grid = other.grid;
+  say = other.say;
+  flags = other.flags;
+  trail = other.trail;
+  trail_index = other.trail_index;
+
+  if (&other != this) {
+    ClearData();
+    FOR_EACH (it, other.data)
+      data.push_back((*it)->Clone());
+    live = other.live;
+    live_data = other.live_data;
+  }
+  return *this;
+}
+
+RenderModel::~RenderModel()
+{
+  SetShape(NULL);
+  ClearData();
+}
+
+void RenderModel::ClearData()
+{
+  FOR_EACH (it, data)
+    delete *it;
+  data.clear();
+  live.clear();
+  live_data = false;
+}
+
+void RenderModel::SetShape(BlockShape *s)
+{
+  if (s == shape)
+    return;
+
+  if (s)
+    BlockGroup::Reference(s);
+  if (shape)
+    BlockGroup::Release(shape);
+
+  shape = s;
+}
+
+RenderBuffers::RenderBuffers()
+    : latest(0), writing(-1), reading(-1), fresh(false), skipped(false)
+{
+  pthread_mutex_init(&mutex, NULL);
+}
+
+RenderBuffers::~RenderBuffers()
+{
+  pthread_mutex_destroy(&mutex);
+}
+
+RenderSnapshot &RenderBuffers::Write()
+{
+  pthread_mutex_lock(&mutex);
+
+  // overwrite the older snapshot, unless the canvas is drawing it, in
+  // which case the latest one has not been drawn and can go
+  writing = (1 - latest == reading) ? latest : 1 - latest;
+  RenderSnapshot &snap(snapshots[writing]);
+
+  pthread_mutex_unlock(&mutex);
+  return snap;
+}
+
+void RenderBuffers::Publish()
+{
+  pthread_mutex_lock(&mutex);
+  latest = writing;
+  writing = -1;
+  fresh = true;
+  skipped = false;
+  pthread_mutex_unlock(&mutex);
+}
+
+const RenderSnapshot &RenderBuffers::Acquire()
+{
+  pthread_mutex_lock(&mutex);
+
+  // while the latest snapshot is overwritten, the one before it is
+  // still complete
+  reading = (latest == writing) ? 1 - latest : latest;
+  fresh = false;
+  const RenderSnapshot &snap(snapshots[reading]);
+
+  pthread_mutex_unlock(&mutex);
+  return snap;
+}
+
+void RenderBuffers::Release()
+{
+  pthread_mutex_lock(&mutex);
+  reading = -1;
+  pthread_mutex_unlock(&mutex);
+}
+
+bool RenderBuffers::Fresh()
+{
+  pthread_mutex_lock(&mutex);
+  const bool f(fresh);
+  pthread_mutex_unlock(&mutex);
+  return f;
+}
+
+bool RenderBuffers::SetShown(const RenderShown &s)
+{
+  pthread_mutex_lock(&mutex);
+  const bool changed(!(s == shown));
+  if (changed)
+    shown = s;
+  pthread_mutex_unlock(&mutex);
+  return changed;
+}
+
+RenderShown RenderBuffers::Shown()
+{
+  pthread_mutex_lock(&mutex);
+  const RenderShown s(shown);
+  pthread_mutex_unlock(&mutex);
+  return s;
+}
+
+void RenderBuffers::Skip()
+{
+  pthread_mutex_lock(&mutex);
+  skipped = true;
+  pthread_mutex_unlock(&mutex);
+}
+
+bool RenderBuffers::Skipped()
+{
+  pthread_mutex_lock(&mutex);
+  const bool s(skipped);
+  pthread_mutex_unlock(&mutex);
+  return s;
+}
+
 void Canvas::TimerCallback(Canvas *c)
 {
-  if (c->world->dirty) {
-    // puts( "timer redraw" );
+  // redraw when the simulation has published a new snapshot
+  if (c->snapshots.Fresh())
     c->redraw();
-    c->world->dirty = false;
-  }
 
   Fl::repeat_timeout(c->interval / 1000.0, (Fl_Timeout_Handler)Canvas::TimerCallback, c);
 }
@@ -54,6 +234,8 @@ Canvas::Canvas(WorldGui *world, int x, int y, int width, int height)
     : Fl_Gl_Window(x, y, width, height), colorstack(), models_sorted(), current_camera(NULL),
       camera(), perspective_camera(), dirty_buffer(false), wf(NULL), startx(-1), starty(-1),
       selected_models(), last_selection(NULL), interval(40), // msec between redraws
+      rays(GL_LINES), snapshot(NULL), frustum(), visible_models(), distant_models(GL_POINTS),
+      footprints(GL_TRIANGLES), flags(GL_TRIANGLES), trail_arrows(),
       // initialize Option objects
       //  showBlinken( "Blinkenlights", "show_blinkenlights", "", true, world ),
       showBBoxes("Debug/Bounding boxes", "show_boundingboxes", "^b", false, world),
@@ -75,7 +257,9 @@ Canvas::Canvas(WorldGui *world, int x, int y, int width, int height)
       pCamOn("Perspective camera", "pcam_on", "r", false, world),
       visualizeAll("Selected only", "vis_all", "v", false, world),
       // and the rest
-      graphics(true), world(world), frames_rendered_count(0), screenshot_frame_skip(1)
+      graphics(true), world(world), frames_rendered_count(0), screenshot_frame_skip(1),
+      sensor_areas(GL_TRIANGLES), sensor_lines(GL_LINES), sensor_points(GL_POINTS),
+      camera_atlas(), snapshots()
 {
   end();
   // show(); // must do this so that the GL context is created before
@@ -197,7 +381,8 @@ void Canvas::InitTextures()
 
 Canvas::~Canvas()
 {
-  // nothing to do
+  FOR_EACH (it, trail_arrows)
+    delete it->second;
 }
 
 Model *Canvas::getModel(int x, int y)
@@ -400,7 +585,10 @@ int Canvas::handle(int event)
   {
     // else
     {
+      // the picker draws the models themselves
+      world->LockWorld();
       Model *mod = getModel(startx, starty);
+      world->UnlockWorld();
       startx = Fl::event_x();
       starty = Fl::event_y();
       selectedModel = false;
@@ -458,10 +646,12 @@ int Canvas::handle(int event)
         double x, y, z;
         CanvasToWorld(Fl::event_x(), Fl::event_y(), &x, &y, &z);
         // move all selected models to the mouse pointer
+        world->LockWorld();
         FOR_EACH (it, selected_models) {
           Model *mod = *it;
           mod->AddToPose(x - sx, y - sy, 0, 0);
         }
+        world->UnlockWorld();
       } else {
         // started dragging on empty space or an
         //  unselected model, move the canvas
@@ -477,10 +667,12 @@ int Canvas::handle(int event)
       // rotate all selected models
 
       if (selected_models.size()) {
+        world->LockWorld();
         FOR_EACH (it, selected_models) {
           Model *mod = *it;
           mod->AddToPose(0, 0, 0, 0.05 * (dx + dy));
         }
+        world->UnlockWorld();
       } else {
         // printf( "button 2\n" );
 
@@ -592,10 +784,8 @@ void Canvas::RemoveModel(Model *mod)
   EraseAll(mod, models_sorted);
 }
 
-void Canvas::DrawGlobalGrid()
+void Canvas::DrawGlobalGrid(const bounds3d_t &bounds)
 {
-  bounds3d_t bounds = world->GetExtent();
-
   glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 
   glEnable(GL_POLYGON_OFFSET_FILL);
@@ -667,8 +857,11 @@ void Canvas::DrawGlobalGrid()
 // draw the floor without any grid ( for robot's perspective camera model )
 void Canvas::DrawFloor()
 {
-  bounds3d_t bounds = world->GetExtent();
+  DrawFloor(world->GetExtent());
+}
 
+void Canvas::DrawFloor(const bounds3d_t &bounds)
+{
   glEnable(GL_POLYGON_OFFSET_FILL);
   glPolygonOffset(2.0, 2.0);
 
@@ -688,6 +881,108 @@ void Canvas::DrawBlocks()
     (*it)->DrawBlocksTree();
 }
 
+void Canvas::CullModels()
+{
+  frustum.Update();
+
+  visible_models.clear();
+  distant_models.Clear();
+
+  // the boxes of the top level models are around their descendants too
+  const std::vector<RenderModel> &models(snapshot->models);
+  for (size_t i(0); i < models.size(); i += models[i].descendants + 1) {
+    const RenderModel &rm(models[i]);
+
+    if (!frustum.Sees(rm.bounds))
+      continue;
+
+    if (frustum.Pixels(rm.bounds) < LOD_PIXELS) {
+      distant_models.SetColor(rm.color);
+      distant_models.Vertex((rm.bounds.x.min + rm.bounds.x.max) / 2.0,
+                            (rm.bounds.y.min + rm.bounds.y.max) / 2.0, rm.bounds.z.max);
+    } else
+      visible_models.push_back(&rm);
+  }
+}
+
+void Canvas::DrawVisibleBlocks()
+{
+  FOR_EACH (it, visible_models)
+    DrawBlocksTree(*it);
+
+  glPointSize(LOD_PIXELS);
+  distant_models.Draw();
+  glPointSize(1);
+}
+
+void Canvas::DrawBlocksTree(const RenderModel *rm)
+{
+  for (const RenderModel *it(rm); it <= rm + rm->descendants; ++it) {
+    if (it->shape->pts.empty())
+      continue;
+
+    glPushMatrix();
+    Gl::pose_shift(it->pose);
+    BlockGroup::DrawShape(it->shape, it->geom, it->color);
+    glPopMatrix();
+  }
+}
+
+const RenderModel *Canvas::Find(const Model *mod) const
+{
+  if (mod)
+    FOR_EACH (it, snapshot->models)
+      if (it->mod == mod)
+        return &*it;
+
+  return NULL;
+}
+
+bool Canvas::DataShown(const Model *mod) const
+{
+  if (!visualizeAll.val())
+    return true;
+
+  if (selected_models.size() > 0)
+    return std::find(selected_models.begin(), selected_models.end(), mod)
+           != selected_models.end();
+
+  return mod == last_selection;
+}
+
+bool Canvas::DataInView(const RenderModel &rm, meters_t reach) const
+{
+  if (reach < 0)
+    return true;
+
+  bounds3d_t box(rm.bounds);
+  box.x.min -= reach;
+  box.x.max += reach;
+  box.y.min -= reach;
+  box.y.max += reach;
+
+  return frustum.Sees(box);
+}
+
+void Canvas::DrawSensorBatches()
+{
+  // the translucent areas do not hide each other, nor what is drawn
+  // after them
+  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+  glDepthMask(GL_FALSE);
+  sensor_areas.Draw();
+  glDepthMask(GL_TRUE);
+
+  sensor_lines.Draw();
+
+  glPointSize(2);
+  sensor_points.Draw();
+
+  sensor_areas.Clear();
+  sensor_lines.Clear();
+  sensor_points.Clear();
+}
+
 void Canvas::DrawBoundingBoxes()
 {
   glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
@@ -695,22 +990,536 @@ void Canvas::DrawBoundingBoxes()
   glPointSize(5.0);
   //glDisable(GL_CULL_FACE);
 
-  world->DrawBoundingBoxTree();
+  FOR_EACH (it, snapshot->models) {
+    const Geom &geom(it->geom);
+
+    glPushMatrix();
+    Gl::pose_shift(it->pose);
+    Gl::pose_shift(geom.pose);
+
+    PushColor(it->color);
+
+    glBegin(GL_QUAD_STRIP);
+
+    glVertex3f(-geom.size.x / 2.0, -geom.size.y / 2.0, geom.size.z);
+    glVertex3f(-geom.size.x / 2.0, -geom.size.y / 2.0, 0);
+
+    glVertex3f(+geom.size.x / 2.0, -geom.size.y / 2.0, geom.size.z);
+    glVertex3f(+geom.size.x / 2.0, -geom.size.y / 2.0, 0);
+
+    glVertex3f(+geom.size.x / 2.0, +geom.size.y / 2.0, geom.size.z);
+    glVertex3f(+geom.size.x / 2.0, +geom.size.y / 2.0, 0);
+
+    glVertex3f(+geom.size.x / 2.0, +geom.size.y / 2.0, geom.size.z);
+    glVertex3f(+geom.size.x / 2.0, +geom.size.y / 2.0, 0);
+
+    glVertex3f(-geom.size.x / 2.0, +geom.size.y / 2.0, geom.size.z);
+    glVertex3f(-geom.size.x / 2.0, +geom.size.y / 2.0, 0);
+
+    glVertex3f(-geom.size.x / 2.0, -geom.size.y / 2.0, geom.size.z);
+    glVertex3f(-geom.size.x / 2.0, -geom.size.y / 2.0, 0);
+
+    glEnd();
+
+    glBegin(GL_LINES);
+    glVertex2f(-0.02, 0);
+    glVertex2f(+0.02, 0);
+
+    glVertex2f(0, -0.02);
+    glVertex2f(0, +0.02);
+    glEnd();
+
+    PopColor();
+    glPopMatrix();
+  }
 
   //glEnable(GL_CULL_FACE);
   glLineWidth(1.0);
   glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 }
 
+void Canvas::DrawSelected(const RenderModel &rm)
+{
+  glPushMatrix();
+
+  glTranslatef(rm.pose.x, rm.pose.y, rm.pose.z + 0.01); // tiny Z offset raises rect above grid
+
+  char buf[64];
+  snprintf(buf, 63, "%s [%.2f %.2f %.2f %.2f]", rm.token.c_str(), rm.pose.x, rm.pose.y, rm.pose.z,
+           rtod(rm.pose.a));
+
+  PushColor(0, 0, 0, 1); // text color black
+  Gl::draw_string(0.5, 0.5, 0.5, buf);
+
+  glRotatef(rtod(rm.pose.a), 0, 0, 1);
+
+  Gl::pose_shift(rm.geom.pose);
+
+  double dx = rm.geom.size.x / 2.0 * 1.6;
+  double dy = rm.geom.size.y / 2.0 * 1.6;
+
+  PopColor();
+
+  PushColor(0, 1, 0, 0.4); // highlight color blue
+  glRectf(-dx, -dy, dx, dy);
+  PopColor();
+
+  PushColor(0, 1, 0, 0.8); // highlight color blue
+  glLineWidth(1);
+  glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+  glRectf(-dx, -dy, dx, dy);
+  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+  PopColor();
+
+  glPopMatrix();
+}
+
+void Canvas::DrawGrid(const RenderModel &rm)
+{
+  if (!rm.grid)
+    return;
+
+  glPushMatrix();
+  Gl::pose_shift(rm.pose);
+
+  bounds3d_t vol;
+  vol.x.min = -rm.geom.size.x / 2.0;
+  vol.x.max = rm.geom.size.x / 2.0;
+  vol.y.min = -rm.geom.size.y / 2.0;
+  vol.y.max = rm.geom.size.y / 2.0;
+  vol.z.min = 0;
+  vol.z.max = rm.geom.size.z;
+
+  PushColor(0, 0, 1, 0.4);
+  Gl::draw_grid(vol);
+  PopColor();
+  glPopMatrix();
+}
+
+void Canvas::DrawStatusTree(const RenderModel *rm)
+{
+  for (const RenderModel *it(rm); it <= rm + rm->descendants; ++it)
+    DrawStatus(*it);
+}
+
+void Canvas::DrawStatus(const RenderModel &rm)
+{
+  if (!rm.say.empty()) {
+    float pitch = -camera.pitch();
+    float yaw = -camera.yaw();
+
+    glPushMatrix();
+
+    // move above the robot
+    glTranslatef(rm.pose.x, rm.pose.y, rm.pose.z + 0.5);
+
+    // rotate to face screen
+    glRotatef(-yaw, 0, 0, 1);
+    glRotatef(-pitch, 1, 0, 0);
+
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+
+    // get raster positition, add gl_width, then project back to world coords
+    glRasterPos3f(0, 0, 0);
+    GLfloat pos[4];
+    glGetFloatv(GL_CURRENT_RASTER_POSITION, pos);
+
+    GLboolean valid;
+    glGetBooleanv(GL_CURRENT_RASTER_POSITION_VALID, &valid);
+
+    if (valid) {
+      // fl_font( FL_HELVETICA, 12 );
+      float w = gl_width(rm.say.c_str()); // scaled text width
+      float h = gl_height(); // scaled text height
+
+      GLdouble wx, wy, wz;
+      GLint viewport[4];
+      glGetIntegerv(GL_VIEWPORT, viewport);
+
+      GLdouble modelview[16];
+      glGetDoublev(GL_MODELVIEW_MATRIX, modelview);
+
+      GLdouble projection[16];
+      glGetDoublev(GL_PROJECTION_MATRIX, projection);
+
+      // get width and height in world coords
+      gluUnProject(pos[0] + w, pos[1], pos[2], modelview, projection, viewport, &wx, &wy, &wz);
+      w = wx;
+      gluUnProject(pos[0], pos[1] + h, pos[2], modelview, projection, viewport, &wx, &wy, &wz);
+      h = wy;
+
+      // calculate speech bubble margin
+      const float m = h / 10;
+
+      // draw inside of bubble
+      PushColor(BUBBLE_FILL);
+      glPushAttrib(GL_POLYGON_BIT | GL_LINE_BIT);
+      glPolygonMode(GL_FRONT, GL_FILL);
+      glEnable(GL_POLYGON_OFFSET_FILL);
+      glPolygonOffset(1.0, 1.0);
+      Gl::draw_octagon(w, h, m);
+      glDisable(GL_POLYGON_OFFSET_FILL);
+      PopColor();
+
+      // draw outline of bubble
+      PushColor(BUBBLE_BORDER);
+      glLineWidth(1);
+      glEnable(GL_LINE_SMOOTH);
+      glPolygonMode(GL_FRONT, GL_LINE);
+      Gl::draw_octagon(w, h, m);
+      glPopAttrib();
+      PopColor();
+
+      PushColor(BUBBLE_TEXT);
+      // draw text inside the bubble
+      Gl::draw_string(m, 2.5 * m, 0, rm.say.c_str());
+      PopColor();
+    }
+
+    glPopMatrix();
+  }
+
+  if (rm.stall)
+    DrawImage(TextureManager::getInstance()._stall_texture_id, rm);
+}
+
+void Canvas::DrawImage(uint32_t texture_id, const RenderModel &rm)
+{
+  float yaw, pitch;
+  pitch = -camera.pitch();
+  yaw = -camera.yaw();
+
+  glPolygonMode(GL_FRONT, GL_FILL);
+
+  glEnable(GL_TEXTURE_2D);
+  glBindTexture(GL_TEXTURE_2D, texture_id);
+
+  glColor4f(1.0, 1.0, 1.0, 1.0);
+  glPushMatrix();
+
+  // position image above the robot
+  glTranslatef(rm.pose.x, rm.pose.y, rm.pose.z + rm.height + 0.3);
+
+  // rotate to face screen
+  glRotatef(-yaw, 0, 0, 1);
+  glRotatef(-pitch - 90, 1, 0, 0);
+
+  // draw a square, with the textured image
+  glBegin(GL_QUADS);
+  glTexCoord2f(0.0f, 0.0f);
+  glVertex3f(-0.25f, 0, -0.25f);
+  glTexCoord2f(1.0f, 0.0f);
+  glVertex3f(0.25f, 0, -0.25f);
+  glTexCoord2f(1.0f, 1.0f);
+  glVertex3f(0.25f, 0, 0.25f);
+  glTexCoord2f(0.0f, 1.0f);
+  glVertex3f(-0.25f, 0, 0.25f);
+  glEnd();
+
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glDisable(GL_TEXTURE_2D);
+
+  glPopMatrix();
+}
+
+// the box around a trail item, which is where the model was then
+static bounds3d_t trail_bounds(const Pose &pose, const Geom &geom, meters_t z)
+{
+  const meters_t r(hypot(geom.size.x, geom.size.y) / 2.0 + hypot(geom.pose.x, geom.pose.y));
+  return bounds3d_t(Bounds(pose.x - r, pose.x + r), Bounds(pose.y - r, pose.y + r),
+                    Bounds(z, z + geom.size.z));
+}
+
+void Canvas::AppendTrailFootprint(const RenderModel &rm)
+{
+  double darkness = 0;
+  double fade = 0.5 / (double)(rm.trail.size() + 1);
+
+  for (unsigned int i = 0; i < rm.trail.size(); i++) {
+
+    // find correct offset inside ring buffer
+    const Model::TrailItem &checkpoint = rm.trail[(i + rm.trail_index) % rm.trail.size()];
+
+    // ignore invalid items
+    if (checkpoint.time == 0)
+      continue;
+
+    darkness += fade;
+
+    if (!frustum.Sees(trail_bounds(checkpoint.pose, rm.geom, 0)))
+      continue;
+
+    Color c = checkpoint.color;
+    c.a = darkness;
+    footprints.SetColor(c);
+
+    BlockGroup::AppendFootPrint(rm.shape, footprints, checkpoint.pose + rm.geom.pose);
+  }
+}
+
+void Canvas::DrawTrailBlocks(const RenderModel &rm)
+{
+  FOR_EACH (it, rm.trail) {
+    const Model::TrailItem &checkpoint = *it;
+
+    Pose pz = checkpoint.pose;
+    pz.z = (snapshot->sim_time - checkpoint.time) * TRAIL_TIMESCALE;
+
+    if (!frustum.Sees(trail_bounds(pz, rm.geom, pz.z)))
+      continue;
+
+    glPushMatrix();
+
+    Gl::pose_shift(pz);
+    Gl::pose_shift(rm.geom.pose);
+
+    BlockGroup::DrawShape(rm.shape, rm.geom, rm.color);
+
+    glPopMatrix();
+  }
+}
+
+void Canvas::DrawTrailArrows(const RenderModel &rm)
+{
+  const double dx = 0.2;
+  const double dy = 0.07;
+
+  TrailArrows *&arrows(trail_arrows[rm.mod]);
+  if (arrows == NULL)
+    arrows = new TrailArrows;
+
+  arrows->frame = frames_rendered_count;
+
+  if (arrows->times.size() != rm.trail.size()) {
+    arrows->batch.Resize(3 * rm.trail.size());
+    arrows->times.assign(rm.trail.size(), 0);
+  }
+
+  // write only the arrows of items recorded since the last frame
+  for (size_t i(0); i < rm.trail.size(); ++i) {
+    const Model::TrailItem &checkpoint = rm.trail[i];
+
+    if (checkpoint.time == arrows->times[i])
+      continue;
+    arrows->times[i] = checkpoint.time;
+
+    Pose pz = checkpoint.pose;
+    pz.z = -(double)checkpoint.time * TRAIL_TIMESCALE;
+    pz = pz + rm.geom.pose;
+
+    const double cosa = cos(pz.a);
+    const double sina = sin(pz.a);
+
+    arrows->batch.SetColor(checkpoint.color);
+    arrows->batch.SetVertex(3 * i, pz.x + dy * sina, pz.y - dy * cosa, pz.z);
+    arrows->batch.SetVertex(3 * i + 1, pz.x + dx * cosa, pz.y + dx * sina, pz.z);
+    arrows->batch.SetVertex(3 * i + 2, pz.x - dy * sina, pz.y + dy * cosa, pz.z);
+  }
+
+  // the arrows were placed below the ground by their time of
+  // recording, so lifting them all by the current time gives each its
+  // height proportional to age
+  glPushMatrix();
+  glTranslatef(0, 0, snapshot->sim_time * TRAIL_TIMESCALE);
+
+  arrows->batch.Draw();
+
+  glPopMatrix();
+}
+
+void Canvas::AppendFlags(const RenderModel &rm)
+{
+  if (rm.flags.size() < 1)
+    return;
+
+  const Pose &gp(rm.pose);
+  GLfloat z = 1.0;
+
+  for (std::vector<RenderModel::Flag>::const_reverse_iterator it(rm.flags.rbegin());
+       it != rm.flags.rend(); ++it) {
+    double sz = it->size;
+    double d = sz / 2.0;
+
+    flags.SetColor(it->color);
+
+    flags.Vertex(gp.x + d, gp.y + 0, gp.z + 0 + z);
+    flags.Vertex(gp.x + 0, gp.y + d, gp.z + 0 + z);
+    flags.Vertex(gp.x + 0, gp.y + 0, gp.z + d + z);
+
+    flags.Vertex(gp.x + d, gp.y + 0, gp.z + 0 + z);
+    flags.Vertex(gp.x + 0, gp.y + d, gp.z + 0 + z);
+    flags.Vertex(gp.x + 0, gp.y + 0, gp.z - d + z);
+
+    flags.Vertex(gp.x - d, gp.y + 0, gp.z + 0 + z);
+    flags.Vertex(gp.x + 0, gp.y - d, gp.z + 0 + z);
+    flags.Vertex(gp.x + 0, gp.y + 0, gp.z + d + z);
+
+    flags.Vertex(gp.x - d, gp.y + 0, gp.z + 0 + z);
+    flags.Vertex(gp.x + 0, gp.y + d, gp.z + 0 + z);
+    flags.Vertex(gp.x + 0, gp.y + 0, gp.z - d + z);
+
+    flags.Vertex(gp.x + d, gp.y + 0, gp.z + 0 + z);
+    flags.Vertex(gp.x + 0, gp.y - d, gp.z + 0 + z);
+    flags.Vertex(gp.x + 0, gp.y + 0, gp.z - d + z);
+
+    // for wire-frame we only need half of the 8 triangles
+
+    z += sz;
+  }
+}
+
+void Canvas::VisualizeSnapshot()
+{
+  const std::vector<RenderModel> &models(snapshot->models);
+  std::vector<const RenderModel *> live_models;
+
+  // a model's data is shown with that of its ancestors
+  size_t shown_until(0);
+
+  for (size_t i(0); i < models.size(); ++i) {
+    const RenderModel &rm(models[i]);
+
+    if (i >= shown_until && DataShown(rm.mod))
+      shown_until = i + 1 + rm.descendants;
+
+    if (i >= shown_until)
+      continue;
+
+    FOR_EACH (it, rm.data)
+      if (DataInView(rm, (*it)->Reach()))
+        (*it)->Draw(this, current_camera, rm);
+
+    if (rm.live_data || !rm.live.empty())
+      live_models.push_back(&rm);
+  }
+
+  if (live_models.empty())
+    return;
+
+  // these read the models, which may have changed or gone since the
+  // snapshot was taken
+  world->LockWorld();
+
+  FOR_EACH (it, live_models) {
+    const RenderModel &rm(**it);
+    Model *mod(world->GetModel(rm.token));
+    if (mod != rm.mod)
+      continue;
+
+    glPushMatrix();
+    Gl::pose_shift(mod->GetGlobalPose());
+
+    if (rm.live_data && DataInView(rm, mod->DataVisualizeReach()))
+      mod->DataVisualize(current_camera);
+
+    FOR_EACH (vis, rm.live)
+      if (std::find(mod->cv_list.begin(), mod->cv_list.end(), *vis) != mod->cv_list.end()
+          && DataInView(rm, (*vis)->Reach(mod)))
+        (*vis)->Visualize(mod, current_camera);
+
+    glPopMatrix();
+  }
+
+  world->UnlockWorld();
+}
+
+void Canvas::DrawDebugCells()
+{
+  if (!snapshot->rt_cells.empty()) {
+    glPushMatrix();
+    GLfloat scale = 1.0 / world->Resolution();
+    glScalef(scale, scale, 1.0); // XX TODO - this seems slightly
+
+    PushColor(Color(0, 0, 1, 0.5));
+
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+
+    glPointSize(2);
+    glBegin(GL_POINTS);
+
+    for (unsigned int i = 0; i < snapshot->rt_cells.size(); i++) {
+      char str[128];
+      snprintf(str, 128, "(%d,%d)", snapshot->rt_cells[i].x, snapshot->rt_cells[i].y);
+
+      Gl::draw_string(snapshot->rt_cells[i].x + 1, snapshot->rt_cells[i].y + 1, 0.1, str);
+
+      // printf( "x: %d y: %d\n", world->rt_regions[i].x, world->rt_regions[i].y
+      // );
+      // glRectf( snapshot->rt_cells[i].x+0.3, snapshot->rt_cells[i].y+0.3,
+      //	 snapshot->rt_cells[i].x+0.7, snapshot->rt_cells[i].y+0.7 );
+
+      glVertex2f(snapshot->rt_cells[i].x, snapshot->rt_cells[i].y);
+    }
+
+    glEnd();
+
+#if 1
+    PushColor(Color(0, 1, 0, 0.2));
+    glBegin(GL_LINE_STRIP);
+    for (unsigned int i = 0; i < snapshot->rt_cells.size(); i++) {
+      glVertex2f(snapshot->rt_cells[i].x + 0.5, snapshot->rt_cells[i].y + 0.5);
+    }
+    glEnd();
+    PopColor();
+#endif
+
+    glPopMatrix();
+    PopColor();
+  }
+
+  if (!snapshot->rt_candidate_cells.empty()) {
+    glPushMatrix();
+    GLfloat scale = 1.0 / world->Resolution();
+    glScalef(scale, scale, 1.0); // XX TODO - this seems slightly
+
+    PushColor(Color(1, 0, 0, 0.5));
+
+    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+
+    for (unsigned int i = 0; i < snapshot->rt_candidate_cells.size(); i++) {
+      // 			 char str[128];
+      // 			 snprintf( str, 128, "(%d,%d)",
+      // 						  snapshot->rt_candidate_cells[i].x,
+      // 						  snapshot->rt_candidate_cells[i].y
+      // );
+
+      // 			 Gl::draw_string(
+      // snapshot->rt_candidate_cells[i].x+1,
+      // 									 snapshot->rt_candidate_cells[i].y+1,
+      // 0.1, str );
+
+      // printf( "x: %d y: %d\n", world->rt_regions[i].x, world->rt_regions[i].y
+      // );
+      glRectf(snapshot->rt_candidate_cells[i].x, snapshot->rt_candidate_cells[i].y,
+              snapshot->rt_candidate_cells[i].x + 1, snapshot->rt_candidate_cells[i].y + 1);
+    }
+
+    PushColor(Color(0, 1, 0, 0.2));
+    glBegin(GL_LINE_STRIP);
+    for (unsigned int i = 0; i < snapshot->rt_candidate_cells.size(); i++) {
+      glVertex2f(snapshot->rt_candidate_cells[i].x + 0.5, snapshot->rt_candidate_cells[i].y + 0.5);
+    }
+    glEnd();
+    PopColor();
+
+    glPopMatrix();
+    PopColor();
+
+    // snapshot->rt_cells.clear();
+  }
+}
+
 void Canvas::resetCamera()
 {
   float max_x = 0, max_y = 0, min_x = 0, min_y = 0;
 
+  const std::vector<RenderModel> &models(snapshots.Acquire().models);
+
   // TODO take orrientation ( `a' ) and geom.pose offset into consideration
-  FOR_EACH (it, world->World::children) {
-    Model *ptr = (*it);
-    Pose pose = ptr->GetPose();
-    Geom geom = ptr->GetGeom();
+  for (size_t i(0); i < models.size(); i += models[i].descendants + 1) {
+    // the global pose of a top level model is its pose
+    const Pose &pose(models[i].pose);
+    const Geom &geom(models[i].geom);
 
     float tmp_min_x = pose.x - geom.size.x / 2.0;
     float tmp_max_x = pose.x + geom.size.x / 2.0;
@@ -727,6 +1536,8 @@ void Canvas::resetCamera()
       max_y = tmp_max_y;
   }
 
+  snapshots.Release();
+
   // do a complete reset
   float x = (min_x + max_x) / 2.0;
   float y = (min_y + max_y) / 2.0;
@@ -778,134 +1589,76 @@ void Canvas::renderFrame()
   // TODO: understand why this doesn't work and fix it - cosmetic but important!
   // std::sort( models_sorted.begin(), models_sorted.end(), DistFuncObj(x,y) );
 
+  BlockGroup::DeleteFreedDisplayLists();
+  Gl::VertexBatch::DeleteFreedBuffers();
+
   glEnable(GL_DEPTH_TEST);
 
   if (!showTrails)
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-  if (showOccupancy)
-    world->DrawOccupancy();
-
-  if (showVoxels)
-    world->DrawVoxels();
-
-  if (!world->rt_cells.empty()) {
-    glPushMatrix();
-    GLfloat scale = 1.0 / world->Resolution();
-    glScalef(scale, scale, 1.0); // XX TODO - this seems slightly
-
-    world->PushColor(Color(0, 0, 1, 0.5));
-
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-
-    glPointSize(2);
-    glBegin(GL_POINTS);
-
-    for (unsigned int i = 0; i < world->rt_cells.size(); i++) {
-      char str[128];
-      snprintf(str, 128, "(%d,%d)", world->rt_cells[i].x, world->rt_cells[i].y);
-
-      Gl::draw_string(world->rt_cells[i].x + 1, world->rt_cells[i].y + 1, 0.1, str);
-
-      // printf( "x: %d y: %d\n", world->rt_regions[i].x, world->rt_regions[i].y
-      // );
-      // glRectf( world->rt_cells[i].x+0.3, world->rt_cells[i].y+0.3,
-      //	 world->rt_cells[i].x+0.7, world->rt_cells[i].y+0.7 );
-
-      glVertex2f(world->rt_cells[i].x, world->rt_cells[i].y);
-    }
-
-    glEnd();
-
-#if 1
-    world->PushColor(Color(0, 1, 0, 0.2));
-    glBegin(GL_LINE_STRIP);
-    for (unsigned int i = 0; i < world->rt_cells.size(); i++) {
-      glVertex2f(world->rt_cells[i].x + 0.5, world->rt_cells[i].y + 0.5);
-    }
-    glEnd();
-    world->PopColor();
-#endif
-
-    glPopMatrix();
-    world->PopColor();
-  }
-
-  if (!world->rt_candidate_cells.empty()) {
-    glPushMatrix();
-    GLfloat scale = 1.0 / world->Resolution();
-    glScalef(scale, scale, 1.0); // XX TODO - this seems slightly
-
-    world->PushColor(Color(1, 0, 0, 0.5));
+  CullModels();
 
+  if (showOccupancy || showVoxels) {
     glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-
-    for (unsigned int i = 0; i < world->rt_candidate_cells.size(); i++) {
-      // 			 char str[128];
-      // 			 snprintf( str, 128, "(%d,%d)",
-      // 						  world->rt_candidate_cells[i].x,
-      // 						  world->rt_candidate_cells[i].y
-      // );
-
-      // 			 Gl::draw_string(
-      // world->rt_candidate_cells[i].x+1,
-      // 									 world->rt_candidate_cells[i].y+1,
-      // 0.1, str );
-
-      // printf( "x: %d y: %d\n", world->rt_regions[i].x, world->rt_regions[i].y
-      // );
-      glRectf(world->rt_candidate_cells[i].x, world->rt_candidate_cells[i].y,
-              world->rt_candidate_cells[i].x + 1, world->rt_candidate_cells[i].y + 1);
-    }
-
-    world->PushColor(Color(0, 1, 0, 0.2));
-    glBegin(GL_LINE_STRIP);
-    for (unsigned int i = 0; i < world->rt_candidate_cells.size(); i++) {
-      glVertex2f(world->rt_candidate_cells[i].x + 0.5, world->rt_candidate_cells[i].y + 0.5);
-    }
-    glEnd();
-    world->PopColor();
-
-    glPopMatrix();
-    world->PopColor();
-
-    // world->rt_cells.clear();
+    if (showOccupancy)
+      snapshot->occupancy.Draw();
+    if (showVoxels)
+      snapshot->voxels.Draw();
   }
 
+  if (!snapshot->rt_cells.empty() || !snapshot->rt_candidate_cells.empty())
+    DrawDebugCells();
+
   if (showGrid)
-    DrawGlobalGrid();
+    DrawGlobalGrid(snapshot->extent);
   else
-    DrawFloor();
+    DrawFloor(snapshot->extent);
+
+  const std::vector<RenderModel> &models(snapshot->models);
 
   if (showFootprints) {
     glDisable(GL_DEPTH_TEST); // using alpha blending
 
-    FOR_EACH (it, models_sorted)
-      (*it)->DrawTrailFootprint();
+    footprints.Clear();
+    for (size_t i(0); i < models.size(); i += models[i].descendants + 1)
+      AppendTrailFootprint(models[i]);
+    footprints.Draw();
 
     glEnable(GL_DEPTH_TEST);
   }
 
   if (showFlags) {
     glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-    glBegin(GL_TRIANGLES);
 
-    FOR_EACH (it, models_sorted)
-      (*it)->DrawFlagList();
-
-    glEnd();
+    flags.Clear();
+    FOR_EACH (it, visible_models)
+      AppendFlags(**it);
+    flags.Draw();
   }
 
-  if (showTrailArrows)
-    FOR_EACH (it, models_sorted)
-      (*it)->DrawTrailArrows();
+  if (showTrailArrows) {
+    for (size_t i(0); i < models.size(); i += models[i].descendants + 1)
+      if (!models[i].trail.empty())
+        DrawTrailArrows(models[i]);
+
+    // forget the arrows of models that are gone
+    for (std::map<const Model *, TrailArrows *>::iterator it(trail_arrows.begin());
+         it != trail_arrows.end();) {
+      if (it->second->frame != frames_rendered_count) {
+        delete it->second;
+        trail_arrows.erase(it++);
+      } else
+        ++it;
+    }
+  }
 
   if (showTrailRise)
-    FOR_EACH (it, models_sorted)
-      (*it)->DrawTrailBlocks();
+    for (size_t i(0); i < models.size(); i += models[i].descendants + 1)
+      DrawTrailBlocks(models[i]);
 
   if (showBlocks)
-    DrawBlocks();
+    DrawVisibleBlocks();
 
   if (showBBoxes)
     DrawBoundingBoxes();
@@ -913,31 +1666,27 @@ void Canvas::renderFrame()
   // TODO - finish this properly
   // LISTMETHOD( models_sorted, Model*, DrawWaypoints );
 
-  FOR_EACH (it, selected_models)
-    (*it)->DrawSelected();
+  FOR_EACH (it, selected_models) {
+    const RenderModel *rm(Find(*it));
+    if (rm)
+      DrawSelected(*rm);
+  }
 
   // useful debug - puts a point at the origin of each model
   // for( GList* it = world->World::children; it; it=it->next )
   // ((Model*)it->data)->DrawOriginTree();
 
   // draw the model-specific visualizations
-  if (world->sim_time > 0) {
+  if (snapshot->sim_time > 0) {
     if (showData) {
-      if (!visualizeAll) {
-        FOR_EACH (it, world->World::children)
-          (*it)->DataVisualizeTree(current_camera);
-      } else if (selected_models.size() > 0) {
-        FOR_EACH (it, selected_models)
-          (*it)->DataVisualizeTree(current_camera);
-      } else if (last_selection) {
-        last_selection->DataVisualizeTree(current_camera);
-      }
+      VisualizeSnapshot();
+      DrawSensorBatches();
     }
   }
 
   if (showGrid)
-    FOR_EACH (it, models_sorted)
-      (*it)->DrawGrid();
+    FOR_EACH (it, visible_models)
+      DrawGrid(**it);
 
   if (showStatus) {
     glPushMatrix();
@@ -945,26 +1694,23 @@ void Canvas::renderFrame()
     if (camera.pitch() == 0 && !pCamOn)
       glTranslatef(0, 0, 0.1);
 
-    FOR_EACH (it, models_sorted)
-      (*it)->DrawStatusTree(&camera);
+    FOR_EACH (it, visible_models)
+      DrawStatusTree(*it);
 
     glPopMatrix();
   }
 
-  if (world->ray_list.size() > 0) {
+  if (snapshot->rays.size() > 0) {
     glDisable(GL_DEPTH_TEST);
-    PushColor(0, 0, 0, 0.5);
-    FOR_EACH (it, world->ray_list) {
-      float *pts = *it;
-      glBegin(GL_LINES);
-      glVertex2f(pts[0], pts[1]);
-      glVertex2f(pts[2], pts[3]);
-      glEnd();
+    rays.Clear();
+    rays.SetColor(Color(0, 0, 0, 0.5));
+    for (size_t i(0); i + 3 < snapshot->rays.size(); i += 4) {
+      const GLfloat *pts = &snapshot->rays[i];
+      rays.Vertex(pts[0], pts[1], 0);
+      rays.Vertex(pts[2], pts[3], 0);
     }
-    PopColor();
+    rays.Draw();
     glEnable(GL_DEPTH_TEST);
-
-    world->ClearRays();
   }
 
   if (showClock) {
@@ -981,7 +1727,7 @@ void Canvas::renderFrame()
     glLoadIdentity();
     glDisable(GL_DEPTH_TEST);
 
-    std::string clockstr = world->ClockString();
+    std::string clockstr = snapshot->clock;
     if (showFollow == true && last_selection)
       clockstr.append(" [FOLLOW MODE]");
 
@@ -1008,7 +1754,7 @@ void Canvas::renderFrame()
     colorstack.Pop();
 
     // ENERGY BOX
-    // if (PowerPack::global_capacity > 0) {
+    // if (world->GetEnergy().capacity > 0) {
     //   colorstack.Push(0.8, 1.0, 0.8, 0.85); // pale green
     //   glRectf(0, height, width, 90);
     //   colorstack.Push(0, 0, 0); // black
@@ -1217,6 +1963,10 @@ void Canvas::draw()
   //	if( loaded_texture == true && pCamOn == true )
   //		return;
 
+  UpdateShown();
+
+  snapshot = &snapshots.Acquire();
+
   if (!valid()) {
     if (!init_done)
       InitGl();
@@ -1228,7 +1978,7 @@ void Canvas::draw()
       perspective_camera.SetProjection();
       current_camera = &perspective_camera;
     } else {
-      bounds3d_t extent = world->GetExtent();
+      const bounds3d_t &extent(snapshot->extent);
       camera.SetProjection(w(), h(), extent.y.min, extent.y.max);
       current_camera = &camera;
     }
@@ -1237,8 +1987,9 @@ void Canvas::draw()
   }
 
   // Follow the selected robot
-  if (showFollow && last_selection) {
-    Pose gpose = last_selection->GetGlobalPose();
+  const RenderModel *followed(showFollow ? Find(last_selection) : NULL);
+  if (followed) {
+    const Pose &gpose(followed->pose);
     if (pCamOn == true) {
       perspective_camera.setPose(gpose.x, gpose.y, 0.2);
       perspective_camera.setYaw(rtod(gpose.a) - 90.0);
@@ -1249,6 +2000,28 @@ void Canvas::draw()
 
   current_camera->Draw();
   renderFrame();
+
+  snapshots.Release();
+  snapshot = NULL;
+}
+
+void Canvas::UpdateShown()
+{
+  RenderShown shown;
+  shown.occupancy = showOccupancy.val();
+  shown.voxels = showVoxels.val();
+  shown.data = showData.val();
+
+  FOR_EACH (it, _custom_options)
+    if (it->second->isEnabled())
+      shown.visualizers.insert(it->first);
+
+  // the world publishes a snapshot when unlocked after a change
+  if (snapshots.SetShown(shown)) {
+    world->LockWorld();
+    world->NeedRedraw();
+    world->UnlockWorld();
+  }
 }
 
 void Canvas::resize(int X, int Y, int W, int H)
@@ -3,9 +3,201 @@
 #include "stage.hh"
 
 #include <map>
+#include <set>
 #include <stack>
 
 namespace Stg {
+/** What the canvas draws of a model, copied from it at the end of an
+    update by Model::CaptureRender(). */
+class RenderModel {
+public:
+  class Flag {
+  public:
+    Color color;
+    double size;
+
+    Flag(const Color &color, double size) : color(color), size(size) {}
+  };
+
+  Model *mod; ///< identifies the model, but its state is never read through it
+  unsigned int descendants; ///< the number of entries of the model's descendants, which follow it
+  std::string token;
+  Pose pose; ///< in the global frame
+  Geom geom;
+  Color color;
+  bounds3d_t bounds; ///< global, around the model and its descendants
+  meters_t height; ///< of the model and its descendants
+  /** The shape of the blocks, which the entry holds a reference to,
+      so the simulation copies it before changing it */
+  BlockShape *shape;
+  bool stall;
+  bool grid;
+  std::string say;
+  std::vector<Flag> flags; ///< in the order of the model's flag list
+  std::vector<Model::TrailItem> trail;
+  unsigned int trail_index;
+  /** The data of the model and its visualizers, which the entry owns.
+      Only copied while the model is subscribed and data is shown. */
+  std::vector<VisData *> data;
+  /** The visualizers that copy nothing, so are drawn from the model */
+  std::vector<Visualizer *> live;
+  /** True if the model copies no data, but may still draw it with the
+      deprecated Model::DataVisualize() */
+  bool live_data;
+
+  RenderModel();
+  RenderModel(const RenderModel &other);
+  RenderModel &operator=(const RenderModel &other);
+  ~RenderModel();
+
+  /** Hold a reference to s, dropping the one held before */
+  void SetShape(BlockShape *s);
+
+  /** Delete the data and forget what is drawn from the model */
+  void ClearData();
+};
+
+/** What the canvas shows of the layers that are only copied into the
+    snapshots while shown */
+class RenderShown {
+public:
+  bool occupancy;
+  bool voxels;
+  bool data;
+  std::set<std::string> visualizers; ///< the menu names of those enabled
+
+  RenderShown() : occupancy(false), voxels(false), data(false), visualizers() {}
+
+  bool operator==(const RenderShown &other) const
+  {
+    return occupancy == other.occupancy && voxels == other.voxels && data == other.data
+           && visualizers == other.visualizers;
+  }
+};
+
+/** The world as the canvas draws it, published at the end of an update */
+class RenderSnapshot {
+public:
+  std::vector<RenderModel> models; ///< depth first through the model tree
+  usec_t sim_time;
+  std::string clock;
+  bounds3d_t extent;
+  std::vector<point_int_t> rt_cells, rt_candidate_cells;
+  std::vector<GLfloat> rays; ///< x1, y1, x2 and y2 of each ray
+  Gl::VertexBatch occupancy; ///< empty unless shown
+  Gl::VertexBatch voxels; ///< empty unless shown
+
+  RenderSnapshot() : models(), sim_time(0), clock(), extent(), rt_cells(), rt_candidate_cells(),
+                     rays(), occupancy(GL_QUADS), voxels(GL_QUADS) {}
+};
+
+/** Two snapshots, so that the simulation can write one while the
+    canvas draws the other. Neither thread waits for the other longer
+    than it takes to swap them. */
+class RenderBuffers {
+public:
+  RenderBuffers();
+  ~RenderBuffers();
+
+  /** Returns the snapshot to overwrite, which the canvas is not
+      drawing. Call Publish() when it is complete. */
+  RenderSnapshot &Write();
+  void Publish();
+
+  /** Returns the latest complete snapshot, which stays unchanged
+      until Release() */
+  const RenderSnapshot &Acquire();
+  void Release();
+
+  /** Returns true iff a snapshot was published since the last Acquire() */
+  bool Fresh();
+
+  /** Set what the canvas shows. Returns true iff it changed, in which
+      case the snapshots lack what is now shown. */
+  bool SetShown(const RenderShown &s);
+  RenderShown Shown();
+
+  /** Returns true iff the canvas has acquired the latest snapshot, so
+      that publishing another is worthwhile */
+  bool Taken() { return !Fresh(); }
+
+  /** Note that the world changed but no snapshot was published,
+      because the canvas had not taken the latest one */
+  void Skip();
+
+  /** Returns true iff a snapshot was skipped since the last Publish() */
+  bool Skipped();
+
+private:
+  RenderSnapshot snapshots[2];
+  int latest; ///< the latest complete snapshot
+  int writing; ///< being written, or -1
+  int reading; ///< being drawn, or -1
+  bool fresh;
+  RenderShown shown;
+  bool skipped;
+  pthread_mutex_t mutex;
+
+  // the snapshots hold references to shapes
+  RenderBuffers(const RenderBuffers &);
+  RenderBuffers &operator=(const RenderBuffers &);
+};
+
+/** An offscreen framebuffer that the GUI cameras draw into, each in a
+    tile of its own, rather than into the window. All the tiles drawn
+    in an update are read back together after it, through one of two
+    pixel buffer objects in turn, so the read of one update overlaps
+    the drawing of the next and nothing waits for the GL to finish. A
+    camera's frame is therefore an update or two old. */
+class CameraAtlas {
+public:
+  CameraAtlas();
+
+  /** Returns the index of a new tile of width by height pixels, or -1
+      if the GL has no framebuffer or pixel buffer objects */
+  int AddTile(int width, int height);
+
+  /** Bind the framebuffer and clear tile for drawing into */
+  void Begin(int tile);
+  /** Bind the window's framebuffer again */
+  void End();
+
+  /** Start reading back the tiles drawn since the last call, and map
+      the read started by the last call for Fetch() */
+  void Readback();
+
+  /** If the mapped read includes tile, point depth and rgba at its
+      first pixel and return the number of pixels between its rows.
+      Otherwise returns 0. */
+  int Fetch(int tile, const GLfloat *&depth, const GLubyte *&rgba) const;
+
+private:
+  class Tile {
+  public:
+    int x, y, width, height;
+    bool drawn; ///< since the last Readback()
+  };
+
+  std::vector<Tile> tiles;
+  int width, height; ///< of the framebuffer, or 0 before it is made
+  int shelf_x, shelf_y, shelf_height; ///< where the next tile goes
+
+  int supported; ///< 1 or 0 once known, -1 before
+  GLuint fbo, color_rb, depth_rb;
+  GLuint pbo[2];
+  std::vector<bool> read_tiles[2]; ///< the tiles in the read into each pbo
+  unsigned int next; ///< the pbo of the next read
+  int mapped; ///< the pbo mapped for Fetch(), or -1
+  const void *mapped_data;
+  GLint window_fbo; ///< the window's framebuffer, saved while the atlas is bound
+  GLint viewport[4]; ///< saved by Begin()
+
+  /** (Re)make the framebuffer and pixel buffers at the atlas size,
+      discarding any reads in flight */
+  void Resize(int w, int h);
+  void Unmap();
+};
+
 class Canvas : public Fl_Gl_Window {
   friend class WorldGui; // allow access to private members
   friend class Model;
@@ -57,10 +249,80 @@ private:
 
   msec_t interval; // window refresh interval in ms
 
-  void RecordRay(double x1, double y1, double x2, double y2);
-  void DrawRays();
-  void ClearRays();
-  void DrawGlobalGrid();
+  Gl::VertexBatch rays; ///< the rays traced for debugging, drawn as one batch
+
+  /** The snapshot being drawn, between Acquire() and Release() in draw() */
+  const RenderSnapshot *snapshot;
+
+  Frustum frustum; ///< what the current camera shows, updated every frame
+  /** The top level models in the snapshot that are in view, each
+      followed in the snapshot by its descendants */
+  std::vector<const RenderModel *> visible_models;
+  Gl::VertexBatch distant_models; ///< a point for each model in view too small to draw
+  Gl::VertexBatch footprints; ///< the trail footprints of every model, drawn as one batch
+  Gl::VertexBatch flags; ///< the flags of the models in view, drawn as one batch
+
+  /** An arrow for each item of a model's trail, in the same ring
+      order. Only the arrows of items recorded since the last frame are
+      written, and uploaded, again. Heights are relative to the start
+      of the simulation, so the arrows rise with age by moving the
+      whole batch down as time passes. */
+  class TrailArrows {
+  public:
+    Gl::VertexBatch batch;
+    std::vector<usec_t> times; ///< when the item of each arrow was recorded
+    uint64_t frame; ///< the last frame the model was drawn in
+
+    TrailArrows() : batch(GL_TRIANGLES), times(), frame(0) {}
+  };
+
+  std::map<const Model *, TrailArrows *> trail_arrows;
+
+  void DrawGlobalGrid(const bounds3d_t &bounds);
+  void DrawFloor(const bounds3d_t &bounds);
+  void DrawSensorBatches();
+
+  /** Sort the top level models of the snapshot into visible_models
+      and distant_models, and leave out those out of view */
+  void CullModels();
+  void DrawVisibleBlocks();
+
+  /** Draw the blocks of a model at its pose, and those of its descendants */
+  void DrawBlocksTree(const RenderModel *rm);
+  void DrawBoundingBoxes();
+  void DrawSelected(const RenderModel &rm);
+  void DrawGrid(const RenderModel &rm);
+  void DrawStatusTree(const RenderModel *rm);
+  void DrawStatus(const RenderModel &rm);
+  /** Draw the image stored in texture_id above the model */
+  void DrawImage(uint32_t texture_id, const RenderModel &rm);
+  void DrawTrailArrows(const RenderModel &rm);
+  void DrawTrailBlocks(const RenderModel &rm);
+  /** Append the footprints of the trail items in view to footprints */
+  void AppendTrailFootprint(const RenderModel &rm);
+  /** Append the stack of flags above the model to flags, as triangles */
+  void AppendFlags(const RenderModel &rm);
+  void DrawDebugCells();
+
+  /** Draw the sensor data in the snapshot of the models whose data
+      is shown, and that of the visualizers that copy nothing from the
+      models themselves, with the world locked */
+  void VisualizeSnapshot();
+
+  /** Returns true iff the data of mod is shown, which also shows that
+      of its descendants */
+  bool DataShown(const Model *mod) const;
+
+  /** Returns false if data drawn within reach of rm's model is
+      certainly out of view */
+  bool DataInView(const RenderModel &rm, meters_t reach) const;
+
+  /** Tell the snapshots what is shown, and have the world publish
+      another if that changed */
+  void UpdateShown();
+
+  /** Returns the snapshot entry of mod, or NULL */
+  const RenderModel *Find(const Model *mod) const;
 
   void AddModel(Model *mod);
   void RemoveModel(Model *mod);
@@ -82,6 +344,16 @@ public:
 
   std::map<std::string, Option *> _custom_options;
 
+  /** Sensor visualizations, gathered in global coordinates while the
+      models are visited and drawn with one call per kind of primitive
+      at the end of the frame: translucent areas as triangles, and
+      lines and points. */
+  Gl::VertexBatch sensor_areas, sensor_lines, sensor_points;
+
+  CameraAtlas camera_atlas; ///< where the cameras draw their frames
+
+  RenderBuffers snapshots; ///< what renderFrame() draws, published by WorldGui::Update()
+
   void Screenshot();
   void InitGl();
   void InitTextures();
@@ -90,7 +362,6 @@ public:
   void FixViewport(int W, int H);
   void DrawFloor(); // simpler floor compared to grid
   void DrawBlocks();
-  void DrawBoundingBoxes();
   void resetCamera();
   virtual void renderFrame();
   virtual void draw();
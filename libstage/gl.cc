@@ -1,4 +1,7 @@
 
+// for the buffer object functions in glext.h
+#define GL_GLEXT_PROTOTYPES 1
+
 #include "stage.hh"
 using namespace Stg;
 
@@ -165,3 +168,168 @@ void Stg::Gl::draw_grid(bounds3d_t vol)
     draw_string(0, i, 0.00, str);
   }
 }
+
+// vertex buffer objects are core from GL 1.5. Returns -1 if there is
+// no GL context to ask yet.
+static int gl_supports_buffers()
+{
+  const char *version(reinterpret_cast<const char *>(glGetString(GL_VERSION)));
+  if (version == NULL)
+    return -1;
+
+  int major(0), minor(0);
+  sscanf(version, "%d.%d", &major, &minor);
+
+  if (major >= 2 || (major == 1 && minor >= 5))
+    return 1;
+
+  const char *extensions(reinterpret_cast<const char *>(glGetString(GL_EXTENSIONS)));
+  return (extensions && strstr(extensions, "GL_ARB_vertex_buffer_object") != NULL);
+}
+
+static int buffers_supported(-1);
+
+/** Buffers of batches destroyed without the GL context current, which
+    DeleteFreedBuffers() deletes for them */
+static std::vector<GLuint> freed_buffers;
+static pthread_mutex_t freed_buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+Stg::Gl::VertexBatch::VertexBatch(GLenum mode)
+    : mode(mode), vertices(), colors(), buffer(0), capacity(0), dirty_first(0), dirty_last(0)
+{
+  color[0] = color[1] = color[2] = 0;
+  color[3] = 1;
+}
+
+Stg::Gl::VertexBatch::~VertexBatch()
+{
+  if (buffer) {
+    pthread_mutex_lock(&freed_buffers_mutex);
+    freed_buffers.push_back(buffer);
+    pthread_mutex_unlock(&freed_buffers_mutex);
+  }
+}
+
+void Stg::Gl::VertexBatch::DeleteFreedBuffers()
+{
+  std::vector<GLuint> buffers;
+
+  pthread_mutex_lock(&freed_buffers_mutex);
+  buffers.swap(freed_buffers);
+  pthread_mutex_unlock(&freed_buffers_mutex);
+
+  if (!buffers.empty())
+    glDeleteBuffers(buffers.size(), &buffers[0]);
+}
+
+void Stg::Gl::VertexBatch::Clear()
+{
+  vertices.clear();
+  colors.clear();
+
+  // whatever is added next is new
+  dirty_first = dirty_last = 0;
+}
+
+void Stg::Gl::VertexBatch::Resize(size_t count)
+{
+  Touch(Size(), count);
+  vertices.resize(3 * count, 0);
+  colors.resize(4 * count, 0);
+}
+
+void Stg::Gl::VertexBatch::SetColor(const Color &c)
+{
+  color[0] = c.r;
+  color[1] = c.g;
+  color[2] = c.b;
+  color[3] = c.a;
+}
+
+void Stg::Gl::VertexBatch::Vertex(GLfloat x, GLfloat y, GLfloat z)
+{
+  Touch(Size(), Size() + 1);
+  vertices.push_back(x);
+  vertices.push_back(y);
+  vertices.push_back(z);
+  colors.insert(colors.end(), color, color + 4);
+}
+
+void Stg::Gl::VertexBatch::SetVertex(size_t index, GLfloat x, GLfloat y, GLfloat z)
+{
+  Touch(index, index + 1);
+  GLfloat *v(&vertices[3 * index]);
+  v[0] = x;
+  v[1] = y;
+  v[2] = z;
+  std::copy(color, color + 4, colors.begin() + 4 * index);
+}
+
+void Stg::Gl::VertexBatch::Upload() const
+{
+  if (buffer == 0)
+    glGenBuffers(1, &buffer);
+
+  glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+  // the positions fill the start of the buffer and the colors follow
+  // them, so growing it means uploading everything again
+  if (Size() > capacity) {
+    capacity = std::max(Size(), 2 * capacity);
+    glBufferData(GL_ARRAY_BUFFER, capacity * 7 * sizeof(GLfloat), NULL, GL_DYNAMIC_DRAW);
+    dirty_first = 0;
+    dirty_last = Size();
+  }
+
+  const size_t last(std::min(dirty_last, Size()));
+
+  if (dirty_first < last) {
+    const size_t count(last - dirty_first);
+
+    glBufferSubData(GL_ARRAY_BUFFER, dirty_first * 3 * sizeof(GLfloat),
+                    count * 3 * sizeof(GLfloat), &vertices[3 * dirty_first]);
+    glBufferSubData(GL_ARRAY_BUFFER, (capacity * 3 + dirty_first * 4) * sizeof(GLfloat),
+                    count * 4 * sizeof(GLfloat), &colors[4 * dirty_first]);
+  }
+
+  dirty_first = Size();
+  dirty_last = 0;
+}
+
+void Stg::Gl::VertexBatch::Draw(size_t first, size_t count) const
+{
+  if (count == 0)
+    return;
+
+  if (buffers_supported < 0) {
+    buffers_supported = gl_supports_buffers();
+    if (buffers_supported == 0)
+      PRINT_WARN("no vertex buffer objects in this GL, so batches are drawn from client memory");
+  }
+
+  // drawing a color array leaves the current color undefined, and
+  // the color stacks rely on it
+  GLfloat current[4];
+  glGetFloatv(GL_CURRENT_COLOR, current);
+
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_COLOR_ARRAY);
+
+  if (buffers_supported > 0) {
+    Upload();
+
+    glVertexPointer(3, GL_FLOAT, 0, NULL);
+    glColorPointer(4, GL_FLOAT, 0,
+                   reinterpret_cast<const GLvoid *>(capacity * 3 * sizeof(GLfloat)));
+    glDrawArrays(mode, first, count);
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  } else {
+    glVertexPointer(3, GL_FLOAT, 0, &vertices[0]);
+    glColorPointer(4, GL_FLOAT, 0, &colors[0]);
+    glDrawArrays(mode, first, count);
+  }
+
+  glDisableClientState(GL_COLOR_ARRAY);
+  glColor4fv(current);
+}
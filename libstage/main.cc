@@ -15,6 +15,18 @@
 
     --help         : print this message
 
+    --stats        : print the time spent in each phase of the updates and
+                     by each type of model, and the rays traced, on exit
+
+    --trace <file> : write a timeline of the updates, loadable in
+                     chrome://tracing or Perfetto, on exit
+
+    --replay <log> : pose the models as recorded in a trajectory log,
+                     instead of running controllers and moving them
+
+    --sensors      : with --replay, update the rangers and fiducials at
+                     the recorded poses, and run the controllers on them
+
     --args \"str\"   : define an argument string to be passed to all controllers
 
     -a \"str\"       : equivalent to --args "str"
@@ -25,6 +37,7 @@
  */
 
 #include <getopt.h>
+#include <sstream>
 
 #include "config.h"
 #include "stage.hh"
@@ -37,6 +50,10 @@ const char *USAGE = "USAGE:  stage [options] <worldfile1> [worldfile2 ... worldf
                     "  --gui          : run without a GUI\n"
                     "  -g             : equivalent to --gui\n"
                     "  --help         : print this message\n"
+                    "  --stats        : print profiling counters on exit\n"
+                    "  --trace <file> : write a Chrome trace of the updates on exit\n"
+                    "  --replay <log> : pose the models from a trajectory log\n"
+                    "  --sensors      : with --replay, update sensors and run controllers\n"
                     "  --args \"str\"   : define an argument string to be passed to all "
                     "controllers\n"
                     "  -a \"str\"       : equivalent to --args \"str\"\n"
@@ -50,6 +67,10 @@ static struct option longopts[] = {
   { "clock",  optional_argument,   NULL,  'c' },
   { "help",  optional_argument,   NULL,  'h' },
   { "args",  required_argument,   NULL,  'a' },
+  { "stats",  no_argument,   NULL,  's' },
+  { "trace",  required_argument,   NULL,  't' },
+  { "replay",  required_argument,   NULL,  'r' },
+  { "sensors",  no_argument,   NULL,  'S' },
   { NULL, 0, NULL, 0 }
 };
 
@@ -63,6 +84,10 @@ int main( int argc, char* argv[] )
   int ch = 0, optindex = 0;
   bool usegui = true;
   bool showclock = false;
+  bool showstats = false;
+  std::string tracefile;
+  std::string replayfile;
+  bool replaysensors = false;
 
   while ((ch = getopt_long(argc, argv, "cgh?", longopts, &optindex)) != -1) {
     switch (ch) {
@@ -78,6 +103,22 @@ int main( int argc, char* argv[] )
       usegui = false;
       printf("[GUI disabled]");
       break;
+    case 's':
+      showstats = true;
+      printf("[Stats enabled]");
+      break;
+    case 't':
+      tracefile = optarg;
+      printf("[Trace %s]", optarg);
+      break;
+    case 'r':
+      replayfile = optarg;
+      printf("[Replay %s]", optarg);
+      break;
+    case 'S':
+      replaysensors = true;
+      printf("[Replay sensors]");
+      break;
     case 'h':
     case '?':
       puts(USAGE);
@@ -96,13 +137,30 @@ int main( int argc, char* argv[] )
   // must be world file names
 
   optindex = optind; // points to first non-option
+  std::vector<World *> worlds;
   while (optindex < argc) {
     if (optindex > 0) {
       const char *worldfilename = argv[optindex];
       World *world = (usegui ? new WorldGui(400, 300, worldfilename) : new World(worldfilename));
+
+      // before loading, so that the controllers are started, or not, to match
+      if (!replayfile.empty() && !world->StartReplay(replayfile, replaysensors))
+        exit(EXIT_FAILURE);
+
       world->Load(worldfilename);
       world->ShowClock(showclock);
 
+      // later worlds trace to numbered files
+      if (!tracefile.empty()) {
+        std::ostringstream name;
+        name << tracefile;
+        if (!worlds.empty())
+          name << "." << worlds.size();
+        world->StartTrace(name.str());
+      }
+
+      worlds.push_back(world);
+
       if (!world->paused)
         world->Start();
     }
@@ -111,7 +169,18 @@ int main( int argc, char* argv[] )
 
   World::Run();
 
+  // a world closed or stopped before it quit has not written its
+  // outputs yet
+  FOR_EACH (it, worlds)
+    (*it)->Finish();
+
   puts("\n[Stage: done]");
 
+  if (showstats)
+    FOR_EACH (it, worlds) {
+      printf("\n[Stats: %s]\n", (*it)->Token());
+      (*it)->GetStats().Print(stdout);
+    }
+
   return EXIT_SUCCESS;
 }
@@ -50,6 +50,8 @@
     alwayson 0
 
     stack_children 1
+
+    log_interval 0 (the world's log_interval for position models)
     )
     @endverbatim
 
@@ -126,6 +128,10 @@
     _top_ of this model, making it easy to stack models together. If
     zero, the child coordinate system is not offset in z, making it
     easy to define objects in a single local coordinate system.
+
+    - log_interval <float>\n The time in msec between records of this
+    model in the world's trajectory log, if the world has a log_file. 0
+    means the model is not logged.
 */
 
 #ifndef _GNU_SOURCE
@@ -136,6 +142,7 @@
 #include <map>
 #include <sstream> // for converting values to strings
 
+#include "canvas.hh"
 #include "config.h" // for build-time config
 #include "file_manager.hh"
 #include "stage.hh"
@@ -230,14 +237,19 @@ Model::GuiState &Model::GuiState::Load(Worldfile *wf, int wf_entity)
 Model::Model(World *world, Model *parent, const std::string &type, const std::string &name)
     : Ancestor(), mapped(false), drawOptions(), alwayson(false), blockgroup(*this), boundary(false),
       callbacks(__CB_TYPE_COUNT), // one slot in the vector for each type
+      callback_depth(0), callbacks_doomed(false),
       color(1, 0, 0), // red
-      data_fresh(false), disabled(false), cv_list(), flag_list(), friction(DEFAULT_FRICTION),
+      data_fresh(false), data_visualize(true), disabled(false), cv_list(), flag_list(),
+      friction(DEFAULT_FRICTION),
       geom(), has_default_block(true), id(Model::count++), interval((usec_t)1e5), // 100msec
       interval_energy((usec_t)1e5), // 100msec
-      last_update(0), log_state(false), map_resolution(0.1), mass(0), parent(parent), pose(),
-      power_pack(NULL), pps_charging(), rastervis(), rebuild_displaylist(true), say_string(),
-      stack_children(true), stall(false), subs(0), thread_safe(false), trail(20),
-      trail_index(0),  trail_interval(10), type(type), event_queue_num(0), used(false), watts(0.0), watts_give(0.0),
+      last_update(0), log_interval(0), map_resolution(0.1), mass(0), parent(parent), pose(),
+      global_pose(), global_cos(1.0), global_sin(0.0),
+      power_pack(NULL), pps_charging(), contacts(), contacts_dirty(false), contacts_layer(0),
+      rastervis(), rebuild_displaylist(true), say_string(),
+      stack_children(true), stall(false), subs(0), thread_safe(false), random(), trail(20),
+      trail_index(0), trail_interval(10), type(type),
+      type_index(World::TypeIndex(type)), event_queue_num(0), used(false), watts(0.0), watts_give(0.0),
       watts_take(0.0), wf(NULL), wf_entity(0), world(world),
       world_gui(dynamic_cast<WorldGui *>(world))
 {
@@ -276,6 +288,8 @@ Model::Model(World *world, Model *parent, const std::string &type, const std::st
   //  printf( "%s generated a name for my child %s\n", Token(),
   //  name.str().c_str() );
 
+  SeedRandom(world->random_seed);
+
   world->AddModel(this);
 
   if (parent)
@@ -286,6 +300,8 @@ Model::Model(World *world, Model *parent, const std::string &type, const std::st
     gui.move = true;
   }
 
+  UpdateGlobalPose();
+
   //static size_t count=0;
   //printf( "basic %lu\n", ++count );
 
@@ -389,7 +405,7 @@ void Model::AddBlockRect(meters_t x, meters_t y, meters_t dx, meters_t dy, meter
   pts[3].x = x;
   pts[3].y = y + dy;
 
-  blockgroup.AppendBlock(Block(&blockgroup, pts, Bounds(0, dz)));
+  blockgroup.AppendBlock(pts, Bounds(0, dz));
 
   // // Instead of unmapping and mapping everything, just the new block
   // Block& tail = blockgroup.blocks.back();
@@ -403,9 +419,9 @@ void Model::AddBlockRect(meters_t x, meters_t y, meters_t dx, meters_t dy, meter
 Pose Model::GlobalToLocal(const Pose &pose) const
 {
   // get model's global pose
-  const Pose org(GetGlobalPose());
-  const double cosa(cos(org.a));
-  const double sina(sin(org.a));
+  const Pose &org(global_pose);
+  const double cosa(global_cos);
+  const double sina(global_sin);
 
   // compute global pose in local coords
   return Pose((pose.x - org.x) * cosa + (pose.y - org.y) * sina,
@@ -417,6 +433,16 @@ void Model::Say(const std::string &str)
   say_string = str;
 }
 
+void Model::SetLogInterval(usec_t val)
+{
+  if (val && !log_interval)
+    world->logged_models.push_back(this);
+  else if (!val && log_interval)
+    EraseAll(this, world->logged_models);
+
+  log_interval = val;
+}
+
 // returns true iff model [testmod] is an antecedent of this model
 bool Model::IsAntecedent(const Model *testmod) const
 {
@@ -477,14 +503,15 @@ std::vector<point_int_t> Model::LocalToPixels(const std::vector<point_t> &local)
 
   std::vector<point_int_t> global(sz);
 
-  const Pose gpose(GetGlobalPose() + geom.pose);
-  Pose ptpose;
+  double cosa, sina;
+  const Pose gpose(GlobalOrigin(cosa, sina));
 
   for (size_t i = 0; i < sz; i++) {
-    ptpose = gpose + Pose(local[i].x, local[i].y, 0, 0);
+    const double x(gpose.x + local[i].x * cosa - local[i].y * sina);
+    const double y(gpose.y + local[i].x * sina + local[i].y * cosa);
 
-    global[i].x = (int32_t)floor(ptpose.x * world->ppm);
-    global[i].y = (int32_t)floor(ptpose.y * world->ppm);
+    global[i].x = (int32_t)floor(x * world->ppm);
+    global[i].y = (int32_t)floor(y * world->ppm);
   }
 
   return global;
@@ -584,6 +611,17 @@ void Model::Startup(void)
   CallCallbacks(CB_STARTUP);
 }
 
+void Model::SeedRandom(long seed)
+{
+  // mix in the name (FNV-1a), so that each model has its own sequence
+  // and keeps it in every world loaded from the same file
+  unsigned long hash(2166136261UL);
+  for (const char *c(Token()); *c; ++c)
+    hash = ((hash ^ (unsigned char)*c) * 16777619UL) & 0xffffffffUL;
+
+  random.Seed(seed ^ (long)hash);
+}
+
 void Model::Shutdown(void)
 {
   // printf( "Shutdown model %s\n", this->token );
@@ -611,7 +649,10 @@ void Model::Update(void)
   // etc. We queue up the callback into a queue specific to
 
   if (!callbacks[Model::CB_UPDATE].empty())
-    world->pending_update_callbacks[event_queue_num].push(this);
+    world->pending_update_callbacks[event_queue_num].push_back(this);
+
+  if (!world->batch_cb_list.empty())
+    world->updated_models[event_queue_num].push_back(this);
 }
 
 void Model::CallUpdateCallbacks(void)
@@ -645,16 +686,23 @@ void Model::AddToPose(const Pose &pose)
   AddToPose(pose.x, pose.y, pose.z, pose.a);
 }
 
+// like Pose::Random(), from the model's generator
+static Pose random_pose(Model *mod, meters_t xmin, meters_t xmax, meters_t ymin, meters_t ymax)
+{
+  const meters_t x(xmin + mod->Random() * (xmax - xmin));
+  const meters_t y(ymin + mod->Random() * (ymax - ymin));
+  return Pose(x, y, 0, normalize(mod->Random() * (2.0 * M_PI)));
+}
 
 bool Model::RandomPoseInFreeSpace(meters_t xmin, meters_t xmax,
 				  meters_t ymin, meters_t ymax,
                                   size_t max_iter)
 {
-  SetPose(Pose::Random(xmin, xmax, ymin, ymax));
+  SetPose(random_pose(this, xmin, xmax, ymin, ymax));
 
   size_t i = 0;
   while (TestCollision() && (max_iter <= 0 || i++ < max_iter))
-    SetPose(Pose::Random(xmin, xmax, ymin, ymax));
+    SetPose(random_pose(this, xmin, xmax, ymin, ymax));
   return i <= max_iter; // return true if a free pose was found within max iterations
 }
 
@@ -697,10 +745,7 @@ void Model::UpdateCharge()
     pps_charging.clear();
 
     // run through and update all appropriate touchers
-    std::set<Model *> touchers;
-    AppendTouchingModels(touchers);
-
-    FOR_EACH (it, touchers) {
+    FOR_EACH (it, contacts) {
       Model *toucher = (*it);
       PowerPack *hispp = toucher->FindPowerPack();
 
@@ -721,12 +766,40 @@ void Model::UpdateCharge()
         mypp->TransferTo(hispp, amount);
 
         // remember who we are charging so we can detatch next time
-        pps_charging.push_front(hispp);
+        pps_charging.push_back(hispp);
       }
     }
   }
 }
 
+void Model::DirtyContacts(unsigned int layer)
+{
+  if (watts_give <= 0 && watts_take <= 0)
+    return;
+
+  contacts_layer = layer;
+
+  if (!contacts_dirty) {
+    contacts_dirty = true;
+    world->dirty_contacts.push_back(this);
+  }
+}
+
+void Model::UpdateContacts()
+{
+  contacts_dirty = false;
+
+  // contacts are listed by both models
+  FOR_EACH (it, contacts)
+    EraseAll(this, (*it)->contacts);
+  contacts.clear();
+
+  blockgroup.AppendContacts(contacts_layer, contacts);
+
+  FOR_EACH (it, contacts)
+    (*it)->contacts.push_back(this);
+}
+
 void Model::UpdateTrail()
 {
   // get the current item and increment the counter
@@ -795,6 +868,16 @@ Model *Model::GetUnusedModelOfType(const std::string &type)
   return NULL;
 }
 
+void Model::GetRangers(std::vector<ModelRanger *> &found) const
+{
+  FOR_EACH (it, children) {
+    ModelRanger *ranger(dynamic_cast<ModelRanger *>(*it));
+    if (ranger)
+      found.push_back(ranger);
+    (*it)->GetRangers(found);
+  }
+}
+
 kg_t Model::GetTotalMass() const
 {
   kg_t sum = mass;
@@ -814,11 +897,17 @@ kg_t Model::GetMassOfChildren() const
 void Model::Map(unsigned int layer)
 {
   blockgroup.Map(layer);
+  DirtyContacts(layer);
+
+  // static blocks are kept in a hierarchy that is rebuilt when they move
+  if (world->exact_enabled && World::IsStatic(this))
+    world->bvh_dirty = true;
 }
 
 void Model::UnMap(unsigned int layer)
 {
   blockgroup.UnMap(layer);
+  DirtyContacts(layer);
 }
 
 void Model::BecomeParentOf(Model *child)
@@ -831,8 +920,10 @@ void Model::BecomeParentOf(Model *child)
   child->parent = this;
 
   this->AddChild(child);
+  child->UpdateGlobalPose();
 
   world->dirty = true;
+  world->bvh_dirty = true; // the child may no longer be static
 }
 
 PowerPack *Model::FindPowerPack() const
@@ -887,87 +978,107 @@ Model::RasterVis::RasterVis()
 {
 }
 
-void Model::RasterVis::Visualize(Model *mod, Camera *cam)
-{
-  (void)cam; // avoid warning about unused var
-
-  if (data == NULL)
-    return;
+// the last rasterization of a model, as the canvas draws it
+class RasterData : public VisData {
+public:
+  RasterData(const uint8_t *data, unsigned int width, unsigned int height, meters_t cellwidth,
+             meters_t cellheight, const std::vector<point_t> &pts)
+      : data(data, data ? data + width * height : data), width(width), height(height),
+        cellwidth(cellwidth), cellheight(cellheight), pts(pts)
+  {
+  }
 
-  // go into world coordinates
-  glPushMatrix();
-  mod->PushColor(1, 0, 0, 0.5);
+  virtual VisData *Clone() const { return new RasterData(*this); }
 
-  Gl::pose_inverse_shift(mod->GetGlobalPose());
+  virtual void Draw(Canvas *canvas, Camera *, const RenderModel &rm) const
+  {
+    if (data.empty())
+      return;
 
-  if (pts.size() > 0) {
+    // we're already in world coordinates
     glPushMatrix();
-    // Size sz = mod->blockgroup.GetSize();
-    // glTranslatef( -mod->geom.size.x / 2.0, -mod->geom.size.y/2.0, 0 );
-    // glScalef( mod->geom.size.x / sz.x, mod->geom.size.y / sz.y, 1 );
+    canvas->PushColor(1, 0, 0, 0.5);
+
+    if (pts.size() > 0) {
+      glPushMatrix();
+
+      // now we're in world meters coordinates
+      glPointSize(4);
+      glBegin(GL_POINTS);
 
-    // now we're in world meters coordinates
-    glPointSize(4);
-    glBegin(GL_POINTS);
+      FOR_EACH (it, pts) {
+        const point_t &pt = *it;
+        glVertex2f(pt.x, pt.y);
+
+        char buf[128];
+        snprintf(buf, 127, "[%.2f x %.2f]", pt.x, pt.y);
+        Gl::draw_string(pt.x, pt.y, 0, buf);
+      }
+      glEnd();
 
-    FOR_EACH (it, pts) {
-      point_t &pt = *it;
-      glVertex2f(pt.x, pt.y);
+      canvas->PopColor();
 
-      char buf[128];
-      snprintf(buf, 127, "[%.2f x %.2f]", pt.x, pt.y);
-      Gl::draw_string(pt.x, pt.y, 0, buf);
+      glPopMatrix();
     }
-    glEnd();
 
-    mod->PopColor();
+    // go into bitmap pixel coords
+    glTranslatef(-rm.geom.size.x / 2.0, -rm.geom.size.y / 2.0, 0);
 
-    glPopMatrix();
-  }
+    glScalef(cellwidth, cellheight, 1);
 
-  // go into bitmap pixel coords
-  glTranslatef(-mod->geom.size.x / 2.0, -mod->geom.size.y / 2.0, 0);
-  // glScalef( mod->geom.size.x / width, mod->geom.size.y / height, 1 );
+    canvas->PushColor(0, 0, 0, 0.5);
+    glPolygonMode(GL_FRONT, GL_FILL);
+    for (unsigned int y = 0; y < height; ++y)
+      for (unsigned int x = 0; x < width; ++x)
+        if (data[x + y * width])
+          glRectf(x, y, x + 1, y + 1);
 
-  glScalef(cellwidth, cellheight, 1);
+    glTranslatef(0, 0, 0.01);
 
-  mod->PushColor(0, 0, 0, 0.5);
-  glPolygonMode(GL_FRONT, GL_FILL);
-  for (unsigned int y = 0; y < height; ++y)
-    for (unsigned int x = 0; x < width; ++x) {
-      // printf( "[%u %u] ", x, y );
-      if (data[x + y * width])
-        glRectf(x, y, x + 1, y + 1);
-    }
+    canvas->PushColor(0, 0, 0, 1);
+    glPolygonMode(GL_FRONT, GL_LINE);
+    for (unsigned int y = 0; y < height; ++y)
+      for (unsigned int x = 0; x < width; ++x)
+        if (data[x + y * width])
+          glRectf(x, y, x + 1, y + 1);
 
-  glTranslatef(0, 0, 0.01);
+    glPolygonMode(GL_FRONT, GL_FILL);
 
-  mod->PushColor(0, 0, 0, 1);
-  glPolygonMode(GL_FRONT, GL_LINE);
-  for (unsigned int y = 0; y < height; ++y)
-    for (unsigned int x = 0; x < width; ++x) {
-      if (data[x + y * width])
-        glRectf(x, y, x + 1, y + 1);
+    canvas->PopColor();
+    canvas->PopColor();
 
-      // 		  char buf[128];
-      // 		  snprintf( buf, 127, "[%u x %u]", x, y );
-      // 		  Gl::draw_string( x, y, 0, buf );
-    }
+    canvas->PushColor(0, 0, 0, 1);
+    char buf[128];
+    snprintf(buf, 127, "[%u x %u]", width, height);
+    glTranslatef(0, 0, 0.01);
+    Gl::draw_string(1, height - 1, 0, buf);
+
+    canvas->PopColor();
 
-  glPolygonMode(GL_FRONT, GL_FILL);
+    if (pts.empty())
+      canvas->PopColor(); // red
 
-  mod->PopColor();
-  mod->PopColor();
+    glPopMatrix();
+  }
 
-  mod->PushColor(0, 0, 0, 1);
-  char buf[128];
-  snprintf(buf, 127, "[%u x %u]", width, height);
-  glTranslatef(0, 0, 0.01);
-  Gl::draw_string(1, height - 1, 0, buf);
+private:
+  const std::vector<uint8_t> data;
+  const unsigned int width, height;
+  const meters_t cellwidth, cellheight;
+  const std::vector<point_t> pts;
+};
 
-  mod->PopColor();
+void Model::RasterVis::Visualize(Model *mod, Camera *cam)
+{
+  // the canvas draws the raster from its snapshot, as copied by Capture()
+  (void)mod;
+  (void)cam;
+}
 
-  glPopMatrix();
+VisData *Model::RasterVis::Capture(Model *mod)
+{
+  (void)mod;
+  return new RasterData(data, width, height, cellwidth, cellheight, pts);
 }
 
 void Model::RasterVis::SetData(uint8_t *data, const unsigned int width, const unsigned int height,
@@ -1070,6 +1181,9 @@ void Model::SetGeom(const Geom &val)
 
   geom = val;
 
+  // children stacked on top of us have moved
+  UpdateGlobalPose();
+
   blockgroup.CalcSize();
 
   // printf( "model %s SetGeom size [%.3f %.3f %.3f]\n", Token(), geom.size.x,
@@ -1086,6 +1200,7 @@ void Model::SetGeom(const Geom &val)
 void Model::SetColor(Color val)
 {
   color = val;
+  world->blob_models_dirty = true;
   NeedRedraw();
 }
 
@@ -1129,6 +1244,7 @@ void Model::SetObstacleReturn(bool val)
 void Model::SetBlobReturn(bool val)
 {
   vis.blob_return = val;
+  world->blob_models_dirty = true;
 }
 
 void Model::SetRangerReturn(double val)
@@ -1194,6 +1310,8 @@ int Model::SetParent(Model *newparent)
   else
     world->AddModel(this);
 
+  UpdateGlobalPose();
+
   CallCallbacks(CB_PARENT);
 
   SetGlobalPose(oldPose); // Needs to recalculate position due to change in parent
@@ -1201,20 +1319,65 @@ int Model::SetParent(Model *newparent)
   return 0; // ok
 }
 
-// get the model's position in the global frame
-Pose Model::GetGlobalPose() const
+// keep the model's position in the global frame
+void Model::UpdateGlobalPose()
 {
   // if I'm a top level model, my global pose is my local pose
   if (parent == NULL)
-    return pose;
+    global_pose = pose;
+  else {
+    global_pose = parent->global_pose.Plus(pose, parent->global_cos, parent->global_sin);
+
+    if (parent->stack_children) // should we be on top of our parent?
+      global_pose.z += parent->geom.size.z;
+  }
 
-  // otherwise
-  Pose global_pose = parent->GetGlobalPose() + pose;
+  global_cos = cos(global_pose.a);
+  global_sin = sin(global_pose.a);
 
-  if (parent->stack_children) // should we be on top of our parent?
-    global_pose.z += parent->geom.size.z;
+  FOR_EACH (it, children)
+    (*it)->UpdateGlobalPose();
+}
+
+Pose Model::GlobalOrigin(double &cosa, double &sina) const
+{
+  const Pose origin(global_pose.Plus(geom.pose, global_cos, global_sin));
+
+  // the body is rarely turned on the model
+  if (geom.pose.a == 0) {
+    cosa = global_cos;
+    sina = global_sin;
+  } else {
+    cosa = cos(origin.a);
+    sina = sin(origin.a);
+  }
 
-  return global_pose;
+  return origin;
+}
+
+bounds3d_t Model::GetGlobalBounds() const
+{
+  const Pose gp(GetGlobalPose() + geom.pose);
+
+  // the footprint rectangle, turned by the heading
+  const double c(fabs(cos(gp.a))), s(fabs(sin(gp.a)));
+  const double dx((c * geom.size.x + s * geom.size.y) / 2.0);
+  const double dy((s * geom.size.x + c * geom.size.y) / 2.0);
+
+  bounds3d_t box(Bounds(gp.x - dx, gp.x + dx), Bounds(gp.y - dy, gp.y + dy),
+                 Bounds(gp.z, gp.z + geom.size.z));
+
+  FOR_EACH (it, children) {
+    const bounds3d_t child((*it)->GetGlobalBounds());
+    box.x.min = std::min(box.x.min, child.x.min);
+    box.x.max = std::max(box.x.max, child.x.max);
+    box.y.min = std::min(box.y.min, child.y.min);
+    box.y.max = std::max(box.y.max, child.y.max);
+    box.z.min = std::min(box.z.min, child.z.min);
+    box.z.max = std::max(box.z.max, child.z.max);
+  }
+
+  return box;
 }
 
 // set the model's pose in the local frame
@@ -1224,6 +1387,7 @@ void Model::SetPose(const Pose &newpose)
   if (pose != newpose) {
     pose = newpose;
     pose.a = normalize(pose.a);
+    UpdateGlobalPose();
 
     //       if( isnan( pose.a ) )
     // 		  printf( "SetPose bad angle %s [%.2f %.2f %.2f %.2f]\n",
@@ -1239,9 +1403,9 @@ void Model::SetPose(const Pose &newpose)
     MapWithChildren(1);
 
     world->dirty = true;
-  }
 
-  CallCallbacks(CB_POSE);
+    CallCallbacks(CB_POSE);
+  }
 }
 
 void Model::Load()
@@ -1297,6 +1461,9 @@ void Model::Load()
   watts_give = wf->ReadFloat(wf_entity, "give_watts", watts_give);
   watts_take = wf->ReadFloat(wf_entity, "take_watts", watts_take);
 
+  // the model was mapped before it could give or take energy
+  DirtyContacts(contacts_layer);
+
   debug = wf->ReadInt(wf_entity, "debug", debug);
 
   std::string name = wf->ReadString(wf_entity, "name", token);
@@ -1337,7 +1504,7 @@ void Model::Load()
     const std::string &colorstr = wf->ReadString(wf_entity, "color", "");
     if (colorstr != "") {
       if (colorstr == "random")
-        col = Color(drand48(), drand48(), drand48());
+        col = Color(Random(), Random(), Random());
       else
         col = Color(colorstr);
     }
@@ -1390,6 +1557,7 @@ void Model::Load()
   }
 
   this->stack_children = wf->ReadInt(wf_entity, "stack_children", this->stack_children);
+  UpdateGlobalPose();
 
   kg_t m = wf->ReadFloat(wf_entity, "mass", this->mass);
   if (m != this->mass)
@@ -1397,6 +1565,7 @@ void Model::Load()
 
   vis.Load(wf, wf_entity);
   SetFiducialReturn(vis.fiducial_return); // may have some work to do
+  SetBlobReturn(vis.blob_return);
 
   gui.Load(wf, wf_entity);
 
@@ -1422,6 +1591,11 @@ void Model::Load()
   // internally interval is in usec, but we use msec in worldfiles
   interval = 1000 * wf->ReadInt(wf_entity, "update_interval", interval / 1000);
 
+  // robots are logged at the world's rate unless they say otherwise
+  const usec_t log_default(
+      log_interval ? log_interval : dynamic_cast<ModelPosition *>(this) ? world->log_interval : 0);
+  SetLogInterval((usec_t)(1e3 * wf->ReadFloat(wf_entity, "log_interval", log_default / 1e3)));
+
   Say(wf->ReadString(wf_entity, "say", ""));
 
   int trail_length = wf->ReadInt(wf_entity, "trail_length", (int)trail.size() );
@@ -1485,6 +1659,110 @@ void Model::Save(void)
   PRINT_DEBUG1("Model \"%s\" saving complete.", token.c_str());
 }
 
+void Model::SaveState(Snapshot &snap) const
+{
+  snap.PutString(parent ? parent->Token() : "");
+  snap.PutPose(pose);
+  snap.Put(subs);
+  snap.Put(event_queue_num);
+  snap.Put(last_update);
+  snap.Put(stall);
+  snap.Put(disabled);
+  snap.Put(watts);
+  snap.Put(random.state);
+  snap.Put(random.have_spare);
+  snap.Put(random.rand1);
+  snap.Put(random.rand2);
+
+  // a power pack is recorded by the model that owns it
+  const bool pack(power_pack && power_pack->mod == this);
+  snap.Put(pack);
+  if (pack)
+    power_pack->SaveState(snap);
+}
+
+void Model::LoadState(Snapshot &snap)
+{
+  std::string parent_name;
+  Pose newpose;
+  int newsubs(0);
+  unsigned int queue_num(0);
+  RandomGenerator generator;
+  bool pack(false);
+
+  snap.GetString(parent_name);
+  snap.GetPose(newpose);
+  snap.Get(newsubs);
+  snap.Get(queue_num);
+  snap.Get(last_update);
+  snap.Get(stall);
+  snap.Get(disabled);
+  snap.Get(watts);
+  snap.Get(generator.state);
+  snap.Get(generator.have_spare);
+  snap.Get(generator.rand1);
+  snap.Get(generator.rand2);
+  snap.Get(pack);
+
+  if (pack && power_pack && power_pack->mod == this)
+    power_pack->LoadState(snap);
+
+  if (!snap.ok)
+    return;
+
+  // a gripper may have picked this model up or put it down
+  Model *newparent(parent_name.empty() ? NULL : world->GetModel(parent_name));
+  if (newparent != parent)
+    SetParent(newparent);
+
+  // remap only if we moved
+  if (newpose != pose)
+    SetPose(newpose);
+
+  // start up or shut down as the subscriptions require. The events
+  // this queues are replaced by the snapshot's.
+  while (subs < newsubs)
+    Subscribe();
+  while (subs > newsubs)
+    Unsubscribe();
+
+  // starting up picks a new queue, but our events go back in the
+  // saved one, and Update() must report to the queue it runs in
+  event_queue_num = queue_num < world->event_queues.size() ? queue_num : 0;
+  random = generator;
+}
+
+bool Model::CheckState(Snapshot &snap) const
+{
+  std::string parent_name;
+  bool pack(false);
+
+  snap.GetString(parent_name);
+  snap.SkipPose();
+  snap.Skip(subs);
+  snap.Skip(event_queue_num);
+  snap.Skip(last_update);
+  snap.Skip(stall);
+  snap.Skip(disabled);
+  snap.Skip(watts);
+  snap.Skip(random.state);
+  snap.Skip(random.have_spare);
+  snap.Skip(random.rand1);
+  snap.Skip(random.rand2);
+  snap.Get(pack);
+
+  if (!snap.ok || (!parent_name.empty() && world->GetModel(parent_name) == NULL))
+    return (snap.ok = false);
+
+  if (pack) {
+    if (power_pack == NULL || power_pack->mod != this)
+      return (snap.ok = false);
+    power_pack->CheckState(snap);
+  }
+
+  return snap.ok;
+}
+
 void Model::LoadControllerModule(const char *lib)
 {
   // printf( "[Ctrl \"%s\"", lib );
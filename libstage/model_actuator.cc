@@ -82,6 +82,34 @@ ModelActuator::~ModelActuator(void)
   // nothing to do
 }
 
+void ModelActuator::SaveState(Snapshot &snap) const
+{
+  Model::SaveState(snap);
+
+  snap.Put(goal);
+  snap.Put(pos);
+  snap.Put(control_mode);
+}
+
+void ModelActuator::LoadState(Snapshot &snap)
+{
+  Model::LoadState(snap);
+
+  snap.Get(goal);
+  snap.Get(pos);
+  snap.Get(control_mode);
+}
+
+bool ModelActuator::CheckState(Snapshot &snap) const
+{
+  Model::CheckState(snap);
+
+  snap.Skip(goal);
+  snap.Skip(pos);
+  snap.Skip(control_mode);
+  return snap.ok;
+}
+
 void ModelActuator::Load(void)
 {
   Model::Load();
@@ -98,13 +98,3 @@ void ModelBlinkenlight::Update(void)
   this->on = !this->on;
   Model::Update();
 }
-
-void ModelBlinkenlight::DataVisualize(Camera *cam)
-{
-  (void)cam; // avoid warning about unused var
-
-  // TODO XX
-  if (on && showBlinkenData) {
-    // LISTMETHOD( this->blocks, Block*, Draw );
-  }
-}
@@ -17,6 +17,7 @@
 
 #include <sys/time.h>
 
+#include "canvas.hh"
 #include "option.hh"
 #include "stage.hh"
 #include "worldfile.hh"
@@ -29,6 +30,10 @@ static const radians_t DEFAULT_BLOBFINDERPAN = 0.0;
 static const unsigned int DEFAULT_BLOBFINDERSCANWIDTH = 80;
 static const unsigned int DEFAULT_BLOBFINDERSCANHEIGHT = 60;
 
+// in analytic mode, the samples traced to check that a model is in
+// view are no further apart than this
+static const unsigned int BLOBFINDER_PROBE_SPACING = 4;
+
 // todo?
 // static const unsigned int DEFAULT_BLOBFINDERINTERVAL_MS = 100;
 // static const unsigned int DEFAULT_BLOBFINDERRESOLUTION = 1;
@@ -61,6 +66,7 @@ static const unsigned int DEFAULT_BLOBFINDERSCANHEIGHT = 60;
    range 12.0
    fov 3.14159/3.0
    pan 0.0
+   mode "scan"
 
    # model properties
    size [ 0.0 0.0 0.0 ]
@@ -80,13 +86,25 @@ static const unsigned int DEFAULT_BLOBFINDERSCANHEIGHT = 60;
    resolution
    - range <float>\n
    maximum range of the sensor in meters.
+   - mode "scan" or "analytic"\n
+   "scan" traces a ray for every column of the image and finds blobs in
+   runs of the same color. "analytic" finds the models of the tracked
+   colors within range from their footprints, and traces rays only in
+   the columns they cover, to find what hides them: much cheaper when
+   the blobs are a few small models. A model is taken to be fully in
+   view if rays no more than 4 columns apart all see its color.
+   Without colors, or if blobs of different colors overlap, the image
+   is scanned anyway. Unlike "scan", "analytic" sees only models with
+   blob_return set.
 
 */
 
 ModelBlobfinder::ModelBlobfinder(World *world, Model *parent, const std::string &type)
-    : Model(world, parent, type), vis(world), blobs(), colors(), fov(DEFAULT_BLOBFINDERFOV),
+    : Model(world, parent, type), vis(world), blobs(), colors(), samples(), runs(),
+      fov(DEFAULT_BLOBFINDERFOV),
       pan(DEFAULT_BLOBFINDERPAN), range(DEFAULT_BLOBFINDERRANGE),
-      scan_height(DEFAULT_BLOBFINDERSCANHEIGHT), scan_width(DEFAULT_BLOBFINDERSCANWIDTH)
+      scan_height(DEFAULT_BLOBFINDERSCANHEIGHT), scan_width(DEFAULT_BLOBFINDERSCANWIDTH),
+      analytic(false)
 {
   PRINT_DEBUG2("Constructing ModelBlobfinder %u (%s)\n", id, type.c_str());
 
@@ -145,6 +163,12 @@ void ModelBlobfinder::Load(void)
   fov = wf->ReadAngle(wf_entity, "fov", fov);
   pan = wf->ReadAngle(wf_entity, "pan", pan);
 
+  const std::string mode(wf->ReadString(wf_entity, "mode", analytic ? "analytic" : "scan"));
+  if (mode == "analytic" || mode == "scan")
+    analytic = (mode == "analytic");
+  else
+    PRINT_WARN1("blobfinder mode \"%s\" is not \"scan\" or \"analytic\"", mode.c_str());
+
   if (wf->PropertyExists(wf_entity, "colors")) {
     RemoveAllColors(); // empty the color list to start from scratch
 
@@ -163,16 +187,24 @@ void ModelBlobfinder::Load(void)
 }
 
 void ModelBlobfinder::Update(void)
+{
+  blobs.clear();
+
+  // tracing the columns of the image is needed to see every color
+  if (!analytic || colors.empty() || scan_width < 2 || !FindBlobsAnalytic())
+    ScanBlobs();
+
+  Model::Update();
+}
+
+void ModelBlobfinder::ScanBlobs(void)
 {
   // generate a scan for post-processing into a blob image
-  std::vector<RaytraceResult> samples(scan_width);
+  samples.resize(scan_width);
 
   Raytrace(Pose(0, 0, 0, pan), range, fov, blob_match, NULL, false, samples);
 
   // now the colors and ranges are filled in - time to do blob detection
-  double yRadsPerPixel = fov / scan_height;
-
-  blobs.clear();
 
   // scan through the samples looking for color blobs
   for (unsigned int s = 0; s < scan_width; s++) {
@@ -212,41 +244,186 @@ void ModelBlobfinder::Update(void)
 
     // printf( "blob end %d %X\n", blobright, blobcol );
 
-    double robotHeight = 0.6; // meters
-
     // find the average range to the blob;
     meters_t range = 0;
     for (unsigned int t = right; t <= left; t++)
       range += samples[t].range;
     range /= left - right + 1;
 
-    double startyangle = atan2(robotHeight / 2.0, range);
-    double endyangle = -startyangle;
-    int blobtop = scan_height / 2 - (int)(startyangle / yRadsPerPixel);
-    int blobbottom = scan_height / 2 - (int)(endyangle / yRadsPerPixel);
-
-    blobtop = std::max(blobtop, 0);
-    blobbottom = std::min(blobbottom, (int)scan_height);
-
-    // fill in an array entry for this blob
-    Blob blob;
-    blob.color = blobcol;
-    blob.left = scan_width - left - 1;
-    blob.top = blobtop;
-    blob.right = scan_width - right - 1;
-    ;
-    blob.bottom = blobbottom;
-    blob.range = range;
-
-    // printf( "Robot %p sees %d xpos %d ypos %d\n",
-    //  mod, blob.color, blob.xpos, blob.ypos );
-
-    // add the blob to our stash
-    // g_array_append_val( blobs, blob );
-    blobs.push_back(blob);
+    AddBlob(blobcol, right, left, range);
   }
+}
 
-  Model::Update();
+// true if the ray hit a model of color col that blobfinders can see
+static bool sees_color(const RaytraceResult &sample, const Color &col)
+{
+  return sample.mod && sample.mod->vis.blob_return && ColorMatchIgnoreAlpha(sample.color, col);
+}
+
+bool ModelBlobfinder::FindBlobsAnalytic(void)
+{
+  const Pose origin(LocalToGlobal(Pose(0, 0, 0, pan)));
+  const radians_t incr(fov / (scan_width - 1));
+
+  Ray ray(this, origin, range, blob_match, NULL, false);
+  ray.exact = world->ExactRaytrace();
+
+  // the grid fills every cell a block touches, so models can look a
+  // couple of cells larger to its rays
+  const meters_t margin(ray.exact ? 0 : 4.0 / world->Resolution());
+
+  runs.clear();
+
+  FOR_EACH (cit, colors) {
+    const std::vector<Model *> &candidates(world->BlobModels(*cit));
+
+    FOR_EACH (it, candidates) {
+      Model *mod(*it);
+
+      if (!ColorMatchIgnoreAlpha(mod->GetColor(), *cit) || !blob_match(mod, this, NULL))
+        continue;
+
+      // the corners of the model's footprint
+      const Geom geom(mod->GetGeom());
+      const Pose gp(mod->GetGlobalPose() + geom.pose);
+      const Size size(geom.size.x + margin, geom.size.y + margin, geom.size.z);
+
+      if (gp.Distance(origin) - hypot(size.x, size.y) / 2.0 > range)
+        continue;
+
+      // the bearings of the corners, from the right of the field of view
+      radians_t lo(M_PI * 2.0), hi(-M_PI * 2.0);
+      for (int c(0); c < 4; ++c) {
+        const Pose corner(gp
+                          + Pose((c & 1 ? 0.5 : -0.5) * size.x, (c & 2 ? 0.5 : -0.5) * size.y, 0, 0));
+        const radians_t bearing(
+            normalize(atan2(corner.y - origin.y, corner.x - origin.x) - origin.a));
+        lo = std::min(lo, bearing);
+        hi = std::max(hi, bearing);
+      }
+
+      // behind us, or around us
+      if (hi - lo > M_PI)
+        continue;
+
+      const double first_sample(ceil((lo + fov / 2.0) / incr));
+      const double last_sample(floor((hi + fov / 2.0) / incr));
+
+      if (last_sample < 0 || first_sample > scan_width - 1 || first_sample > last_sample)
+        continue; // between two samples or out of view
+
+      Run run;
+      run.color = *cit;
+      run.first = static_cast<unsigned int>(std::max(first_sample, 0.0));
+      run.last = static_cast<unsigned int>(std::min(last_sample, scan_width - 1.0));
+      run.range = 0;
+      run.traced = 0;
+
+      // probe the model's columns a few apart, and if all see its
+      // color, take it to be in view
+      const unsigned int width(run.last - run.first + 1);
+      const unsigned int probes((width + BLOBFINDER_PROBE_SPACING - 2) / BLOBFINDER_PROBE_SPACING
+                                + 1);
+      bool visible(true);
+
+      for (unsigned int p(0); p < probes && visible; ++p) {
+        const unsigned int s(probes > 1 ? run.first + (width - 1) * p / (probes - 1) : run.first);
+        ray.origin.a = origin.a - fov / 2.0 + s * incr;
+
+        const RaytraceResult sample(world->Raytrace(ray));
+        visible = sees_color(sample, *cit);
+        run.range += sample.range;
+        ++run.traced;
+      }
+
+      if (visible) {
+        runs.push_back(run);
+        continue;
+      }
+
+      // otherwise trace every column, for the parts in view
+      bool in_run(false);
+      for (unsigned int s(run.first); s <= run.last; ++s) {
+        ray.origin.a = origin.a - fov / 2.0 + s * incr;
+        const RaytraceResult sample(world->Raytrace(ray));
+
+        if (!sees_color(sample, *cit)) {
+          in_run = false;
+          continue;
+        }
+
+        if (!in_run) {
+          Run part(run);
+          part.first = s;
+          part.range = 0;
+          part.traced = 0;
+          runs.push_back(part);
+          in_run = true;
+        }
+
+        runs.back().last = s;
+        runs.back().range += sample.range;
+        ++runs.back().traced;
+      }
+    }
+  }
+
+  // runs of one color that touch are one blob, as in the scan. Runs
+  // of different colors that overlap need the scan to tell which is
+  // in front.
+  std::sort(runs.begin(), runs.end());
+
+  for (size_t r(0); r < runs.size();) {
+    Run blob(runs[r]);
+
+    for (++r; r < runs.size() && runs[r].first <= blob.last + 1; ++r) {
+      if (!ColorMatchIgnoreAlpha(runs[r].color, blob.color)) {
+        if (runs[r].first <= blob.last) {
+          blobs.clear();
+          return false;
+        }
+        break;
+      }
+
+      blob.last = std::max(blob.last, runs[r].last);
+      blob.range += runs[r].range;
+      blob.traced += runs[r].traced;
+    }
+
+    AddBlob(blob.color, blob.first, blob.last, blob.range / blob.traced);
+  }
+
+  return true;
+}
+
+void ModelBlobfinder::AddBlob(const Color &color, unsigned int first, unsigned int last,
+                              meters_t range)
+{
+  double yRadsPerPixel = fov / scan_height;
+  double robotHeight = 0.6; // meters
+
+  double startyangle = atan2(robotHeight / 2.0, range);
+  double endyangle = -startyangle;
+  int blobtop = scan_height / 2 - (int)(startyangle / yRadsPerPixel);
+  int blobbottom = scan_height / 2 - (int)(endyangle / yRadsPerPixel);
+
+  blobtop = std::max(blobtop, 0);
+  blobbottom = std::min(blobbottom, (int)scan_height);
+
+  // fill in an array entry for this blob
+  Blob blob;
+  blob.color = color;
+  blob.left = scan_width - last - 1;
+  blob.top = blobtop;
+  blob.right = scan_width - first - 1;
+  blob.bottom = blobbottom;
+  blob.range = range;
+
+  // printf( "Robot %p sees %d xpos %d ypos %d\n",
+  //  mod, blob.color, blob.xpos, blob.ypos );
+
+  // add the blob to our stash
+  blobs.push_back(blob);
 }
 
 void ModelBlobfinder::Startup(void)
@@ -287,76 +464,108 @@ ModelBlobfinder::Vis::Vis(World *) : Visualizer("Blobfinder", "blobfinder_vis")
   // world->RegisterOption( &showBeams );
 }
 
-void ModelBlobfinder::Vis::Visualize(Model *mod, Camera *cam)
-{
-  ModelBlobfinder *bf(dynamic_cast<ModelBlobfinder *>(mod));
+// the blobs of a subscribed blobfinder, as the canvas draws them
+class BlobfinderData : public VisData {
+public:
+  BlobfinderData(const std::vector<ModelBlobfinder::Blob> &blobs, meters_t range, radians_t fov,
+                 radians_t pan, radians_t heading, unsigned int scan_width,
+                 unsigned int scan_height, bool debug)
+      : blobs(blobs), range(range), fov(fov), pan(pan), heading(heading), scan_width(scan_width),
+        scan_height(scan_height), debug(debug)
+  {
+  }
 
-  if (bf->debug) {
-    // draw the FOV
-    GLUquadric *quadric = gluNewQuadric();
+  virtual VisData *Clone() const { return new BlobfinderData(*this); }
 
-    bf->PushColor(0, 0, 0, 0.2);
+  virtual void Draw(Canvas *canvas, Camera *cam, const RenderModel &rm) const
+  {
+    glPushMatrix();
+    Gl::pose_shift(rm.pose);
 
-    gluQuadricDrawStyle(quadric, GLU_SILHOUETTE);
-    gluPartialDisk(quadric, 0, bf->range,
-                   20, // slices
-                   1, // loops
-                   rtod(M_PI / 2.0 + bf->fov / 2.0 - bf->pan), // start angle
-                   rtod(-bf->fov)); // sweep angle
+    if (debug) {
+      // draw the FOV
+      GLUquadric *quadric = gluNewQuadric();
 
-    gluDeleteQuadric(quadric);
-    bf->PopColor();
-  }
+      canvas->PushColor(0, 0, 0, 0.2);
 
-  if (bf->subs < 1)
-    return;
+      gluQuadricDrawStyle(quadric, GLU_SILHOUETTE);
+      gluPartialDisk(quadric, 0, range,
+                     20, // slices
+                     1, // loops
+                     rtod(M_PI / 2.0 + fov / 2.0 - pan), // start angle
+                     rtod(-fov)); // sweep angle
 
-  glPushMatrix();
+      gluDeleteQuadric(quadric);
+      canvas->PopColor();
+    }
 
-  // return to global rotation frame
-  Pose gpose(bf->GetGlobalPose());
-  glRotatef(rtod(-gpose.a), 0, 0, 1);
+    // return to global rotation frame
+    glRotatef(rtod(-rm.pose.a), 0, 0, 1);
 
-  // place the "screen" a little away from the robot
-  glTranslatef(-2.5, -1.5, 0.5);
+    // place the "screen" a little away from the robot
+    glTranslatef(-2.5, -1.5, 0.5);
 
-  // rotate to face screen
-  float yaw, pitch;
-  pitch = -cam->pitch();
-  yaw = -cam->yaw();
-  float robotAngle = -rtod(bf->pose.a);
-  glRotatef(robotAngle - yaw, 0, 0, 1);
-  glRotatef(-pitch, 1, 0, 0);
+    // rotate to face screen
+    float yaw, pitch;
+    pitch = -cam->pitch();
+    yaw = -cam->yaw();
+    float robotAngle = -rtod(heading);
+    glRotatef(robotAngle - yaw, 0, 0, 1);
+    glRotatef(-pitch, 1, 0, 0);
 
-  // convert blob pixels to meters scale - arbitrary
-  glScalef(0.025, 0.025, 1);
+    // convert blob pixels to meters scale - arbitrary
+    glScalef(0.025, 0.025, 1);
 
-  // draw a white screen with a black border
-  bf->PushColor(1, 1, 1, 1);
-  glRectf(0, 0, bf->scan_width, bf->scan_height);
-  bf->PopColor();
+    // draw a white screen with a black border
+    canvas->PushColor(1, 1, 1, 1);
+    glRectf(0, 0, scan_width, scan_height);
+    canvas->PopColor();
 
-  glTranslatef(0, 0, 0.01);
+    glTranslatef(0, 0, 0.01);
 
-  glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-  bf->PushColor(1, 0, 0, 1);
-  glRectf(0, 0, bf->scan_width, bf->scan_height);
-  bf->PopColor();
-  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+    canvas->PushColor(1, 0, 0, 1);
+    glRectf(0, 0, scan_width, scan_height);
+    canvas->PopColor();
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 
-  // draw the blobs on the screen
-  for (unsigned int s = 0; s < bf->blobs.size(); s++) {
-    Blob *b = &bf->blobs[s];
-    // blobfinder_blob_t* b =
-    //&g_array_index( blobs, blobfinder_blob_t, s);
+    // draw the blobs on the screen
+    for (unsigned int s = 0; s < blobs.size(); s++) {
+      const ModelBlobfinder::Blob *b = &blobs[s];
+      // blobfinder_blob_t* b =
+      //&g_array_index( blobs, blobfinder_blob_t, s);
 
-    bf->PushColor(b->color);
-    glRectf(b->left, b->top, b->right, b->bottom);
+      canvas->PushColor(b->color);
+      glRectf(b->left, b->top, b->right, b->bottom);
 
-    // printf( "%u l %u t%u r %u b %u\n", s, b->left, b->top, b->right,
-    // b->bottom );
-    bf->PopColor();
+      // printf( "%u l %u t%u r %u b %u\n", s, b->left, b->top, b->right,
+      // b->bottom );
+      canvas->PopColor();
+    }
+
+    glPopMatrix();
   }
 
-  glPopMatrix();
+private:
+  const std::vector<ModelBlobfinder::Blob> blobs;
+  const meters_t range;
+  const radians_t fov, pan;
+  const radians_t heading; ///< of the blobfinder on its parent
+  const unsigned int scan_width, scan_height;
+  const bool debug;
+};
+
+void ModelBlobfinder::Vis::Visualize(Model *mod, Camera *cam)
+{
+  // the canvas draws the blobs from its snapshot, as copied by Capture()
+  (void)mod;
+  (void)cam;
+}
+
+VisData *ModelBlobfinder::Vis::Capture(Model *mod)
+{
+  ModelBlobfinder *bf(dynamic_cast<ModelBlobfinder *>(mod));
+
+  return new BlobfinderData(bf->blobs, bf->range, bf->fov, bf->pan, bf->pose.a, bf->scan_width,
+                            bf->scan_height, bf->debug);
 }
@@ -54,6 +54,7 @@ setting above.
 
 */
 
+#include "canvas.hh"
 #include "option.hh"
 #include "stage.hh"
 #include "worldfile.hh"
@@ -213,35 +214,77 @@ ModelBumper::BumperVis::~BumperVis()
   // Nothing to do here
 }
 
-void ModelBumper::BumperVis::Visualize(Model *mod, Camera *)
-{
-  ModelBumper *bump = dynamic_cast<ModelBumper *>(mod);
-
-  if (!(bump->samples && bump->bumpers && bump->bumper_count)) {
-    return;
+// the bumpers of a subscribed bumper model and whether each is hit,
+// as the canvas draws them
+class BumperData : public VisData {
+public:
+  BumperData(const ModelBumper &bump, const Option *shown) : bumpers(), hits(), shown(shown)
+  {
+    if (!(bump.samples && bump.bumpers))
+      return;
+
+    for (unsigned int t = 0; t < bump.bumper_count; t++) {
+      bumpers.push_back(bump.bumpers[t]);
+      hits.push_back(bump.samples[t].hit != NULL);
+    }
   }
 
-  if (!bump->showBumperData) {
-    return;
+  virtual VisData *Clone() const { return new BumperData(*this); }
+
+  virtual meters_t Reach() const
+  {
+    meters_t reach(0);
+    FOR_EACH (it, bumpers)
+      reach = std::max(reach, hypot(it->pose.x, it->pose.y) + it->length / 2.0);
+    return reach;
   }
-  /*
- * draw the sensitive area of the bumper, with a color indicating if it is hit.
- */
-  for (unsigned int t = 0; t < bump->bumper_count; t++) {
-    // This is how wide the active area rectangle will be.
-    float thickness = 0.01;
+
+  virtual void Draw(Canvas *, Camera *, const RenderModel &rm) const
+  {
+    if (!shown->isEnabled())
+      return;
+
     glPushMatrix();
-    // draw the active area with a different color if it is hit
-    if (bump->samples[t].hit) {
-      glColor3f(1.0f, 0.0f, 0.0f);
-    } else {
-      glColor3f(0.0f, 1.0f, 0.0f);
+    Gl::pose_shift(rm.pose);
+
+    /*
+   * draw the sensitive area of the bumper, with a color indicating if it is hit.
+   */
+    for (unsigned int t = 0; t < bumpers.size(); t++) {
+      // This is how wide the active area rectangle will be.
+      float thickness = 0.01;
+      glPushMatrix();
+      // draw the active area with a different color if it is hit
+      if (hits[t]) {
+        glColor3f(1.0f, 0.0f, 0.0f);
+      } else {
+        glColor3f(0.0f, 1.0f, 0.0f);
+      }
+      const float rad2deg = 180.0 / M_PI;
+      glTranslatef(bumpers[t].pose.x, bumpers[t].pose.y, 0);
+      glRotatef(bumpers[t].pose.a * rad2deg, 0, 0, 1);
+      glRectf(-thickness / 2.0f, -bumpers[t].length / 2.0, thickness / 2.0f,
+              bumpers[t].length / 2.0);
+      glPopMatrix();
     }
-    const float rad2deg = 180.0 / M_PI;
-    glTranslatef(bump->bumpers[t].pose.x, bump->bumpers[t].pose.y, 0);
-    glRotatef(bump->bumpers[t].pose.a * rad2deg, 0, 0, 1);
-    glRectf(-thickness / 2.0f, -bump->bumpers[t].length / 2.0, thickness / 2.0f,
-            bump->bumpers[t].length / 2.0);
+
     glPopMatrix();
   }
+
+private:
+  std::vector<ModelBumper::BumperConfig> bumpers;
+  std::vector<bool> hits;
+  const Option *shown; ///< ModelBumper::showBumperData, read when drawn
+};
+
+void ModelBumper::BumperVis::Visualize(Model *mod, Camera *)
+{
+  // the canvas draws the bumpers from its snapshot, as copied by Capture()
+  (void)mod;
+}
+
+VisData *ModelBumper::BumperVis::Capture(Model *mod)
+{
+  ModelBumper *bump = dynamic_cast<ModelBumper *>(mod);
+  return new BumperData(*bump, &bump->showBumperData);
 }
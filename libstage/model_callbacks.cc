@@ -2,10 +2,22 @@
 using namespace Stg;
 using namespace std;
 
+// a callback cleared while its list was being called
+static bool is_doomed(const Model::cb_t &cb)
+{
+  return cb.callback == NULL;
+}
+
 void Model::AddCallback(callback_type_t type, model_callback_t cb, void *user)
 {
-  // callbacks[address].insert( cb_t( cb, user ));
-  callbacks[type].insert(cb_t(cb, user));
+  vector<cb_t> &callvec = callbacks[type];
+
+  // each function and argument is added once
+  FOR_EACH (it, callvec)
+    if (it->callback == cb && it->arg == user)
+      return;
+
+  callvec.push_back(cb_t(cb, user));
 
   // debug info - record the global number of registered callbacks
   if (type == CB_UPDATE) {
@@ -14,39 +26,70 @@ void Model::AddCallback(callback_type_t type, model_callback_t cb, void *user)
   }
 }
 
-int Model::RemoveCallback(callback_type_t type, model_callback_t callback)
+int Model::RemoveCallback(callback_type_t type, model_callback_t callback, void *user)
 {
-  set<cb_t> &callset = callbacks[type];
-  callset.erase(cb_t(callback, NULL));
+  vector<cb_t> &callvec = callbacks[type];
+  int remaining(0);
 
-  if (type == CB_UPDATE) {
-    world->update_cb_count--;
-    assert(world->update_cb_count >= 0);
+  FOR_EACH (it, callvec) {
+    if (it->callback != callback || it->arg != user) {
+      remaining += !is_doomed(*it);
+      continue;
+    }
+
+    // the list may be being called, so erase it afterwards
+    it->callback = NULL;
+    callbacks_doomed = true;
+
+    if (type == CB_UPDATE) {
+      world->update_cb_count--;
+      assert(world->update_cb_count >= 0);
+    }
+  }
+
+  if (callback_depth == 0 && callbacks_doomed) {
+    callvec.erase(remove_if(callvec.begin(), callvec.end(), is_doomed), callvec.end());
+    callbacks_doomed = false;
   }
 
   // return the number of callbacks remaining for this address. Useful
   // for detecting when there are none.
-  return callset.size();
+  return remaining;
 }
 
 int Model::CallCallbacks(callback_type_t type)
 {
-  // maintain a list of callbacks that should be cancelled
-  vector<cb_t> doomed;
+  vector<cb_t> &callvec = callbacks[type];
 
-  set<cb_t> &callset = callbacks[type];
+  ++callback_depth;
 
-  FOR_EACH (it, callset) {
-    const cb_t &cba = *it;
-    // callbacks return true if they should be cancelled
-    if ((cba.callback)(this, cba.arg))
-      doomed.push_back(cba);
+  // callbacks added by a callback are first called next time
+  for (size_t i(0), count(callvec.size()); i < count; ++i) {
+    const cb_t cba(callvec[i]);
+    if (is_doomed(cba))
+      continue;
+
+    // callbacks return true if they should be cancelled. Nothing is
+    // erased while we are calling, so the callback is still at i,
+    // unless it removed itself.
+    if ((cba.callback)(this, cba.arg) && !is_doomed(callvec[i])) {
+      callvec[i].callback = NULL;
+      callbacks_doomed = true;
+
+      if (type == CB_UPDATE) {
+        world->update_cb_count--;
+        assert(world->update_cb_count >= 0);
+      }
+    }
   }
 
-  FOR_EACH (it, doomed)
-    callset.erase(*it);
+  if (--callback_depth == 0 && callbacks_doomed) {
+    FOR_EACH (it, callbacks)
+      it->erase(remove_if(it->begin(), it->end(), is_doomed), it->end());
+    callbacks_doomed = false;
+  }
 
   // return the number of callbacks remaining for this address. Useful
   // for detecting when there are none.
-  return callset.size();
+  return callvec.size() - count_if(callvec.begin(), callvec.end(), is_doomed);
 }
@@ -70,6 +70,13 @@ value too close to 0.
 - pantilt [ pan:<float> tilt:<float> ]
   angle, in degrees, where the camera is looking. pan is the left-right
 positioning, and tilt is the up-down positioning.
+
+With a GUI the frames are drawn offscreen and read back without
+waiting for the GL, so they lag the world by an update or two. In a
+world without a GUI the frames are raytraced rather than drawn
+with OpenGL, in the same layout. The robot carrying the camera is not
+seen, and a tilted camera traces each column along the bearing of its
+middle row.
 */
 
 // calculate the cross product, and store results in the first vertex
@@ -87,20 +94,21 @@ void cross(float &x1, float &y1, float &z1, float x2, float y2, float z2)
 }
 
 ModelCamera::ModelCamera(World *world, Model *parent, const std::string &type)
-    : Model(world, parent, type), _canvas(NULL), _frame_data(NULL), _frame_color_data(NULL),
-      _valid_vertexbuf_cache(false), _vertexbuf_cache(NULL), _width(32), _height(32),
-      _camera_quads_size(0), _camera_quads(NULL), _camera_colors(NULL), _camera(), _yaw_offset(0.0),
-      _pitch_offset(0.0)
+    : Model(world, parent, type), _canvas(NULL), _atlas_tile(-1), _frame_data(NULL),
+      _frame_color_data(NULL), _valid_vertexbuf_cache(false), _vertexbuf_cache(NULL), _width(32),
+      _height(32), _camera(), _yaw_offset(0.0), _pitch_offset(0.0), _row_length(), _row_slope(),
+      _row_done()
 {
 PRINT_DEBUG2("Constructing ModelCamera %u (%s)\n", id, type.c_str());
 
   WorldGui *world_gui = dynamic_cast<WorldGui *>(world);
 
-  if (world_gui == NULL) {
-    printf("Unable to use Camera Model - it must be run with a GUI world\n");
-    assert(0);
-  }
-  _canvas = world_gui->GetCanvas();
+  // without a GUI there is no GL context, so frames are raytraced,
+  // which is safe in the worker threads
+  if (world_gui)
+    _canvas = world_gui->GetCanvas();
+  else
+    thread_safe = true;
 
   _camera.setPitch(90.0);
 
@@ -118,8 +126,6 @@ ModelCamera::~ModelCamera()
     delete[] _frame_data;
     delete[] _frame_color_data;
     delete[] _vertexbuf_cache;
-    delete[] _camera_quads;
-    delete[] _camera_colors;
     _frame_data = NULL;
   }
 }
@@ -146,38 +152,53 @@ void ModelCamera::Load(void)
 
 void ModelCamera::Update(void)
 {
-  GetFrame();
+  if (_canvas)
+    GetFrame();
+  else
+    GetFrameRaytrace();
+
   Model::Update();
 }
 
-bool ModelCamera::GetFrame(void)
+void ModelCamera::AllocFrame(void)
 {
-  if (_width == 0 || _height == 0)
-    return false;
-
   if (_frame_data == NULL) {
     _frame_data = new GLfloat[_width * _height]; // assumes a max of depth 4
     _frame_color_data = new GLubyte[4 * _width * _height]; // for RGBA
 
     _vertexbuf_cache = new ColoredVertex[_width * _height]; // for unit vectors
-
-    _camera_quads_size = _height * _width * 4 * 3; // one quad per pixel, 3 vertex per quad
-    _camera_quads = new GLfloat[_camera_quads_size];
-    _camera_colors = new GLubyte[_camera_quads_size];
   }
+}
 
-  // TODO overcome issue when glviewport is set LARGER than the window side
-  // currently it just clips and draws outside areas black - resulting in bad
-  // glreadpixel data
-  if (_width > _canvas->w())
-    _width = _canvas->w();
-  if (_height > _canvas->h())
-    _height = _canvas->h();
+bool ModelCamera::GetFrame(void)
+{
+  if (_width == 0 || _height == 0)
+    return false;
 
-  GLint viewport[4];
-  glGetIntegerv(GL_VIEWPORT, viewport);
+  AllocFrame();
 
-  glViewport(0, 0, _width, _height);
+  CameraAtlas &atlas(_canvas->camera_atlas);
+  if (_atlas_tile < 0)
+    _atlas_tile = atlas.AddTile(_width, _height);
+
+  if (_atlas_tile < 0)
+    return GetFrameSync();
+
+  // collect the last frame read back, if any
+  const GLfloat *depth(NULL);
+  const GLubyte *rgba(NULL);
+  const int stride(atlas.Fetch(_atlas_tile, depth, rgba));
+  if (stride)
+    CopyFrame(depth, rgba, stride);
+
+  atlas.Begin(_atlas_tile);
+  DrawFrame();
+  atlas.End();
+  return true;
+}
+
+void ModelCamera::DrawFrame(void)
+{
   _camera.update();
   _camera.SetProjection();
   float height = GetGlobalPose().z;
@@ -192,9 +213,34 @@ bool ModelCamera::GetFrame(void)
   _camera.setPitch(90.0 - _pitch_offset);
   _camera.Draw();
 
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
   _canvas->DrawFloor();
   _canvas->DrawBlocks();
+}
+
+void ModelCamera::CopyFrame(const GLfloat *depth, const GLubyte *rgba, int stride)
+{
+  for (int row(0); row < _height; ++row) {
+    _camera.realDistance(depth + row * stride, _frame_data + row * _width, _width);
+    memcpy(_frame_color_data + 4 * row * _width, rgba + 4 * row * stride, 4 * _width);
+  }
+}
+
+bool ModelCamera::GetFrameSync(void)
+{
+  // TODO overcome issue when glviewport is set LARGER than the window side
+  // currently it just clips and draws outside areas black - resulting in bad
+  // glreadpixel data
+  if (_width > _canvas->w())
+    _width = _canvas->w();
+  if (_height > _canvas->h())
+    _height = _canvas->h();
+
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+
+  glViewport(0, 0, _width, _height);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  DrawFrame();
 
   // read depth buffer
   glReadPixels(0, 0, _width, _height,
@@ -202,10 +248,7 @@ bool ModelCamera::GetFrame(void)
                GL_FLOAT, // GL_UNSIGNED_BYTE,
                _frame_data);
   // transform length into linear length
-  float *data = (float *)(_frame_data); // TODO use static_cast here
-  int buf_size = _width * _height;
-  for (int i = 0; i < buf_size; i++)
-    data[i] = _camera.realDistance(data[i]);
+  _camera.realDistance(_frame_data, _frame_data, _width * _height);
 
   // read color buffer
   glReadPixels(0, 0, _width, _height, GL_RGBA, GL_UNSIGNED_BYTE, _frame_color_data);
@@ -216,12 +259,190 @@ bool ModelCamera::GetFrame(void)
   return true;
 }
 
+// Ignore the robot carrying the camera, which GetFrame() sees from
+// inside (see the TODO there)
+static bool camera_match(Model *hit, const Model *finder, const void *dummy)
+{
+  (void)dummy; // avoid warning about unused var
+
+  // small optimization to avoid recursive Model::IsRelated call in common cases
+  if ((hit == finder->Parent()) || (hit == finder))
+    return false;
+
+  return !hit->IsRelated(finder);
+}
+
+static void set_pixel(GLubyte *rgba, const Color &color)
+{
+  rgba[0] = static_cast<GLubyte>(color.r * 255.0 + 0.5);
+  rgba[1] = static_cast<GLubyte>(color.g * 255.0 + 0.5);
+  rgba[2] = static_cast<GLubyte>(color.b * 255.0 + 0.5);
+  rgba[3] = static_cast<GLubyte>(color.a * 255.0 + 0.5);
+}
+
+bool ModelCamera::GetFrameRaytrace(void)
+{
+  if (_width <= 0 || _height <= 0)
+    return false;
+
+  AllocFrame();
+
+  _row_length.resize(_height);
+  _row_slope.resize(_height);
+  _row_done.resize(_height);
+
+  // the floor and the background that GetFrame() draws
+  static const Color floor_color(1.0, 1.0, 1.0, 1.0);
+  static const Color sky_color(0.7, 0.7, 0.8, 1.0);
+
+  const Pose gpose(GetGlobalPose());
+  const double near(_camera.nearClip());
+  const double far(_camera.farClip());
+
+  // as in GetFrame(), the camera looks along its parent's heading,
+  // panned right by _yaw_offset and tilted down by _pitch_offset
+  const radians_t heading(parent->GetGlobalPose().a - dtor(_yaw_offset));
+  const double cos_tilt(cos(dtor(_pitch_offset)));
+  const double sin_tilt(sin(dtor(_pitch_offset)));
+  const double tan_h(tan(dtor(_camera.horizFov()) / 2.0));
+  const double tan_v(tan(dtor(_camera.vertFov()) / 2.0));
+
+  const bounds3d_t &extent(world->GetExtent());
+  const meters_t cell(1.0 / world->Resolution());
+
+  Ray ray(this, gpose, 0, camera_match, NULL, false);
+  ray.exact = world->ExactRaytrace();
+
+  for (int i(0); i < _width; ++i) {
+    // pixels are numbered from the bottom left, as glReadPixels() does
+    const double u(((2.0 * i + 1.0) / _width - 1.0) * tan_h);
+
+    // the direction of pixel (i,j) is forward + u * right + v * up.
+    // Its bearing depends on the row only when the camera is tilted,
+    // so the column is traced along the bearing of its middle row
+    const radians_t bearing(normalize(heading - atan2(u, cos_tilt)));
+    const double c(cos(bearing));
+    const double s(sin(bearing));
+
+    meters_t reach(0);
+    for (int j(0); j < _height; ++j) {
+      const double v(((2.0 * j + 1.0) / _height - 1.0) * tan_v);
+      _row_length[j] = hypot(cos_tilt + v * sin_tilt, u);
+      _row_slope[j] = (v * cos_tilt - sin_tilt) / _row_length[j];
+      _row_done[j] = false;
+      reach = std::max(reach, far * _row_length[j]);
+    }
+
+    // each hit resolves the rows that meet its block, and the rest
+    // carry on from just beyond it
+    meters_t start(0);
+    int open(_height);
+
+    while (open > 0 && start < reach) {
+      ray.origin.x = gpose.x + start * c;
+      ray.origin.y = gpose.y + start * s;
+      ray.origin.a = bearing;
+      ray.range = reach - start;
+
+      const RaytraceResult hit(world->Raytrace(ray));
+      if (hit.mod == NULL)
+        break;
+
+      const meters_t r(start + hit.range);
+      open = 0;
+
+      for (int j(0); j < _height; ++j) {
+        if (_row_done[j])
+          continue;
+
+        const meters_t z(gpose.z + _row_slope[j] * r);
+        const meters_t depth(r / _row_length[j]);
+
+        // passed below the floor or beyond the far clip
+        if (z < 0 || depth > far)
+          continue;
+
+        if (depth >= near && z >= hit.z.min && z <= hit.z.max) {
+          const int index(i + j * _width);
+          _frame_data[index] = depth;
+          set_pixel(_frame_color_data + 4 * index, hit.color);
+          _row_done[j] = true;
+        } else
+          ++open;
+      }
+
+      start = r + cell;
+    }
+
+    // the rows that met no block see the floor or the background
+    for (int j(0); j < _height; ++j) {
+      if (_row_done[j])
+        continue;
+
+      const int index(i + j * _width);
+      _frame_data[index] = far;
+      set_pixel(_frame_color_data + 4 * index, sky_color);
+
+      if (_row_slope[j] >= 0)
+        continue;
+
+      const meters_t r(gpose.z / -_row_slope[j]);
+      const meters_t depth(r / _row_length[j]);
+      const meters_t x(gpose.x + r * c);
+      const meters_t y(gpose.y + r * s);
+
+      if (depth >= near && depth <= far && x >= extent.x.min && x <= extent.x.max
+          && y >= extent.y.min && y <= extent.y.max) {
+        _frame_data[index] = depth;
+        set_pixel(_frame_color_data + 4 * index, floor_color);
+      }
+    }
+  }
+
+  return true;
+}
+
+// the depth image of a camera as a quad per pixel, as the canvas draws it
+class CameraData : public VisData {
+public:
+  CameraData(size_t pixels, const Option *shown)
+      : quads(pixels * 4 * 3), colors(pixels * 4 * 3), shown(shown)
+  {
+  }
+
+  virtual VisData *Clone() const { return new CameraData(*this); }
+
+  virtual void Draw(Canvas *, Camera *, const RenderModel &rm) const
+  {
+    if (quads.empty() || !shown->isEnabled())
+      return;
+
+    glPushMatrix();
+    Gl::pose_shift(rm.pose);
+
+    // vertex arrays are already enabled
+    glEnableClientState(GL_COLOR_ARRAY);
+
+    glVertexPointer(3, GL_FLOAT, 0, &quads[0]);
+    glColorPointer(3, GL_UNSIGNED_BYTE, 0, &colors[0]);
+    glDrawArrays(GL_QUADS, 0, quads.size() / 3);
+
+    glDisableClientState(GL_COLOR_ARRAY);
+
+    glPopMatrix();
+  }
+
+  std::vector<GLfloat> quads; ///< one quad per pixel, 3 values per vertex
+  std::vector<GLubyte> colors; ///< the color of each vertex
+  const Option *shown; ///< ModelCamera::showCameraData, read when drawn
+};
+
 // TODO create lines outlining camera frustrum, then iterate over each depth
 // measurement and create a square
-void ModelCamera::DataVisualize(Camera *)
+VisData *ModelCamera::CaptureData()
 {
-  if (_frame_data == NULL || !showCameraData)
-    return;
+  if (_frame_data == NULL)
+    return NULL;
 
   float w_fov = _camera.horizFov();
   float h_fov = _camera.vertFov();
@@ -268,7 +489,7 @@ void ModelCamera::DataVisualize(Camera *)
     _valid_vertexbuf_cache = true;
   }
 
-  //  glDisable( GL_CULL_FACE );
+  CameraData *data = new CameraData(w * h, &showCameraData);
 
   // Scale cached unit vectors with depth-buffer
   float *depth_data = (float *)(_frame_data);
@@ -293,7 +514,7 @@ void ModelCamera::DataVisualize(Camera *)
 
       z = length * M_PI * vert_a_space / 360.0;
 
-      GLfloat *p = _camera_quads + index * 4 * 3;
+      GLfloat *p = &data->quads[index * 4 * 3];
       p[0] = sx - x;
       p[1] = sy - y;
       p[2] = sz - z;
@@ -311,18 +532,11 @@ void ModelCamera::DataVisualize(Camera *)
       // TODO using a color index would be smarter
       const GLubyte *color = _frame_color_data + index * 4;
       for (int i = 0; i < 4; i++) {
-        GLubyte *cp = _camera_colors + index * 4 * 3 + i * 3;
+        GLubyte *cp = &data->colors[index * 4 * 3 + i * 3];
         memcpy(cp, color, sizeof(GLubyte) * 3);
       }
     }
   }
 
-  // vertex arrays are already enabled
-  glEnableClientState(GL_COLOR_ARRAY);
-
-  glVertexPointer(3, GL_FLOAT, 0, _camera_quads);
-  glColorPointer(3, GL_UNSIGNED_BYTE, 0, _camera_colors);
-  glDrawArrays(GL_QUADS, 0, w * h * 4);
-
-  glDisableClientState(GL_COLOR_ARRAY);
+  return data;
 }
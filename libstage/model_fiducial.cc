@@ -15,6 +15,7 @@
 
 #undef DEBUG
 
+#include "canvas.hh"
 #include "option.hh"
 #include "stage.hh"
 #include "worldfile.hh"
@@ -306,67 +307,105 @@ void ModelFiducial::Load(void)
   ignore_zloc = wf->ReadInt(wf_entity, "ignore_zloc", ignore_zloc);
 }
 
-void ModelFiducial::DataVisualize(Camera *cam)
-{
-  (void)cam; // avoid warning about unused var
+// the fiducials detected by a subscribed fiducial finder, as the canvas
+// draws them
+class FiducialData : public VisData {
+public:
+  FiducialData(const std::vector<ModelFiducial::Fiducial> &fiducials, radians_t fov,
+               meters_t max_range_anon, meters_t max_range_id, const Option *showFov,
+               const Option *showData)
+      : fiducials(fiducials), fov(fov), max_range_anon(max_range_anon),
+        max_range_id(max_range_id), showFov(showFov), showData(showData)
+  {
+  }
+
+  virtual VisData *Clone() const { return new FiducialData(*this); }
 
-  if (showFov) {
-    PushColor(1, 0, 1, 0.2); // magenta, with a bit of alpha
+  virtual meters_t Reach() const
+  {
+    meters_t reach(std::max(max_range_anon, max_range_id));
+    FOR_EACH (it, fiducials)
+      reach = std::max(reach, it->range + hypot(it->geom.x, it->geom.y) / 2.0);
+    return reach;
+  }
 
-    GLUquadric *quadric = gluNewQuadric();
+  virtual void Draw(Canvas *canvas, Camera *, const RenderModel &rm) const
+  {
+    glPushMatrix();
+    Gl::pose_shift(rm.pose);
 
-    gluQuadricDrawStyle(quadric, GLU_SILHOUETTE);
+    if (showFov->isEnabled()) {
+      canvas->PushColor(1, 0, 1, 0.2); // magenta, with a bit of alpha
 
-    gluPartialDisk(quadric, 0, max_range_anon,
-                   20, // slices
-                   1, // loops
-                   rtod(M_PI / 2.0 + fov / 2.0), // start angle
-                   rtod(-fov)); // sweep angle
+      GLUquadric *quadric = gluNewQuadric();
 
-    gluDeleteQuadric(quadric);
+      gluQuadricDrawStyle(quadric, GLU_SILHOUETTE);
 
-    PopColor();
-  }
+      gluPartialDisk(quadric, 0, max_range_anon,
+                     20, // slices
+                     1, // loops
+                     rtod(M_PI / 2.0 + fov / 2.0), // start angle
+                     rtod(-fov)); // sweep angle
+
+      gluDeleteQuadric(quadric);
 
-  if (showData) {
-    PushColor(1, 0, 1, 0.4); // magenta, with a bit of alpha
+      canvas->PopColor();
+    }
+
+    if (showData->isEnabled()) {
+      canvas->PushColor(1, 0, 1, 0.4); // magenta, with a bit of alpha
+
+      // draw fuzzy dotted lines
+      glLineWidth(2.0);
+      glLineStipple(1, 0x00FF);
 
-    // draw fuzzy dotted lines
-    glLineWidth(2.0);
-    glLineStipple(1, 0x00FF);
+      // draw lines to the fiducials
+      FOR_EACH (it, fiducials) {
+        const ModelFiducial::Fiducial &fid = *it;
 
-    // draw lines to the fiducials
-    FOR_EACH (it, fiducials) {
-      Fiducial &fid = *it;
+        double dx = fid.range * cos(fid.bearing);
+        double dy = fid.range * sin(fid.bearing);
 
-      double dx = fid.range * cos(fid.bearing);
-      double dy = fid.range * sin(fid.bearing);
+        glEnable(GL_LINE_STIPPLE);
+        glBegin(GL_LINES);
+        glVertex2f(0, 0);
+        glVertex2f(dx, dy);
+        glEnd();
+        glDisable(GL_LINE_STIPPLE);
 
-      glEnable(GL_LINE_STIPPLE);
-      glBegin(GL_LINES);
-      glVertex2f(0, 0);
-      glVertex2f(dx, dy);
-      glEnd();
-      glDisable(GL_LINE_STIPPLE);
+        glPushMatrix();
+        Gl::coord_shift(dx, dy, 0, fid.geom.a);
 
-      glPushMatrix();
-      Gl::coord_shift(dx, dy, 0, fid.geom.a);
+        glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+        glRectf(-fid.geom.x / 2.0, -fid.geom.y / 2.0, fid.geom.x / 2.0, fid.geom.y / 2.0);
 
-      glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-      glRectf(-fid.geom.x / 2.0, -fid.geom.y / 2.0, fid.geom.x / 2.0, fid.geom.y / 2.0);
+        // show the fiducial ID
+        char idstr[32];
+        snprintf(idstr, 31, "%d", fid.id);
+        Gl::draw_string(0, 0, 0, idstr);
 
-      // show the fiducial ID
-      char idstr[32];
-      snprintf(idstr, 31, "%d", fid.id);
-      Gl::draw_string(0, 0, 0, idstr);
+        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+        glPopMatrix();
+      }
 
-      glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-      glPopMatrix();
+      canvas->PopColor();
+      glLineWidth(1.0);
     }
 
-    PopColor();
-    glLineWidth(1.0);
+    glPopMatrix();
   }
+
+private:
+  const std::vector<ModelFiducial::Fiducial> fiducials;
+  const radians_t fov;
+  const meters_t max_range_anon, max_range_id;
+  const Option *showFov; ///< ModelFiducial::showFov, read when drawn
+  const Option *showData; ///< ModelFiducial::showData, read when drawn
+};
+
+VisData *ModelFiducial::CaptureData()
+{
+  return new FiducialData(fiducials, fov, max_range_anon, max_range_id, &showFov, &showData);
 }
 
 void ModelFiducial::Shutdown(void)
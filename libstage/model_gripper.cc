@@ -50,6 +50,7 @@
    "down"
 */
 
+#include "canvas.hh"
 #include "stage.hh"
 #include "worldfile.hh"
 #include <sys/time.h>
@@ -176,6 +177,79 @@ void ModelGripper::Save()
                  (cfg.lift == LIFT_UP) ? "up" : "down");
 }
 
+// models are recorded by name, since pointers do not survive a snapshot
+static void put_model(Snapshot &snap, const Model *mod)
+{
+  snap.PutString(mod ? mod->Token() : "");
+}
+
+static Model *get_model(Snapshot &snap, World *world)
+{
+  std::string name;
+  snap.GetString(name);
+  return name.empty() ? NULL : world->GetModel(name);
+}
+
+void ModelGripper::SaveState(Snapshot &snap) const
+{
+  Model::SaveState(snap);
+
+  snap.Put(cfg.paddles);
+  snap.Put(cfg.lift);
+  snap.Put(cfg.paddle_position);
+  snap.Put(cfg.lift_position);
+  snap.Put(cfg.paddles_stalled);
+  snap.Put(cfg.close_limit);
+  snap.Put(cfg.autosnatch);
+  snap.Put(cmd);
+  put_model(snap, cfg.gripped);
+  for (unsigned int i(0); i < 2; ++i) {
+    put_model(snap, cfg.beam[i]);
+    put_model(snap, cfg.contact[i]);
+  }
+}
+
+void ModelGripper::LoadState(Snapshot &snap)
+{
+  Model::LoadState(snap);
+
+  const double paddle_position(cfg.paddle_position), lift_position(cfg.lift_position);
+
+  snap.Get(cfg.paddles);
+  snap.Get(cfg.lift);
+  snap.Get(cfg.paddle_position);
+  snap.Get(cfg.lift_position);
+  snap.Get(cfg.paddles_stalled);
+  snap.Get(cfg.close_limit);
+  snap.Get(cfg.autosnatch);
+  snap.Get(cmd);
+  cfg.gripped = get_model(snap, world);
+  for (unsigned int i(0); i < 2; ++i) {
+    cfg.beam[i] = get_model(snap, world);
+    cfg.contact[i] = get_model(snap, world);
+  }
+
+  if (cfg.paddle_position != paddle_position || cfg.lift_position != lift_position)
+    PositionPaddles();
+}
+
+bool ModelGripper::CheckState(Snapshot &snap) const
+{
+  Model::CheckState(snap);
+
+  snap.Skip(cfg.paddles);
+  snap.Skip(cfg.lift);
+  snap.Skip(cfg.paddle_position);
+  snap.Skip(cfg.lift_position);
+  snap.Skip(cfg.paddles_stalled);
+  snap.Skip(cfg.close_limit);
+  snap.Skip(cfg.autosnatch);
+  snap.Skip(cmd);
+  for (unsigned int i(0); i < 5; ++i) // gripped, then the beams and contacts
+    snap.SkipString();
+  return snap.ok;
+}
+
 void ModelGripper::FixBlocks()
 {
   // get rid of the default cube
@@ -443,71 +517,88 @@ void ModelGripper::UpdateContacts()
   }
 }
 
-void ModelGripper::DataVisualize(Camera *cam)
-{
-  (void)cam; // avoid warning about unused var
+// the sensor lights of a subscribed gripper, as the canvas draws them. Only
+// whether the beams and contacts hold a model is used, never the model.
+class GripperData : public VisData {
+public:
+  explicit GripperData(const ModelGripper::config_t &cfg) : cfg(cfg) {}
+
+  virtual VisData *Clone() const { return new GripperData(*this); }
 
-  // only draw if someone is using the gripper
-  if (subs < 1)
-    return;
+  virtual meters_t Reach() const { return 0; }
 
-  // if( ! showData )
-  // return;
+  virtual void Draw(Canvas *canvas, Camera *, const RenderModel &rm) const
+  {
+    const Geom &geom = rm.geom;
 
-  // outline the sensor lights in black
-  PushColor(0, 0, 0, 1.0); // black
-  glTranslatef(0, 0, geom.size.z * cfg.paddle_size.z);
-  glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+    glPushMatrix();
+    Gl::pose_shift(rm.pose);
 
-  // different x location for each beam
-  double ibbx = (geom.size.x - cfg.break_beam_inset[0] * geom.size.x) - geom.size.x / 2.0;
-  double obbx = (geom.size.x - cfg.break_beam_inset[1] * geom.size.x) - geom.size.x / 2.0;
+    // outline the sensor lights in black
+    canvas->PushColor(0, 0, 0, 1.0); // black
+    glTranslatef(0, 0, geom.size.z * cfg.paddle_size.z);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
-  // common y position
-  double invp = 1.0 - cfg.paddle_position;
-  double bby = invp * ((geom.size.y / 2.0) - (geom.size.y * cfg.paddle_size.y));
+    // different x location for each beam
+    double ibbx = (geom.size.x - cfg.break_beam_inset[0] * geom.size.x) - geom.size.x / 2.0;
+    double obbx = (geom.size.x - cfg.break_beam_inset[1] * geom.size.x) - geom.size.x / 2.0;
 
-  //   // size of the paddle indicator lights
-  double led_dx = cfg.paddle_size.y * 0.5 * geom.size.y;
+    // common y position
+    double invp = 1.0 - cfg.paddle_position;
+    double bby = invp * ((geom.size.y / 2.0) - (geom.size.y * cfg.paddle_size.y));
 
-  // paddle break beams
-  Gl::draw_centered_rect(ibbx, bby + led_dx, led_dx, led_dx);
-  Gl::draw_centered_rect(ibbx, -bby - led_dx, led_dx, led_dx);
-  Gl::draw_centered_rect(obbx, bby + led_dx, led_dx, led_dx);
-  Gl::draw_centered_rect(obbx, -bby - led_dx, led_dx, led_dx);
+    //   // size of the paddle indicator lights
+    double led_dx = cfg.paddle_size.y * 0.5 * geom.size.y;
 
-  // paddle contacts
-  double cx = ((1.0 - cfg.paddle_size.x / 2.0) * geom.size.x) - geom.size.x / 2.0;
-  double cy = (geom.size.y / 2.0) - (geom.size.y * 0.8 * cfg.paddle_size.y);
-  double plen = cfg.paddle_size.x * geom.size.x;
-  double pwidth = 0.4 * cfg.paddle_size.y * geom.size.y;
+    // paddle break beams
+    Gl::draw_centered_rect(ibbx, bby + led_dx, led_dx, led_dx);
+    Gl::draw_centered_rect(ibbx, -bby - led_dx, led_dx, led_dx);
+    Gl::draw_centered_rect(obbx, bby + led_dx, led_dx, led_dx);
+    Gl::draw_centered_rect(obbx, -bby - led_dx, led_dx, led_dx);
 
-  Gl::draw_centered_rect(cx, invp * +cy, plen, pwidth);
-  Gl::draw_centered_rect(cx, invp * -cy, plen, pwidth);
+    // paddle contacts
+    double cx = ((1.0 - cfg.paddle_size.x / 2.0) * geom.size.x) - geom.size.x / 2.0;
+    double cy = (geom.size.y / 2.0) - (geom.size.y * 0.8 * cfg.paddle_size.y);
+    double plen = cfg.paddle_size.x * geom.size.x;
+    double pwidth = 0.4 * cfg.paddle_size.y * geom.size.y;
 
-  // if the gripper detects anything, fill the lights in with yellow
-  if (cfg.beam[0] || cfg.beam[1] || cfg.contact[0] || cfg.contact[1]) {
-    PushColor(1, 1, 0, 1.0); // yellow
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    Gl::draw_centered_rect(cx, invp * +cy, plen, pwidth);
+    Gl::draw_centered_rect(cx, invp * -cy, plen, pwidth);
 
-    if (cfg.contact[0])
-      Gl::draw_centered_rect(cx, invp * +cy, plen, pwidth);
+    // if the gripper detects anything, fill the lights in with yellow
+    if (cfg.beam[0] || cfg.beam[1] || cfg.contact[0] || cfg.contact[1]) {
+      canvas->PushColor(1, 1, 0, 1.0); // yellow
+      glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 
-    if (cfg.contact[1])
-      Gl::draw_centered_rect(cx, invp * -cy, plen, pwidth);
+      if (cfg.contact[0])
+        Gl::draw_centered_rect(cx, invp * +cy, plen, pwidth);
 
-    if (cfg.beam[0]) {
-      Gl::draw_centered_rect(ibbx, bby + led_dx, led_dx, led_dx);
-      Gl::draw_centered_rect(ibbx, -bby - led_dx, led_dx, led_dx);
-    }
+      if (cfg.contact[1])
+        Gl::draw_centered_rect(cx, invp * -cy, plen, pwidth);
 
-    if (cfg.beam[1]) {
-      Gl::draw_centered_rect(obbx, bby + led_dx, led_dx, led_dx);
-      Gl::draw_centered_rect(obbx, -bby - led_dx, led_dx, led_dx);
+      if (cfg.beam[0]) {
+        Gl::draw_centered_rect(ibbx, bby + led_dx, led_dx, led_dx);
+        Gl::draw_centered_rect(ibbx, -bby - led_dx, led_dx, led_dx);
+      }
+
+      if (cfg.beam[1]) {
+        Gl::draw_centered_rect(obbx, bby + led_dx, led_dx, led_dx);
+        Gl::draw_centered_rect(obbx, -bby - led_dx, led_dx, led_dx);
+      }
+
+      canvas->PopColor(); // yellow
     }
 
-    PopColor(); // yellow
+    canvas->PopColor(); // black
+
+    glPopMatrix();
   }
 
-  PopColor(); // black
+private:
+  const ModelGripper::config_t cfg;
+};
+
+VisData *ModelGripper::CaptureData()
+{
+  return new GripperData(cfg);
 }
@@ -1,3 +1,4 @@
+#include "canvas.hh"
 #include "stage.hh"
 
 using namespace Stg;
@@ -35,3 +36,16 @@ void ModelLightIndicator::DrawBlocks()
     this->SetColor(keep);
   }
 }
+
+void ModelLightIndicator::CaptureRender(RenderModel &rm) const
+{
+  Model::CaptureRender(rm);
+
+  if (!m_IsOn) {
+    const double scaleFactor = 0.8;
+
+    rm.color.r *= scaleFactor;
+    rm.color.g *= scaleFactor;
+    rm.color.b *= scaleFactor;
+  }
+}
@@ -12,6 +12,7 @@
 
 #include <sys/time.h>
 
+#include "canvas.hh"
 #include "stage.hh"
 #include "worldfile.hh"
 using namespace Stg;
@@ -115,10 +116,10 @@ ModelPosition::ModelPosition(World *world, Model *parent, const std::string &typ
       // private
       velocity(), goal(0, 0, 0, 0), control_mode(CONTROL_VELOCITY), drive_mode(DRIVE_DIFFERENTIAL),
       localization_mode(LOCALIZATION_GPS),
-      integration_error(drand48() * INTEGRATION_ERROR_MAX_X - INTEGRATION_ERROR_MAX_X / 2.0,
-                        drand48() * INTEGRATION_ERROR_MAX_Y - INTEGRATION_ERROR_MAX_Y / 2.0,
-                        drand48() * INTEGRATION_ERROR_MAX_Z - INTEGRATION_ERROR_MAX_Z / 2.0,
-                        drand48() * INTEGRATION_ERROR_MAX_A - INTEGRATION_ERROR_MAX_A / 2.0),
+      integration_error(Random() * INTEGRATION_ERROR_MAX_X - INTEGRATION_ERROR_MAX_X / 2.0,
+                        Random() * INTEGRATION_ERROR_MAX_Y - INTEGRATION_ERROR_MAX_Y / 2.0,
+                        Random() * INTEGRATION_ERROR_MAX_Z - INTEGRATION_ERROR_MAX_Z / 2.0,
+                        Random() * INTEGRATION_ERROR_MAX_A - INTEGRATION_ERROR_MAX_A / 2.0),
       wheelbase(1.0), acceleration_bounds(), velocity_bounds(),
       // public
       waypoints(), wpvis(), posevis()
@@ -192,6 +193,50 @@ void ModelPosition::SetGlobalVelocity(const Velocity &gv)
   this->SetVelocity(lv);
 }
 
+void ModelPosition::SaveState(Snapshot &snap) const
+{
+  Model::SaveState(snap);
+
+  snap.PutPose(velocity);
+  snap.PutPose(goal);
+  snap.Put(control_mode);
+  snap.Put(drive_mode);
+  snap.Put(localization_mode);
+  snap.PutPose(integration_error);
+  snap.PutPose(est_pose);
+  snap.PutPose(est_pose_error);
+  snap.PutPose(est_origin);
+}
+
+void ModelPosition::LoadState(Snapshot &snap)
+{
+  Model::LoadState(snap);
+
+  snap.GetPose(velocity);
+  snap.GetPose(goal);
+  snap.Get(control_mode);
+  snap.Get(drive_mode);
+  snap.Get(localization_mode);
+  snap.GetPose(integration_error);
+  snap.GetPose(est_pose);
+  snap.GetPose(est_pose_error);
+  snap.GetPose(est_origin);
+}
+
+bool ModelPosition::CheckState(Snapshot &snap) const
+{
+  Model::CheckState(snap);
+
+  snap.SkipPose();
+  snap.SkipPose();
+  snap.Skip(control_mode);
+  snap.Skip(drive_mode);
+  snap.Skip(localization_mode);
+  for (unsigned int i(0); i < 4; ++i)
+    snap.SkipPose();
+  return snap.ok;
+}
+
 void ModelPosition::Load(void)
 {
   Model::Load();
@@ -545,6 +590,7 @@ void ModelPosition::Move(void)
   const Pose startpose(pose);
 
   pose = newpose; // do the move provisionally - we might undo it below
+  UpdateGlobalPose();
 
   const unsigned int layer(world->UpdateCount() % 2);
   // @todo th
@@ -556,6 +602,7 @@ void ModelPosition::Move(void)
     // put things back the way they were
     // this is expensive, but it happens _very_ rarely for most people
     pose = startpose;
+    UpdateGlobalPose();
     UnMapWithChildren(layer);
     MapWithChildren(layer);
 
@@ -681,62 +728,84 @@ ModelPosition::PoseVis::PoseVis() : Visualizer("Position coordinates", "show_pos
 {
 }
 
-void ModelPosition::PoseVis::Visualize(Model *mod, Camera *cam)
-{
-  (void)cam; // avoid warning about unused var
+// the estimated pose of a subscribed position model, as the canvas
+// draws it
+class PoseData : public VisData {
+public:
+  PoseData(const Pose &est_origin, const Pose &est_pose)
+      : est_origin(est_origin), est_pose(est_pose)
+  {
+  }
 
-  ModelPosition *pos = dynamic_cast<ModelPosition *>(mod);
+  virtual VisData *Clone() const { return new PoseData(*this); }
+
+  virtual void Draw(Canvas *canvas, Camera *, const RenderModel &rm) const
+  {
+    // vizualize my estimated pose
+    glPushMatrix();
 
-  // vizualize my estimated pose
-  glPushMatrix();
+    Gl::pose_shift(est_origin);
+    canvas->PushColor(1, 0, 0, 1); // origin in red
+    Gl::draw_origin(0.5);
 
-  // back into global coords
-  Gl::pose_inverse_shift(pos->GetGlobalPose());
+    glEnable(GL_LINE_STIPPLE);
+    glLineStipple(3, 0xAAAA);
 
-  Gl::pose_shift(pos->est_origin);
-  pos->PushColor(1, 0, 0, 1); // origin in red
-  Gl::draw_origin(0.5);
+    canvas->PushColor(1, 0, 0, 0.5);
+    glBegin(GL_LINE_STRIP);
+    glVertex2f(0, 0);
+    glVertex2f(est_pose.x, 0);
+    glVertex2f(est_pose.x, est_pose.y);
+    glEnd();
+
+    glDisable(GL_LINE_STIPPLE);
 
-  glEnable(GL_LINE_STIPPLE);
-  glLineStipple(3, 0xAAAA);
+    char label[64];
+    snprintf(label, 64, "x:%.3f", est_pose.x);
+    Gl::draw_string(est_pose.x / 2.0, -0.5, 0, label);
 
-  pos->PushColor(1, 0, 0, 0.5);
-  glBegin(GL_LINE_STRIP);
-  glVertex2f(0, 0);
-  glVertex2f(pos->est_pose.x, 0);
-  glVertex2f(pos->est_pose.x, pos->est_pose.y);
-  glEnd();
+    snprintf(label, 64, "y:%.3f", est_pose.y);
+    Gl::draw_string(est_pose.x + 0.5, est_pose.y / 2.0, 0, (const char *)label);
 
-  glDisable(GL_LINE_STIPPLE);
+    canvas->PopColor();
 
-  char label[64];
-  snprintf(label, 64, "x:%.3f", pos->est_pose.x);
-  Gl::draw_string(pos->est_pose.x / 2.0, -0.5, 0, label);
+    Gl::pose_shift(est_pose);
+    canvas->PushColor(0, 1, 0, 1); // pose in green
+    Gl::draw_origin(0.5);
+    canvas->PopColor();
 
-  snprintf(label, 64, "y:%.3f", pos->est_pose.y);
-  Gl::draw_string(pos->est_pose.x + 0.5, pos->est_pose.y / 2.0, 0, (const char *)label);
+    Gl::pose_shift(rm.geom.pose);
+    canvas->PushColor(0, 0, 1, 1); // offset in blue
+    Gl::draw_origin(0.5);
+    canvas->PopColor();
 
-  pos->PopColor();
+    Color c = rm.color;
+    c.a = 0.5;
+    canvas->PushColor(c);
 
-  Gl::pose_shift(pos->est_pose);
-  pos->PushColor(0, 1, 0, 1); // pose in green
-  Gl::draw_origin(0.5);
-  pos->PopColor();
+    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+    BlockGroup::DrawFootPrint(rm.shape);
+    canvas->PopColor();
 
-  Gl::pose_shift(pos->geom.pose);
-  pos->PushColor(0, 0, 1, 1); // offset in blue
-  Gl::draw_origin(0.5);
-  pos->PopColor();
+    canvas->PopColor(); // red origin
+    glPopMatrix();
+  }
 
-  Color c = pos->color;
-  c.a = 0.5;
-  pos->PushColor(c);
+private:
+  const Pose est_origin, est_pose;
+};
 
-  glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-  pos->blockgroup.DrawFootPrint(pos->geom);
-  pos->PopColor();
+void ModelPosition::PoseVis::Visualize(Model *mod, Camera *cam)
+{
+  // the canvas draws the pose from its snapshot, as copied by Capture()
+  (void)mod;
+  (void)cam;
+}
 
-  glPopMatrix();
+VisData *ModelPosition::PoseVis::Capture(Model *mod)
+{
+  ModelPosition *pos = dynamic_cast<ModelPosition *>(mod);
+  return new PoseData(pos->est_origin, pos->est_pose);
 }
 
 ModelPosition::WaypointVis::WaypointVis()
@@ -744,52 +813,90 @@ ModelPosition::WaypointVis::WaypointVis()
 {
 }
 
-void ModelPosition::WaypointVis::Visualize(Model *mod, Camera *cam)
-{
-  (void)cam; // avoid warning about unused var
+// the waypoints of a subscribed position model, as the canvas draws
+// them. The batches are filled when first drawn.
+class WaypointData : public VisData {
+public:
+  WaypointData(const std::vector<ModelPosition::Waypoint> &waypoints, const Pose &pose,
+               const Pose &est_origin, const Color &color)
+      : waypoints(waypoints), pose(pose), est_origin(est_origin), color(color), points(GL_POINTS),
+        quivers(GL_LINES), path(GL_LINES)
+  {
+  }
 
-  ModelPosition *pos = dynamic_cast<ModelPosition *>(mod);
-  const std::vector<Waypoint> &waypoints = pos->waypoints;
+  WaypointData(const WaypointData &other)
+      : VisData(), waypoints(other.waypoints), pose(other.pose), est_origin(other.est_origin),
+        color(other.color), points(GL_POINTS), quivers(GL_LINES), path(GL_LINES)
+  {
+  }
 
-  if (waypoints.empty())
-    return;
+  virtual VisData *Clone() const { return new WaypointData(*this); }
 
-  glPointSize(5);
-  glPushMatrix();
-  pos->PushColor(pos->color);
+  virtual void Draw(Canvas *canvas, Camera *, const RenderModel &rm) const
+  {
+    if (waypoints.empty())
+      return;
 
-  Gl::pose_inverse_shift(pos->pose);
-  Gl::pose_shift(pos->est_origin);
+    if (points.Empty()) {
+      FOR_EACH (it, waypoints)
+        it->Append(points, quivers);
 
-  glTranslatef(0, 0, 0.02);
+      // lines connecting the waypoints
+      path.SetColor(Color(1, 0, 0, 0.3));
+      for (size_t i(1); i < waypoints.size(); i++) {
+        Pose p = waypoints[i].pose;
+        Pose o = waypoints[i - 1].pose;
 
-  // draw waypoints
-  glLineWidth(3);
-  FOR_EACH (it, waypoints)
-    it->Draw();
-  glLineWidth(1);
+        path.Vertex(p.x, p.y, 0);
+        path.Vertex(o.x, o.y, 0);
+      }
+    }
 
-  // draw lines connecting the waypoints
-  const size_t num(waypoints.size());
-  if (num > 1) {
-    pos->PushColor(1, 0, 0, 0.3);
-    glBegin(GL_LINES);
+    glPointSize(5);
+    glPushMatrix();
+    canvas->PushColor(color);
 
-    for (size_t i(1); i < num; i++) {
-      Pose p = waypoints[i].pose;
-      Pose o = waypoints[i - 1].pose;
+    // back out of the model's pose on its parent, and into the
+    // estimated origin, which the waypoints are relative to
+    Gl::pose_shift(rm.pose);
+    Gl::pose_inverse_shift(pose);
+    Gl::pose_shift(est_origin);
 
-      glVertex2f(p.x, p.y);
-      glVertex2f(o.x, o.y);
-    }
+    glTranslatef(0, 0, 0.02);
 
-    glEnd();
+    // draw waypoints
+    points.Draw();
+    glLineWidth(3);
+    quivers.Draw();
+    glLineWidth(1);
 
-    pos->PopColor();
+    // draw lines connecting the waypoints
+    path.Draw();
+
+    canvas->PopColor();
+    glPopMatrix();
   }
 
-  pos->PopColor();
-  glPopMatrix();
+private:
+  const std::vector<ModelPosition::Waypoint> waypoints;
+  const Pose pose, est_origin;
+  const Color color;
+  mutable Gl::VertexBatch points, quivers, path;
+
+  WaypointData &operator=(const WaypointData &);
+};
+
+void ModelPosition::WaypointVis::Visualize(Model *mod, Camera *cam)
+{
+  // the canvas draws the waypoints from its snapshot, as copied by Capture()
+  (void)mod;
+  (void)cam;
+}
+
+VisData *ModelPosition::WaypointVis::Capture(Model *mod)
+{
+  ModelPosition *pos = dynamic_cast<ModelPosition *>(mod);
+  return new WaypointData(pos->waypoints, pos->pose, pos->est_origin, pos->color);
 }
 
 ModelPosition::Waypoint::Waypoint(const Pose &pose, Color color) : pose(pose), color(color)
@@ -805,28 +912,17 @@ ModelPosition::Waypoint::Waypoint() : pose(), color()
 {
 }
 
-void ModelPosition::Waypoint::Draw() const
+void ModelPosition::Waypoint::Append(Gl::VertexBatch &points, Gl::VertexBatch &quivers) const
 {
-  GLdouble d[4];
-
-  d[0] = color.r;
-  d[1] = color.g;
-  d[2] = color.b;
-  d[3] = color.a;
-
-  glColor4dv(d);
-
-  glBegin(GL_POINTS);
-  glVertex3f(pose.x, pose.y, pose.z);
-  glEnd();
+  points.SetColor(color);
+  points.Vertex(pose.x, pose.y, pose.z);
 
   meters_t quiver_length = 0.15;
 
   double dx = cos(pose.a) * quiver_length;
   double dy = sin(pose.a) * quiver_length;
 
-  glBegin(GL_LINES);
-  glVertex3f(pose.x, pose.y, pose.z);
-  glVertex3f(pose.x + dx, pose.y + dy, pose.z);
-  glEnd();
+  quivers.SetColor(color);
+  quivers.Vertex(pose.x, pose.y, pose.z);
+  quivers.Vertex(pose.x + dx, pose.y + dy, pose.z);
 }
@@ -35,6 +35,7 @@
    fov a
    range [min max]
    noise [range_const range_prop angular]
+   raytrace "grid"
    )
 
    # generic model properties with non-default values
@@ -72,11 +73,17 @@
    angular noise in degrees
    - sview[\<transducer index\>] [float float float]
    - per-transducer version of the sview property. Overrides the common setting.
+   - raytrace "grid" or "exact"
+   - how the sensor's rays are traced: through the world's grid, so
+   that ranges are accurate to the world resolution, or against the
+   edges of the models' polygons, so that they are exact. Defaults to
+   the world's raytrace property.
 
 */
 
 //#define DEBUG 1
 
+#include "canvas.hh"
 #include "option.hh"
 #include "stage.hh"
 #include "worldfile.hh"
@@ -90,6 +97,9 @@ static const Stg::Size RANGER_SIZE(0.15, 0.15, 0.2); // SICK LMS size
 static const Color RANGER_CONFIG_COLOR(0, 0, 0.5);
 // static const Color RANGER_GEOM_COLOR( 1,0,1 );
 
+// the name of the visualization in the View menu
+static const char *VIS_MENU_NAME = "Ranger";
+
 // static members
 Option ModelRanger::Vis::showTransducers("Ranger transducers", "show_ranger_transducers", "", false,
                                          NULL);
@@ -100,7 +110,8 @@ Option ModelRanger::Vis::showFov("Ranger FOV", "show_ranger_fov", "", false, NUL
 // false, NULL );
 
 ModelRanger::ModelRanger(World *world, Model *parent, const std::string &type)
-    : Model(world, parent, type), vis(world)
+    : Model(world, parent, type), vis(world), sensors(), scan(), scan_count(0), scan_sequence(0),
+      scan_layout()
 {
  PRINT_DEBUG2("Constructing ModelRanger %u (%s)\n", id, type.c_str());
 
@@ -121,6 +132,72 @@ ModelRanger::~ModelRanger()
 {
 }
 
+void ModelRanger::SaveState(Snapshot &snap) const
+{
+  Model::SaveState(snap);
+
+  // the latest readings, so the restored world reports them until the
+  // next update, as the original did
+  snap.Put((uint32_t)sensors.size());
+  FOR_EACH (it, sensors) {
+    snap.Put((uint32_t)it->ranges.size());
+    FOR_EACH (r, it->ranges)
+      snap.Put(*r);
+    FOR_EACH (i, it->intensities)
+      snap.Put(*i);
+  }
+}
+
+void ModelRanger::LoadState(Snapshot &snap)
+{
+  Model::LoadState(snap);
+
+  uint32_t count(0);
+  if (!snap.Get(count) || count != sensors.size()) {
+    snap.ok = false;
+    return;
+  }
+
+  FOR_EACH (it, sensors) {
+    uint32_t samples(0);
+    snap.Get(samples);
+    it->ranges.resize(samples);
+    it->intensities.resize(samples);
+
+    FOR_EACH (r, it->ranges)
+      snap.Get(*r);
+    FOR_EACH (i, it->intensities)
+      snap.Get(*i);
+  }
+
+  // and the same readings in the scan
+  LayoutScan();
+  ++scan_sequence;
+
+  FOR_EACH (it, sensors)
+    for (size_t t(0); t < it->sample_count && t < it->ranges.size(); ++t) {
+      scan[it->offset + t] = it->ranges[t];
+      scan[scan_count + it->offset + t] = it->intensities[t];
+    }
+}
+
+bool ModelRanger::CheckState(Snapshot &snap) const
+{
+  Model::CheckState(snap);
+
+  uint32_t count(0);
+  if (!snap.Get(count) || count != sensors.size())
+    return (snap.ok = false);
+
+  for (uint32_t i(0); i < count; ++i) {
+    uint32_t samples(0);
+    snap.Get(samples);
+    snap.Skip(samples * (sizeof(meters_t) + sizeof(double)));
+  }
+
+  return snap.ok;
+}
+
 void ModelRanger::Startup(void)
 {
   Model::Startup();
@@ -139,7 +216,12 @@ void ModelRanger::Shutdown(void)
 void ModelRanger::LoadSensor(Worldfile *wf, int entity)
 {
   Sensor s;
+  s.exact = world->ExactRaytrace();
   s.Load(wf, entity);
+
+  if (s.exact)
+    world->EnableExactRaytrace();
+
   sensors.push_back(s);
 }
 
@@ -153,6 +235,12 @@ void ModelRanger::Sensor::Load(Worldfile *wf, int entity)
 
   wf->ReadTuple(entity, "noise", 0, 3, "lfa", &range_noise_const, &range_noise, &angle_noise);
   color.Load(wf, entity);
+
+  const std::string raytrace(wf->ReadString(entity, "raytrace", exact ? "exact" : "grid"));
+  if (raytrace == "exact" || raytrace == "grid")
+    exact = (raytrace == "exact");
+  else
+    PRINT_WARN1("ranger sensor raytrace \"%s\" is not \"grid\" or \"exact\"", raytrace.c_str());
 }
 
 static bool ranger_match(Model *hit, const Model *finder, const void *dummy)
@@ -170,50 +258,73 @@ static bool ranger_match(Model *hit, const Model *finder, const void *dummy)
 }
 
 // Returns random numbers in range [-1.0, 1.0)
-double simpleNoise()
+static double simpleNoise(Model *mod)
 {
-  return 2 * (rand() % 1000 * 0.001 - 0.5);
+  return 2 * (mod->Random() - 0.5);
 }
 
-#define TWO_PI (M_PI + M_PI)
-// Returns gaussian noise
-// taken from http://en.wikipedia.org/wiki/Box%E2%80%93Muller_transform
-template <class Scalar_t> Scalar_t generateGaussianNoise(Scalar_t variance)
+
+void ModelRanger::LayoutScan()
 {
-  static bool haveSpare = false;
-  static Scalar_t rand1, rand2;
+  bool changed(scan_layout.size() != sensors.size());
 
-  if (haveSpare) {
-    haveSpare = false;
-    return sqrt(variance * rand1) * sin(rand2);
+  for (size_t s(0); s < sensors.size() && !changed; ++s)
+    changed = scan_layout[s].first != sensors[s].sample_count
+              || scan_layout[s].second != sensors[s].fov;
+
+  if (!changed)
+    return;
+
+  scan_layout.resize(sensors.size());
+  scan_count = 0;
+
+  FOR_EACH (it, sensors) {
+    it->offset = scan_count;
+    scan_count += it->sample_count;
   }
 
-  haveSpare = true;
+  scan.assign(3 * scan_count, 0.0f);
+
+  for (size_t s(0); s < sensors.size(); ++s) {
+    Sensor &sensor(sensors[s]);
+    scan_layout[s] = std::make_pair(sensor.sample_count, sensor.fov);
+
+    // make the first and last rays exactly at the extremes of the FOV
+    const double sample_incr(sensor.fov / std::max(sensor.sample_count - 1, (unsigned int)1));
+    const double start_angle(sensor.sample_count > 1 ? -sensor.fov / 2.0 : 0.0);
 
-  rand1 = rand() / ((Scalar_t)RAND_MAX);
-  if (rand1 < 1e-100)
-    rand1 = 1e-100;
-  rand1 = -2 * log(rand1);
-  rand2 = (rand() / ((Scalar_t)RAND_MAX)) * TWO_PI;
+    sensor.ranges.resize(sensor.sample_count);
+    sensor.intensities.resize(sensor.sample_count);
+    sensor.bearings.resize(sensor.sample_count);
 
-  return sqrt(variance * rand1) * cos(rand2);
+    for (size_t t(0); t < sensor.sample_count; ++t) {
+      sensor.bearings[t] = start_angle + ((double)t) * sample_incr;
+      scan[2 * scan_count + sensor.offset + t] = sensor.bearings[t];
+    }
+  }
 }
 
 void ModelRanger::Update(void)
 {
+  // these change very rarely, so this is very cheap
+  LayoutScan();
+
   // raytrace new range data for all sensors
   FOR_EACH (it, sensors)
     it->Update(this);
 
+  ++scan_sequence;
+
   Model::Update();
 }
 
 void ModelRanger::Sensor::Update(ModelRanger *mod)
 {
-  // these sizes change very rarely, so this is very cheap
-  ranges.resize(sample_count);
-  intensities.resize(sample_count);
-  bearings.resize(sample_count);
+  if (sample_count == 0)
+    return;
+
+  float *scan_ranges(&mod->scan[offset]);
+  float *scan_intensities(scan_ranges + mod->scan_count);
 
   // printf( "update sensor, has ranges size %u\n", (unsigned int)ranges.size()
   // );
@@ -231,24 +342,27 @@ void ModelRanger::Sensor::Update(ModelRanger *mod)
 
   // set up a ray to trace
   Ray ray(mod, rayorg, range.max, ranger_match, NULL, true);
+  ray.exact = exact;
 
   // trace the ray, incrementing its heading for each sample
   for (size_t t(0); t < sample_count; t++) {
     float savedAngle = ray.origin.a;
-    float distortedAngle = ray.origin.a + sample_incr * angle_noise * simpleNoise() * 0.5;
+    float distortedAngle = ray.origin.a + sample_incr * angle_noise * simpleNoise(mod) * 0.5;
     ray.origin.a = distortedAngle;
     const RaytraceResult res = mod->world->Raytrace(ray);
     ray.origin.a = savedAngle;
 
     /// Apply noise only if it is in valid range
     if (res.range < this->range.max)
-      ranges[t] = res.range + res.range * range_noise * simpleNoise()
-                  + generateGaussianNoise(range_noise_const);
+      ranges[t] = res.range + res.range * range_noise * simpleNoise(mod)
+                  + mod->RandomGaussian(range_noise_const);
     else
       ranges[t] = res.range;
 
     intensities[t] = res.mod ? res.mod->vis.ranger_return : 0.0;
-    bearings[t] = start_angle + ((double)t) * sample_incr;
+
+    scan_ranges[t] = ranges[t];
+    scan_intensities[t] = intensities[t];
 
     // point the ray to the next angle:
     ray.origin.a += sample_incr;
@@ -263,122 +377,115 @@ std::string ModelRanger::Sensor::String() const
   return (std::string(buf));
 }
 
-typedef struct { GLfloat x; GLfloat y; } glpoint_t;
-  
-void ModelRanger::Sensor::Visualize(ModelRanger::Vis *vis, ModelRanger *rgr) const
+// a point in a sensor's frame, moved into the global frame of pose
+// by the precomputed cosine and sine of its heading
+class GlobalVertex {
+public:
+  GlobalVertex(const Pose &pose) : pose(pose), cosa(cos(pose.a)), sina(sin(pose.a)) {}
+
+  void operator()(Gl::VertexBatch &batch, double x, double y) const
+  {
+    batch.Vertex(pose.x + x * cosa - y * sina, pose.y + x * sina + y * cosa, pose.z);
+  }
+
+private:
+  const Pose pose;
+  const double cosa, sina;
+};
+
+// the polygon of a sensor's strikes, kept to avoid allocating every
+// frame. Only used by the GUI thread.
+static std::vector<point_t> strike_verts;
+
+void ModelRanger::Sensor::Visualize(Canvas *canvas, const Pose &gpose) const
 {
   // glTranslatef( 0,0, ranger->GetGeom().size.z/2.0 ); // shoot the ranger beam
   // out at the right height
 
-  glPushMatrix();
-
-  Gl::pose_shift(pose);
-
-  const double sample_fov = fov / sample_count;
-  
-  if (vis->showTransducers) {
-    rgr->PushColor(color);    
+  if (Vis::showTransducers) {
+    glPushMatrix();
+    Gl::pose_shift(gpose);
+    Gl::pose_shift(pose);
+    canvas->PushColor(color);
     glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
     glRectf(-size.x / 2.0, -size.y / 2.0, size.x / 2.0, size.y / 2.0);
-    rgr->PopColor();
+    canvas->PopColor();
+    glPopMatrix();
   }
-  
-  if (vis->showFov)
-    {
-      if (sample_count == 1)
-	{
-	  rgr->PushColor(color);
-	  glBegin( GL_LINES );
-	  glVertex2f( 0,0 );
-	  glVertex2f( range.max, 0 );
-	  glEnd();
-	  rgr->PopColor();
-	}
-      else
-	{    
-	  glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-	  Color c = color;
-	  c.a = 0.5;
-	  rgr->PushColor(c);
-	  glBegin( GL_POLYGON );
-	  
-	  glVertex2f( 0,0 );
-	  
-	  for (size_t s(0); s < sample_count; s++) {
-	    const double ray_angle = (((double)s)-0.5) * sample_fov - fov / 2.0;      
-	    const GLfloat x = range.max * cos(ray_angle);
-	    const GLfloat y = range.max * sin(ray_angle);
-	    
-	    glVertex2f( x, y );
-	  }
-	  
-	  glVertex2f( 0,0 );
-	  
-	  glEnd();
-	  
-	  rgr->PopColor();
-	}
+
+  // the rest goes into the canvas's batches, which are drawn once all
+  // the models have been visited
+  const GlobalVertex vertex(gpose + pose);
+
+  const double sample_fov = fov / sample_count;
+
+  if (Vis::showFov) {
+    if (sample_count == 1) {
+      canvas->sensor_lines.SetColor(color);
+      vertex(canvas->sensor_lines, 0, 0);
+      vertex(canvas->sensor_lines, range.max, 0);
+    } else {
+      Color c = color;
+      c.a = 0.5;
+      canvas->sensor_lines.SetColor(c);
+
+      // the outline of the fan from the sensor to its maximum range
+      double x(0), y(0);
+      for (size_t s(0); s <= sample_count; s++) {
+        vertex(canvas->sensor_lines, x, y);
+
+        if (s < sample_count) {
+          const double ray_angle = (((double)s) - 0.5) * sample_fov - fov / 2.0;
+          x = range.max * cos(ray_angle);
+          y = range.max * sin(ray_angle);
+        } else
+          x = y = 0;
+
+        vertex(canvas->sensor_lines, x, y);
+      }
     }
-  
-  std::vector<glpoint_t> verts( sample_count );
-  
+  }
+
+  if (!Vis::showArea && !Vis::showStrikes)
+    return;
+
+  // the polygon of the strikes, which is a fan around the sensor
+  std::vector<point_t> &verts(strike_verts);
+  verts.clear();
+
   if (sample_count == 1) {
     // only one sample, so we fake up some beam width for beauty
     const double sidelen = ranges[0];
     const double da = fov / 2.0;
-    
-    verts.resize(3);
-    verts[0].x = 0;
-    verts[0].y = 0;
-    verts[1].x = sidelen * cos(-da);
-    verts[1].y = sidelen * sin(-da);
-    verts[2].x = sidelen * cos(+da);
-    verts[2].y = sidelen * sin(+da);
+
+    verts.push_back(point_t(sidelen * cos(-da), sidelen * sin(-da)));
+    verts.push_back(point_t(sidelen * cos(+da), sidelen * sin(+da)));
   } else {
     for (size_t s(0); s < sample_count; s++) {
-      const double ray_angle = (((double)s)-0.5) * sample_fov - fov / 2.0;
-      verts[s].x = (float)(ranges[s] * cos(ray_angle));
-      verts[s].y = (float)(ranges[s] * sin(ray_angle));
+      const double ray_angle = (((double)s) - 0.5) * sample_fov - fov / 2.0;
+      verts.push_back(point_t(ranges[s] * cos(ray_angle), ranges[s] * sin(ray_angle)));
     }
   }
-  
-  if (vis->showArea) {        
-    // draw the filled polygon in transparent blue
-    glEnable( GL_BLEND );
-    glBlendFunc( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA );
-    
-    glDepthMask(GL_FALSE);
-    glPolygonMode(GL_FRONT, GL_FILL);
+
+  if (Vis::showArea) {
+    // the filled polygon in transparent blue
     Color c = color;
     c.a = 0.1; // some alpha
-    rgr->PushColor(c);
-    
-    glBegin( GL_POLYGON );
-    glVertex2f( 0,0 );
-    
-    FOR_EACH( it, verts )
-      glVertex2f( it->x, it->y );
-    
-    glVertex2f( 0,0 );    
-    glEnd();	
-    
-    rgr->PopColor();
-    glDepthMask(GL_TRUE);
+    canvas->sensor_areas.SetColor(c);
+
+    for (size_t s(1); s < verts.size(); s++) {
+      vertex(canvas->sensor_areas, 0, 0);
+      vertex(canvas->sensor_areas, verts[s - 1].x, verts[s - 1].y);
+      vertex(canvas->sensor_areas, verts[s].x, verts[s].y);
+    }
   }
-      
-  if (vis->showStrikes) {
-    rgr->PushColor(Color::blue); // solid color
-    glPointSize(2);
-
-    glBegin( GL_POINTS );
-    FOR_EACH( it, verts )
-      glVertex2f( it->x, it->y );
-    glEnd();
-      
-    rgr->PopColor();
+
+  if (Vis::showStrikes) {
+    canvas->sensor_points.SetColor(Color::blue); // solid color
+
+    FOR_EACH (it, verts)
+      vertex(canvas->sensor_points, it->x, it->y);
   }
- 
-  glPopMatrix();
 }
 
 void ModelRanger::Print(char *prefix) const
@@ -407,7 +514,7 @@ void ModelRanger::Print(char *prefix) const
 
 // VIS -------------------------------------------------------------------
 
-ModelRanger::Vis::Vis(World *world) : Visualizer("Ranger", "ranger_vis")
+ModelRanger::Vis::Vis(World *world) : Visualizer(VIS_MENU_NAME, "ranger_vis")
 {
   world->RegisterOption(&showArea);
   world->RegisterOption(&showStrikes);
@@ -416,35 +523,65 @@ ModelRanger::Vis::Vis(World *world) : Visualizer("Ranger", "ranger_vis")
   world->RegisterOption(&showTransducers);
 }
 
-void ModelRanger::Vis::Visualize(Model *mod, Camera *cam)
-{
-  (void)cam; // avoid warning about unused var
+// the sensors of a subscribed ranger, as the canvas draws them
+class RangerData : public VisData {
+public:
+  explicit RangerData(const std::vector<ModelRanger::Sensor> &sensors) : sensors(sensors) {}
 
-  ModelRanger *ranger(dynamic_cast<ModelRanger *>(mod));
+  virtual VisData *Clone() const { return new RangerData(*this); }
 
-  const std::vector<Sensor> &sensors(ranger->GetSensors());
+  virtual meters_t Reach() const
+  {
+    meters_t reach(0);
+    FOR_EACH (it, sensors)
+      reach = std::max(reach, hypot(it->pose.x, it->pose.y) + it->range.max);
+    return reach;
+  }
 
-  FOR_EACH (it, sensors)
-    it->Visualize(this, ranger);
+  virtual void Draw(Canvas *canvas, Camera *, const RenderModel &rm) const
+  {
+    FOR_EACH (it, sensors)
+      it->Visualize(canvas, rm.pose);
 
-  const size_t sensor_count = sensors.size();
+    const size_t sensor_count = sensors.size();
 
-  if (showTransducers) {
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-    ranger->PushColor(0, 0, 0, 1);
+    if (ModelRanger::Vis::showTransducers) {
+      glPushMatrix();
+      Gl::pose_shift(rm.pose);
 
-    for (size_t s(0); s < sensor_count; s++) {
-      const Sensor &rngr(sensors[s]);
+      glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+      canvas->PushColor(0, 0, 0, 1);
 
-      glPointSize(4);
-      glBegin(GL_POINTS);
-      glVertex3f(rngr.pose.x, rngr.pose.y, rngr.pose.z);
-      glEnd();
+      for (size_t s(0); s < sensor_count; s++) {
+        const ModelRanger::Sensor &rngr(sensors[s]);
 
-      char buf[8];
-      snprintf(buf, 8, "%d", (int)s);
-      Gl::draw_string(rngr.pose.x, rngr.pose.y, rngr.pose.z, buf);
+        glPointSize(4);
+        glBegin(GL_POINTS);
+        glVertex3f(rngr.pose.x, rngr.pose.y, rngr.pose.z);
+        glEnd();
+
+        char buf[8];
+        snprintf(buf, 8, "%d", (int)s);
+        Gl::draw_string(rngr.pose.x, rngr.pose.y, rngr.pose.z, buf);
+      }
+      canvas->PopColor();
+
+      glPopMatrix();
     }
-    ranger->PopColor();
   }
+
+private:
+  const std::vector<ModelRanger::Sensor> sensors;
+};
+
+void ModelRanger::Vis::Visualize(Model *mod, Camera *cam)
+{
+  // the canvas draws the sensors from its snapshot, as copied by Capture()
+  (void)mod;
+  (void)cam;
+}
+
+VisData *ModelRanger::Vis::Capture(Model *mod)
+{
+  return new RangerData(dynamic_cast<ModelRanger *>(mod)->GetSensors());
 }
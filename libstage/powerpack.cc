@@ -5,21 +5,16 @@
     SVN: $Id$
 */
 
+#include <errno.h>
+#include <limits>
+
+#include "canvas.hh"
 #include "stage.hh"
 #include "texture_manager.hh"
 using namespace Stg;
 
-joules_t PowerPack::global_stored = 0.0;
-joules_t PowerPack::global_input = 0.0;
-joules_t PowerPack::global_capacity = 0.0;
-joules_t PowerPack::global_dissipated = 0.0;
-
 PowerPack::PowerPack(Model *mod)
-    : event_vis(2.0 * std::max(fabs(ceil(mod->GetWorld()->GetExtent().x.max)),
-                               fabs(floor(mod->GetWorld()->GetExtent().x.min))),
-                2.0 * std::max(fabs(ceil(mod->GetWorld()->GetExtent().y.max)),
-                               fabs(floor(mod->GetWorld()->GetExtent().y.min))),
-                1.0),
+    : event_vis(),
       output_vis(0, 100, 200, 40, 1200, Color(1, 0, 0), Color(0, 0, 0, 0.5), "energy output",
                  "energy_input"),
       stored_vis(0, 142, 200, 40, 1200, Color(0, 1, 0), Color(0, 0, 0, 0.5), "energy stored",
@@ -154,7 +149,7 @@ void PowerPack::Add(joules_t j)
 {
   joules_t amount = std::min(RemainingCapacity(), j);
   stored += amount;
-  global_stored += amount;
+  mod->world->energy.stored += amount;
 
   if (amount > 0)
     charging = true;
@@ -164,14 +159,14 @@ void PowerPack::Subtract(joules_t j)
 {
   if (stored < 0) // infinte supply!
   {
-    global_input += j; // record energy entering the system
+    mod->world->energy.input += j; // record energy entering the system
     return;
   }
 
   joules_t amount = std::min(stored, j);
 
   stored -= amount;
-  global_stored -= amount;
+  mod->world->energy.stored -= amount;
 }
 
 void PowerPack::TransferTo(PowerPack *dest, joules_t amount)
@@ -198,14 +193,14 @@ void PowerPack::TransferTo(PowerPack *dest, joules_t amount)
 
 void PowerPack::SetCapacity(joules_t cap)
 {
-  global_capacity -= capacity;
+  mod->world->energy.capacity -= capacity;
   capacity = cap;
-  global_capacity += capacity;
+  mod->world->energy.capacity += capacity;
 
   if (stored > cap) {
-    global_stored -= stored;
+    mod->world->energy.stored -= stored;
     stored = cap;
-    global_stored += stored;
+    mod->world->energy.stored += stored;
   }
 }
 
@@ -224,11 +219,48 @@ joules_t PowerPack::GetDissipated() const
   return dissipated;
 }
 
+void PowerPack::SaveState(Snapshot &snap) const
+{
+  snap.Put(stored);
+  snap.Put(dissipated);
+  snap.Put(charging);
+  snap.Put(last_time);
+  snap.Put(last_joules);
+  snap.Put(last_watts);
+}
+
+void PowerPack::LoadState(Snapshot &snap)
+{
+  joules_t newstored(stored), newdissipated(dissipated);
+  snap.Get(newstored);
+  snap.Get(newdissipated);
+  snap.Get(charging);
+  snap.Get(last_time);
+  snap.Get(last_joules);
+  snap.Get(last_watts);
+
+  // keep the world's totals consistent
+  SetStored(newstored);
+  mod->world->energy.dissipated += newdissipated - dissipated;
+  dissipated = newdissipated;
+}
+
+bool PowerPack::CheckState(Snapshot &snap) const
+{
+  snap.Skip(stored);
+  snap.Skip(dissipated);
+  snap.Skip(charging);
+  snap.Skip(last_time);
+  snap.Skip(last_joules);
+  snap.Skip(last_watts);
+  return snap.ok;
+}
+
 void PowerPack::SetStored(joules_t j)
 {
-  global_stored -= stored;
+  mod->world->energy.stored -= stored;
   stored = j;
-  global_stored += stored;
+  mod->world->energy.stored += stored;
 }
 
 void PowerPack::Dissipate(joules_t j)
@@ -237,7 +269,7 @@ void PowerPack::Dissipate(joules_t j)
 
   Subtract(amount);
   dissipated += amount;
-  global_dissipated += amount;
+  mod->world->energy.dissipated += amount;
 
   output_vis.AppendValue(amount);
   stored_vis.AppendValue(stored);
@@ -246,18 +278,17 @@ void PowerPack::Dissipate(joules_t j)
 void PowerPack::Dissipate(joules_t j, const Pose &p)
 {
   Dissipate(j);
-  event_vis.Accumulate(p.x, p.y, j);
+
+  DissipationMap *map(mod->world->GetDissipation());
+  if (map)
+    map->Accumulate(mod->GetId(), p.x, p.y, j);
 }
 
 //------------------------------------------------------------------------------
 // Dissipation Visualizer class
 
-joules_t PowerPack::DissipationVis::global_peak_value = 0.0;
-
-PowerPack::DissipationVis::DissipationVis(meters_t width, meters_t height, meters_t cellsize)
-    : Visualizer("energy dissipation", "energy_dissipation"), columns(width / cellsize),
-      rows(height / cellsize), width(width), height(height), cells(columns * rows), peak_value(0),
-      cellsize(cellsize)
+PowerPack::DissipationVis::DissipationVis()
+    : Visualizer("energy dissipation", "energy_dissipation")
 { /* nothing to do */
 }
 
@@ -265,52 +296,164 @@ PowerPack::DissipationVis::~DissipationVis()
 {
 }
 
+// the dissipation map cells of a model, as the canvas draws them
+class DissipationData : public VisData {
+public:
+  explicit DissipationData(meters_t cellsize) : cells(), cellsize(cellsize) {}
+
+  virtual VisData *Clone() const { return new DissipationData(*this); }
+
+  virtual void Draw(Canvas *, Camera *, const RenderModel &) const
+  {
+    // we're already in world coordinates
+    glPushMatrix();
+    glTranslatef(0, 0, 0.01);
+    glScalef(cellsize, cellsize, 1);
+
+    for (size_t i(0); i + 2 < cells.size(); i += 3) {
+      glColor4f(1.0, 0, 0, cells[i + 2]);
+      glRectf(cells[i], cells[i + 1], cells[i] + 1, cells[i + 1] + 1);
+    }
+
+    glPopMatrix();
+  }
+
+  std::vector<GLfloat> cells; ///< x, y and shade of each cell
+  const meters_t cellsize;
+};
+
 void PowerPack::DissipationVis::Visualize(Model *mod, Camera *cam)
 {
-  (void)cam; // avoid warning about unused var
+  // the canvas draws the map from its snapshot, as copied by Capture()
+  (void)mod;
+  (void)cam;
+}
+
+VisData *PowerPack::DissipationVis::Capture(Model *mod)
+{
+  const DissipationMap *map(mod->GetWorld()->EnableDissipation());
+
+  DissipationData *data(new DissipationData(map->CellSize()));
+  map->Capture(mod->GetId(), data->cells);
+  return data;
+}
+
+//------------------------------------------------------------------------------
+// Dissipation Map class
 
-  // go into world coordinates
+const char DissipationMap::MAGIC[8] = { 'S', 'T', 'G', 'H', 'E', 'A', 'T', 0 };
+const uint32_t DissipationMap::FORMAT_VERSION;
 
-  glPushMatrix();
+DissipationMap::DissipationMap(meters_t cellsize)
+    : tiles(), cellsize(cellsize), peak(0), last_key(0, 0, 0), last_tile(NULL)
+{
+}
 
-  Gl::pose_inverse_shift(mod->GetGlobalPose());
+void DissipationMap::Accumulate(uint32_t id, meters_t x, meters_t y, joules_t amount)
+{
+  const int32_t cx(floor(x / cellsize)), cy(floor(y / cellsize));
 
-  glTranslatef(-width / 2.0, -height / 2.0, 0.01);
-  glScalef(cellsize, cellsize, 1);
+  // the arithmetic shift rounds negative cells down to their tile
+  const Key key(id, cx >> TILE_BITS, cy >> TILE_BITS);
 
-  for (unsigned int y = 0; y < rows; y++)
-    for (unsigned int x = 0; x < columns; x++) {
-      joules_t j = cells[y * columns + x];
+  if (last_tile == NULL || key != last_key) {
+    last_key = key;
+    last_tile = &tiles[key];
+  }
 
-      // printf( "%d %d %.2f\n", x, y, j );
+  joules_t &j(last_tile->cells[(cy & (TILE_SIZE - 1)) * TILE_SIZE + (cx & (TILE_SIZE - 1))]);
 
-      if (j > 0) {
-        glColor4f(1.0, 0, 0, j / global_peak_value);
-        glRectf(x, y, x + 1, y + 1);
-      }
-    }
+  j += amount;
+  if (j > peak)
+    peak = j;
+}
 
-  glPopMatrix();
+void DissipationMap::Capture(uint32_t id, std::vector<GLfloat> &cells) const
+{
+  if (peak <= 0)
+    return;
+
+  const int32_t lowest(std::numeric_limits<int32_t>::min());
+
+  for (std::map<Key, Tile>::const_iterator it(tiles.lower_bound(Key(id, lowest, lowest)));
+       it != tiles.end() && it->first.id == id; ++it) {
+    const int32_t x0(it->first.x << TILE_BITS), y0(it->first.y << TILE_BITS);
+    const joules_t *cell(it->second.cells);
+
+    for (int32_t y(0); y < TILE_SIZE; ++y)
+      for (int32_t x(0); x < TILE_SIZE; ++x, ++cell)
+        if (*cell > 0) {
+          cells.push_back(x0 + x);
+          cells.push_back(y0 + y);
+          cells.push_back(*cell / peak);
+        }
+  }
 }
 
-void PowerPack::DissipationVis::Accumulate(meters_t x, meters_t y, joules_t amount)
+bool DissipationMap::Save(const std::string &filename, const World &world) const
 {
-  // printf( "accumulate %.2f %.2f %.2f\n", x, y, amount );
+  FILE *fp(fopen(filename.c_str(), "wb"));
+  if (fp == NULL) {
+    PRINT_ERR2("failed to open dissipation file \"%s\": %s", filename.c_str(), strerror(errno));
+    return false;
+  }
 
-  int ix = (x + width / 2.0) / cellsize;
-  int iy = (y + height / 2.0) / cellsize;
+  const std::set<Model *> models(world.GetAllModels());
+  const uint32_t version(FORMAT_VERSION), tile_size(TILE_SIZE);
+  const uint32_t model_count(models.size());
+  const uint64_t tile_count(tiles.size());
+
+  fwrite(MAGIC, sizeof(MAGIC), 1, fp);
+  fwrite(&version, sizeof(version), 1, fp);
+  fwrite(&tile_size, sizeof(tile_size), 1, fp);
+  fwrite(&model_count, sizeof(model_count), 1, fp);
+  fwrite(&cellsize, sizeof(cellsize), 1, fp);
+
+  FOR_EACH (it, models) {
+    const uint32_t id((*it)->GetId());
+    const std::string token((*it)->TokenStr());
+    const uint32_t length(token.size());
+
+    fwrite(&id, sizeof(id), 1, fp);
+    fwrite(&length, sizeof(length), 1, fp);
+    fwrite(token.data(), 1, length, fp);
+  }
 
-  // don't accumulate if we're outside the grid
-  if (ix < 0 || ix >= int(columns) || iy < 0 || iy >= int(rows))
-    return;
+  fwrite(&tile_count, sizeof(tile_count), 1, fp);
 
-  joules_t &j = cells[ix + (iy * columns)];
+  FOR_EACH (it, tiles) {
+    const int32_t x(it->first.x << TILE_BITS), y(it->first.y << TILE_BITS);
 
-  j += amount;
-  if (j > peak_value) {
-    peak_value = j;
+    fwrite(&it->first.id, sizeof(it->first.id), 1, fp);
+    fwrite(&x, sizeof(x), 1, fp);
+    fwrite(&y, sizeof(y), 1, fp);
+    fwrite(it->second.cells, sizeof(it->second.cells), 1, fp);
+  }
 
-    if (peak_value > global_peak_value)
-      global_peak_value = peak_value;
+  const bool failed(ferror(fp) != 0);
+  if (fclose(fp) != 0 || failed) {
+    PRINT_ERR1("failed to write dissipation file \"%s\"", filename.c_str());
+    return false;
   }
+
+  return true;
+}
+
+DissipationMap *World::EnableDissipation()
+{
+  if (dissipation == NULL)
+    dissipation = new DissipationMap(dissipation_cellsize);
+
+  return dissipation;
+}
+
+bool World::SaveDissipation(const std::string &filename) const
+{
+  return dissipation && dissipation->Save(filename, *this);
+}
+
+void World::WriteDissipation()
+{
+  SaveDissipation(dissipation_file);
+  dissipation_file.clear();
 }
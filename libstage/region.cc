@@ -16,6 +16,21 @@ Stg::Region::~Region()
 {
 }
 
+void Stg::Region::AllocateCells()
+{
+  assert(count == 0);
+
+  // cells.clear() keeps the storage, so this only counts new storage
+  if (cells.capacity() == 0)
+    superregion->RegionAllocated();
+
+  const int32_t size(superregion->RegionSize());
+  cells.resize(size);
+
+  for (int32_t c = 0; c < size; ++c)
+    cells[c].region = this;
+}
+
 void Stg::Region::AddBlock()
 {
   ++count;
@@ -34,14 +49,48 @@ void Stg::Region::RemoveBlock()
 }
 
 SuperRegion::SuperRegion(World *world, point_int_t origin)
-    : count(0), origin(origin), regions(), world(world)
+    : count(0), origin(origin), regions(), world(world), allocated(0), entries(),
+      entry_count(0), last_used(world->updates)
 {
-  for (int32_t c = 0; c < SUPERREGIONSIZE; ++c)
+  const int32_t size(SuperRegionSize());
+  regions = new Region[size];
+
+  for (int32_t c = 0; c < size; ++c)
     regions[c].superregion = this;
 }
 
 SuperRegion::~SuperRegion()
 {
+  FreeRegions();
+}
+
+void SuperRegion::RegionAllocated()
+{
+  ++allocated;
+  __sync_fetch_and_add(&world->grid_regions, 1);
+}
+
+void SuperRegion::FreeRegions()
+{
+  delete[] regions;
+  regions = NULL;
+  count = 0;
+
+  __sync_fetch_and_sub(&world->grid_regions, allocated);
+  allocated = 0;
+}
+
+size_t SuperRegion::MemoryEstimate() const
+{
+  // cells reserve space for 8 blocks in each layer
+  const size_t cellbytes(sizeof(Cell) + 16 * sizeof(Block *));
+
+  // allow for the map node of each block's entries
+  const size_t nodebytes(64 + sizeof(std::vector<uint32_t>));
+
+  return sizeof(SuperRegion) + (regions ? SuperRegionSize() * sizeof(Region) : 0)
+         + allocated * RegionSize() * cellbytes + entries.size() * nodebytes
+         + entry_count * sizeof(uint32_t);
 }
 
 void SuperRegion::AddBlock()
@@ -54,230 +103,157 @@ void SuperRegion::RemoveBlock()
   --count;
 }
 
-void SuperRegion::DrawOccupancy(void) const
+// append the square from cell x0,y0 to x1,y1 as a quad, in metres
+static void AppendSquare(Gl::VertexBatch &batch, GLfloat x0, GLfloat y0, GLfloat x1, GLfloat y1,
+                         GLfloat scale)
 {
+  batch.Vertex(x0 * scale, y0 * scale, 0);
+  batch.Vertex(x1 * scale, y0 * scale, 0);
+  batch.Vertex(x1 * scale, y1 * scale, 0);
+  batch.Vertex(x0 * scale, y1 * scale, 0);
+}
+
+void SuperRegion::AppendOccupancy(Gl::VertexBatch &batch) const
+{
+  const uint32_t rbits(RegionBits());
+  const uint32_t srbits(rbits + SuperRegionBits());
+  const int32_t rwidth(RegionWidth());
+  const int32_t srwidth(SuperRegionWidth());
+
   // printf( "SR origin (%d,%d) this %p\n", origin.x, origin.y, this );
 
-  glPushMatrix();
-  GLfloat scale = 1.0 / world->Resolution();
-  glScalef(scale, scale, 1.0); // XX TODO - this seems slightly
-  glTranslatef(origin.x << SRBITS, origin.y << SRBITS, 0);
+  const GLfloat scale = 1.0 / world->Resolution();
+  const GLfloat ox(origin.x << srbits), oy(origin.y << srbits);
 
-  glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+  // outline superregion, grey if it is evicted
+  if (regions)
+    batch.SetColor(Color(0, 0, 1));
+  else
+    batch.SetColor(Color(0.5, 0.5, 0.5));
+  AppendSquare(batch, ox, oy, ox + (1 << srbits), oy + (1 << srbits), scale);
 
-  // outline superregion
-  glColor3f(0, 0, 1);
-  glRecti(0, 0, 1 << SRBITS, 1 << SRBITS);
+  if (regions == NULL)
+    return;
 
-  // outline regions
-  const Region *r = &regions[0];
+  // outline the regions that contain some occupied cells, and each
+  // occupied cell within them
+  batch.SetColor(Color(0, 1, 0));
 
-  // XX hack: this means only one window at a time will have its cells
-  // drawn properly, but OpenGL needs a non-stack vertex buffer
-  static std::vector<GLfloat> rects(1000);
-  rects.resize(0);
+  const Region *r = &regions[0];
 
   //char buf[16];
-  
-  for (unsigned int y = 0; y < SUPERREGIONWIDTH; ++y)
-    for (unsigned int x = 0; x < SUPERREGIONWIDTH; ++x) {
+
+  for (int y = 0; y < srwidth; ++y)
+    for (int x = 0; x < srwidth; ++x) {
       if (r->count) // region contains some occupied cells
       {
         // outline the region
-        glColor3f(0, 1, 0);
-        glRecti(x << RBITS, y << RBITS, (x + 1) << RBITS, (y + 1) << RBITS);
-	
-	// show how many cells are occupied	
-	//snprintf( buf, 15, "%lu", r->count );
-	//Gl::draw_string( x<<RBITS, y<<RBITS, 0, buf );
-	
-	// draw a rectangle around each occupied cell
-        for (unsigned int p = 0; p < REGIONWIDTH; ++p)
-          for (unsigned int q = 0; q < REGIONWIDTH; ++q) {
-            const Cell &c = r->cells[p + (q * REGIONWIDTH)];
+        const GLfloat x0 = ox + (x << rbits), y0 = oy + (y << rbits);
+        AppendSquare(batch, x0, y0, x0 + rwidth, y0 + rwidth, scale);
+
+        // show how many cells are occupied
+        //snprintf( buf, 15, "%lu", r->count );
+        //Gl::draw_string( x<<rbits, y<<rbits, 0, buf );
+
+        // draw a rectangle around each occupied cell
+        for (int p = 0; p < rwidth; ++p)
+          for (int q = 0; q < rwidth; ++q) {
+            const Cell &c = r->cells[p + (q * rwidth)];
+            const GLfloat xx = x0 + p;
+            const GLfloat yy = y0 + q;
 
             if (c.blocks[0].size()) // layer 0
-            {
-              const GLfloat xx = p + (x << RBITS);
-              const GLfloat yy = q + (y << RBITS);
-
-              rects.push_back(xx);
-              rects.push_back(yy);
-              rects.push_back(xx + 1);
-              rects.push_back(yy);
-              rects.push_back(xx + 1);
-              rects.push_back(yy + 1);
-              rects.push_back(xx);
-              rects.push_back(yy + 1);
-	    }
+              AppendSquare(batch, xx, yy, xx + 1, yy + 1, scale);
 
             if (c.blocks[1].size()) // layer 1
             {
-              const GLfloat xx = p + (x << RBITS);
-              const GLfloat yy = q + (y << RBITS);
-              const double dx = 0.1;
-
-              rects.push_back(xx + dx);
-              rects.push_back(yy + dx);
-              rects.push_back(xx + 1 - dx);
-              rects.push_back(yy + dx);
-              rects.push_back(xx + 1 - dx);
-              rects.push_back(yy + 1 - dx);
-              rects.push_back(xx + dx);
-              rects.push_back(yy + 1 - dx);
+              const GLfloat dx = 0.1;
+              AppendSquare(batch, xx + dx, yy + dx, xx + 1 - dx, yy + 1 - dx, scale);
             }
-
-	  }
+          }
       }
       ++r; // next region quickly
     }
 
-  glEnableClientState(GL_VERTEX_ARRAY);
-
-  if (rects.size()) {
-    assert(rects.size() % 8 == 0); // should be full of squares
-    glVertexPointer(2, GL_FLOAT, 0, &rects[0]);
-    glDrawArrays(GL_QUADS, 0, rects.size() / 2);
-  }
-
   // char buf[32];
   // snprintf( buf, 15, "%lu", count );
   // Gl::draw_string( 1<<SBITS, 1<<SBITS, 0, buf );
-
-  glPopMatrix();
 }
 
-static inline const std::vector<GLfloat> DrawBlock(GLfloat x, GLfloat y, GLfloat zmin, GLfloat zmax)
+// append the top and sides of the box over cell x,y as quads, in metres
+static void AppendBox(Gl::VertexBatch &batch, GLfloat x, GLfloat y, GLfloat zmin, GLfloat zmax,
+                      GLfloat scale)
 {
-  std::vector<GLfloat> v(60);
+  const GLfloat x0(x * scale), y0(y * scale);
+  const GLfloat x1((x + 1) * scale), y1((y + 1) * scale);
 
   // TOP
-  v[0] = x;
-  v[1] = y;
-  v[2] = zmax;
-  v[3] = 1 + x;
-  v[4] = y;
-  v[5] = zmax;
-  v[6] = 1 + x;
-  v[7] = 1 + y;
-  v[8] = zmax;
-  v[9] = x;
-  v[10] = 1 + y;
-  v[11] = zmax;
+  batch.Vertex(x0, y0, zmax);
+  batch.Vertex(x1, y0, zmax);
+  batch.Vertex(x1, y1, zmax);
+  batch.Vertex(x0, y1, zmax);
 
   // sides
-  v[12] = x;
-  v[13] = y;
-  v[14] = zmax;
-  v[15] = x;
-  v[16] = 1 + y;
-  v[17] = zmax;
-  v[18] = x;
-  v[19] = 1 + y;
-  v[20] = zmin;
-  v[21] = x;
-  v[22] = y;
-  v[23] = zmin;
-  v[24] = 1 + x;
-  v[25] = y;
-  v[26] = zmax;
-  v[27] = x;
-  v[28] = y;
-  v[29] = zmax;
-  v[30] = x;
-  v[31] = y;
-  v[32] = zmin;
-  v[33] = 1 + x;
-  v[34] = y;
-  v[35] = zmin;
-  v[36] = 1 + x;
-  v[37] = 1 + y;
-  v[38] = zmax;
-  v[39] = 1 + x;
-  v[40] = y;
-  v[41] = zmax;
-  v[42] = 1 + x;
-  v[43] = y;
-  v[44] = zmin;
-  v[45] = 1 + x;
-  v[46] = 1 + y;
-  v[47] = zmin;
-  v[48] = x;
-  v[49] = 1 + y;
-  v[50] = zmax;
-  v[51] = 1 + x;
-  v[52] = 1 + y;
-  v[53] = zmax;
-  v[54] = 1 + x;
-  v[55] = 1 + y;
-  v[56] = zmin;
-  v[57] = x;
-  v[58] = 1 + y;
-  v[59] = zmin;
-
-  return v;
+  batch.Vertex(x0, y0, zmax);
+  batch.Vertex(x0, y1, zmax);
+  batch.Vertex(x0, y1, zmin);
+  batch.Vertex(x0, y0, zmin);
+
+  batch.Vertex(x1, y0, zmax);
+  batch.Vertex(x0, y0, zmax);
+  batch.Vertex(x0, y0, zmin);
+  batch.Vertex(x1, y0, zmin);
+
+  batch.Vertex(x1, y1, zmax);
+  batch.Vertex(x1, y0, zmax);
+  batch.Vertex(x1, y0, zmin);
+  batch.Vertex(x1, y1, zmin);
+
+  batch.Vertex(x0, y1, zmax);
+  batch.Vertex(x1, y1, zmax);
+  batch.Vertex(x1, y1, zmin);
+  batch.Vertex(x0, y1, zmin);
 }
 
-void SuperRegion::DrawVoxels(unsigned int layer) const
+void SuperRegion::AppendVoxels(Gl::VertexBatch &batch, unsigned int layer) const
 {
-  glPushMatrix();
-  GLfloat scale = 1.0 / world->Resolution();
-  glScalef(scale, scale, 1.0); // XX TODO - this seems slightly
-  glTranslatef(origin.x << SRBITS, origin.y << SRBITS, 0);
+  if (regions == NULL) // evicted
+    return;
 
-  glEnable(GL_DEPTH_TEST);
-  glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+  const uint32_t rbits(RegionBits());
+  const uint32_t srbits(rbits + SuperRegionBits());
+  const int32_t rwidth(RegionWidth());
+  const int32_t srwidth(SuperRegionWidth());
 
-  std::vector<GLfloat> verts(1000);
-  std::vector<GLfloat> colors(1000);
+  const GLfloat scale = 1.0 / world->Resolution();
+  const GLfloat ox(origin.x << srbits), oy(origin.y << srbits);
 
   const Region *r = &regions[0];
 
-  for (int y = 0; y < SUPERREGIONWIDTH; ++y)
-    for (int x = 0; x < SUPERREGIONWIDTH; ++x) {
+  for (int y = 0; y < srwidth; ++y)
+    for (int x = 0; x < srwidth; ++x) {
       if (r->count) // not an empty region
-        for (int p = 0; p < REGIONWIDTH; ++p)
-          for (int q = 0; q < REGIONWIDTH; ++q) {
-            const std::vector<Block *> &blocks = r->cells[p + (q * REGIONWIDTH)].blocks[layer];
+        for (int p = 0; p < rwidth; ++p)
+          for (int q = 0; q < rwidth; ++q) {
+            const std::vector<Block *> &blocks = r->cells[p + (q * rwidth)].blocks[layer];
 
             if (blocks.size()) // not an empty cell
             {
-              const GLfloat xx(p + (x << RBITS));
-              const GLfloat yy(q + (y << RBITS));
+              const GLfloat xx(ox + p + (x << rbits));
+              const GLfloat yy(oy + q + (y << rbits));
 
               FOR_EACH (it, blocks) {
                 Block *block = *it;
                 Color c = block->group->mod.GetColor();
+                c.a = 1.0;
 
-                const std::vector<GLfloat> v =
-                    DrawBlock(xx, yy, block->global_z.min, block->global_z.max);
-                verts.insert(verts.end(), v.begin(), v.end());
-
-                for (unsigned int i = 0; i < 20; i++) {
-                  colors.push_back(c.r);
-                  colors.push_back(c.g);
-                  colors.push_back(c.b);
-                }
+                batch.SetColor(c);
+                AppendBox(batch, xx, yy, block->global_z.min, block->global_z.max, scale);
               }
             }
           }
       ++r;
     }
-
-  if (verts.size()) {
-    assert(verts.size() % 60 == 0); // should be full of blocks, each with 20 3D vertices
-
-    glEnableClientState(GL_COLOR_ARRAY);
-
-    glVertexPointer(3, GL_FLOAT, 0, &verts[0]);
-    glColorPointer(3, GL_FLOAT, 0, &colors[0]);
-
-    glDrawArrays(GL_QUADS, 0, verts.size() / 3);
-
-    glDisableClientState(GL_COLOR_ARRAY);
-  }
-
-  glPopMatrix();
 }
 
 void Stg::Cell::AddBlock(Block *b, unsigned int layer)
@@ -9,35 +9,50 @@
 
 namespace Stg {
 
-// a bit of experimenting suggests that these values are fast. YMMV.
-const uint32_t RBITS(5); // regions contain (2^RBITS)^2 pixels
-const uint32_t SBITS(5); // superregions contain (2^SBITS)^2 regions
-const uint32_t SRBITS(RBITS + SBITS);
-
-const int32_t REGIONWIDTH(1 << RBITS);
-const int32_t REGIONSIZE(REGIONWIDTH *REGIONWIDTH);
-
-const int32_t SUPERREGIONWIDTH(1 << SBITS);
-const int32_t SUPERREGIONSIZE(SUPERREGIONWIDTH *SUPERREGIONWIDTH);
-
-const int32_t CELLMASK(~((~0x00u) << RBITS));
-const int32_t REGIONMASK(~((~0x00u) << SRBITS));
-
-inline int32_t GETCELL(const int32_t x)
-{
-  return (x & CELLMASK);
-}
-inline int32_t GETREG(const int32_t x)
-{
-  return ((x & REGIONMASK) >> RBITS);
-}
-inline int32_t GETSREG(const int32_t x)
-{
-  return (x >> SRBITS);
-}
-
-// this is slightly faster than the inline method above, but not as safe
-//#define GETREG(X) (( (static_cast<int32_t>(X)) & REGIONMASK ) >> RBITS)
+// the default grid dimensions: a bit of experimenting suggests that
+// these values are fast. YMMV. Worlds can choose others with the
+// worldfile properties region_bits and superregion_bits.
+//
+// worlds/benchmark, without GUI, peak memory in MB for region_bits
+// 3 to 7 (superregion_bits makes little difference):
+//
+//   hospital.world, 20s   218  287  392  530  746
+//   cave.world, 100s       36   41   50   66   86
+//
+// Run times of all the sizes from 3/4 to 6/6 were within the noise
+// of each other (about 10%), with 7 about 25% slower. Dense indoor
+// maps can save memory with region_bits 4 at no measurable cost.
+const uint32_t DEFAULT_RBITS(5); // regions contain (2^RBITS)^2 pixels
+const uint32_t DEFAULT_SBITS(5); // superregions contain (2^SBITS)^2 regions
+
+/** The dimensions of the raytracing grid as compile-time constants,
+    so the inner loops of World::Raytrace() and World::MapPoly() can
+    be compiled for each supported size. See World::SetGridBits(). */
+template <uint32_t RB, uint32_t SB> class Grid {
+public:
+  static const uint32_t RBITS = RB; // regions contain (2^RBITS)^2 pixels
+  static const uint32_t SBITS = SB; // superregions contain (2^SBITS)^2 regions
+  static const uint32_t SRBITS = RB + SB;
+
+  static const int32_t REGIONWIDTH = 1 << RB;
+  static const int32_t REGIONSIZE = REGIONWIDTH * REGIONWIDTH;
+
+  static const int32_t SUPERREGIONWIDTH = 1 << SB;
+  static const int32_t SUPERREGIONSIZE = SUPERREGIONWIDTH * SUPERREGIONWIDTH;
+
+  static const int32_t CELLMASK = REGIONWIDTH - 1;
+  static const int32_t REGIONMASK = (1 << SRBITS) - 1;
+
+  static inline int32_t GETCELL(const int32_t x) { return (x & CELLMASK); }
+  static inline int32_t GETREG(const int32_t x) { return ((x & REGIONMASK) >> RBITS); }
+  static inline int32_t GETSREG(const int32_t x) { return (x >> SRBITS); }
+
+  /** Returns the index of the region containing global cell (x,y) in its superregion */
+  static inline int32_t REGION(const int32_t x, const int32_t y)
+  {
+    return GETREG(x) + GETREG(y) * SUPERREGIONWIDTH;
+  }
+};
 
 class Cell {
   friend class SuperRegion;
@@ -74,20 +89,18 @@ public:
   Region();
   ~Region();
 
-  inline Cell *GetCell(int32_t x, int32_t y)
+  /** Returns the cell at index x + y * region width */
+  inline Cell *GetCell(int32_t index)
   {
-    if (cells.size() == 0) {
-      assert(count == 0);
-
-      cells.resize(REGIONSIZE);
-
-      for (int32_t c = 0; c < REGIONSIZE; ++c)
-        cells[c].region = this;
-    }
+    if (cells.size() == 0)
+      AllocateCells();
 
-    return (&cells[x + y * REGIONWIDTH]);
+    return (&cells[index]);
   }
 
+  /** Create the cells of this region, which are allocated lazily */
+  void AllocateCells();
+
   inline void AddBlock();
   inline void RemoveBlock();
 
@@ -96,24 +109,62 @@ public:
 }; // class Region
 
 class SuperRegion {
+  friend class World;
+
 private:
   unsigned long count; // number of blocks rendered into this superregion
   point_int_t origin;
-  Region regions[SUPERREGIONSIZE];
+  Region *regions; // NULL while the superregion is evicted
   World *world;
+  unsigned long allocated; // number of regions that have cell storage
+
+  /** While evicted, the cells each block is rendered into, in
+compact form: the cell's index in the superregion (region index *
+region size + cell index) shifted left by one, plus the layer. See
+World::EvictSuperRegion(). */
+  std::map<Block *, std::vector<uint32_t> > entries;
+  size_t entry_count; // total length of the vectors in entries
+
+  /** The value of World::updates when this superregion was last used */
+  uint64_t last_used;
 
 public:
   SuperRegion(World *world, point_int_t origin);
   ~SuperRegion();
 
-  inline Region *GetRegion(int32_t x, int32_t y) { return (&regions[x + y * SUPERREGIONWIDTH]); }
-  void DrawOccupancy(void) const;
-  void DrawVoxels(unsigned int layer) const;
+  /** Returns the region at index x + y * superregion width */
+  inline Region *GetRegion(int32_t index) { return (&regions[index]); }
+  /** Append the outlines of the superregion, its occupied regions
+      and their occupied cells to batch, as quads in metres */
+  void AppendOccupancy(Gl::VertexBatch &batch) const;
+  /** Append a box for each block in the occupied cells of layer to
+      batch, as quads in metres */
+  void AppendVoxels(Gl::VertexBatch &batch, unsigned int layer) const;
 
   inline void AddBlock();
   inline void RemoveBlock();
 
+  /** Called when a member region allocates its cells */
+  void RegionAllocated();
+
+  /** Release the regions and their cells, leaving the superregion evicted */
+  void FreeRegions();
+
+  /** Returns true iff the superregion's cells are not in memory */
+  bool Evicted() const { return regions == NULL; }
+
+  /** Returns the approximate number of bytes used by this superregion */
+  size_t MemoryEstimate() const;
+
   const point_int_t &GetOrigin() const { return origin; }
+
+  /** The grid dimensions, which are fixed when the world is loaded */
+  uint32_t RegionBits() const { return world->region_bits; }
+  uint32_t SuperRegionBits() const { return world->superregion_bits; }
+  int32_t RegionWidth() const { return 1 << world->region_bits; }
+  int32_t RegionSize() const { return RegionWidth() * RegionWidth(); }
+  int32_t SuperRegionWidth() const { return 1 << world->superregion_bits; }
+  int32_t SuperRegionSize() const { return SuperRegionWidth() * SuperRegionWidth(); }
 }; // class SuperRegion;
 
 } // namespace Stg
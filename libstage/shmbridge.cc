@@ -0,0 +1,313 @@
+/*
+  shmbridge.cc
+  publishes the position models and rangers of a world to another
+  process through POSIX shared memory, and applies its velocity
+  commands.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h> // for gettimeofday(2)
+#include <unistd.h>
+
+#include "stage.hh"
+#include "stageshm.h"
+
+using namespace Stg;
+
+// how long an update waits for a lockstep client before giving up,
+// so that the GUI stays responsive
+static const long LOCKSTEP_WAIT_NSEC(10000000);
+
+static size_t align8(size_t bytes)
+{
+  return (bytes + 7) & ~(size_t)7;
+}
+
+static void copy_name(char *dest, const std::string &name)
+{
+  if (name.size() >= STG_SHM_NAME_LEN)
+    PRINT_WARN2("model name \"%s\" is truncated to %d characters in shared memory", name.c_str(),
+                STG_SHM_NAME_LEN - 1);
+
+  strncpy(dest, name.c_str(), STG_SHM_NAME_LEN - 1);
+  dest[STG_SHM_NAME_LEN - 1] = 0;
+}
+
+ShmBridge::ShmBridge() : name(), segment(NULL), size(0), robots(), rangers(), applied()
+{
+}
+
+ShmBridge::~ShmBridge()
+{
+  Close();
+}
+
+bool ShmBridge::Open(const std::string &segment_name, World *world, bool lockstep,
+                     unsigned int frame_count)
+{
+  Close();
+
+  name = segment_name[0] == '/' ? segment_name : "/" + segment_name;
+
+  // the models are published in order of name, so that clients see
+  // the same indices every run
+  std::map<std::string, ModelPosition *> by_name;
+  const std::set<Model *> models(world->GetAllModels());
+
+  FOR_EACH (it, models) {
+    ModelPosition *pos(dynamic_cast<ModelPosition *>(*it));
+    if (pos)
+      by_name[pos->TokenStr()] = pos;
+  }
+
+  robots.clear();
+  rangers.clear();
+
+  std::vector<uint32_t> first_ranger, ranger_counts;
+  FOR_EACH (it, by_name) {
+    robots.push_back(it->second);
+    first_ranger.push_back(rangers.size());
+    it->second->GetRangers(rangers);
+    ranger_counts.push_back(rangers.size() - first_ranger.back());
+  }
+
+  applied.assign(robots.size(), 0);
+
+  // the client sees nothing of models that do not update
+  FOR_EACH (it, robots)
+    (*it)->Subscribe();
+  FOR_EACH (it, rangers)
+    (*it)->Subscribe();
+
+  std::vector<uint32_t> first_range, range_counts;
+  uint32_t range_count(0);
+  FOR_EACH (it, rangers) {
+    first_range.push_back(range_count);
+    range_counts.push_back(0);
+    FOR_EACH (sit, (*it)->GetSensors())
+      range_counts.back() += sit->sample_count;
+    range_count += range_counts.back();
+  }
+
+  frame_count = std::max(frame_count, 1U);
+
+  const size_t robots_offset(align8(sizeof(stg_shm_header_t)));
+  const size_t rangers_offset(robots_offset
+                              + align8(robots.size() * sizeof(stg_shm_robot_info_t)));
+  const size_t commands_offset(rangers_offset
+                               + align8(rangers.size() * sizeof(stg_shm_ranger_info_t)));
+  const size_t frames_offset(commands_offset + robots.size() * sizeof(stg_shm_command_t));
+  const size_t frame_size(align8(sizeof(stg_shm_frame_t) + robots.size() * sizeof(stg_shm_robot_t)
+                                 + range_count * sizeof(float)));
+
+  size = frames_offset + frame_count * frame_size;
+
+  // another world may be using the name, so never take it over
+  const int fd(shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600));
+  if (fd < 0 && errno == EEXIST) {
+    PRINT_ERR2("shared memory \"%s\" already exists; another world is using it, or one that "
+               "crashed left it behind in /dev/shm%s",
+               name.c_str(), name.c_str());
+    return false;
+  }
+  if (fd < 0) {
+    PRINT_ERR2("failed to create shared memory \"%s\": %s", name.c_str(), strerror(errno));
+    return false;
+  }
+
+  if (ftruncate(fd, size) != 0) {
+    PRINT_ERR2("failed to size shared memory \"%s\": %s", name.c_str(), strerror(errno));
+    close(fd);
+    shm_unlink(name.c_str());
+    return false;
+  }
+
+  void *mem(mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+  close(fd);
+
+  if (mem == MAP_FAILED) {
+    PRINT_ERR2("failed to map shared memory \"%s\": %s", name.c_str(), strerror(errno));
+    shm_unlink(name.c_str());
+    return false;
+  }
+
+  segment = mem;
+
+  // ftruncate() zeroed the segment
+  stg_shm_header_t *header(static_cast<stg_shm_header_t *>(segment));
+  memcpy(header->magic, "STGSHM", 7);
+  header->version = STG_SHM_VERSION;
+  header->lockstep = lockstep;
+  header->size = size;
+  header->interval = world->sim_interval;
+  header->robot_count = robots.size();
+  header->ranger_count = rangers.size();
+  header->range_count = range_count;
+  header->frame_count = frame_count;
+  header->frame_size = frame_size;
+  header->robots_offset = robots_offset;
+  header->rangers_offset = rangers_offset;
+  header->commands_offset = commands_offset;
+  header->frames_offset = frames_offset;
+  header->alive = 1;
+  header->published = 0;
+  sem_init(&header->step, 1, 0);
+  sem_init(&header->done, 1, 0);
+
+  stg_shm_robot_info_t *robot_info(stg_shm_robot_infos(header));
+  for (size_t r(0); r < robots.size(); ++r) {
+    copy_name(robot_info[r].name, robots[r]->TokenStr());
+    robot_info[r].first_ranger = first_ranger[r];
+    robot_info[r].ranger_count = ranger_counts[r];
+  }
+
+  stg_shm_ranger_info_t *ranger_info(stg_shm_ranger_infos(header));
+  for (size_t r(0), robot(0); r < rangers.size(); ++r) {
+    while (r >= first_ranger[robot] + ranger_counts[robot])
+      ++robot;
+
+    copy_name(ranger_info[r].name, rangers[r]->TokenStr());
+    ranger_info[r].robot = robot;
+    ranger_info[r].first_range = first_range[r];
+    ranger_info[r].range_count = range_counts[r];
+  }
+
+  WriteFrame(world->GetUpdateCount(), world->SimTimeNow());
+  return true;
+}
+
+void ShmBridge::Close()
+{
+  if (segment == NULL)
+    return;
+
+  stg_shm_header_t *header(static_cast<stg_shm_header_t *>(segment));
+  header->alive = 0;
+  __sync_synchronize();
+
+  // release a client waiting for an update
+  sem_post(&header->done);
+
+  // clients keep their mappings until they close them
+  munmap(segment, size);
+  shm_unlink(name.c_str());
+
+  segment = NULL;
+  size = 0;
+
+  FOR_EACH (it, robots)
+    (*it)->Unsubscribe();
+  FOR_EACH (it, rangers)
+    (*it)->Unsubscribe();
+
+  robots.clear();
+  rangers.clear();
+}
+
+bool ShmBridge::BeginUpdate()
+{
+  stg_shm_header_t *header(static_cast<stg_shm_header_t *>(segment));
+
+  if (header->lockstep) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    struct timespec until;
+    until.tv_sec = now.tv_sec;
+    until.tv_nsec = now.tv_usec * 1000 + LOCKSTEP_WAIT_NSEC;
+    if (until.tv_nsec >= 1000000000) {
+      until.tv_sec += 1;
+      until.tv_nsec -= 1000000000;
+    }
+
+    if (sem_timedwait(&header->step, &until) != 0)
+      return false;
+  }
+
+  const stg_shm_command_t *commands(stg_shm_commands(header));
+
+  for (size_t r(0); r < robots.size(); ++r) {
+    const stg_shm_command_t &cmd(commands[r]);
+
+    // a command being written is applied at the next update
+    const uint32_t seq(cmd.seq);
+    if ((seq & 1) || seq == applied[r])
+      continue;
+
+    __sync_synchronize();
+    const double x(cmd.velocity[0]), y(cmd.velocity[1]), a(cmd.velocity[2]);
+    __sync_synchronize();
+
+    if (cmd.seq != seq)
+      continue;
+
+    robots[r]->SetSpeed(x, y, a);
+    applied[r] = seq;
+  }
+
+  return true;
+}
+
+void ShmBridge::EndUpdate(uint64_t tick, usec_t sim_time)
+{
+  WriteFrame(tick, sim_time);
+
+  stg_shm_header_t *header(static_cast<stg_shm_header_t *>(segment));
+  if (header->lockstep)
+    sem_post(&header->done);
+}
+
+void ShmBridge::WriteFrame(uint64_t tick, usec_t sim_time)
+{
+  stg_shm_header_t *header(static_cast<stg_shm_header_t *>(segment));
+  stg_shm_frame_t *frame(stg_shm_frame(header, header->published));
+
+  ++frame->seq;
+  __sync_synchronize();
+
+  frame->tick = tick;
+  frame->sim_time = sim_time;
+
+  stg_shm_robot_t *robot(stg_shm_frame_robots(frame));
+  for (size_t r(0); r < robots.size(); ++r, ++robot) {
+    const Pose pose(robots[r]->GetGlobalPose());
+    const Velocity vel(robots[r]->GetVelocity());
+
+    robot->pose[0] = pose.x;
+    robot->pose[1] = pose.y;
+    robot->pose[2] = pose.a;
+    robot->velocity[0] = vel.x;
+    robot->velocity[1] = vel.y;
+    robot->velocity[2] = vel.a;
+    robot->stalled = robots[r]->Stalled();
+  }
+
+  float *ranges(stg_shm_frame_ranges(header, frame));
+  const stg_shm_ranger_info_t *info(stg_shm_ranger_infos(header));
+
+  for (size_t r(0); r < rangers.size(); ++r) {
+    // the sample counts may have changed since the segment was made,
+    // so pad or truncate to the space it has
+    const ModelRanger::Scan scan(rangers[r]->GetScan());
+    const uint32_t count(std::min(scan.count, info[r].range_count));
+    float *dest(ranges + info[r].first_range);
+
+    if (count)
+      memcpy(dest, scan.ranges, count * sizeof(float));
+    if (count < info[r].range_count)
+      memset(dest + count, 0, (info[r].range_count - count) * sizeof(float));
+  }
+
+  __sync_synchronize();
+  ++frame->seq;
+  __sync_synchronize();
+  ++header->published;
+}
+
+bool World::StartBridge(const std::string &name, bool lockstep, unsigned int frame_count)
+{
+  return shm_bridge.Open(name, this, lockstep, frame_count);
+}
@@ -0,0 +1,311 @@
+/*
+  snapshot.cc
+  binary checkpoints of the dynamic state of a world, for restoring
+  experiments without reloading the worldfile.
+*/
+
+#include <errno.h>
+
+#include "stage.hh"
+
+using namespace Stg;
+
+// identifies snapshot data, and its layout
+static const char SNAPSHOT_MAGIC[8] = { 'S', 'T', 'G', 'S', 'N', 'A', 'P', 0 };
+static const uint32_t SNAPSHOT_VERSION(3);
+
+/** Where the state of a model is in a snapshot */
+class ModelEntry {
+public:
+  Model *mod;
+  size_t start;
+  uint32_t length;
+};
+
+std::vector<model_callback_t> World::event_callbacks(1, &Model::UpdateWrapper);
+
+void Snapshot::PutString(const std::string &str)
+{
+  Put((uint32_t)str.size());
+  data.append(str);
+}
+
+bool Snapshot::GetString(std::string &str)
+{
+  uint32_t size(0);
+  if (!Get(size) || pos + size > data.size())
+    return (ok = false);
+
+  str.assign(data, pos, size);
+  pos += size;
+  return true;
+}
+
+bool Snapshot::SkipString()
+{
+  uint32_t size(0);
+  return Get(size) && Skip(size);
+}
+
+bool Snapshot::Write(const std::string &filename) const
+{
+  FILE *fp(fopen(filename.c_str(), "wb"));
+  if (fp == NULL) {
+    PRINT_ERR2("failed to open snapshot \"%s\": %s", filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  const bool written(fwrite(data.data(), 1, data.size(), fp) == data.size());
+
+  if (fclose(fp) != 0 || !written) {
+    PRINT_ERR2("failed to write snapshot \"%s\": %s", filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+bool Snapshot::Read(const std::string &filename)
+{
+  FILE *fp(fopen(filename.c_str(), "rb"));
+  if (fp == NULL) {
+    PRINT_ERR2("failed to open snapshot \"%s\": %s", filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  data.clear();
+  pos = 0;
+  ok = true;
+
+  char buf[1 << 16];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+    data.append(buf, len);
+
+  const bool failed(ferror(fp));
+  fclose(fp);
+
+  if (failed) {
+    PRINT_ERR1("failed to read snapshot \"%s\"", filename.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+void World::RegisterEventCallback(model_callback_t cb)
+{
+  if (std::find(event_callbacks.begin(), event_callbacks.end(), cb) == event_callbacks.end())
+    event_callbacks.push_back(cb);
+}
+
+void World::SaveSnapshot(Snapshot &snap) const
+{
+  snap.data.clear();
+  snap.pos = 0;
+  snap.ok = true;
+
+  snap.data.append(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  snap.Put(SNAPSHOT_VERSION);
+  snap.Put(sim_time);
+  snap.Put(updates);
+
+  pthread_mutex_lock(&random_mutex);
+  snap.Put(random.state);
+  snap.Put(random.have_spare);
+  snap.Put(random.rand1);
+  snap.Put(random.rand2);
+  pthread_mutex_unlock(&random_mutex);
+
+  snap.Put((uint32_t)models_by_name.size());
+
+  FOR_EACH (it, models_by_name) {
+    snap.PutString(it->first);
+    snap.PutString(it->second->GetModelType());
+
+    // the length of the model's state is filled in afterwards, so
+    // that models can be skipped without decoding them
+    const size_t length_pos(snap.data.size());
+    snap.Put((uint32_t)0);
+
+    it->second->SaveState(snap);
+
+    const uint32_t length(snap.data.size() - length_pos - sizeof(uint32_t));
+    memcpy(&snap.data[length_pos], &length, sizeof(length));
+  }
+
+  // events are in priority queues, which can only be read by popping
+  std::vector<std::pair<uint32_t, Event> > events;
+  unsigned int dropped(0);
+
+  for (uint32_t q(0); q < event_queues.size(); ++q)
+    for (std::priority_queue<Event> queue(event_queues[q]); !queue.empty(); queue.pop()) {
+      const Event &ev(queue.top());
+
+      if (ev.arg != NULL
+          || std::find(event_callbacks.begin(), event_callbacks.end(), ev.cb)
+                 == event_callbacks.end()) {
+        ++dropped;
+        continue;
+      }
+
+      events.push_back(std::make_pair(q, ev));
+    }
+
+  if (dropped)
+    PRINT_WARN1("%u events with unregistered callbacks or arguments were not recorded in the "
+                "snapshot",
+                dropped);
+
+  snap.Put((uint32_t)events.size());
+
+  FOR_EACH (it, events) {
+    const Event &ev(it->second);
+
+    snap.Put(it->first);
+    snap.Put(ev.time);
+    snap.PutString(ev.mod->Token());
+    snap.Put((uint32_t)(std::find(event_callbacks.begin(), event_callbacks.end(), ev.cb)
+                        - event_callbacks.begin()));
+  }
+}
+
+bool World::RestoreSnapshot(Snapshot &snap)
+{
+  snap.pos = 0;
+  snap.ok = true;
+
+  char magic[sizeof(SNAPSHOT_MAGIC)];
+  uint32_t version(0);
+
+  if (!snap.Get(magic) || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0
+      || !snap.Get(version) || version != SNAPSHOT_VERSION) {
+    PRINT_ERR("not a snapshot, or one from another version of Stage");
+    return false;
+  }
+
+  usec_t time(0);
+  uint64_t count(0);
+  RandomGenerator generator;
+
+  snap.Get(time);
+  snap.Get(count);
+  snap.Get(generator.state);
+  snap.Get(generator.have_spare);
+  snap.Get(generator.rand1);
+  snap.Get(generator.rand2);
+
+  // check that every model and event matches the world before
+  // changing anything
+  std::vector<ModelEntry> entries;
+  uint32_t model_count(0);
+  snap.Get(model_count);
+
+  for (uint32_t i(0); i < model_count && snap.ok; ++i) {
+    std::string name, type;
+    ModelEntry entry;
+
+    snap.GetString(name);
+    snap.GetString(type);
+    snap.Get(entry.length);
+    entry.start = snap.pos;
+
+    if (!snap.ok || entry.start + entry.length > snap.data.size()) {
+      snap.ok = false;
+      break;
+    }
+
+    std::map<std::string, Model *>::const_iterator it(models_by_name.find(name));
+
+    if (it == models_by_name.end() || it->second->GetModelType() != type) {
+      PRINT_ERR2("snapshot model \"%s\" of type %s is not in this world", name.c_str(),
+                 type.c_str());
+      return false;
+    }
+
+    entry.mod = it->second;
+    entries.push_back(entry);
+    snap.pos += entry.length;
+  }
+
+  std::vector<std::pair<uint32_t, Event> > events;
+  uint32_t event_count(0);
+  snap.Get(event_count);
+
+  for (uint32_t i(0); i < event_count && snap.ok; ++i) {
+    uint32_t queue(0), cb(0);
+    usec_t when(0);
+    std::string name;
+
+    snap.Get(queue);
+    snap.Get(when);
+    snap.GetString(name);
+    snap.Get(cb);
+
+    std::map<std::string, Model *>::const_iterator it(models_by_name.find(name));
+
+    if (it == models_by_name.end() || cb >= event_callbacks.size()) {
+      PRINT_ERR1("snapshot event of model \"%s\" can not be restored", name.c_str());
+      return false;
+    }
+
+    // the world may have fewer threads than the one that saved it
+    if (queue >= event_queues.size())
+      queue = 0;
+
+    events.push_back(std::make_pair(queue, Event(when, it->second, event_callbacks[cb], NULL)));
+  }
+
+  if (!snap.ok) {
+    PRINT_ERR("snapshot is truncated");
+    return false;
+  }
+
+  // and that each model's state fits it
+  FOR_EACH (it, entries) {
+    snap.pos = it->start;
+
+    if (!it->mod->CheckState(snap) || snap.pos != it->start + it->length) {
+      PRINT_ERR1("snapshot state of model \"%s\" does not match it", it->mod->Token());
+      return false;
+    }
+  }
+
+  sim_time = time;
+  updates = count;
+
+  FOR_EACH (it, entries) {
+    snap.pos = it->start;
+    it->mod->LoadState(snap);
+  }
+
+  // subscribing models above queued events of their own, which the
+  // snapshot's replace
+  FOR_EACH (it, event_queues)
+    *it = std::priority_queue<Event>();
+
+  FOR_EACH (it, events)
+    event_queues[it->first].push(it->second);
+
+  // restore the generator last, since subscribing may have used it
+  pthread_mutex_lock(&random_mutex);
+  random = generator;
+  pthread_mutex_unlock(&random_mutex);
+
+  bvh_dirty = true;
+  dirty = true;
+  return true;
+}
+
+bool World::SaveSnapshot(const std::string &filename) const
+{
+  Snapshot snap;
+  SaveSnapshot(snap);
+  return snap.Write(filename);
+}
+
+bool World::RestoreSnapshot(const std::string &filename)
+{
+  Snapshot snap;
+  return snap.Read(filename) && RestoreSnapshot(snap);
+}
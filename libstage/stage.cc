@@ -1,5 +1,7 @@
 // Author: Richard Vaughan
 
+#include <FL/Fl_JPEG_Image.H>
+#include <FL/Fl_PNG_Image.H>
 #include <FL/Fl_Shared_Image.H>
 
 #include "config.h" // results of cmake's system configuration tests
@@ -23,7 +25,7 @@ void Stg::Init(int *argc, char **argv[])
   for (int i = 0; i < *argc; i++)
     World::args.push_back((*argv)[i]);
 
-  // seed the RNG
+  // seed the RNG, which seeds each world's own
   srand48(time(NULL));
 
   if (!setlocale(LC_ALL, "POSIX"))
@@ -69,6 +71,50 @@ const Color Color::cyan(0, 1, 1);
 //     }
 // }
 
+/** serializes access to FLTK's shared image cache, which decodes
+    the formats private_image() does not */
+static pthread_mutex_t image_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Decode a PNG or JPEG file into an image of its own, outside FLTK's
+    shared image cache, so that several threads can decode at once.
+    Returns NULL for other formats, or if the file can't be decoded. */
+static Fl_Image *private_image(const std::string &filename)
+{
+  FILE *fp(fopen(filename.c_str(), "rb"));
+  if (fp == NULL)
+    return NULL;
+
+  unsigned char magic[8];
+  const size_t got(fread(magic, 1, sizeof(magic), fp));
+  fclose(fp);
+
+  Fl_Image *img(NULL);
+  if (got == 8 && memcmp(magic, "\211PNG\r\n\032\n", 8) == 0)
+    img = new Fl_PNG_Image(filename.c_str());
+  else if (got >= 3 && memcmp(magic, "\377\330\377", 3) == 0)
+    img = new Fl_JPEG_Image(filename.c_str());
+  else
+    return NULL;
+
+  if (img->w() <= 0 || img->h() <= 0 || img->d() <= 0 || img->count() < 1) {
+    delete img;
+    return NULL;
+  }
+
+  return img;
+}
+
+/** Copy the first channel of img into channel */
+static void first_channel(const Fl_Image *img, std::vector<uint8_t> &channel)
+{
+  channel.resize(img->w() * img->h());
+
+  const uint8_t *src = (const uint8_t *)img->data()[0];
+  const unsigned int d = img->d();
+  for (size_t i = 0; i < channel.size(); ++i)
+    channel[i] = src[i * d];
+}
+
 static inline bool pixel_is_set(uint8_t *pixels, const unsigned int width, const unsigned int depth,
                                 const unsigned int x, const unsigned int y, uint8_t threshold)
 {
@@ -89,21 +135,42 @@ int Stg::polys_from_image_file(const std::string &filename,
   // TODO: make this a parameter
   const int threshold = 127;
 
-  Fl_Shared_Image *img = Fl_Shared_Image::get(filename.c_str());
-  if (img == NULL) {
-    std::cerr << "failed to open file: " << filename << std::endl;
+  // PNG and JPEG images are decoded privately, so that several can be
+  // decoded and polygonized in parallel (see World::DecodeBitmaps()).
+  // Other formats go through FLTK's image cache, which is not
+  // thread-safe, so only their polygonization runs in parallel.
+  unsigned int width, height;
+  const unsigned int depth = 1;
+  std::vector<uint8_t> channel;
+
+  Fl_Image *own = private_image(filename);
+  if (own) {
+    width = own->w();
+    height = own->h();
+    first_channel(own, channel);
+    delete own;
+  } else {
+    pthread_mutex_lock(&image_mutex);
+
+    Fl_Shared_Image *img = Fl_Shared_Image::get(filename.c_str());
+    if (img == NULL) {
+      // the caller reports the failure
+      pthread_mutex_unlock(&image_mutex);
+      return -1;
+    }
 
-    assert(img); // easy access to this point in debugger
-    exit(-1);
-  }
+    // printf( "loaded image %s w %d h %d d %d count %d ld %d\n",
+    //  filename, img->w(), img->h(), img->d(), img->count(), img->ld() );
 
-  // printf( "loaded image %s w %d h %d d %d count %d ld %d\n",
-  //  filename, img->w(), img->h(), img->d(), img->count(), img->ld() );
+    width = img->w();
+    height = img->h();
+    first_channel(img, channel);
 
-  const unsigned int width = img->w();
-  const unsigned height = img->h();
-  const unsigned int depth = img->d();
-  uint8_t *pixels = (uint8_t *)img->data()[0];
+    img->release(); // frees all resources for this image
+    pthread_mutex_unlock(&image_mutex);
+  }
+
+  uint8_t *pixels = channel.empty() ? NULL : &channel[0];
 
   // a set of previously seen directed edges, The key is a 4-element vector
   // [x1,y1,x2,y2].
@@ -209,8 +276,6 @@ int Stg::polys_from_image_file(const std::string &filename,
     polys.push_back(poly);
   }
 
-  if (img)
-    img->release(); // frees all resources for this image
   return 0; // ok
 }
 
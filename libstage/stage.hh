@@ -48,6 +48,7 @@
 // C++ libs
 #include <algorithm>
 #include <cmath>
+#include <deque>
 #include <iostream>
 #include <list>
 #include <map>
@@ -80,10 +81,15 @@ class Worldfile;
 class World;
 class WorldGui;
 class Model;
+class ModelPosition;
+class ModelRanger;
 class OptionsDlg;
 class Camera;
 class FileManager;
 class Option;
+class RenderModel;
+class RenderShown;
+class VisData;
 
 typedef Model *(*creator_t)(World *, Model *, const std::string &type);
 
@@ -263,7 +269,6 @@ public:
 
   Pose() : x(0.0), y(0.0), z(0.0), a(0.0) { /*empty*/}
 
-  virtual ~Pose() {}
   /** return a random pose within the bounding rectangle, with z=0 and
 angle random */
   static Pose Random(meters_t xmin, meters_t xmax, meters_t ymin, meters_t ymax)
@@ -275,7 +280,7 @@ angle random */
   /** Print pose in human-readable format on stdout
 @param prefix Character string to prepend to pose output
   */
-  virtual void Print(const char *prefix) const
+  void Print(const char *prefix) const
   {
     printf("%s pose [x:%.3f y:%.3f z:%.3f a:%.3f]\n", prefix, x, y, z, a);
   }
@@ -294,11 +299,12 @@ angle random */
   Pose &Load(Worldfile *wf, int section, const char *keyword);
   void Save(Worldfile *wf, int section, const char *keyword);
 
-  inline Pose operator+(const Pose &p) const
-  {
-    const double cosa = cos(a);
-    const double sina = sin(a);
+  inline Pose operator+(const Pose &p) const { return Plus(p, cos(a), sin(a)); }
 
+  /** Returns this + p, given the cosine and sine of a, for callers
+that already have them */
+  inline Pose Plus(const Pose &p, double cosa, double sina) const
+  {
     return Pose(x + p.x * cosa - p.y * sina, y + p.x * sina + p.y * cosa, z + p.z,
                 normalize(a + p.a));
   }
@@ -324,20 +330,6 @@ angle random */
   meters_t Distance(const Pose &other) const { return hypot(x - other.x, y - other.y); }
 };
 
-class RaytraceResult {
-public:
-  Pose pose;
-  Model *mod;
-  Color color;
-  meters_t range;
-
-  RaytraceResult() : pose(), mod(NULL), color(), range(0.0) {}
-  RaytraceResult(const Pose &pose, Model *mod, const Color &color, const meters_t range)
-      : pose(pose), mod(mod), color(color), range(range)
-  {
-  }
-};
-
 /** Specify a 4 axis velocity: 3D vector in [x, y, z], plus rotation
       about Z (yaw).*/
 class Velocity : public Pose {
@@ -362,7 +354,7 @@ prefix string
 
 @param prefix Character string to prepend to output, or NULL.
   */
-  virtual void Print(const char *prefix) const
+  void Print(const char *prefix) const
   {
     if (prefix)
       printf("%s", prefix);
@@ -434,6 +426,21 @@ public:
   bounds3d_t(const Bounds &x, const Bounds &y, const Bounds &z) : x(x), y(y), z(z) {}
 };
 
+class RaytraceResult {
+public:
+  Pose pose;
+  Model *mod;
+  Color color;
+  meters_t range;
+  Bounds z; ///< the global z extent of the block hit
+
+  RaytraceResult() : pose(), mod(NULL), color(), range(0.0), z() {}
+  RaytraceResult(const Pose &pose, Model *mod, const Color &color, const meters_t range)
+      : pose(pose), mod(mod), color(color), range(range), z()
+  {
+  }
+};
+
 /** Define a field-of-view: an angle and range bounds */
 typedef struct {
   Bounds range; ///< min and max range of sensor
@@ -511,10 +518,97 @@ void draw_array(float x, float y, float w, float h, float *data, size_t len, siz
 void draw_array(float x, float y, float w, float h, float *data, size_t len, size_t offset);
 /** Draws a rectangle with center at x,y, with sides of length dx,dy */
 void draw_centered_rect(float x, float y, float dx, float dy);
+
+/** Colored vertices drawn with a single glDrawArrays() instead of a
+    glBegin()/glEnd() for each primitive. The vertices are kept in a
+    vertex buffer object, and only those added or changed since the
+    last draw are uploaded, so a batch that is mostly unchanged, like
+    a trail, costs little to draw again. Where the GL has no buffer
+    objects the batch is drawn from client-side arrays instead. */
+class VertexBatch {
+public:
+  explicit VertexBatch(GLenum mode);
+  ~VertexBatch();
+
+  /** Forget all the vertices, keeping the memory for the next frame */
+  void Clear();
+  bool Empty() const { return vertices.empty(); }
+  size_t Size() const { return vertices.size() / 3; }
+
+  /** Set the number of vertices. New vertices are at the origin and
+      transparent, so triangles made of them are not seen. */
+  void Resize(size_t count);
+
+  /** The color of the vertices added or set after this call */
+  void SetColor(const Color &c);
+
+  /** Append a vertex in the current color */
+  void Vertex(GLfloat x, GLfloat y, GLfloat z);
+
+  /** Overwrite vertex index, and its color with the current color */
+  void SetVertex(size_t index, GLfloat x, GLfloat y, GLfloat z);
+
+  /** Draw vertices [first, first + count) with one call, first
+      uploading any that changed. Call with the GL context current. */
+  void Draw(size_t first, size_t count) const;
+  void Draw() const { Draw(0, Size()); }
+
+  /** Delete the buffers of batches destroyed since the last call.
+      Call with the GL context current. */
+  static void DeleteFreedBuffers();
+
+private:
+  GLenum mode;
+  std::vector<GLfloat> vertices; ///< x, y and z of each vertex
+  std::vector<GLfloat> colors; ///< r, g, b and a of each vertex
+  GLfloat color[4];
+
+  mutable GLuint buffer; ///< the vertex buffer object, 0 until first drawn
+  mutable size_t capacity; ///< vertices the buffer has room for
+  /** The vertices changed since they were last uploaded, [dirty_first,
+      dirty_last), empty if dirty_first >= dirty_last */
+  mutable size_t dirty_first, dirty_last;
+
+  /** Note that vertices [first, last) need uploading */
+  void Touch(size_t first, size_t last)
+  {
+    dirty_first = std::min(dirty_first, first);
+    dirty_last = std::max(dirty_last, last);
+  }
+
+  /** Copy the changed vertices into the buffer, growing it if needed */
+  void Upload() const;
+
+  // each batch owns its buffer
+  VertexBatch(const VertexBatch &);
+  VertexBatch &operator=(const VertexBatch &);
+};
 } // namespace Gl
 
 void RegisterModels();
 
+/** What a visualization draws of a model, copied from the model at
+    the end of an update so that the canvas can draw it while the
+    simulation carries on. Made by Visualizer::Capture() and
+    Model::CaptureData(). */
+class VisData {
+public:
+  VisData() {}
+  virtual ~VisData() {}
+
+  /** Returns a copy, which the caller deletes */
+  virtual VisData *Clone() const = 0;
+
+  /** Draw in the global frame. rm is the snapshot entry of the
+      model, with its global pose. */
+  virtual void Draw(Canvas *canvas, Camera *cam, const RenderModel &rm) const = 0;
+
+  /** How far from the model's origin Draw() may draw, or a negative
+      number if it may draw anywhere, as it does by default. Data out of
+      view is not drawn. */
+  virtual meters_t Reach() const { return -1; }
+};
+
 /** Abstract class for adding visualizations to models. Visualize must be overloaded, and is then
  * called in the models local coord system */
 class Visualizer {
@@ -531,6 +625,26 @@ public:
   virtual ~Visualizer(void) {}
   virtual void Visualize(Model *mod, Camera *cam) = 0;
 
+  /** Returns a copy of what Visualize() would draw of mod, for the
+      canvas to draw from its snapshot, or NULL as by default. The
+      canvas then calls Visualize() itself, with the world locked, so
+      overriding this keeps the simulation from waiting for the GUI. */
+  virtual VisData *Capture(Model *mod)
+  {
+    (void)mod;
+    return NULL;
+  }
+
+  /** How far from the origin of mod Visualize() may draw, or a
+      negative number if it may draw anywhere, as it does by default.
+      Only asked of visualizers without Capture(), whose copies say
+      this with VisData::Reach(). */
+  virtual meters_t Reach(Model *mod) const
+  {
+    (void)mod;
+    return -1;
+  }
+
   const std::string &GetMenuName() { return menu_name; }
   const std::string &GetWorldfileName() { return worldfile_name; }
 };
@@ -541,6 +655,11 @@ typedef int (*model_callback_t)(Model *mod, void *user);
 
 typedef int (*world_callback_t)(World *world, void *user);
 
+/** Define a callback function type that is passed every model that
+    updated in a step of the world */
+typedef int (*world_batch_callback_t)(World *world, const std::vector<Model *> &updated,
+                                      void *user);
+
 /// return val, or minval if val < minval, or maxval if val > maxval
 double constrain(double val, double minval, double maxval);
 
@@ -559,8 +678,9 @@ typedef struct {
   Size size;
 } rotrect_t; /// rotated rectangle
 
-/** load the image file [filename] and convert it to a vector of polygons
-   */
+/** load the image file [filename] and convert it to a vector of polygons.
+    Returns non-zero if the image can't be read. Safe to call from
+    several threads at once. */
 int polys_from_image_file(const std::string &filename, std::vector<std::vector<point_t> > &polys);
 
 /** matching function should return true iff the candidate block is
@@ -712,42 +832,281 @@ class Ray {
 public:
   Ray(const Model *mod, const Pose &origin, const meters_t range, const ray_test_func_t func,
       const void *arg, const bool ztest)
-      : mod(mod), origin(origin), range(range), func(func), arg(arg), ztest(ztest)
+      : mod(mod), origin(origin), range(range), func(func), arg(arg), ztest(ztest), exact(false)
   {
   }
 
-  Ray() : mod(NULL), origin(0, 0, 0, 0), range(0), func(NULL), arg(NULL), ztest(true) {}
+  Ray()
+      : mod(NULL), origin(0, 0, 0, 0), range(0), func(NULL), arg(NULL), ztest(true), exact(false)
+  {
+  }
   const Model *mod;
   Pose origin;
   meters_t range;
   ray_test_func_t func;
   const void *arg;
   bool ztest;
+  /** iff true, intersect the ray with the block polygons rather than
+  the grid cells, so the range does not depend on the world
+  resolution. See World::RaytraceExact(). */
+  bool exact;
 };
 
 // defined in stage_internal.hh
 class Region;
 class SuperRegion;
+class Bvh;
+class BvhEdge;
 class BlockGroup;
 class PowerPack;
 
-class LogEntry {
-  usec_t timestamp;
-  Model *mod;
-  Pose pose;
+/** A binary log of the trajectories of models, for analysing runs
+afterwards. Records are copied into a ring buffer for each of the
+world's threads and written to the file by a background thread, so
+logging costs the simulation little more than the copy. If a ring
+fills, the thread logging into it waits for the writer.
+
+The file starts with a header: the 8 byte magic "STGLOG", then as
+uint32_t the version, the size of a Record and the number of models,
+then a uint64_t of the world's update interval in usec. Next, for each
+model in the world, its uint32_t id, and its name as a uint32_t length
+and that many characters. Records follow until the end of the file.
+The encoding is native, as for Snapshot. The stagelog program prints
+logs as text. */
+class TrajectoryLog {
+public:
+  /** The state of one model at one update */
+  class Record {
+  public:
+    uint64_t tick; ///< the world's update count
+    uint32_t model; ///< the model's id
+    uint32_t flags; ///< STALLED or 0
+    double pose[4]; ///< global x, y, z and heading
+    double velocity[3]; ///< x, y and heading, for position models, otherwise 0
+  };
+
+  enum { STALLED = 1 };
 
+  static const char MAGIC[8];
+  static const uint32_t FORMAT_VERSION = 1;
+
+  TrajectoryLog();
+  ~TrajectoryLog();
+
+  /** Create the file, write the header for the models of world and
+  start the writer thread, with a ring of ring_size records. Returns
+  false on failure. */
+  bool Open(const std::string &filename, const World &world, size_t ring_size);
+
+  /** Write the records still in the ring and close the file */
+  void Close();
+
+  bool IsOpen() const { return fp != NULL; }
+
+  /** Append records to the ring, waiting for the writer if it is
+  full. Thread safe, but the world logs its models in one batch from
+  the main thread, so only controllers that log for themselves
+  contend. */
+  void Write(const Record *records, size_t count);
+
+  /** Returns the number of records written to the file so far */
+  uint64_t Written() const { return written; }
+
+private:
+  /** Records waiting to be written. head and tail only increase; the
+  records are at their values modulo the size. */
+  class Ring {
+  public:
+    std::vector<Record> records;
+    volatile size_t head; ///< the next record to fill, advanced under append_mutex
+    volatile size_t tail; ///< the next record to write, advanced by the writer
+
+    Ring() : records(), head(0), tail(0) {}
+  };
+
+  FILE *fp;
+  std::string filename;
+  Ring ring;
+  uint64_t written;
+
+  pthread_t writer;
+  pthread_mutex_t append_mutex; ///< serializes the threads calling Write()
+  pthread_mutex_t mutex;
+  pthread_cond_t wake; ///< signalled when the ring is half full, or to stop
+  pthread_cond_t drained; ///< signalled by the writer after each Drain()
+  bool running;
+
+  static void *writer_entry(void *log);
+
+  /** Write every record waiting in the ring */
+  void Drain();
+};
+
+/** The records of a trajectory log read back into memory, for posing
+the models of a world as they were logged instead of simulating
+them. Models are matched to the log by name. */
+class TrajectoryReplay {
 public:
-  LogEntry(usec_t timestamp, Model *mod);
+  TrajectoryReplay();
+
+  /** Read a log written by TrajectoryLog. Returns false on failure. */
+  bool Read(const std::string &filename);
+
+  bool IsLoaded() const { return loaded; }
+
+  /** Match the logged models to the models of world by name */
+  void Bind(const World &world);
+
+  /** Forget the models matched by Bind(), before they are deleted */
+  void Unbind();
+
+  /** Pose the models recorded at update tick */
+  void Apply(uint64_t tick) const;
 
-  /** A log of all LogEntries ever created */
-  static std::vector<LogEntry> log;
+  /** Pose each model as it was last recorded at or before update
+  tick, for jumping to any point in the log */
+  void Seek(uint64_t tick) const;
 
-  /** Returns the number of logged entries */
-  static size_t Count() { return log.size(); }
-  /** Clear the log */
-  static void Clear() { log.clear(); }
-  /** Print the log on stdout */
-  static void Print();
+  /** Returns the update count of the last record */
+  uint64_t LastTick() const { return records.empty() ? 0 : records.back().tick; }
+
+  /** Returns the update interval of the logged world */
+  usec_t GetInterval() const { return interval; }
+
+private:
+  bool loaded;
+  usec_t interval;
+  std::map<uint32_t, std::string> names; ///< logged model names by id
+  std::vector<TrajectoryLog::Record> records; ///< in order of tick
+  std::vector<Model *> bound; ///< the world's models by logged id, or NULL
+  std::vector<ModelPosition *> positions; ///< the bound models that are position models
+
+  /** Pose the model of a record, if it is bound */
+  void Replay(const TrajectoryLog::Record &record) const;
+};
+
+/** Publishes the poses and ranges of the position models of a world
+after each update to another process through POSIX shared memory,
+and sets their velocities from the commands it writes there, without
+serializing either. Frames are written to a ring, each versioned like
+a seqlock, so that readers never wait for the world. In lockstep, the
+world makes an update only when the other process allows it. The
+layout, and the C library for the other side, are in stageshm.h. */
+class ShmBridge {
+public:
+  ShmBridge();
+  ~ShmBridge();
+
+  /** Create the segment called name, eg. "/stage", for the position
+  models of world, with a ring of frame_count frames, and publish
+  their current state. Returns false on failure. */
+  bool Open(const std::string &name, World *world, bool lockstep, unsigned int frame_count);
+
+  /** Tell the client the world has gone, and remove the segment */
+  void Close();
+
+  bool IsOpen() const { return segment != NULL; }
+
+  /** Before an update: in lockstep, wait briefly for the client to
+  allow it, returning false if it does not. Then apply its commands. */
+  bool BeginUpdate();
+
+  /** After an update: publish the models' state as of update tick,
+  and in lockstep tell the client */
+  void EndUpdate(uint64_t tick, usec_t sim_time);
+
+private:
+  std::string name;
+  void *segment; ///< the mapped stg_shm_header_t and what follows it
+  size_t size;
+  std::vector<ModelPosition *> robots; ///< in order of name
+  std::vector<ModelRanger *> rangers; ///< grouped by the robot carrying them
+  std::vector<uint32_t> applied; ///< the sequence of each robot's last command
+
+  /** Write the next frame of the ring */
+  void WriteFrame(uint64_t tick, usec_t sim_time);
+};
+
+/** Where the power packs of a world dissipated their energy, summed
+in square cells for each model that owns a pack. Cells are grouped
+into tiles of TILE_SIZE cells on a side, which are allocated only where
+a model has dissipated energy, so models that stay in a small part of
+a large world use little memory. A World makes one only when the
+energy dissipation visualizer is shown or dissipation_file is set.
+
+Save() writes MAGIC, then as native uint32_t FORMAT_VERSION, the
+TILE_SIZE and the number of models, then the double cell size. Each
+model follows as its uint32_t id, the uint32_t length of its name and
+the name. Then come the uint64_t number of tiles and the tiles, each
+the uint32_t id of its model, the int32_t x and y of its first cell,
+in cells from the origin, and its TILE_SIZE * TILE_SIZE joules as
+doubles, row by row. */
+class DissipationMap {
+public:
+  enum { TILE_BITS = 4, TILE_SIZE = 1 << TILE_BITS };
+
+  static const char MAGIC[8];
+  static const uint32_t FORMAT_VERSION = 1;
+
+  explicit DissipationMap(meters_t cellsize);
+
+  /** Add amount to the cell of model id at global x,y */
+  void Accumulate(uint32_t id, meters_t x, meters_t y, joules_t amount);
+
+  /** Append the x and y, in cells, and the shade, from 0 to 1, of
+  each cell of model id that holds energy to cells. Cells with more
+  energy are drawn redder. */
+  void Capture(uint32_t id, std::vector<GLfloat> &cells) const;
+
+  /** Write the map and the names of the models of world to filename.
+  Returns false on failure. */
+  bool Save(const std::string &filename, const World &world) const;
+
+  meters_t CellSize() const { return cellsize; }
+
+  /** Returns the number of tiles allocated */
+  size_t TileCount() const { return tiles.size(); }
+
+  /** Returns the bytes used by the tiles */
+  size_t MemoryUsed() const { return tiles.size() * sizeof(Tile); }
+
+private:
+  class Key {
+  public:
+    uint32_t id;
+    int32_t x, y; ///< in tiles
+
+    Key(uint32_t id, int32_t x, int32_t y) : id(id), x(x), y(y) {}
+
+    bool operator<(const Key &other) const
+    {
+      return id != other.id ? id < other.id : (y != other.y ? y < other.y : x < other.x);
+    }
+
+    bool operator!=(const Key &other) const
+    {
+      return id != other.id || x != other.x || y != other.y;
+    }
+  };
+
+  class Tile {
+  public:
+    joules_t cells[TILE_SIZE * TILE_SIZE];
+
+    Tile() { memset(cells, 0, sizeof(cells)); }
+  };
+
+  /** The tiles of each model, in order of model id so that the tiles
+  of a model are together */
+  std::map<Key, Tile> tiles;
+
+  meters_t cellsize;
+  joules_t peak; ///< the most energy in any cell
+
+  /** The tile of the last Accumulate(), as a model usually dissipates
+  near where it did last time */
+  Key last_key;
+  Tile *last_tile;
 };
 
 class CtrlArgs {
@@ -758,16 +1117,170 @@ public:
   CtrlArgs(std::string w, std::string c) : worldfile(w), cmdline(c) {}
 };
 
-class ModelPosition;
+/** Profiling counters of a World, accumulated since it was created
+or World::ResetStats() was called. Times are wall-clock seconds. See
+World::GetStats(). */
+class WorldStats {
+public:
+  /** Work done for the models of one type */
+  class ModelType {
+  public:
+    uint64_t events; ///< events handled, which are mostly updates
+    double time; ///< time spent handling them
+
+    ModelType() : events(0), time(0) {}
+  };
+
+  uint64_t updates; ///< time steps simulated
+  double update_time; ///< in World::Update(), including the phases below
+  double replay_time; ///< posing models from a trajectory log
+  double bvh_time; ///< bringing the exact raytracing edges up to date
+  double queue_time; ///< handling the main thread's events
+  double move_time; ///< moving the position models
+  double wait_time; ///< waiting for the worker threads after moving
+  double callback_time; ///< in update callbacks
+  double charge_time; ///< charging and discharging power packs
+  double evict_time; ///< evicting idle superregions
+  double log_time; ///< recording trajectories
+  double bridge_time; ///< publishing to shared memory
+  uint64_t rays; ///< rays traced
+  uint64_t cells; ///< grid cells that rays visited
+  uint64_t remaps; ///< blocks rendered into the grid
+
+  /** events handled by all threads, indexed by model type */
+  std::map<std::string, ModelType> types;
+
+  WorldStats();
+
+  /** Print a human-readable report */
+  void Print(FILE *out) const;
+};
+
+/** A random number generator built on erand48(), with the spare
+sample of the gaussian noise, which is generated in pairs. Each world
+and each model has its own, so that models updated in parallel draw
+the same numbers however the threads are scheduled, and snapshots
+record them. Not thread safe. */
+class RandomGenerator {
+public:
+  unsigned short state[3]; ///< for erand48()
+  bool have_spare; ///< iff true, rand1 and rand2 hold the second gaussian sample
+  double rand1, rand2;
+
+  RandomGenerator() : have_spare(false), rand1(0), rand2(0) { Seed(0); }
+  /** Restart the sequence from seed, as srand48() does */
+  void Seed(long seed);
+  /** Returns a random number in [0.0, 1.0) */
+  double Uniform() { return erand48(state); }
+  /** Returns gaussian noise with the given variance */
+  double Gaussian(double variance);
+};
+
+/** A binary record of the dynamic state of a World: the simulation
+time, the state of every model, the pending events and the random
+number generators. Written by World::SaveSnapshot() and restored into
+the same world, or another loaded from the same worldfile, by
+World::RestoreSnapshot(). The encoding is native, so snapshots are
+only portable between builds of Stage for the same platform. */
+class Snapshot {
+public:
+  std::string data; ///< the encoded state
+  size_t pos; ///< where the next Get*() reads from data
+  bool ok; ///< false once a Get*() has run past the end of data
+
+  Snapshot() : data(), pos(0), ok(true) {}
+  /** Append a value of a type without pointers or virtual methods */
+  template <class T> void Put(const T &val)
+  {
+    data.append(reinterpret_cast<const char *>(&val), sizeof(T));
+  }
+
+  /** Read a value written by Put(). Returns false, leaving the value
+  unchanged, if there is not enough data. */
+  template <class T> bool Get(T &val)
+  {
+    if (!ok || pos + sizeof(T) > data.size())
+      return (ok = false);
+
+    memcpy(&val, data.data() + pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+  }
+
+  /** Move past a number of bytes without reading them. Returns false
+  if there are not enough. */
+  bool Skip(size_t bytes)
+  {
+    if (!ok || pos + bytes > data.size())
+      return (ok = false);
+
+    pos += bytes;
+    return true;
+  }
+
+  /** Move past a value written by Put() of the same type as val */
+  template <class T> bool Skip(const T &) { return Skip(sizeof(T)); }
+
+  void PutString(const std::string &str);
+  bool GetString(std::string &str);
+  bool SkipString();
+
+  /** Poses and velocities are plain values, so they are written whole */
+  void PutPose(const Pose &pose) { Put(pose); }
+  bool GetPose(Pose &pose) { return Get(pose); }
+  bool SkipPose() { return Skip(sizeof(Pose)); }
+
+  /** Write the data to a file. Returns false on failure. */
+  bool Write(const std::string &filename) const;
+  /** Replace the data with the contents of a file. Returns false on failure. */
+  bool Read(const std::string &filename);
+};
+
+/** The memory used by the parts of a World, in bytes and numbers of
+objects. Containers count their capacity but not the allocator's
+overhead, and models count only the Model base class, so the totals
+are lower bounds. See World::MemoryReport(). */
+class WorldMemory {
+public:
+  /** The memory used by objects of one kind */
+  class Category {
+  public:
+    uint64_t count; ///< objects
+    uint64_t bytes; ///< bytes used by them
+
+    Category() : count(0), bytes(0) {}
+  };
+
+  /** The categories in the order they were first added. A deque, so
+  that adding one leaves references to the others valid. */
+  std::deque<std::pair<std::string, Category> > categories;
+
+  WorldMemory() : categories() {}
+
+  /** Returns the named category, adding it if it is new */
+  Category &operator[](const std::string &name);
+
+  /** Returns the bytes used by all the categories */
+  uint64_t TotalBytes() const;
+
+  /** Print a human-readable report */
+  void Print(FILE *out) const;
+};
 
 /// %World class
 class World : public Ancestor {
 public:
   friend class Block;
+  friend class BlockGroup;
   friend class Model; // allow access to private members
   friend class ModelFiducial;
+  friend class ModelBlobfinder;
   friend class Canvas;
+  friend class WorldGui;
+  friend class SuperRegion;
   friend class WorkerThread;
+  friend class TrajectoryLog;
+  friend class PowerPack;
 
 public:
   /** contains the command line arguments passed to Stg::Init(), so
@@ -822,9 +1335,50 @@ quickly finding nearby fidcucials */
 
   /** Remove a model from the set of models with non-zero fiducials, if it exists. */
   void FiducialErase(Model *mod) { EraseAll(mod, models_with_fiducials); }
+
+  /** The models with blob_return set, by color, for blobfinders that
+find blobs analytically. Rebuilt by UpdateBlobModels() when dirty, in
+the main thread before the sensors update. */
+  std::map<uint32_t, std::vector<Model *> > blob_models;
+  bool blob_models_dirty; ///< a model came, went or changed color or blob_return
+
+  /** Rebuild blob_models if it is dirty. Not thread safe. */
+  void UpdateBlobModels();
+
+  /** Returns the models with blob_return set and about color col. The
+caller checks the color exactly. Safe to call from the worker threads,
+as it only reads blob_models. */
+  const std::vector<Model *> &BlobModels(const Color &col) const;
   /// Defines what all World::Load(*) methods have in common. Called after initial setup.
   void LoadWorldPostHook();
 
+  /** The polygons of a bitmap decoded by DecodeBitmaps() */
+  class DecodedBitmap {
+  public:
+    std::vector<std::vector<point_t> > polys;
+    unsigned int users; ///< the models yet to load the bitmap; the last takes polys
+
+    DecodedBitmap() : polys(), users(0) {}
+  };
+
+  /** The bitmaps referenced by the worldfile, decoded in parallel by
+DecodeBitmaps() before the models are created and indexed by full
+path. Emptied once loading is complete. */
+  std::map<std::string, DecodedBitmap> bitmap_polys;
+
+  /** Decode and polygonize every bitmap named in the worldfile,
+using up to worker_threads threads, and store the results in
+bitmap_polys. PNG and JPEG images are decoded in parallel; other
+formats go through FLTK's image cache one at a time, and only their
+polygonization is parallel. Model creation remains serial. */
+  void DecodeBitmaps();
+
+  static void *decode_bitmap_thread_entry(void *job);
+
+  /** The world this one is being cloned from, while Clone() loads
+it, otherwise NULL. */
+  const World *clone_source;
+
   double ppm; ///< the resolution of the world model in pixels per meter
   bool quit; ///< quit this world ASAP
   bool show_clock; ///< iff true, print the sim time on stdout
@@ -835,18 +1389,204 @@ quickly finding nearby fidcucials */
   unsigned int threads_working; ///< the number of worker threads not yet finished
   pthread_cond_t threads_start_cond; ///< signalled to unblock worker threads
   pthread_cond_t threads_done_cond; ///< signalled by last worker thread to unblock main thread
+  bool threads_exit; ///< iff true, the worker threads return instead of waiting for work
+  std::vector<pthread_t> worker_ids; ///< the worker threads, joined when the world is destroyed
   int total_subs; ///< the total number of subscriptions to all models
   unsigned int worker_threads; ///< the number of worker threads to use
 
+  //--- random numbers ----
+  /** This world's random number generator. Each world has its own, so
+that worlds stepped on separate threads do not share a sequence, and
+snapshots record it. The models draw from their own instead. */
+  mutable RandomGenerator random;
+  mutable pthread_mutex_t random_mutex; ///< protects random
+  long random_seed; ///< the seed last given to SeedRandom(), which seeds the models
+
+  //--- superregion streaming ----
+  /** If non-zero, idle superregions holding only static blocks are
+evicted to keep the grid's memory use near this many bytes. */
+  size_t grid_memory;
+  /** Simulated time that a superregion must go unused before it can be evicted */
+  usec_t grid_idle;
+  unsigned long grid_regions; ///< the number of regions with cell storage
+  pthread_mutex_t grid_mutex; ///< protects evicted superregions
+
+  /** Returns true iff the model can never move by itself, i.e. it is
+not a position model or attached to one. */
+  static bool IsStatic(const Model *mod);
+
+  /** Evict idle superregions, least recently used first, until the
+grid fits in grid_memory. Called between updates. */
+  void EvictSuperRegions();
+
+  /** Replace the cells of the superregion with a compact list of the
+blocks rendered into them. Returns false, doing nothing, if the
+superregion contains any non-static blocks. */
+  bool EvictSuperRegion(SuperRegion *sr);
+
+  /** Recreate the cells of an evicted superregion from its compact list */
+  void RestoreSuperRegion(SuperRegion *sr);
+
+  /** Remove a block's entries at the indicated layer from all evicted superregions */
+  void PurgeEvicted(Block *block, unsigned int layer);
+
+  //--- grid dimensions ----
+  uint32_t region_bits; ///< regions contain (2^region_bits)^2 cells
+  uint32_t superregion_bits; ///< superregions contain (2^superregion_bits)^2 regions
+
+  /** Raytrace() compiled for the grid dimensions. See SetGridBits(). */
+  RaytraceResult (World::*raytrace_grid)(const Ray &ray);
+  /** MapPoly() compiled for the grid dimensions. See SetGridBits(). */
+  void (World::*map_poly_grid)(const std::vector<point_int_t> &poly, Block *block,
+                               unsigned int layer);
+
+  template <uint32_t RBITS, uint32_t SBITS> RaytraceResult RaytraceGrid(const Ray &ray);
+  template <uint32_t RBITS, uint32_t SBITS>
+  void MapPolyGrid(const std::vector<point_int_t> &poly, Block *block, unsigned int layer);
+
+  //--- exact raytracing ----
+  bool exact_raytrace; ///< iff true, rays are exact unless a sensor says otherwise
+  bool exact_enabled; ///< iff true, the edge hierarchies are kept up to date
+  bool bvh_dirty; ///< the static edges or the set of blocks have changed
+  Bvh *bvh_static; ///< edges of blocks that can only be moved from outside
+  Bvh *bvh_dynamic; ///< edges of blocks that can move by themselves, refit every update
+  std::vector<Block *> bvh_blocks; ///< the blocks in bvh_dynamic, in order
+
+  /** Bring the edge hierarchies up to date with the blocks mapped in
+the layer rays read during this update. Called at the start of each
+update. */
+  void UpdateBvh();
+
+  /** Append the global edges of the block's polygon to edges. Blocks
+that are not mapped in layer get edges that are ignored. */
+  void AppendEdges(Block *block, unsigned int layer, std::vector<BvhEdge> &edges) const;
+
+  /** Select the grid dimensions, which must be done before anything
+is mapped. Returns false, leaving the dimensions unchanged, if there
+is no compiled version of the raytracer for them. */
+  bool SetGridBits(uint32_t rbits, uint32_t sbits);
+
+  //--- profiling ----
+  /** A traced interval of wall-clock time */
+  class TraceSpan {
+  public:
+    const char *name; ///< the phase, or NULL for an event of a model
+    uint32_t model; ///< the id of the model if name is NULL
+    double start; ///< seconds
+    double end; ///< seconds
+  };
+
+  /** Counters and spans that only one thread writes, so they need no locking */
+  class StatsSlot {
+  public:
+    uint64_t rays;
+    uint64_t cells;
+    std::vector<WorldStats::ModelType> types; ///< indexed by Model::type_index
+    std::vector<TraceSpan> trace; ///< a ring of the latest spans, empty unless tracing
+    uint64_t trace_count; ///< the number of spans ever put in the ring
+    char pad[64]; ///< keeps the threads' counters in separate cache lines
+
+    StatsSlot() : rays(0), cells(0), types(), trace(), trace_count(0) {}
+  };
+
+  /** Counters for each event queue, indexed by queue number. Rays are
+counted in the slot of the queue of the model that traces them. */
+  std::vector<StatsSlot> stats_slots;
+  /** The phase times and remaps. Only the main thread writes the
+times, and remaps are added atomically. */
+  WorldStats stats;
+
+  /** The callbacks of events that can be recorded in snapshots,
+identified by their index */
+  static std::vector<model_callback_t> event_callbacks;
+
+  /** The names of the model types, indexed by Model::type_index */
+  static std::vector<std::string> type_names;
+  static pthread_mutex_t type_names_mutex;
+
+  /** Returns the index of the model type, adding it if it is new */
+  static unsigned int TypeIndex(const std::string &type);
+
+  /** Returns the counters of the thread the model's events are handled in */
+  StatsSlot &SlotFor(const Model *mod);
+
+  /** Updates between memory reports on stdout, or 0 for none */
+  uint64_t memory_report_interval;
+
+  TrajectoryLog trajectory_log;
+  std::vector<Model *> logged_models; ///< models with a log interval
+  usec_t log_interval; ///< the default log interval of position models
+
+  DissipationMap *dissipation; ///< NULL until something needs one
+  meters_t dissipation_cellsize;
+  std::string dissipation_file; ///< written when the world quits, if set
+
+  /** Save the dissipation map to dissipation_file, once */
+  void WriteDissipation();
+
+  std::vector<TrajectoryLog::Record> log_records; ///< reused by LogModels()
+
+  /** Fill in the record of a model's state at this update */
+  void LogRecord(Model *mod, TrajectoryLog::Record &record) const;
+
+  /** Log the models whose log interval has come round */
+  void LogModels();
+
+  ShmBridge shm_bridge;
+
+  TrajectoryReplay replay;
+  bool replay_sensors; ///< iff true, sensors are updated during a replay
+
+  /** Match the replay to the loaded models, and subscribe to the
+  sensors it updates */
+  void BindReplay();
+
+  bool tracing; ///< iff true, spans are put in the rings of stats_slots
+  std::string trace_file; ///< where WriteTrace() writes the spans
+  double trace_start; ///< the time tracing started, which is zero in the trace
+
+  /** Put a span in the ring of the slot. Call only from the slot's thread. */
+  void Trace(unsigned int slot, const char *name, uint32_t model, double start, double end)
+  {
+    StatsSlot &s(stats_slots[slot]);
+    if (s.trace.empty()) // created since tracing started
+      return;
+    TraceSpan &span(s.trace[s.trace_count++ % s.trace.size()]);
+    span.name = name;
+    span.model = model;
+    span.start = start;
+    span.end = end;
+  }
+
+  /** Add the time since then to the phase's total, and trace the
+phase. Returns the time now, which is the start of the next phase. */
+  double EndPhase(const char *name, double &total, double then);
+
+public:
+  /** The energy of all the power packs in this world, kept up to date
+by the packs */
+  class Energy {
+  public:
+    joules_t stored; ///< stored in all the packs
+    joules_t capacity; ///< the capacity of all the packs
+    joules_t dissipated; ///< dissipated by all the packs
+    joules_t input; ///< drawn from packs with an infinite supply
+
+    Energy() : stored(0.0), capacity(0.0), dissipated(0.0), input(0.0) {}
+  };
+
 protected:
   std::list<std::pair<world_callback_t, void *> >
       cb_list; ///< List of callback functions and arguments
+  std::list<std::pair<world_batch_callback_t, void *> >
+      batch_cb_list; ///< List of batch callback functions and arguments
   bounds3d_t extent; ///< Describes the 3D volume of the world
   bool graphics; ///< true iff we have a GUI
 
   std::set<Option *> option_table; ///< GUI options (toggles) registered by models
   std::list<PowerPack *>
       powerpack_list; ///< List of all the powerpacks attached to models in the world
+  Energy energy; ///< the totals of powerpack_list
   /** World::quit is set true when this simulation time is reached */
   usec_t quit_time;
   std::list<float *> ray_list; ///< List of rays traced for debug visualization
@@ -883,9 +1623,59 @@ the end of a complete update step */
 AddUpdateCallback is not automatically freed. */
   int RemoveUpdateCallback(world_callback_t cb, void *user);
 
-  /** Log the state of a Model */
+  /** Attach a callback function, to be called at the end of a
+complete update step with every model that updated in it, so that a
+controller of many models can handle them in one pass. It is called
+after the models' CB_UPDATE callbacks, and is removed if it returns
+true. */
+  void AddBatchUpdateCallback(world_batch_callback_t cb, void *user);
+
+  /** Remove a batch callback function. Returns the number left. */
+  int RemoveBatchUpdateCallback(world_batch_callback_t cb, void *user);
+
+  /** Record the state of a model in the trajectory log, if it is
+open. Models with a log interval are recorded automatically. */
   void Log(Model *mod);
 
+  /** Log the trajectories of the models with a log interval to
+filename, with a ring of ring_size records for each thread. Call
+between updates. Returns false on failure. */
+  bool StartLog(const std::string &filename, size_t ring_size = 1 << 15);
+
+  /** Write the rest of the trajectory log and close it */
+  void StopLog() { trajectory_log.Close(); }
+
+  /** Write the trace and the dissipation map, if they were asked
+for, and close the trajectory log and the shared memory bridge. Done
+when the world quits, but a world closed or stopped first never quits,
+so call it for each world after Run(). Later calls do nothing. */
+  void Finish();
+
+  /** Pose the models as recorded in the trajectory log in filename
+at each update instead of simulating them: controllers are not run and
+nothing is moved, so the log plays as fast as it can be drawn. If
+sensors is true, rangers and fiducials are subscribed and update at
+the recorded poses, and the controllers run on what they sense, but
+their commands move nothing. Call before Load(), so that the
+controllers are started, or not, to match. The world stops at the end of the log. Returns false on
+failure. */
+  bool StartReplay(const std::string &filename, bool sensors);
+
+  /** Publish the position models to the POSIX shared memory called
+name after each update, and read their velocity commands from it. In
+lockstep, updates wait for the client. Call between updates. Returns
+false on failure. See ShmBridge. */
+  bool StartBridge(const std::string &name, bool lockstep, unsigned int frame_count = 4);
+
+  /** Close the shared memory, telling any client the world has gone */
+  void StopBridge() { shm_bridge.Close(); }
+
+  /** Returns true iff the world is replaying a trajectory log */
+  bool Replaying() const { return replay.IsLoaded(); }
+
+  /** Jump a replay to update tick */
+  void SeekReplay(uint64_t tick);
+
   /** hint that the world needs to be redrawn if a GUI is attached */
   void NeedRedraw() { dirty = true; }
   /** Special model for the floor of the world */
@@ -905,7 +1695,10 @@ time. */
   virtual Model *RecentlySelectedModel() const { return NULL; }
   /** Add the block to every raytrace bitmap cell that intersects
 the edges of the polygon.*/
-  void MapPoly(const std::vector<point_int_t> &poly, Block *block, unsigned int layer);
+  void MapPoly(const std::vector<point_int_t> &poly, Block *block, unsigned int layer)
+  {
+    (this->*map_poly_grid)(poly, block, layer);
+  }
 
   SuperRegion *AddSuperRegion(const point_int_t &coord);
   SuperRegion *GetSuperRegion(const point_int_t &org);
@@ -936,7 +1729,17 @@ grid pixels */
   void DestroySuperRegion(SuperRegion *sr);
 
   /** trace a ray. */
-  RaytraceResult Raytrace(const Ray &ray);
+  RaytraceResult Raytrace(const Ray &ray)
+  {
+    if (ray.exact && bvh_static)
+      return RaytraceExact(ray);
+    return (this->*raytrace_grid)(ray);
+  }
+
+  /** trace a ray against the edges of the block polygons, so that the
+  range is exact. Stage keeps the edges only after
+  EnableExactRaytrace() is called. */
+  RaytraceResult RaytraceExact(const Ray &ray);
 
   RaytraceResult Raytrace(const Pose &pose, const meters_t range, const ray_test_func_t func,
                           const Model *finder, const void *arg, const bool ztest);
@@ -988,8 +1791,16 @@ should quit */
   /** Queue of pending simulation events for the main thread to handle. */
   std::vector<std::priority_queue<Event> > event_queues;
 
-  /** Queue of pending simulation events for the main thread to handle. */
-  std::vector<std::queue<Model *> > pending_update_callbacks;
+  /** The models with CB_UPDATE callbacks that updated in this step,
+for each thread, to be called back in the main thread. */
+  std::vector<std::vector<Model *> > pending_update_callbacks;
+
+  /** Every model that updated in this step, for each thread, while
+there are batch callbacks */
+  std::vector<std::vector<Model *> > updated_models;
+
+  /** The models of updated_models in one list, reused each step */
+  std::vector<Model *> updated_batch;
 
   /** Create a new simulation event to be handled in the future.
 
@@ -1011,6 +1822,9 @@ called at the specified time.
   std::set<Model *> active_energy;
   void EnableEnergy(Model *m) { active_energy.insert(m); }
   void DisableEnergy(Model *m) { active_energy.erase(m); }
+  /** Models that give or take energy and have been mapped since their
+contacts were last found. */
+  std::vector<Model *> dirty_contacts;
   /** Set of models that require their positions to be recalculated at each World::Update(). */
   std::set<ModelPosition *> active_velocity;
 
@@ -1106,6 +1920,13 @@ QuitAll(). */
   /** Get the resolution in pixels-per-metre of the underlying
 discrete raytracing model */
   double Resolution() const { return ppm; }
+  /** Returns true iff rays are intersected with the block polygons
+rather than the grid, unless a sensor says otherwise. Set by the
+worldfile property raytrace. */
+  bool ExactRaytrace() const { return exact_raytrace; }
+  /** Keep the edges of the block polygons for rays with Ray::exact
+set. Called when loading models that trace such rays. */
+  void EnableExactRaytrace() { exact_enabled = true; }
   /** Returns a pointer to the model identified by name, or NULL if
 nonexistent */
   Model *GetModel(const std::string &name) const;
@@ -1116,6 +1937,93 @@ nonexistent */
   const bounds3d_t &GetExtent() const { return extent; }
   /** Return the number of times the world has been updated. */
   uint64_t GetUpdateCount() const { return updates; }
+  /** Returns the profiling counters accumulated since the world was
+created or ResetStats() was called, merged across threads. Call
+between updates. */
+  WorldStats GetStats() const;
+  /** Zero the profiling counters. Call between updates. */
+  void ResetStats();
+
+  /** Record the dynamic state of the world in snap, replacing its
+contents. Call between updates. */
+  void SaveSnapshot(Snapshot &snap) const;
+
+  /** Return the world to the state recorded in snap. The models are
+matched by name and must have the same types as when the snapshot was
+taken, so the world must have been loaded from the same worldfile;
+models created since are left alone. Only models whose pose or parent
+changed are remapped. Returns false, changing nothing, if the snapshot
+does not match the world. Call between updates. */
+  bool RestoreSnapshot(Snapshot &snap);
+
+  /** Write a snapshot of the world to a file. Returns false on failure. */
+  bool SaveSnapshot(const std::string &filename) const;
+  /** Restore a snapshot from a file. Returns false on failure. */
+  bool RestoreSnapshot(const std::string &filename);
+
+  /** Allow events with this callback and a NULL argument to be
+recorded in snapshots. Model updates are always allowed; other events
+are dropped with a warning. */
+  static void RegisterEventCallback(model_callback_t cb);
+
+  /** Create an independent, headless copy of this world in its
+current state, for example to try several different commands from the
+same starting point. The clone copies the parsed worldfile instead of
+reading it again, shares the geometry of every model's blocks with
+this world until either changes it, and does not decode bitmaps. It
+then creates its own models and grid, and restores a snapshot of this
+world into them; see SaveSnapshot() for what that covers. Controllers
+are initialised afresh in the clone. Clones can be updated on
+separate threads. The clone continues this world's random number
+sequence; see SeedRandom() to give it another. Create and delete worlds
+from one thread. Call between updates. Returns NULL on failure. */
+  World *Clone() const;
+
+  /** Returns a random number in [0.0, 1.0) from this world's
+generator. Thread safe, but which thread draws which number depends on
+scheduling, so models updated in parallel should use
+Model::Random(). */
+  double Random() const;
+  /** Returns gaussian noise with the given variance from this world's
+generator. Thread safe. */
+  double RandomGaussian(double variance) const;
+  /** Restart this world's random number sequence from seed, and
+each model's from seed and the model's name. Worlds are seeded from
+drand48(), which Stg::Init() seeds with the time. Also drops any
+gaussian noise kept by RandomGaussian(). */
+  void SeedRandom(long seed);
+
+  const Energy &GetEnergy() const { return energy; }
+
+  /** Walk the grid, the blocks and the models and return the memory
+used by each kind of object in them. Call between updates. */
+  WorldMemory MemoryReport() const;
+
+  /** Record the latest spans of time spent in each update, in each
+phase of the updates, in each thread's share of the events and in
+each model's events, keeping up to spans of them per thread. They are
+written to filename by WriteTrace(), which happens when the world
+quits or is destroyed. Call between updates. */
+  void StartTrace(const std::string &filename, size_t spans = 1 << 18);
+
+  /** Stop tracing and write the spans recorded so far as Chrome
+trace-event JSON, which chrome://tracing and Perfetto can load. Returns
+false if the file could not be written. */
+  bool WriteTrace();
+
+  /** Returns the map of where the power packs dissipated energy, or
+NULL if neither the GUI nor the worldfile has asked for one */
+  DissipationMap *GetDissipation() const { return dissipation; }
+
+  /** Returns the map of where the power packs dissipate energy,
+making an empty one if there is none. Dissipation is recorded only
+from then on. */
+  DissipationMap *EnableDissipation();
+
+  /** Write the dissipation map to filename in the format described
+at DissipationMap. Returns false if there is no map or it could not
+be written. */
+  bool SaveDissipation(const std::string &filename) const;
   /// Register an Option for pickup by the GUI
   void RegisterOption(Option *opt);
 
@@ -1134,13 +2042,10 @@ class Block {
   friend class Cell;
 
 public:
-  /** Block Constructor. A model's body is a list of these
-blocks. The point data is copied, so pts can safely be freed
-after constructing the block.*/
-  Block(BlockGroup *group, const std::vector<point_t> &pts, const Bounds &zrange);
-
-  /** A from-file  constructor */
-  Block(BlockGroup *group, Worldfile *wf, int entity);
+  /** Block Constructor. A block is a view of the polygon with the
+same index in its group's BlockShape, so blocks are created by
+BlockGroup::AppendBlock() rather than directly.*/
+  Block(BlockGroup *group, unsigned int index);
 
   ~Block();
 
@@ -1179,18 +2084,29 @@ after constructing the block.*/
 
   void AppendTouchingModels(std::set<Model *> &touchers);
 
+  /** Append the models that share a cell with this block in layer,
+and that it can exchange energy with, unless they are listed already. */
+  void AppendContacts(unsigned int layer, std::vector<Model *> &contacts);
+
   /** Returns the first model that shares a bitmap cell with this model */
   Model *TestCollision();
 
+  /** Replace this block's polygon and z extent with those described
+by a worldfile entry. */
   void Load(Worldfile *wf, int entity);
 
   void Rasterize(uint8_t *data, unsigned int width, unsigned int height, meters_t cellwidth,
                  meters_t cellheight);
 
+  /** Return the points defining the block's polygon, in local coords. */
+  inline const std::vector<point_t> &Points() const;
+
+  /** Return the z extent of the block in local coords. */
+  inline const Bounds &LocalZ() const;
+
   BlockGroup *group; ///< The BlockGroup to which this Block belongs.
 private:
-  std::vector<point_t> pts; ///< points defining a polygon.
-  Bounds local_z; ///<  z extent in local coords.
+  unsigned int index; ///< index of this block's polygon in the group's shape
   Bounds global_z; ///< z extent in global coordinates.
 
   /** record the cells into which this block has been rendered so we
@@ -1198,10 +2114,40 @@ can remove them very quickly. One vector for each of the two
 bitmap layers.*/
   std::vector<Cell *> rendered_cells[2];
 
+  /** The evicted superregions that record cells holding this block. */
+  std::vector<SuperRegion *> evicted_in;
+
   void DrawTop();
   void DrawSides();
 };
 
+/** The geometry of a BlockGroup: the polygon and z extent of each of
+its blocks, plus a display list that draws them without color or
+pose. Models loaded from the same worldfile definition usually have
+identical shapes, so a shape is reference counted and shared by every
+BlockGroup that uses it. Shared shapes are never modified; a
+BlockGroup takes a private copy before changing its geometry. */
+class BlockShape {
+public:
+  std::vector<std::vector<point_t> > pts; ///< one polygon per block, in local coords
+  std::vector<Bounds> z; ///< z extent of each block in local coords
+  Size fitted_size; ///< model size the points were last scaled to
+  bool fitted; ///< iff true, the points are already scaled to fitted_size
+  int displaylist; ///< OpenGL display list that renders the shape, 0 until needed
+  bool rebuild; ///< iff true, regenerate displaylist before it is next used
+  unsigned int refcount; ///< the number of BlockGroups using this shape
+  std::string key; ///< key in the shape cache, empty if not cached
+
+  BlockShape()
+      : pts(), z(), fitted_size(), fitted(false), displaylist(0), rebuild(true), refcount(1),
+        key()
+  {
+  }
+
+  /** Returns true iff the other shape has exactly the same geometry */
+  bool SameGeometry(const BlockShape &other) const;
+};
+
 class BlockGroup {
   friend class Model;
   friend class Block;
@@ -1210,18 +2156,35 @@ class BlockGroup {
 
 private:
   std::vector<Block> blocks; ///< Contains the blocks in this group.
+  BlockShape *shape; ///< The geometry of the blocks, possibly shared with other groups.
   int displaylist; ///< OpenGL displaylist that renders this blockgroup.
 
 public:
   Model &mod;
 
 private:
-  void AppendBlock(const Block &block);
+  /** Add a new block to the group, with a copy of the points */
+  void AppendBlock(const std::vector<point_t> &pts, const Bounds &zrange);
 
   void CalcSize();
   void Clear(); /** deletes all blocks from the group */
 
+  /** Return our shape for modification, first taking a private copy
+if it is shared with other groups. */
+  BlockShape &MutableShape();
+
+  /** Switch to an identical shape from the shape cache if there is
+one, so that models with the same geometry share a single copy of
+it, otherwise offer our shape to the cache. Called once the world
+has finished loading. */
+  void Share();
+
+  /** Use the same shape as another group, replacing our blocks with
+one for each of its polygons. Used to clone worlds. */
+  void ShareShape(const BlockGroup &other);
+
   void AppendTouchingModels(std::set<Model *> &touchers);
+  void AppendContacts(unsigned int layer, std::vector<Model *> &contacts);
 
   /** Returns a pointer to the first model detected to be colliding
 with a block in this group, or NULL, if none are detected. */
@@ -1236,6 +2199,10 @@ with a block in this group, or NULL, if none are detected. */
 as blocks to this group.*/
   void LoadBitmap(const std::string &bitmapfile, Worldfile *wf);
 
+  /** Return the full path of a bitmap named in a worldfile, which
+is relative to the worldfile's directory unless it is absolute. */
+  static std::string BitmapPath(const std::string &bitmapfile, Worldfile *wf);
+
   /** Add a new block decribed by a worldfile entry. */
   void LoadBlock(Worldfile *wf, int entity);
 
@@ -1266,8 +2233,45 @@ public:
 
   /** Draw the projection of the block group onto the z=0 plane. */
   void DrawFootPrint(const Geom &geom);
+
+  /** Append the projection of the block group onto the z=0 plane,
+      placed at pose, to batch as fans of triangles */
+  void AppendFootPrint(Gl::VertexBatch &batch, const Pose &pose) const;
+
+  /** Take a reference to a shape, so that it is not changed or
+deleted until it is passed to Release(). */
+  static void Reference(BlockShape *shape);
+
+  /** Drop a reference to a shape, deleting it when it is no longer used. */
+  static void Release(BlockShape *shape);
+
+  /** Draw a shape, filled in color and outlined in a darker one,
+offset by geom. Builds the shape's display list first if needed, so
+must not be called while compiling another one. */
+  static void DrawShape(BlockShape *shape, const Geom &geom, const Color &color);
+
+  /** Append the projection of a shape onto the z=0 plane, placed at
+pose, to batch as fans of triangles */
+  static void AppendFootPrint(const BlockShape *shape, Gl::VertexBatch &batch, const Pose &pose);
+
+  /** Draw the projection of a shape onto the z=0 plane */
+  static void DrawFootPrint(const BlockShape *shape);
+
+  /** Free the display lists of shapes and groups deleted since the
+last call. Must be called with the GL context current. */
+  static void DeleteFreedDisplayLists();
 };
 
+const std::vector<point_t> &Block::Points() const
+{
+  return group->shape->pts[index];
+}
+
+const Bounds &Block::LocalZ() const
+{
+  return group->shape->z[index];
+}
+
 class Camera {
 protected:
   double _pitch; // left-right (about y)
@@ -1352,6 +2356,9 @@ public:
   {
     return _z_near * _z_far / (_z_far - z_buf_val * (_z_far - _z_near));
   }
+  /** Convert count depth buffer values at z_buf to distances at out,
+      which may be z_buf */
+  void realDistance(const GLfloat *z_buf, GLfloat *out, size_t count) const;
   void scroll(double dy) { _z += dy; }
   double nearClip(void) const { return _z_near; }
   double farClip(void) const { return _z_far; }
@@ -1415,6 +2422,29 @@ public:
   void Save(Worldfile *wf, int sec);
 };
 
+/** The volume of the world a camera shows, taken from the OpenGL
+    matrices and viewport that it set up, so that it works the same
+    for orthographic and perspective cameras. */
+class Frustum {
+public:
+  Frustum();
+
+  /** Take the planes from the current projection and modelview
+      matrices and the viewport. Call after the camera has drawn. */
+  void Update();
+
+  /** Returns false if box is certainly out of view */
+  bool Sees(const bounds3d_t &box) const;
+
+  /** Returns roughly how many pixels across box is on screen */
+  double Pixels(const bounds3d_t &box) const;
+
+private:
+  double m[16]; ///< projection * modelview, in OpenGL's column-major order
+  double planes[6][4]; ///< a, b, c and d of ax + by + cz + d >= 0 inside each plane
+  double half_width, half_height; ///< of the viewport, in pixels
+};
+
 /** Extends World to implement an FLTK / OpenGL graphical user
       interface.
   */
@@ -1455,6 +2485,41 @@ updates. */
   /** Number of updates between measuring elapsed real time. */
   uint64_t timing_interval;
 
+  /** While World::Run() runs the GUI, the world is updated on this
+thread rather than from FLTK timeouts, so that the update rate no
+longer depends on the granularity of FLTK's timeouts, and a fast
+simulation does not starve the window. The thread never takes FLTK's
+lock: an update ends by publishing a snapshot of the world to the
+canvas, once the canvas has taken the last one, and the canvas draws
+only that, so a slow frame does not hold up the updates. FLTK's event
+handlers, and the few visualizations drawn from the world itself, take
+the world's lock instead. */
+  pthread_t sim_thread;
+  bool sim_thread_running; ///< true between StartSimThread() and StopSimThread()
+  bool sim_on_thread; ///< true if updates are made by sim_thread, not FLTK timeouts
+  bool sim_quit; ///< tells sim_thread to finish
+  bool sim_wake; ///< tells sim_thread to look at speedup and paused again
+  bool world_wanted; ///< tells sim_thread to let the GUI thread lock the world
+  pthread_mutex_t sim_mutex; ///< protects sim_quit, sim_wake and world_wanted
+  /** Signalled when sim_quit or sim_wake is set, or world_wanted cleared */
+  pthread_cond_t sim_cond;
+
+  /** Held while the world is updated, or changed or read by the GUI thread */
+  pthread_mutex_t world_mutex;
+  unsigned int world_locks; ///< LockWorld() calls not yet undone, by the GUI thread
+
+  static void *SimThread(void *wg);
+  void SimLoop();
+
+  /** Wait until woken, or until the real time until if not 0 */
+  void WaitSim(usec_t until);
+  void WakeSimThread();
+
+  /** Copy what the canvas draws of the world into a snapshot and
+publish it. Called at the end of an update if the canvas has taken the
+last snapshot, and after the GUI thread changes the world. */
+  void PublishSnapshot();
+
   // static callback functions
   static void windowCb(Fl_Widget *w, WorldGui *wg);
   static void fileLoadCb(Fl_Widget *w, WorldGui *wg);
@@ -1470,6 +2535,8 @@ updates. */
   static void slowerCb(Fl_Widget *w, WorldGui *wg);
   static void realtimeCb(Fl_Widget *w, WorldGui *wg);
   static void fasttimeCb(Fl_Widget *w, WorldGui *wg);
+  static void replayBackCb(Fl_Widget *w, WorldGui *wg);
+  static void replayForwardCb(Fl_Widget *w, WorldGui *wg);
   static void resetViewCb(Fl_Widget *w, WorldGui *wg);
   static void moreHelptCb(Fl_Widget *w, WorldGui *wg);
 
@@ -1481,6 +2548,9 @@ updates. */
 
   void SetTimeouts();
 
+  /** Jump a replay by seconds of simulated time, back if negative */
+  void JumpReplay(double seconds);
+
   /// Defines what all WorldGUI::Load(*) in methods have in common. Called after initial setup.
   void LoadWorldGuiPostHook(usec_t load_start_time);
 
@@ -1489,6 +2559,19 @@ protected:
   virtual void PushColor(double r, double g, double b, double a);
   virtual void PopColor();
 
+  /** Append the outlines of the superregions, regions and occupied
+      cells to batch, as GL_QUADS in metres. These and the voxels are
+      drawn by the canvas from its snapshot, replacing DrawOccupancy()
+      and DrawVoxels(). */
+  void CaptureOccupancy(Gl::VertexBatch &batch) const;
+
+  /** Append a box for each block in each occupied cell to batch, as
+      GL_QUADS in metres */
+  void CaptureVoxels(Gl::VertexBatch &batch) const;
+
+  /** Deprecated: draw what CaptureOccupancy() and CaptureVoxels()
+      copy, straight from the world. The canvas no longer calls these.
+      The caller must hold the world's lock and the GL context. */
   void DrawOccupancy() const;
   void DrawVoxels() const;
 
@@ -1512,10 +2595,32 @@ public:
   virtual void Start();
   virtual void Stop();
 
-  usec_t RealTimeNow(void) const;
+  /** Make the updates on a thread of their own from now on. The
+calling thread must be the one that runs FLTK. Worlds with cameras
+are still updated from FLTK timeouts, as the cameras draw with the
+canvas's OpenGL context, which is only current in the GUI thread. */
+  void StartSimThread();
 
-  void DrawBoundingBoxTree();
+  /** Go back to making the updates from FLTK timeouts */
+  void StopSimThread();
 
+  usec_t RealTimeNow(void) const;
+
+  /** Keep the simulation thread from updating the world until
+UnlockWorld(). Only for the GUI thread, which may nest the calls, and
+which takes the lock just while it changes the world, as the canvas
+draws from its snapshots. */
+  void LockWorld();
+  void UnlockWorld();
+
+  /** Deprecated: passes an FLTK event to its widget with the world
+locked. The GUI no longer installs it, as only the handlers that change
+the world lock it. Programs whose own widgets change the world can
+install it with Fl::event_dispatch(). */
+  static int DispatchEvent(int event, Fl_Window *window);
+
+  /** The canvas draws the bounding boxes from its snapshots too, so
+there is no DrawBoundingBoxTree() any more. */
   Canvas *GetCanvas(void) const { return canvas; }
   /** show the window - need to call this if you don't Load(). */
   void Show();
@@ -1542,33 +2647,25 @@ public:
                const char *name, const char *wfname);
   virtual ~StripPlotVis();
   virtual void Visualize(Model *mod, Camera *cam);
+  virtual VisData *Capture(Model *mod);
   void AppendValue(float value);
 };
 
 class PowerPack {
   friend class WorldGui;
   friend class Canvas;
+  friend class Model;
 
 protected:
+  /** Draws where the model dissipated energy, from the world's
+  DissipationMap. The map is made when this is first shown. */
   class DissipationVis : public Visualizer {
-  private:
-    unsigned int columns, rows;
-    meters_t width, height;
-
-    std::vector<joules_t> cells;
-
-    joules_t peak_value;
-    double cellsize;
-
-    static joules_t global_peak_value;
-
   public:
-    DissipationVis(meters_t width, meters_t height, meters_t cellsize);
+    DissipationVis();
 
     virtual ~DissipationVis();
     virtual void Visualize(Model *mod, Camera *cam);
-
-    void Accumulate(meters_t x, meters_t y, joules_t amount);
+    virtual VisData *Capture(Model *mod);
   } event_vis;
 
   StripPlotVis output_vis;
@@ -1594,12 +2691,6 @@ protected:
   joules_t last_joules;
   watts_t last_watts;
 
-public:
-  static joules_t global_stored;
-  static joules_t global_capacity;
-  static joules_t global_dissipated;
-  static joules_t global_input;
-
 public:
   explicit PowerPack(Model *mod);
   ~PowerPack();
@@ -1643,8 +2734,16 @@ argument string, or NULL */
   /** Lose energy as work or heat */
   void Dissipate(joules_t j);
 
-  /** Lose energy as work or heat, and record the event */
+  /** Lose energy as work or heat, and record where in the world's
+  DissipationMap, if it has one */
   void Dissipate(joules_t j, const Pose &p);
+
+  /** Record the charge in a snapshot. See World::SaveSnapshot(). */
+  void SaveState(Snapshot &snap) const;
+  /** Restore the charge from a snapshot */
+  void LoadState(Snapshot &snap);
+  /** Move past the charge in a snapshot, returning false if it is not there */
+  bool CheckState(Snapshot &snap) const;
 };
 
 /// %Model class
@@ -1654,6 +2753,7 @@ class Model : public Ancestor {
   friend class World::Event;
   friend class WorldGui;
   friend class Canvas;
+  friend class RenderModel;
   friend class Block;
   friend class Region;
   friend class BlockGroup;
@@ -1746,8 +2846,16 @@ creating the quadric for each flag */
 protected:
   /** A list of callback functions can be attached to any
 address. When Model::CallCallbacks( void*) is called, the
-callbacks are called.*/
-  std::vector<std::set<cb_t> > callbacks;
+callbacks are called, in the order they were added. Callbacks removed
+while the list is being called are cleared to NULL and erased when
+the call is done. */
+  std::vector<std::vector<cb_t> > callbacks;
+
+  /** The number of CallCallbacks() in progress on this model */
+  unsigned int callback_depth;
+
+  /** TRUE iff a callback was cleared while callbacks were called */
+  bool callbacks_doomed;
 
   /** Default color of the model's blocks.*/
   Color color;
@@ -1757,6 +2865,10 @@ may be of interest to users. This allows polling the model
 instead of adding a data callback. */
   bool data_fresh;
 
+  /** True until the default DataVisualize() is called, which draws
+nothing, so the canvas stops calling it for the model. */
+  bool data_visualize;
+
   /** If set true, Update() is not called on this model. Useful
 e.g. for temporarily disabling updates when dragging models
 with the mouse.*/
@@ -1795,7 +2907,7 @@ offset of its local coordinate system wrt that its parent. */
   usec_t interval; ///< time between updates in usec
   usec_t interval_energy; ///< time between updates of powerpack in usec
   usec_t last_update; ///< time of last update in us
-  bool log_state; ///< iff true, model state is logged
+  usec_t log_interval; ///< time between records in the world's trajectory log, 0 for none
   meters_t map_resolution;
   kg_t mass;
 
@@ -1806,12 +2918,30 @@ offset of its local coordinate system wrt that its parent. */
 global coordinate frame is the parent is NULL. */
   Pose pose;
 
+  /** The pose of the model in the global coordinate frame, and the
+cosine and sine of its heading, kept up to date by UpdateGlobalPose()
+whenever the model or one of its ancestors moves. */
+  Pose global_pose;
+  double global_cos, global_sin;
+
   /** Optional attached PowerPack, defaults to NULL */
   PowerPack *power_pack;
 
   /** list of powerpacks that this model is currently charging,
-initially NULL. */
-  std::list<PowerPack *> pps_charging;
+initially empty. */
+  std::vector<PowerPack *> pps_charging;
+
+  /** The models touching this one that it can give energy to or take
+energy from. Kept up to date as models that give or take energy are
+mapped, so that UpdateCharge() need not search the grid. */
+  std::vector<Model *> contacts;
+
+  /** TRUE iff this model is on the world's list of models whose
+contacts are found again before the next energy update */
+  bool contacts_dirty;
+
+  /** The layer this model was last mapped into */
+  unsigned int contacts_layer;
 
   /** Visualize the most recent rasterization operation performed by this model */
   class RasterVis : public Visualizer {
@@ -1825,6 +2955,7 @@ initially NULL. */
     RasterVis();
     virtual ~RasterVis(void) {}
     virtual void Visualize(Model *mod, Camera *cam);
+    virtual VisData *Capture(Model *mod);
 
     void SetData(uint8_t *data, unsigned int width, unsigned int height, meters_t cellwidth,
                  meters_t cellheight);
@@ -1850,6 +2981,11 @@ safety. Derived classes can set it true in their constructor to
 allow parallel Updates(). */
   bool thread_safe;
 
+  /** This model's own random number generator, used by its Update(),
+so that what it draws does not depend on the other models updated in
+parallel. Seeded by World::SeedRandom() and recorded in snapshots. */
+  RandomGenerator random;
+
   /** Cache of recent poses, used to draw the trail. */
   class TrailItem {
   public:
@@ -1881,6 +3017,7 @@ allow parallel Updates(). */
 
   // model_type_t type;
   const std::string type;
+  const unsigned int type_index; ///< identifies the type in the world's profiling counters
   /** The index into the world's vector of event queues. Initially
 -1, to indicate that it is not on a list yet. */
   unsigned int event_queue_num;
@@ -1940,6 +3077,13 @@ it doesn't exist in this model. */
   usec_t GetEnergyInterval() const { return interval_energy; }
   //    usec_t GetPoseInterval() const { return interval_pose; }
 
+  /** Returns the time between records of this model in the world's
+  trajectory log, 0 if it is not logged */
+  usec_t GetLogInterval() const { return log_interval; }
+  /** Record this model in the world's trajectory log every interval
+  usec, rounded to a whole number of updates, or never if 0 */
+  void SetLogInterval(usec_t interval);
+
   /** Render the model's blocks as an occupancy grid into the
 preallocated array of width by height pixels */
   void Rasterize(uint8_t *data, unsigned int width, unsigned int height, meters_t cellwidth,
@@ -2014,6 +3158,23 @@ by pose, in local coords */
 
   virtual void UpdateCharge();
 
+  /** Recompute the cached global pose of this model and its
+descendants, after it moved, its parent changed or its parent's
+height changed. */
+  void UpdateGlobalPose();
+
+  /** Returns the global pose of the origin of the model's body, ie.
+its global pose plus geom.pose, and the cosine and sine of its heading */
+  Pose GlobalOrigin(double &cosa, double &sina) const;
+
+  /** Queue this model to find its contacts again, if it can give or
+take energy. */
+  void DirtyContacts(unsigned int layer);
+
+  /** Replace this model's contacts with the models that share cells
+with it in the layer it was last mapped into. */
+  void UpdateContacts();
+
   static int UpdateWrapper(Model *mod, void *)
   {
     mod->Update();
@@ -2025,12 +3186,12 @@ by pose, in local coords */
 
   meters_t ModelHeight() const;
 
+  /** Draw the blocks in the current GL frame. The canvas draws the
+      main view from its snapshot, so this is only used by the cameras
+      that render through the GUI; a model that draws its blocks
+      differently must override CaptureRender() as well. */
   void DrawBlocksTree();
   virtual void DrawBlocks();
-  void DrawBoundingBox();
-  void DrawBoundingBoxTree();
-  virtual void DrawStatus(Camera *cam);
-  void DrawStatusTree(Camera *cam);
 
   void DrawOriginTree();
   void DrawOrigin();
@@ -2038,21 +3199,44 @@ by pose, in local coords */
   void PushLocalCoords();
   void PopCoords();
 
-  /** Draw the image stored in texture_id above the model */
-  void DrawImage(uint32_t texture_id, Camera *cam, float alpha, double width = 1.0,
-                 double height = 1.0);
-
+  /** Copy what the canvas draws of the model into rm, at the end of
+      an update. The shape of the blocks is shared rather than copied.
+      The canvas draws the status, selection, trails, flags, grid and
+      bounding boxes from this copy, so the DrawStatus(),
+      DrawSelected(), DrawTrail*(), DrawImage(), DrawFlagList() and
+      DrawGrid() methods that drew them from the model are gone. */
+  virtual void CaptureRender(RenderModel &rm) const;
+
+  /** Capture the model and then its descendants, depth first, into
+      models from index count, which is advanced past them. The data of
+      subscribed models is copied too if shown shows it. */
+  void CaptureRenderTree(std::vector<RenderModel> &models, size_t &count,
+                         const RenderShown &shown) const;
+
+  /** Copy the data of the model and of its visualizers that shown
+      enables into rm */
+  void CaptureVisualizations(RenderModel &rm, const RenderShown &shown) const;
+
+  /** Draw the model and its descendants in solid colour, for the
+      canvas to find which model is under the mouse */
   virtual void DrawPicker();
+
+  /** Returns a copy of the sensor data the model draws, or NULL if it
+      draws none, as by default. Called at the end of an update while
+      the model is subscribed and the canvas shows data. */
+  virtual VisData *CaptureData();
+
+  /** Deprecated: override CaptureData() instead. Draws the sensor
+      data in the model's local frame. The canvas still calls it for
+      subscribed models that capture no data, with the world locked, so
+      the simulation waits for it. The default draws nothing and clears
+      data_visualize, after which the canvas calls it no more. */
   virtual void DataVisualize(Camera *cam);
-  virtual void DrawSelected(void);
-
-  void DrawTrailFootprint();
-  void DrawTrailBlocks();
-  void DrawTrailArrows();
-  void DrawGrid();
-  //	void DrawBlinkenlights();
-  void DataVisualizeTree(Camera *cam);
-  void DrawFlagList();
+
+  /** How far from the model's origin DataVisualize() may draw, or a
+      negative number if it may draw anywhere, as by default */
+  virtual meters_t DataVisualizeReach() const { return -1; }
+
   void DrawPose(Pose pose);
 
 public:
@@ -2098,12 +3282,15 @@ public:
 
   /** Alternate constructor that creates dummy models with only a pose */
   Model()
-      : mapped(false), alwayson(false), blockgroup(*this), boundary(false), data_fresh(false),
-        disabled(true), friction(0), has_default_block(false), id(0), interval(0),
-        interval_energy(0), last_update(0), log_state(false), map_resolution(0), mass(0),
-        parent(NULL), power_pack(NULL), rebuild_displaylist(false), stack_children(true),
-        stall(false), subs(0), thread_safe(false), trail_index(0), event_queue_num(0), used(false),
-        watts(0), watts_give(0), watts_take(0), wf(NULL), wf_entity(0), world(NULL), world_gui(NULL)
+      : mapped(false), alwayson(false), blockgroup(*this), boundary(false), callback_depth(0),
+        callbacks_doomed(false), data_fresh(false), data_visualize(false), disabled(true),
+        friction(0), has_default_block(false), id(0), interval(0), interval_energy(0),
+        last_update(0), log_interval(0), map_resolution(0), mass(0), parent(NULL),
+        global_cos(1.0), global_sin(0.0), power_pack(NULL), contacts_dirty(false),
+        contacts_layer(0), rebuild_displaylist(false), stack_children(true), stall(false),
+        subs(0), thread_safe(false), trail_index(0),
+        type_index(0), event_queue_num(0), used(false), watts(0), watts_give(0), watts_take(0), wf(NULL),
+        wf_entity(0), world(NULL), world_gui(NULL)
   {
   }
 
@@ -2139,6 +3326,29 @@ before Load() */
   /** save the state of the model to the current world file */
   virtual void Save();
 
+  /** Record the dynamic state of the model in a snapshot. Subclasses
+with more state extend this, calling the base class first. See
+World::SaveSnapshot(). */
+  virtual void SaveState(Snapshot &snap) const;
+
+  /** Restore the dynamic state written by SaveState(). */
+  virtual void LoadState(Snapshot &snap);
+
+  /** Move past the state written by SaveState() without changing the
+model, returning false if it does not fit this model. Subclasses that
+extend SaveState() extend this too. */
+  virtual bool CheckState(Snapshot &snap) const;
+
+  /** Returns a random number in [0.0, 1.0) from this model's
+generator. Call only from this model's update or its controllers. */
+  double Random() { return random.Uniform(); }
+  /** Returns gaussian noise with the given variance from this model's
+generator. Call only from this model's update or its controllers. */
+  double RandomGaussian(double variance) { return random.Gaussian(variance); }
+  /** Restart this model's random number sequence from the world's
+seed and the model's name. See World::SeedRandom(). */
+  void SeedRandom(long seed);
+
   /** Call Init() for all attached controllers. */
   void InitControllers();
 
@@ -2197,7 +3407,11 @@ model has no parent */
   bool IsRelated(const Model *testmod) const;
 
   /** get the pose of a model in the global CS */
-  Pose GetGlobalPose() const;
+  Pose GetGlobalPose() const { return global_pose; }
+
+  /** Returns the axis-aligned box, in the global CS, around the body
+      of the model and its descendants */
+  bounds3d_t GetGlobalBounds() const;
 
   /** subscribe to a model's data */
   void Subscribe();
@@ -2280,7 +3494,10 @@ when called.
   */
   void AddCallback(callback_type_t type, model_callback_t cb, void *user);
 
-  int RemoveCallback(callback_type_t type, model_callback_t callback);
+  /** Remove the callback added with this function and user data,
+which is NULL unless given. Returns the number of callbacks of the
+type that remain. */
+  int RemoveCallback(callback_type_t type, model_callback_t callback, void *user = NULL);
 
   int CallCallbacks(callback_type_t type);
 
@@ -2293,7 +3510,11 @@ coordinate system. */
 
   /** Return the global pose (i.e. pose in world coordinates) of a
 pose specified in the model's local coordinate system */
-  Pose LocalToGlobal(const Pose &pose) const { return ((GetGlobalPose() + geom.pose) + pose); }
+  Pose LocalToGlobal(const Pose &pose) const
+  {
+    double cosa, sina;
+    return GlobalOrigin(cosa, sina).Plus(pose, cosa, sina);
+  }
   /** Return a vector of global pixels corresponding to a vector of local points. */
   std::vector<point_int_t> LocalToPixels(const std::vector<point_t> &local) const;
 
@@ -2309,6 +3530,10 @@ and has the type indicated by the string */
 and has the type indicated by the string. This model is tagged as used. */
   Model *GetUnusedModelOfType(const std::string &type);
 
+  /** Append the rangers among this model's descendants to found,
+depth first */
+  void GetRangers(std::vector<ModelRanger *> &found) const;
+
   /** Returns the value of the model's stall boolean, which is true
 iff the model has crashed into another model */
   bool Stalled() const { return this->stall; }
@@ -2343,6 +3568,7 @@ public:
     explicit Vis(World *world);
     virtual ~Vis(void) {}
     virtual void Visualize(Model *mod, Camera *cam);
+    virtual VisData *Capture(Model *mod);
   } vis;
 
 private:
@@ -2358,6 +3584,34 @@ to add and remove colors at run time.*/
   /// Predicate for ray tracing
   static bool BlockMatcher(Block *testblock, Model *finder);
 
+  /** Samples first to last, counted anticlockwise from the right of
+the field of view, that see a color */
+  class Run {
+  public:
+    Color color;
+    unsigned int first, last;
+    meters_t range; ///< the sum of the ranges of the samples traced
+    unsigned int traced; ///< the number of samples traced
+
+    bool operator<(const Run &other) const { return first < other.first; }
+  };
+
+  std::vector<RaytraceResult> samples; ///< the column scan, kept to save allocating it
+  std::vector<Run> runs; ///< scratch for FindBlobsAnalytic()
+
+  /** Trace a ray for every sample, and find blobs in runs of samples
+of the same color */
+  void ScanBlobs();
+
+  /** Find the blobs of the models of the tracked colors within range
+from their footprints, tracing rays only to find what hides
+them. Returns false if the blobs overlap ambiguously, and the caller
+should ScanBlobs() instead. */
+  bool FindBlobsAnalytic();
+
+  /** Add the blob seen by samples first to last at the given range */
+  void AddBlob(const Color &color, unsigned int first, unsigned int last, meters_t range);
+
 public:
   radians_t fov; ///< Horizontal field of view in radians, in the range 0 to pi.
   radians_t pan; ///< Horizontal pan angle in radians, in the range -pi to +pi.
@@ -2365,6 +3619,10 @@ public:
   /// setting this small saves computation  time.
   unsigned int scan_height; ///< Height of the input image in pixels.
   unsigned int scan_width; ///< Width of the input image in pixels.
+  /** iff true, find the blobs of the tracked colors from the models'
+footprints rather than by tracing a ray for every sample. See the
+worldfile property "mode". */
+  bool analytic;
 
   /// Constructor
   explicit ModelBlobfinder(World *world, Model *parent, const std::string &type);
@@ -2405,6 +3663,7 @@ public:
 
 protected:
   virtual void DrawBlocks();
+  virtual void CaptureRender(RenderModel &rm) const;
 
 private:
   bool m_IsOn;
@@ -2456,7 +3715,7 @@ public:
 
 private:
   virtual void Update();
-  virtual void DataVisualize(Camera *cam);
+  virtual VisData *CaptureData();
 
   void FixBlocks();
   void PositionPaddles();
@@ -2481,6 +3740,9 @@ public:
 
   virtual void Load();
   virtual void Save();
+  virtual void SaveState(Snapshot &snap) const;
+  virtual void LoadState(Snapshot &snap);
+  virtual bool CheckState(Snapshot &snap) const;
 
   /** Configure the gripper */
   void SetConfig(config_t &newcfg)
@@ -2540,6 +3802,7 @@ protected:
     BumperVis();
     virtual ~BumperVis();
     virtual void Visualize(Model *mod, Camera *cam);
+    virtual VisData *Capture(Model *mod);
   } bumpervis;
 
 private:
@@ -2570,7 +3833,7 @@ private:
   void AddModelIfVisible(Model *him);
 
   virtual void Update();
-  virtual void DataVisualize(Camera *cam);
+  virtual VisData *CaptureData();
 
   static Option showData;
   static Option showFov;
@@ -2626,6 +3889,7 @@ public:
     explicit Vis(World *world);
     virtual ~Vis(void) {}
     virtual void Visualize(Model *mod, Camera *cam);
+    virtual VisData *Capture(Model *mod);
   } vis;
 
   class Sensor {
@@ -2639,6 +3903,8 @@ public:
     double range_noise_const; //< variance for constant noise (not depending on range)
     unsigned int sample_count;
     Color color;
+    bool exact; ///< iff true, trace exact rays. See World::RaytraceExact().
+    unsigned int offset; ///< the index of this sensor's first sample in the ranger's Scan
 
     std::vector<meters_t> ranges;
     std::vector<double> intensities;
@@ -2647,25 +3913,74 @@ public:
     Sensor()
         : pose(0, 0, 0, 0), size(0.02, 0.02, 0.02), // teeny transducer
           range(0.0, 5.0), fov(0.1), angle_noise(0.0), range_noise(0.0), range_noise_const(0.0),
-          sample_count(1), color(Color(0, 0, 1, 0.15)), ranges(), intensities(), bearings()
+          sample_count(1), color(Color(0, 0, 1, 0.15)), exact(false), offset(0), ranges(),
+          intensities(), bearings()
     {
     }
 
     void Update(ModelRanger *rgr);
-    void Visualize(Vis *vis, ModelRanger *rgr) const;
+    /** Draw the sensor of a ranger at global pose gpose */
+    void Visualize(Canvas *canvas, const Pose &gpose) const;
     std::string String() const;
     void Load(Worldfile *wf, int entity);
   };
 
+  /** A read-only view of the latest samples of all the sensors,
+  as arrays of count floats with each sensor's samples following the
+  previous sensor's, starting at Sensor::offset. Bearings are relative
+  to the sensor's pose. Valid until the ranger next updates. */
+  class Scan {
+  public:
+    const float *ranges;
+    const float *intensities;
+    const float *bearings;
+    uint32_t count; ///< the number of samples of all the sensors
+    uint64_t sequence; ///< incremented at each update, so readers can skip scans they have seen
+
+    Scan() : ranges(NULL), intensities(NULL), bearings(NULL), count(0), sequence(0) {}
+  };
+
+  /** Returns the latest samples without copying them */
+  Scan GetScan() const
+  {
+    Scan s;
+    if (scan_count) {
+      s.ranges = &scan[0];
+      s.intensities = s.ranges + scan_count;
+      s.bearings = s.intensities + scan_count;
+    }
+    s.count = scan_count;
+    s.sequence = scan_sequence;
+    return s;
+  }
+
   /** returns a const reference to a vector of range and reflectance samples */
   const std::vector<Sensor> &GetSensors() const { return sensors; }
   /** returns a mutable reference to a vector of range and reflectance samples */
   std::vector<Sensor> &GetSensorsMutable() { return sensors; }
   void LoadSensor(Worldfile *wf, int entity);
 
+  virtual void SaveState(Snapshot &snap) const;
+  virtual void LoadState(Snapshot &snap);
+  virtual bool CheckState(Snapshot &snap) const;
+
 private:
   std::vector<Sensor> sensors;
 
+  /** The ranges, then the intensities, then the bearings of every
+  sample of every sensor, allocated once for all the sensors. */
+  std::vector<float> scan;
+  uint32_t scan_count; ///< the number of samples in scan
+  uint64_t scan_sequence; ///< incremented at each update
+  /** the sample count and fov of each sensor when the scan was laid
+  out, to notice changes made through GetSensorsMutable() */
+  std::vector<std::pair<unsigned int, radians_t> > scan_layout;
+
+  /** Size the scan for the sensors' sample counts, set their offsets
+  and compute the bearings, if the sensors have changed since this was
+  last done. */
+  void LayoutScan();
+
 protected:
   virtual void Startup();
   virtual void Shutdown();
@@ -2689,7 +4004,6 @@ public:
 
   virtual void Load();
   virtual void Update();
-  virtual void DataVisualize(Camera *cam);
 };
 
 // CAMERA MODEL ----------------------------------------------------
@@ -2703,7 +4017,8 @@ public:
   } ColoredVertex;
 
 private:
-  Canvas *_canvas;
+  Canvas *_canvas; // NULL without a GUI, when frames are raytraced
+  int _atlas_tile; // where the frames are drawn in the canvas' CameraAtlas, or -1
 
   GLfloat *_frame_data; // opengl read buffer
   GLubyte *_frame_color_data; // opengl read buffer
@@ -2716,20 +4031,42 @@ private:
   int _height; // height of buffer
   static const int _depth = 4;
 
-  int _camera_quads_size;
-  GLfloat *_camera_quads;
-  GLubyte *_camera_colors;
-
   static Option showCameraData;
 
   PerspectiveCamera _camera;
   double _yaw_offset; // position camera is mounted at
   double _pitch_offset;
 
+  // scratch for GetFrameRaytrace(), one entry per row of a column
+  std::vector<double> _row_length; // horizontal length of the ray per meter of depth
+  std::vector<double> _row_slope; // rise of the ray per horizontal meter
+  std::vector<bool> _row_done;
+
+  /// Allocate the frame buffers, if not done yet
+  void AllocFrame();
+
   /// Take a screenshot from the camera's perspective. return: true for sucess, and data is
-  /// available via FrameDepth() / FrameColor()
+  /// available via FrameDepth() / FrameColor(). The frame is drawn in the
+  /// canvas' CameraAtlas and collected an update or two later.
   bool GetFrame();
 
+  /// GetFrame() for a GL without framebuffer objects: draw in the window
+  /// and wait to read the frame back
+  bool GetFrameSync();
+
+  /// Set up the view from the camera and draw the world
+  void DrawFrame();
+
+  /// Copy a frame read back from the GL, with stride pixels between rows,
+  /// converting the depths to distances
+  void CopyFrame(const GLfloat *depth, const GLubyte *rgba, int stride);
+
+  /// Render the same frame as GetFrame() without OpenGL, by tracing a
+  /// ray through the world for each column of pixels and testing the
+  /// height of each row against the blocks it meets. Used when there
+  /// is no GUI, so any worker thread can update the camera.
+  bool GetFrameRaytrace();
+
 public:
   ModelCamera(World *world, Model *parent, const std::string &type);
 
@@ -2737,14 +4074,14 @@ public:
 
   virtual void Load();
 
-  /// Capture a new frame ( calls GetFrame )
+  /// Capture a new frame ( calls GetFrame, or GetFrameRaytrace without a GUI )
   virtual void Update();
 
   /// Draw Camera Model - TODO
   // virtual void Draw( uint32_t flags, Canvas* canvas );
 
-  /// Draw camera visualization
-  virtual void DataVisualize(Camera *cam);
+  /// Copy the camera visualization for the canvas
+  virtual VisData *CaptureData();
 
   /// width of captured image
   int getWidth(void) const { return _width; }
@@ -2827,7 +4164,9 @@ Models and visualized. */
     Waypoint(meters_t x, meters_t y, meters_t z, radians_t a, Color color);
     Waypoint(const Pose &pose, Color color);
     Waypoint();
-    void Draw() const;
+
+    /** Append a point to points and a line showing the heading to quivers */
+    void Append(Gl::VertexBatch &points, Gl::VertexBatch &quivers) const;
 
     Pose pose;
     Color color;
@@ -2840,6 +4179,7 @@ Models and visualized. */
     WaypointVis();
     virtual ~WaypointVis(void) {}
     virtual void Visualize(Model *mod, Camera *cam);
+    virtual VisData *Capture(Model *mod);
   } wpvis;
 
   class PoseVis : public Visualizer {
@@ -2847,6 +4187,7 @@ Models and visualized. */
     PoseVis();
     virtual ~PoseVis(void) {}
     virtual void Visualize(Model *mod, Camera *cam);
+    virtual VisData *Capture(Model *mod);
   } posevis;
 
   /** Set the current pose estimate.*/
@@ -2884,6 +4225,11 @@ protected:
   virtual void Shutdown();
   virtual void Update();
   virtual void Load();
+
+public:
+  virtual void SaveState(Snapshot &snap) const;
+  virtual void LoadState(Snapshot &snap);
+  virtual bool CheckState(Snapshot &snap) const;
 };
 
 // ACTUATOR MODEL --------------------------------------------------------
@@ -2922,6 +4268,9 @@ public:
   virtual void Shutdown();
   virtual void Update();
   virtual void Load();
+  virtual void SaveState(Snapshot &snap) const;
+  virtual void LoadState(Snapshot &snap);
+  virtual bool CheckState(Snapshot &snap) const;
 
   /** Sets the control_mode to CONTROL_VELOCITY and sets
 the goal velocity. */
@@ -2939,6 +4288,100 @@ the goal pose */
   point3_t GetAxis() const { return axis; }
 };
 
+// WORLD BATCH -----------------------------------------------------------
+
+/** Steps several clones of a world in parallel, for learning
+workloads that run many short episodes. Actions and observations are
+exchanged in flat arrays of floats owned by the caller, instead of a
+call per model.
+
+Each world has the same robots: position models named when the batch
+is created. The actions of a world are ActionSize() floats, [vx, vy,
+va] for each robot in turn. Its observations are ObservationSize()
+floats: for each robot in turn its global [x, y, a], then 1 if it is
+stalled or 0, then the ranges of each sensor of each ranger it
+carries, depth first. The arrays for all worlds follow each other,
+world 0 first.
+
+The robots and their rangers are subscribed in every world. The
+original world is left alone. */
+class WorldBatch {
+public:
+  /** Clone world count times. If robot_names is empty, every
+position model is a robot, in order of name. Uses up to threads
+threads, including the calling one, or one for each processor if
+threads is 0. Check Ok() for failure. */
+  WorldBatch(const World *world, unsigned int count,
+             const std::vector<std::string> &robot_names = std::vector<std::string>(),
+             unsigned int threads = 0);
+  ~WorldBatch();
+
+  /** Returns true iff every world was cloned and has every robot */
+  bool Ok() const { return ok; }
+  unsigned int WorldCount() const { return worlds.size(); }
+  unsigned int RobotCount() const { return robot_names.size(); }
+  /** Returns the number of action floats per world */
+  unsigned int ActionSize() const { return 3 * robot_names.size(); }
+  /** Returns the number of observation floats per world */
+  unsigned int ObservationSize() const { return observation_size; }
+  World *GetWorld(unsigned int index) { return worlds[index]; }
+
+  /** Set the speeds of every robot from actions, which holds
+ActionSize() floats for each world, run every world for the given
+number of updates, then fill observations, if not NULL, with
+ObservationSize() floats for each world. */
+  void Step(const float *actions, float *observations, unsigned int updates = 1);
+
+  /** Fill observations with ObservationSize() floats for each world */
+  void Observe(float *observations);
+
+  /** Return a world to the state it was created in, for the next
+episode, with a new random number sequence of its own. Call from the
+thread that created the batch. */
+  void Reset(unsigned int index);
+  /** Return every world to the state it was created in */
+  void Reset();
+
+private:
+  std::vector<World *> worlds;
+  std::vector<std::string> robot_names;
+  std::vector<std::vector<ModelPosition *> > robots; ///< the robots of each world
+  std::vector<std::vector<ModelRanger *> > rangers; ///< the rangers of each world, in robot order
+  std::vector<unsigned int> ranger_counts; ///< the number of rangers of each robot
+  std::vector<unsigned int> range_counts; ///< the number of ranges observed from each ranger
+  unsigned int observation_size;
+  Snapshot start; ///< the state every world is reset to
+  bool ok;
+
+  //--- the current job, shared with the threads ----
+  const float *actions;
+  float *observations;
+  unsigned int updates;
+  unsigned int next; ///< the next world not yet claimed by a thread
+
+  //--- thread sync ----
+  pthread_mutex_t mutex;
+  pthread_cond_t start_cond; ///< signalled when a job is ready
+  pthread_cond_t done_cond; ///< signalled when the last thread finishes a job
+  unsigned int job; ///< incremented for each job
+  unsigned int working; ///< the number of threads still working on the job
+  bool exiting; ///< iff true, the threads return
+  std::vector<pthread_t> threads;
+
+  static void *thread_entry(void *batch);
+
+  /** Claim and process worlds until there are none left */
+  void Work();
+
+  /** Apply the actions, run the updates and write the observations of one world */
+  void StepWorld(unsigned int index);
+
+  void ObserveWorld(unsigned int index, float *obs) const;
+
+  /** Run Work() on every thread, including this one, and wait until it is done */
+  void RunJob(const float *actions, float *observations, unsigned int updates);
+};
+
 } // end namespace stg
 
 #endif
@@ -0,0 +1,110 @@
+/**
+  \defgroup stagelog Print a Stage trajectory log as text
+
+  USAGE:  stagelog [-m <model>] <logfile>
+
+  Prints one line for each record in the log written by a world with
+  the log_file property: the simulation time in seconds, the model's
+  name, its global pose x y z a, its velocity x y a and 1 if it was
+  stalled, otherwise 0.
+
+    -m <model> : print only the records of the named model
+
+    -h         : print this message
+ */
+
+#include <errno.h>
+#include <unistd.h> // for getopt(3)
+
+#include "stage.hh"
+using namespace Stg;
+
+const char *USAGE = "USAGE:  stagelog [-m <model>] <logfile>\n"
+                    "  -m <model> : print only the records of the named model\n"
+                    "  -h         : print this message";
+
+int main(int argc, char *argv[])
+{
+  const char *only(NULL);
+
+  int ch;
+  while ((ch = getopt(argc, argv, "m:h?")) != -1) {
+    switch (ch) {
+    case 'm':
+      only = optarg;
+      break;
+    default:
+      puts(USAGE);
+      return (ch == 'h' || ch == '?') ? 0 : 1;
+    }
+  }
+
+  if (optind != argc - 1) {
+    puts(USAGE);
+    return 1;
+  }
+
+  FILE *fp(fopen(argv[optind], "rb"));
+  if (fp == NULL) {
+    fprintf(stderr, "stagelog: failed to open \"%s\": %s\n", argv[optind], strerror(errno));
+    return 1;
+  }
+
+  char magic[sizeof(TrajectoryLog::MAGIC)];
+  uint32_t version(0), record_size(0), model_count(0);
+  uint64_t interval(0);
+
+  if (fread(magic, sizeof(magic), 1, fp) != 1
+      || memcmp(magic, TrajectoryLog::MAGIC, sizeof(magic)) != 0
+      || fread(&version, sizeof(version), 1, fp) != 1
+      || version != TrajectoryLog::FORMAT_VERSION
+      || fread(&record_size, sizeof(record_size), 1, fp) != 1
+      || record_size != sizeof(TrajectoryLog::Record)
+      || fread(&model_count, sizeof(model_count), 1, fp) != 1
+      || fread(&interval, sizeof(interval), 1, fp) != 1) {
+    fprintf(stderr, "stagelog: \"%s\" is not a trajectory log from this version of Stage\n",
+            argv[optind]);
+    fclose(fp);
+    return 1;
+  }
+
+  std::map<uint32_t, std::string> names;
+
+  for (uint32_t i(0); i < model_count; ++i) {
+    uint32_t id(0), length(0);
+    if (fread(&id, sizeof(id), 1, fp) != 1 || fread(&length, sizeof(length), 1, fp) != 1) {
+      fprintf(stderr, "stagelog: \"%s\" is truncated\n", argv[optind]);
+      fclose(fp);
+      return 1;
+    }
+
+    std::string name(length, '\0');
+    if (length && fread(&name[0], 1, length, fp) != length) {
+      fprintf(stderr, "stagelog: \"%s\" is truncated\n", argv[optind]);
+      fclose(fp);
+      return 1;
+    }
+
+    names[id] = name;
+  }
+
+  TrajectoryLog::Record rec;
+  while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+    std::map<uint32_t, std::string>::const_iterator it(names.find(rec.model));
+
+    char unnamed[32];
+    snprintf(unnamed, sizeof(unnamed), "%u", rec.model);
+    const char *name(it == names.end() ? unnamed : it->second.c_str());
+
+    if (only && strcmp(only, name) != 0)
+      continue;
+
+    printf("%.3f %s %.4f %.4f %.4f %.4f %.4f %.4f %.4f %d\n",
+           rec.tick * interval / 1e6, name, rec.pose[0], rec.pose[1], rec.pose[2], rec.pose[3],
+           rec.velocity[0], rec.velocity[1], rec.velocity[2],
+           (rec.flags & TrajectoryLog::STALLED) ? 1 : 0);
+  }
+
+  fclose(fp);
+  return 0;
+}
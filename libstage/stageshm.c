@@ -0,0 +1,238 @@
+/*
+  stageshm.c
+  the client side of the shared memory bridge: maps the segment a
+  world publishes, reads its frames and writes velocity commands.
+*/
+
+/* shm_open(), sem_timedwait() and nanosleep() are POSIX, and hidden
+   by a strict -std=c99 without this */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stageshm.h"
+
+stg_shm_t *stg_shm_open(const char *name)
+{
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    fprintf(stderr, "stageshm: failed to open \"%s\": %s\n", name, strerror(errno));
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(stg_shm_header_t)) {
+    fprintf(stderr, "stageshm: \"%s\" is too small\n", name);
+    close(fd);
+    return NULL;
+  }
+
+  void *mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd); /* the mapping keeps the segment */
+
+  if (mem == MAP_FAILED) {
+    fprintf(stderr, "stageshm: failed to map \"%s\": %s\n", name, strerror(errno));
+    return NULL;
+  }
+
+  stg_shm_header_t *header = (stg_shm_header_t *)mem;
+
+  if (memcmp(header->magic, "STGSHM", 7) != 0 || header->version != STG_SHM_VERSION
+      || header->size != (uint64_t)st.st_size) {
+    fprintf(stderr, "stageshm: \"%s\" is not from this version of Stage\n", name);
+    munmap(mem, st.st_size);
+    return NULL;
+  }
+
+  stg_shm_t *shm = (stg_shm_t *)malloc(sizeof(stg_shm_t));
+  shm->header = header;
+  shm->size = st.st_size;
+  return shm;
+}
+
+void stg_shm_close(stg_shm_t *shm)
+{
+  if (shm == NULL)
+    return;
+
+  munmap(shm->header, shm->size);
+  free(shm);
+}
+
+int stg_shm_find_robot(const stg_shm_t *shm, const char *name)
+{
+  const stg_shm_robot_info_t *info = stg_shm_robot_infos(shm->header);
+  unsigned int i;
+
+  for (i = 0; i < shm->header->robot_count; ++i)
+    if (strcmp(info[i].name, name) == 0)
+      return i;
+
+  return -1;
+}
+
+int stg_shm_find_ranger(const stg_shm_t *shm, const char *name)
+{
+  const stg_shm_ranger_info_t *info = stg_shm_ranger_infos(shm->header);
+  unsigned int i;
+
+  for (i = 0; i < shm->header->ranger_count; ++i)
+    if (strcmp(info[i].name, name) == 0)
+      return i;
+
+  return -1;
+}
+
+const stg_shm_frame_t *stg_shm_latest(const stg_shm_t *shm)
+{
+  const uint64_t published = shm->header->published;
+  return published ? stg_shm_frame(shm->header, published - 1) : NULL;
+}
+
+/* microseconds since the epoch */
+static uint64_t now_usec(void)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+/* wait a little while the world writes */
+static void pause_briefly(void)
+{
+  const struct timespec delay = { 0, 100000 }; /* 100 usec */
+  nanosleep(&delay, NULL);
+}
+
+int stg_shm_read(const stg_shm_t *shm, stg_shm_frame_t *frame)
+{
+  const stg_shm_header_t *header = shm->header;
+  uint64_t start = 0;
+  unsigned int tries;
+
+  for (tries = 0;; ++tries) {
+    if (!header->alive)
+      return -1;
+
+    /* writing a frame takes microseconds, so after a few quick tries
+       the world is either very busy or died while writing one */
+    if (tries >= 16) {
+      if (start == 0)
+        start = now_usec();
+      else if (now_usec() - start > STG_SHM_READ_TIMEOUT_USEC)
+        return -1;
+
+      pause_briefly();
+    }
+
+    const uint64_t published = header->published;
+    if (published == 0)
+      return -1;
+
+    const stg_shm_frame_t *src = stg_shm_frame(header, published - 1);
+    const uint64_t seq = src->seq;
+    __sync_synchronize();
+
+    if (seq & 1)
+      continue; /* the world has lapped the ring and is writing it */
+
+    memcpy(frame, src, header->frame_size);
+    __sync_synchronize();
+
+    /* unchanged, so the copy is not torn */
+    if (src->seq == seq) {
+      frame->seq = seq;
+      return 0;
+    }
+  }
+}
+
+void stg_shm_command(stg_shm_t *shm, unsigned int robot, double x, double y, double a)
+{
+  stg_shm_command_t *cmd = stg_shm_commands(shm->header) + robot;
+
+  ++cmd->seq;
+  __sync_synchronize();
+
+  cmd->velocity[0] = x;
+  cmd->velocity[1] = y;
+  cmd->velocity[2] = a;
+
+  __sync_synchronize();
+  ++cmd->seq;
+}
+
+int stg_shm_step(stg_shm_t *shm)
+{
+  stg_shm_header_t *header = shm->header;
+
+  if (!header->lockstep || !header->alive)
+    return -1;
+
+  sem_post(&header->step);
+
+  /* wake now and then to notice the world going away */
+  for (;;) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    struct timespec until;
+    until.tv_sec = now.tv_sec;
+    until.tv_nsec = now.tv_usec * 1000 + 100000000;
+    if (until.tv_nsec >= 1000000000) {
+      until.tv_sec += 1;
+      until.tv_nsec -= 1000000000;
+    }
+
+    if (sem_timedwait(&header->done, &until) == 0)
+      return header->alive ? 0 : -1;
+
+    if (errno != ETIMEDOUT && errno != EINTR)
+      return -1;
+
+    if (!header->alive)
+      return -1;
+  }
+}
+
+/* read the tick of a frame the way stg_shm_read() reads the whole
+   frame. Returns 0, or -1 if the world was writing it. */
+static int frame_tick(const stg_shm_frame_t *frame, uint64_t *tick)
+{
+  const uint64_t seq = frame->seq;
+  __sync_synchronize();
+
+  if (seq & 1)
+    return -1;
+
+  *tick = *(const volatile uint64_t *)&frame->tick;
+  __sync_synchronize();
+
+  return frame->seq == seq ? 0 : -1;
+}
+
+int stg_shm_wait(const stg_shm_t *shm, uint64_t tick)
+{
+  const stg_shm_header_t *header = shm->header;
+
+  for (;;) {
+    if (!header->alive)
+      return -1;
+
+    const stg_shm_frame_t *frame = stg_shm_latest(shm);
+    uint64_t latest;
+    if (frame && frame_tick(frame, &latest) == 0 && latest > tick)
+      return 0;
+
+    pause_briefly();
+  }
+}
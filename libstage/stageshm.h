@@ -0,0 +1,168 @@
+/*
+  stageshm.h
+  the layout of the shared memory through which a world publishes its
+  position models and rangers to another process, and reads velocity
+  commands from it, and the C client library that reads and writes it.
+*/
+
+#ifndef STAGESHM_H
+#define STAGESHM_H
+
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** The version of the layout below */
+#define STG_SHM_VERSION 1
+
+/** The longest model name, including its terminating zero */
+#define STG_SHM_NAME_LEN 64
+
+/** How long stg_shm_read() tries to read a frame whole */
+#define STG_SHM_READ_TIMEOUT_USEC 1000000
+
+/** At the start of the segment. Offsets are from the start of the
+    segment, and are multiples of 8. */
+typedef struct stg_shm_header {
+  char magic[8]; /**< "STGSHM" */
+  uint32_t version; /**< STG_SHM_VERSION */
+  uint32_t lockstep; /**< 1 if the world waits for stg_shm_step() before each update */
+  uint64_t size; /**< bytes in the segment */
+  uint64_t interval; /**< simulated usec per update */
+  uint32_t robot_count; /**< position models, in order of name */
+  uint32_t ranger_count; /**< rangers carried by the position models */
+  uint32_t range_count; /**< ranges in each frame, of all the rangers */
+  uint32_t frame_count; /**< frames in the ring */
+  uint64_t frame_size; /**< bytes in each frame */
+  uint64_t robots_offset; /**< stg_shm_robot_info_t[robot_count] */
+  uint64_t rangers_offset; /**< stg_shm_ranger_info_t[ranger_count] */
+  uint64_t commands_offset; /**< stg_shm_command_t[robot_count] */
+  uint64_t frames_offset; /**< frame_count frames of frame_size bytes */
+  volatile uint32_t alive; /**< cleared when the world closes the segment */
+  uint32_t reserved;
+  volatile uint64_t published; /**< frames published so far; the latest is
+                                  number (published - 1) % frame_count */
+  sem_t step; /**< posted by the client to allow one update, in lockstep */
+  sem_t done; /**< posted by the world after each update, in lockstep */
+} stg_shm_header_t;
+
+/** Describes a position model. Written once, when the world opens the segment. */
+typedef struct stg_shm_robot_info {
+  char name[STG_SHM_NAME_LEN];
+  uint32_t first_ranger; /**< the index of its first ranger */
+  uint32_t ranger_count; /**< the rangers it carries, which follow the first */
+} stg_shm_robot_info_t;
+
+/** Describes a ranger. Written once, when the world opens the segment. */
+typedef struct stg_shm_ranger_info {
+  char name[STG_SHM_NAME_LEN];
+  uint32_t robot; /**< the index of the position model carrying it */
+  uint32_t first_range; /**< the index of its first range in a frame's ranges */
+  uint32_t range_count; /**< the samples of all its sensors */
+  uint32_t reserved;
+} stg_shm_ranger_info_t;
+
+/** A velocity command for a position model, written by the client */
+typedef struct stg_shm_command {
+  volatile uint32_t seq; /**< odd while the client writes the command */
+  uint32_t reserved;
+  double velocity[3]; /**< x, y and turn speeds */
+} stg_shm_command_t;
+
+/** The state of a position model in a frame */
+typedef struct stg_shm_robot {
+  double pose[3]; /**< global x, y and heading */
+  double velocity[3]; /**< x, y and turn speeds */
+  uint32_t stalled;
+  uint32_t reserved;
+} stg_shm_robot_t;
+
+/** The state of the world after an update. It is followed by
+    robot_count stg_shm_robot_t, then by range_count floats of ranges.
+    Ranges a ranger no longer has are zero. */
+typedef struct stg_shm_frame {
+  volatile uint64_t seq; /**< odd while the world writes the frame */
+  uint64_t tick; /**< updates done */
+  uint64_t sim_time; /**< usec */
+} stg_shm_frame_t;
+
+static inline stg_shm_robot_info_t *stg_shm_robot_infos(const stg_shm_header_t *h)
+{
+  return (stg_shm_robot_info_t *)((char *)h + h->robots_offset);
+}
+
+static inline stg_shm_ranger_info_t *stg_shm_ranger_infos(const stg_shm_header_t *h)
+{
+  return (stg_shm_ranger_info_t *)((char *)h + h->rangers_offset);
+}
+
+static inline stg_shm_command_t *stg_shm_commands(const stg_shm_header_t *h)
+{
+  return (stg_shm_command_t *)((char *)h + h->commands_offset);
+}
+
+/** Returns frame number i of the ring */
+static inline stg_shm_frame_t *stg_shm_frame(const stg_shm_header_t *h, uint64_t i)
+{
+  return (stg_shm_frame_t *)((char *)h + h->frames_offset + (i % h->frame_count) * h->frame_size);
+}
+
+static inline stg_shm_robot_t *stg_shm_frame_robots(const stg_shm_frame_t *frame)
+{
+  return (stg_shm_robot_t *)(frame + 1);
+}
+
+static inline float *stg_shm_frame_ranges(const stg_shm_header_t *h, const stg_shm_frame_t *frame)
+{
+  return (float *)(stg_shm_frame_robots(frame) + h->robot_count);
+}
+
+/** A client's view of a segment */
+typedef struct stg_shm {
+  stg_shm_header_t *header;
+  size_t size;
+} stg_shm_t;
+
+/** Map the segment a world published as name, eg. "/stage". Returns
+    NULL on failure. */
+stg_shm_t *stg_shm_open(const char *name);
+
+/** Unmap the segment */
+void stg_shm_close(stg_shm_t *shm);
+
+/** Returns the index of the named position model or ranger, or -1 */
+int stg_shm_find_robot(const stg_shm_t *shm, const char *name);
+int stg_shm_find_ranger(const stg_shm_t *shm, const char *name);
+
+/** Copy the latest frame into frame, which must have room for
+    header->frame_size bytes. Returns 0, or -1 if no frame has been
+    published, the world has gone, or no frame could be read whole
+    within STG_SHM_READ_TIMEOUT_USEC, as when the world died while
+    writing one. */
+int stg_shm_read(const stg_shm_t *shm, stg_shm_frame_t *frame);
+
+/** Returns the latest frame in place, or NULL if there is none. In
+    lockstep the world does not write it again until stg_shm_step(),
+    so it can be read without copying. */
+const stg_shm_frame_t *stg_shm_latest(const stg_shm_t *shm);
+
+/** Set the velocity of position model robot from the next update on */
+void stg_shm_command(stg_shm_t *shm, unsigned int robot, double x, double y, double a);
+
+/** In lockstep, let the world make one update and wait for it.
+    Returns 0, or -1 if the world is not in lockstep or has gone. */
+int stg_shm_step(stg_shm_t *shm);
+
+/** Wait until a frame later than tick is published. Returns 0, or -1
+    if the world has gone. */
+int stg_shm_wait(const stg_shm_t *shm, uint64_t tick);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,454 @@
+/*
+  trajectorylog.cc
+  an append-only binary log of model poses, filled by the simulation
+  threads and written by a background thread, and its replay.
+*/
+
+#include <errno.h>
+#include <sys/time.h> // for gettimeofday(2)
+
+#include "stage.hh"
+
+using namespace Stg;
+
+const char TrajectoryLog::MAGIC[8] = { 'S', 'T', 'G', 'L', 'O', 'G', 0, 0 };
+const uint32_t TrajectoryLog::FORMAT_VERSION;
+
+TrajectoryLog::TrajectoryLog()
+    : fp(NULL), filename(), ring(), written(0), writer(), append_mutex(), mutex(), wake(),
+      drained(), running(false)
+{
+  pthread_mutex_init(&append_mutex, NULL);
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&wake, NULL);
+  pthread_cond_init(&drained, NULL);
+}
+
+TrajectoryLog::~TrajectoryLog()
+{
+  Close();
+  pthread_mutex_destroy(&append_mutex);
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&wake);
+  pthread_cond_destroy(&drained);
+}
+
+bool TrajectoryLog::Open(const std::string &name, const World &world, size_t ring_size)
+{
+  Close();
+
+  fp = fopen(name.c_str(), "wb");
+  if (fp == NULL) {
+    PRINT_ERR2("failed to open trajectory log \"%s\": %s", name.c_str(), strerror(errno));
+    return false;
+  }
+
+  // the writer sends many records at a time, so buffer generously
+  setvbuf(fp, NULL, _IOFBF, 1 << 20);
+
+  filename = name;
+  written = 0;
+
+  const std::set<Model *> models(world.GetAllModels());
+  const uint32_t version(FORMAT_VERSION), record_size(sizeof(Record));
+  const uint32_t model_count(models.size());
+  const uint64_t interval(world.sim_interval);
+
+  fwrite(MAGIC, sizeof(MAGIC), 1, fp);
+  fwrite(&version, sizeof(version), 1, fp);
+  fwrite(&record_size, sizeof(record_size), 1, fp);
+  fwrite(&model_count, sizeof(model_count), 1, fp);
+  fwrite(&interval, sizeof(interval), 1, fp);
+
+  FOR_EACH (it, models) {
+    const uint32_t id((*it)->GetId());
+    const std::string token((*it)->TokenStr());
+    const uint32_t length(token.size());
+
+    fwrite(&id, sizeof(id), 1, fp);
+    fwrite(&length, sizeof(length), 1, fp);
+    fwrite(token.data(), 1, length, fp);
+  }
+
+  if (ferror(fp)) {
+    PRINT_ERR1("failed to write trajectory log \"%s\"", name.c_str());
+    fclose(fp);
+    fp = NULL;
+    return false;
+  }
+
+  ring.records.assign(std::max(ring_size, (size_t)1), Record());
+  ring.head = ring.tail = 0;
+
+  running = true;
+  pthread_create(&writer, NULL, TrajectoryLog::writer_entry, this);
+  return true;
+}
+
+void TrajectoryLog::Close()
+{
+  if (fp == NULL)
+    return;
+
+  pthread_mutex_lock(&mutex);
+  running = false;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&mutex);
+
+  pthread_join(writer, NULL);
+
+  // anything logged while the writer was stopping
+  Drain();
+
+  if (fclose(fp) != 0)
+    PRINT_ERR2("failed to write trajectory log \"%s\": %s", filename.c_str(), strerror(errno));
+
+  fp = NULL;
+  ring.records.clear();
+}
+
+void TrajectoryLog::Write(const Record *records, size_t count)
+{
+  const size_t size(ring.records.size());
+
+  pthread_mutex_lock(&append_mutex);
+
+  for (size_t i(0); i < count; ++i) {
+    // full: wait for the writer to catch up. It moves the tail before
+    // taking the mutex to signal drained, so checking under the mutex
+    // can not miss the signal.
+    if (ring.head - ring.tail >= size) {
+      pthread_mutex_lock(&mutex);
+      while (ring.head - ring.tail >= size) {
+        pthread_cond_signal(&wake);
+        pthread_cond_wait(&drained, &mutex);
+      }
+      pthread_mutex_unlock(&mutex);
+    }
+
+    ring.records[ring.head % size] = records[i];
+
+    // the record must be complete before the writer can see it
+    __sync_synchronize();
+    ++ring.head;
+
+    if (ring.head - ring.tail == size / 2) {
+      pthread_mutex_lock(&mutex);
+      pthread_cond_signal(&wake);
+      pthread_mutex_unlock(&mutex);
+    }
+  }
+
+  pthread_mutex_unlock(&append_mutex);
+}
+
+void *TrajectoryLog::writer_entry(void *arg)
+{
+  TrajectoryLog *log(static_cast<TrajectoryLog *>(arg));
+
+  pthread_mutex_lock(&log->mutex);
+
+  while (log->running) {
+    // wake now and then even if the ring does not fill, so that the file
+    // keeps up with slow simulations
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    struct timespec until;
+    until.tv_sec = now.tv_sec;
+    until.tv_nsec = now.tv_usec * 1000 + 10000000;
+    if (until.tv_nsec >= 1000000000) {
+      until.tv_sec += 1;
+      until.tv_nsec -= 1000000000;
+    }
+
+    pthread_cond_timedwait(&log->wake, &log->mutex, &until);
+
+    pthread_mutex_unlock(&log->mutex);
+    log->Drain();
+    pthread_mutex_lock(&log->mutex);
+
+    pthread_cond_broadcast(&log->drained);
+  }
+
+  pthread_mutex_unlock(&log->mutex);
+  return NULL;
+}
+
+void TrajectoryLog::Drain()
+{
+  const size_t size(ring.records.size());
+  const size_t head(ring.head);
+  __sync_synchronize();
+
+  size_t tail(ring.tail);
+
+  while (tail < head) {
+    // up to the end of the ring, then from its start
+    const size_t start(tail % size);
+    const size_t count(std::min(head - tail, size - start));
+
+    if (fwrite(&ring.records[start], sizeof(Record), count, fp) != count)
+      PRINT_ERR1("failed to write trajectory log \"%s\"", filename.c_str());
+
+    tail += count;
+    written += count;
+  }
+
+  // the records must be copied before a logging thread can reuse them
+  __sync_synchronize();
+  ring.tail = tail;
+}
+
+/** Orders records by update, and otherwise as they were logged */
+class TickLess {
+public:
+  bool operator()(const TrajectoryLog::Record &a, const TrajectoryLog::Record &b) const
+  {
+    return a.tick < b.tick;
+  }
+};
+
+TrajectoryReplay::TrajectoryReplay()
+    : loaded(false), interval(0), names(), records(), bound(), positions()
+{
+}
+
+bool TrajectoryReplay::Read(const std::string &filename)
+{
+  loaded = false;
+  names.clear();
+  records.clear();
+  bound.clear();
+  positions.clear();
+
+  FILE *fp(fopen(filename.c_str(), "rb"));
+  if (fp == NULL) {
+    PRINT_ERR2("failed to open trajectory log \"%s\": %s", filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  char magic[sizeof(TrajectoryLog::MAGIC)];
+  uint32_t version(0), record_size(0), model_count(0);
+  uint64_t logged_interval(0);
+
+  bool ok(fread(magic, sizeof(magic), 1, fp) == 1
+          && memcmp(magic, TrajectoryLog::MAGIC, sizeof(magic)) == 0
+          && fread(&version, sizeof(version), 1, fp) == 1
+          && version == TrajectoryLog::FORMAT_VERSION
+          && fread(&record_size, sizeof(record_size), 1, fp) == 1
+          && record_size == sizeof(TrajectoryLog::Record)
+          && fread(&model_count, sizeof(model_count), 1, fp) == 1
+          && fread(&logged_interval, sizeof(logged_interval), 1, fp) == 1);
+
+  for (uint32_t i(0); ok && i < model_count; ++i) {
+    uint32_t id(0), length(0);
+    ok = fread(&id, sizeof(id), 1, fp) == 1 && fread(&length, sizeof(length), 1, fp) == 1;
+
+    std::string name(length, '\0');
+    ok = ok && (length == 0 || fread(&name[0], 1, length, fp) == length);
+    names[id] = name;
+  }
+
+  if (!ok) {
+    PRINT_ERR1("\"%s\" is not a trajectory log from this version of Stage", filename.c_str());
+    fclose(fp);
+    return false;
+  }
+
+  TrajectoryLog::Record buf[1024];
+  size_t count;
+  while ((count = fread(buf, sizeof(buf[0]), sizeof(buf) / sizeof(buf[0]), fp)) > 0)
+    records.insert(records.end(), buf, buf + count);
+
+  fclose(fp);
+
+  // records are logged in order of update, but a controller could
+  // log a model in its update after the world did
+  std::stable_sort(records.begin(), records.end(), TickLess());
+
+  interval = logged_interval;
+  loaded = true;
+  return true;
+}
+
+void TrajectoryReplay::Bind(const World &world)
+{
+  bound.clear();
+  positions.clear();
+
+  unsigned int missing(0);
+
+  FOR_EACH (it, names) {
+    Model *mod(world.GetModel(it->second));
+    if (mod == NULL) {
+      ++missing;
+      continue;
+    }
+
+    if (it->first >= bound.size()) {
+      bound.resize(it->first + 1, NULL);
+      positions.resize(it->first + 1, NULL);
+    }
+
+    bound[it->first] = mod;
+    positions[it->first] = dynamic_cast<ModelPosition *>(mod);
+  }
+
+  if (missing)
+    PRINT_WARN1("%u models in the trajectory log are not in the world, and will not be replayed",
+                missing);
+}
+
+void TrajectoryReplay::Unbind()
+{
+  bound.clear();
+  positions.clear();
+}
+
+void TrajectoryReplay::Replay(const TrajectoryLog::Record &record) const
+{
+  if (record.model >= bound.size() || bound[record.model] == NULL)
+    return;
+
+  Model *mod(bound[record.model]);
+  mod->SetGlobalPose(Pose(record.pose[0], record.pose[1], record.pose[2], record.pose[3]));
+  mod->SetStall(record.flags & TrajectoryLog::STALLED);
+
+  if (positions[record.model])
+    positions[record.model]->SetVelocity(
+        Velocity(record.velocity[0], record.velocity[1], 0, record.velocity[2]));
+}
+
+void TrajectoryReplay::Apply(uint64_t tick) const
+{
+  TrajectoryLog::Record key;
+  key.tick = tick;
+
+  const std::pair<std::vector<TrajectoryLog::Record>::const_iterator,
+                  std::vector<TrajectoryLog::Record>::const_iterator>
+      range(std::equal_range(records.begin(), records.end(), key, TickLess()));
+
+  for (std::vector<TrajectoryLog::Record>::const_iterator it(range.first); it != range.second;
+       ++it)
+    Replay(*it);
+}
+
+void TrajectoryReplay::Seek(uint64_t tick) const
+{
+  TrajectoryLog::Record key;
+  key.tick = tick;
+
+  std::vector<TrajectoryLog::Record>::const_iterator it(
+      std::upper_bound(records.begin(), records.end(), key, TickLess()));
+
+  // walk back until every model has been posed once
+  std::vector<bool> posed(bound.size(), false);
+  size_t remaining(bound.size() - std::count(bound.begin(), bound.end(), (Model *)NULL));
+
+  while (remaining && it != records.begin()) {
+    --it;
+    if (it->model < bound.size() && bound[it->model] && !posed[it->model]) {
+      posed[it->model] = true;
+      --remaining;
+      Replay(*it);
+    }
+  }
+}
+
+bool World::StartLog(const std::string &filename, size_t ring_size)
+{
+  return trajectory_log.Open(filename, *this, ring_size);
+}
+
+void World::LogRecord(Model *mod, TrajectoryLog::Record &record) const
+{
+  record.tick = updates;
+  record.model = mod->GetId();
+  record.flags = mod->Stalled() ? TrajectoryLog::STALLED : 0;
+
+  const Pose pose(mod->GetGlobalPose());
+  record.pose[0] = pose.x;
+  record.pose[1] = pose.y;
+  record.pose[2] = pose.z;
+  record.pose[3] = pose.a;
+
+  const ModelPosition *pos(dynamic_cast<ModelPosition *>(mod));
+  const Velocity vel(pos ? pos->GetVelocity() : Velocity(0, 0, 0, 0));
+  record.velocity[0] = vel.x;
+  record.velocity[1] = vel.y;
+  record.velocity[2] = vel.a;
+}
+
+void World::Log(Model *mod)
+{
+  if (!trajectory_log.IsOpen())
+    return;
+
+  TrajectoryLog::Record record;
+  LogRecord(mod, record);
+  trajectory_log.Write(&record, 1);
+}
+
+void World::LogModels()
+{
+  log_records.clear();
+
+  FOR_EACH (it, logged_models) {
+    const uint64_t ticks(std::max((usec_t)1, (*it)->GetLogInterval() / sim_interval));
+    if (updates % ticks == 0) {
+      log_records.push_back(TrajectoryLog::Record());
+      LogRecord(*it, log_records.back());
+    }
+  }
+
+  if (!log_records.empty())
+    trajectory_log.Write(&log_records[0], log_records.size());
+}
+
+bool World::StartReplay(const std::string &filename, bool sensors)
+{
+  if (Replaying()) {
+    PRINT_ERR("the world is already replaying a trajectory log");
+    return false;
+  }
+
+  if (!replay.Read(filename))
+    return false;
+
+  replay_sensors = sensors;
+
+  // a world that is not loaded yet binds it in LoadWorldPostHook()
+  if (wf)
+    BindReplay();
+
+  return true;
+}
+
+void World::BindReplay()
+{
+  if (replay.GetInterval() != sim_interval)
+    PRINT_WARN2("the trajectory log was recorded every %.3f msec, but the world updates every "
+                "%.3f msec",
+                replay.GetInterval() / 1e3, sim_interval / 1e3);
+
+  replay.Bind(*this);
+
+  if (replay_sensors)
+    FOR_EACH (it, models)
+      if (dynamic_cast<ModelRanger *>(*it) || dynamic_cast<ModelFiducial *>(*it))
+        (*it)->Subscribe();
+}
+
+void World::SeekReplay(uint64_t tick)
+{
+  if (!Replaying())
+    return;
+
+  tick = std::min(tick, replay.LastTick());
+
+  updates = tick;
+  sim_time = tick * sim_interval;
+  replay.Seek(tick);
+  dirty = true;
+}
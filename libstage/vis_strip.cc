@@ -21,24 +21,53 @@ StripPlotVis::~StripPlotVis()
     free(data);
 }
 
-void StripPlotVis::Visualize(Model *mod, Camera *)
-{
-  Canvas *canvas = dynamic_cast<WorldGui *>(mod->GetWorld())->GetCanvas();
+// the values of a strip plot, as the canvas draws them
+class StripPlotData : public VisData {
+public:
+  StripPlotData(const float *data, size_t len, size_t count, float x, float y, float w, float h,
+                float min, float max, Color fgcolor, Color bgcolor)
+      : values(data, data + len), count(count), x(x), y(y), w(w), h(h), min(min), max(max),
+        fgcolor(fgcolor), bgcolor(bgcolor)
+  {
+  }
+
+  virtual VisData *Clone() const { return new StripPlotData(*this); }
+
+  virtual void Draw(Canvas *canvas, Camera *, const RenderModel &rm) const
+  {
+    if (!canvas->selected(rm.mod)) // == canvas->SelectedVisualizeAll() )
+      return;
+
+    canvas->EnterScreenCS();
 
-  if (!canvas->selected(mod)) // == canvas->SelectedVisualizeAll() )
-    return;
+    canvas->PushColor(bgcolor);
+    glRectf(x, y, w, h);
+    canvas->PopColor();
 
-  canvas->EnterScreenCS();
+    canvas->PushColor(fgcolor);
+    Gl::draw_array(x, y, w, h, &values[0], values.size(), count % values.size(), min, max);
+    canvas->PopColor();
 
-  mod->PushColor(bgcolor);
-  glRectf(x, y, w, h);
-  mod->PopColor();
+    canvas->LeaveScreenCS();
+  }
 
-  mod->PushColor(fgcolor);
-  Gl::draw_array(x, y, w, h, data, len, count % len, min, max);
-  mod->PopColor();
+private:
+  mutable std::vector<float> values; // Gl::draw_array() takes a non-const array
+  size_t count;
+  float x, y, w, h, min, max;
+  Color fgcolor, bgcolor;
+};
 
-  canvas->LeaveScreenCS();
+void StripPlotVis::Visualize(Model *mod, Camera *)
+{
+  // the canvas draws the plot from its snapshot, as copied by Capture()
+  (void)mod;
+}
+
+VisData *StripPlotVis::Capture(Model *mod)
+{
+  (void)mod;
+  return new StripPlotData(data, len, count, x, y, w, h, min, max, fgcolor, bgcolor);
 }
 
 void StripPlotVis::AppendValue(float value)
@@ -20,11 +20,34 @@
     interval_sim            100
     quit_time                 0
     resolution                0.02
+    raytrace               "grid"
 
     show_clock                0
     show_clock_interval     100
     threads                   1
 
+    region_bits               5
+    superregion_bits          5
+
+    grid_memory               0
+    grid_idle                10
+
+    memory_report_interval    0
+
+    trace_file               ""
+    trace_spans          262144
+
+    log_file                 ""
+    log_interval              0
+    log_buffer            32768
+
+    dissipation_file         ""
+    dissipation_resolution  1.0
+
+    shm_name                 ""
+    shm_lockstep              0
+    shm_frames                4
+
     @endverbatim
 
     @par Details
@@ -52,6 +75,16 @@
     values speed up raytracing at the expense of fidelity in collision
     detection and sensing. The default is often a reasonable choice.
 
+    - raytrace "grid" or "exact"\n
+    How sensors trace rays. "grid" walks the cells of the bitmap
+    model, so ranges are only accurate to the resolution. "exact"
+    intersects rays with the edges of the models' polygons, so ranges
+    do not depend on the resolution, which then only affects collision
+    detection. The edges of models that can move by themselves are
+    refit every update, so "exact" costs more per update but can be
+    cheaper per ray in sparse worlds. Ranger sensors can override
+    this. Defaults to "grid".
+
     - show_clock <int>\n
     If non-zero, print the simulation time on stdout every
     $show_clock_interval updates. Useful to watch the progress of
@@ -68,9 +101,108 @@
     depending on the number of CPU cores available and the
     worldfile. As a guideline, use one thread per core if you have
     parallel-enabled high-resolution models, e.g. a laser with
-    hundreds or thousands of samples, or lots of models. Defaults to
+    hundreds or thousands of samples, or lots of models. The same
+    number of threads is used to decode and polygonize the bitmaps
+    named in the worldfile while it is loading, which shortens the
+    startup time of worlds with several large maps. Defaults to
     1. Values of less than 1 will be forced to 1.
 
+    - region_bits <int>\n
+    The raytracing grid is divided into square regions of
+    2^region_bits cells on a side, and empty regions are skipped
+    quickly. Larger regions skip more empty space in sparse worlds;
+    smaller ones use less memory in dense maps. Values of 3 to 7 are
+    supported. Defaults to 5.
+
+    - superregion_bits <int>\n
+    Regions are grouped into superregions of 2^superregion_bits
+    regions on a side, which are allocated only where there are
+    models. Values of 4 to 6 are supported. Defaults to 5.
+
+    - grid_memory <float>\n
+    If non-zero, the approximate limit in megabytes on the memory used
+    by the raytracing grid. Superregions that contain only static
+    models (those that are not position models or attached to one)
+    and have not been used for $grid_idle seconds are evicted, least
+    recently used first, to a compact list of their occupied cells.
+    They are restored when a ray or a moving model next reaches them.
+    With a limit set, static models are mapped into new superregions
+    in compact form, so very large maps can be used at a fine
+    resolution. Defaults to 0 (no limit).
+
+    - grid_idle <float>\n
+    The number of simulated seconds a superregion must go unused
+    before it may be evicted to stay within $grid_memory. Defaults
+    to 10.
+
+    - memory_report_interval <float>\n
+    If non-zero, print the memory used by the grid, the blocks, the
+    models and their trails and the dissipation map on stdout every this
+    many simulated seconds, when running without a GUI. Useful to size
+    large batch jobs. See World::MemoryReport(). Defaults to 0 (no
+    reports).
+
+    - trace_file <string>\n
+    If set, record how long each update, each phase of the updates,
+    each thread's share of the events and each model's update took,
+    and write them to this file in Chrome trace-event JSON when the
+    world quits. Load the file in chrome://tracing or Perfetto to see
+    why some updates are slower than others. The path is relative to
+    the working directory. Equivalent to the --trace option of
+    Stage. Defaults to "" (no tracing).
+
+    - trace_spans <int>\n
+    The number of spans of time each thread keeps while tracing. Only
+    the latest are written, so this bounds the memory used by long
+    runs to about 32 bytes per span per thread. Defaults to 262144.
+
+    - log_file <string>\n
+    If set, log the trajectories of models to this binary file while
+    the world runs. The pose, velocity and stall state of each model
+    with a log interval are recorded every log interval. Print the log
+    with the stagelog program. See TrajectoryLog. The path is relative
+    to the working directory. Defaults to "" (no log).
+
+    - log_interval <float>\n
+    The default log interval of position models, in msec, rounded to
+    a whole number of updates. Any model can set its own log_interval.
+    Defaults to 0 (position models are not logged).
+
+    - log_buffer <int>\n
+    The number of records that can be queued before logging has to
+    wait for them to be written, at 72 bytes each. Defaults to 32768.
+
+    - dissipation_file <string>\n
+    If set, record where the power packs dissipate their energy, for
+    each model that owns a pack, and write the map to this binary file
+    when the world quits. See DissipationMap for the format. The path
+    is relative to the working directory. Without it, the map is made
+    only when the energy dissipation visualizer is first shown.
+    Defaults to "" (no file).
+
+    - dissipation_resolution <float>\n
+    The side of the square cells of the dissipation map, in
+    meters. Defaults to 1.
+
+    - shm_name <string>\n
+    If set, publish the poses and ranges of the position models after
+    each update to POSIX shared memory of this name, eg. "/stage", and
+    set their velocities from the commands written there, for
+    controllers in other processes. See ShmBridge, and stageshm.h for
+    the client library. The bridge is not started if memory of that
+    name already exists, so that two worlds never share it; remove
+    /dev/shm/<name> if a world that crashed left it behind. Defaults
+    to "" (no shared memory).
+
+    - shm_lockstep <int>\n
+    If 1, each update waits for the client to call stg_shm_step(), so
+    that it drives the simulation time. Defaults to 0.
+
+    - shm_frames <int>\n
+    The number of frames in the shared memory ring. More frames give
+    slow readers longer to copy a frame before it is overwritten.
+    Defaults to 4.
+
     @par More examples
     The Stage source distribution contains several example world files in
     <tt>(stage src)/worlds</tt> along with the worldfile properties
@@ -90,11 +222,13 @@ using std::abs;
 
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
 #include <libgen.h> // for dirname(3)
 #include <limits.h>
 #include <locale.h>
 #include <string.h> // for strdup(3)
 
+#include "bvh.hh"
 #include "file_manager.hh"
 #include "option.hh"
 #include "region.hh"
@@ -124,23 +258,49 @@ bool World::quit_all(false);
 std::set<World *> World::world_set;
 std::string World::ctrlargs;
 std::vector<std::string> World::args;
+std::vector<std::string> World::type_names;
+pthread_mutex_t World::type_names_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// a clock for the profiling counters, in seconds
+static double stats_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
 
 World::World(const std::string &,
              double ppm)
     : // private
       destroy(false),
       dirty(true), models(), models_by_name(), models_with_fiducials(), models_with_fiducials_byx(),
-      models_with_fiducials_byy(), ppm(ppm), // raytrace resolution
+      models_with_fiducials_byy(), blob_models(), blob_models_dirty(true), clone_source(NULL),
+      ppm(ppm), // raytrace resolution
       quit(false), show_clock(false),
       show_clock_interval(100), // 10 simulated seconds using defaults
-      sync_mutex(), threads_working(0), threads_start_cond(), threads_done_cond(), total_subs(0),
-      worker_threads(1),
+      sync_mutex(), threads_working(0), threads_start_cond(), threads_done_cond(),
+      threads_exit(false), worker_ids(), total_subs(0),
+      worker_threads(1), random(), random_mutex(), random_seed(0),
+      grid_memory(0), grid_idle(10000000), // 10 seconds
+      grid_regions(0), grid_mutex(),
+      region_bits(DEFAULT_RBITS), superregion_bits(DEFAULT_SBITS),
+      raytrace_grid(&World::RaytraceGrid<DEFAULT_RBITS, DEFAULT_SBITS>),
+      map_poly_grid(&World::MapPolyGrid<DEFAULT_RBITS, DEFAULT_SBITS>),
+      exact_raytrace(false), exact_enabled(false), bvh_dirty(true), bvh_static(NULL),
+      bvh_dynamic(NULL), bvh_blocks(), stats_slots(1), stats(),
+      memory_report_interval(0), trajectory_log(), logged_models(), log_interval(0),
+      dissipation(NULL), dissipation_cellsize(1.0), dissipation_file(), log_records(),
+      shm_bridge(), replay(), replay_sensors(false),
+      tracing(false), trace_file(),
+      trace_start(0),
 
       // protected
-      cb_list(), extent(), graphics(false), option_table(), powerpack_list(), quit_time(0),
+      cb_list(), batch_cb_list(), extent(), graphics(false), option_table(), powerpack_list(),
+      energy(), quit_time(0),
       ray_list(), sim_time(0), superregions(), updates(0), wf(NULL), paused(false),
       event_queues(1), // use 1 thread by default
-      pending_update_callbacks(), active_energy(), active_velocity(),
+      pending_update_callbacks(), updated_models(), updated_batch(), active_energy(),
+      dirty_contacts(), active_velocity(),
       sim_interval(1e5), // 100 msec has proved a good default
       update_cb_count(0)
 {
@@ -152,6 +312,10 @@ World::World(const std::string &,
   pthread_mutex_init(&sync_mutex, NULL);
   pthread_cond_init(&threads_start_cond, NULL);
   pthread_cond_init(&threads_done_cond, NULL);
+  pthread_mutex_init(&grid_mutex, NULL);
+  pthread_mutex_init(&random_mutex, NULL);
+
+  SeedRandom(lrand48());
 
   World::world_set.insert(this);
 
@@ -166,10 +330,34 @@ World::World(const std::string &,
 World::~World(void)
 {
   PRINT_DEBUG1("destroying world %s", Token());
+  Finish(); // while its models exist
+
+  pthread_mutex_lock(&sync_mutex);
+  threads_exit = true;
+  pthread_cond_broadcast(&threads_start_cond);
+  pthread_mutex_unlock(&sync_mutex);
+
+  FOR_EACH (it, worker_ids)
+    pthread_join(*it, NULL);
+
   if (ground)
     delete ground;
+
+  // delete the models while the grid they are mapped into still exists
+  std::vector<Model *> doomed;
+  doomed.swap(children);
+  FOR_EACH (it, doomed)
+    delete *it;
+
+  FOR_EACH (it, superregions)
+    delete it->second;
+  superregions.clear();
+
   if (wf)
     delete wf;
+  delete bvh_static;
+  delete bvh_dynamic;
+  delete dissipation;
   World::world_set.erase(this);
 }
 
@@ -204,15 +392,30 @@ void World::Run()
     // https://wiki.orfeo-toolbox.org/index.php/How_to_exit_every_fltk_window_in_the_world,
     // FLTK
     // is a piece of crap):
+    WorldGui *gui(dynamic_cast<WorldGui *>(*world_set.begin()));
+    gui->StartSimThread();
+
     while (Fl::first_window() && !World::quit_all) {
       Fl::wait();
     }
+
+    gui->StopSimThread();
   } else {
     while (!UpdateAll())
       ;
   }
 }
 
+void World::Finish()
+{
+  if (tracing)
+    WriteTrace();
+  if (!dissipation_file.empty())
+    WriteDissipation();
+  StopLog();
+  StopBridge();
+}
+
 bool World::UpdateAll()
 {
   bool quit(true);
@@ -229,17 +432,21 @@ void *World::update_thread_entry(std::pair<World *, int> *thread_info)
 {
   World *world(thread_info->first);
   const int thread_instance(thread_info->second);
+  delete thread_info;
 
   // printf( "thread ID %d waiting for mutex\n", thread_instance );
 
   pthread_mutex_lock(&world->sync_mutex);
 
-  while (1) {
+  // until the world is destroyed
+  while (!world->threads_exit) {
     // printf( "thread ID %d waiting for start\n", thread_instance );
     // wait until the main thread signals us
     // puts( "worker waiting for start signal" );
 
     pthread_cond_wait(&world->threads_start_cond, &world->sync_mutex);
+    if (world->threads_exit)
+      break;
     pthread_mutex_unlock(&world->sync_mutex);
 
     // printf( "worker %u thread awakes for task %u\n", thread_instance, task );
@@ -258,6 +465,7 @@ void *World::update_thread_entry(std::pair<World *, int> *thread_info)
     // keep lock going round the loop
   }
 
+  pthread_mutex_unlock(&world->sync_mutex);
   return NULL;
 }
 
@@ -265,6 +473,8 @@ void World::AddModel(Model *mod)
 {
   models.insert(mod);
   models_by_name[mod->token] = mod;
+  bvh_dirty = true;
+  blob_models_dirty = true;
 }
 
 void World::AddModelName(Model *mod, const std::string &name)
@@ -278,6 +488,48 @@ void World::RemoveModel(Model *mod)
   models_by_name.erase(mod->token);
 
   models.erase(mod);
+  bvh_dirty = true;
+  blob_models_dirty = true;
+
+  if (mod->log_interval)
+    EraseAll(mod, logged_models);
+
+  if (mod->contacts_dirty)
+    EraseAll(mod, dirty_contacts);
+  FOR_EACH (it, mod->contacts)
+    EraseAll(mod, (*it)->contacts);
+  mod->contacts.clear();
+}
+
+// colors are compared to within 1/255 to find blob models
+static uint32_t blob_key(const Color &col)
+{
+  return (static_cast<uint32_t>(col.r * 255.0 + 0.5) << 16)
+         | (static_cast<uint32_t>(col.g * 255.0 + 0.5) << 8)
+         | static_cast<uint32_t>(col.b * 255.0 + 0.5);
+}
+
+void World::UpdateBlobModels()
+{
+  if (!blob_models_dirty)
+    return;
+
+  blob_models_dirty = false;
+  blob_models.clear();
+
+  FOR_EACH (it, models)
+    if ((*it)->vis.blob_return)
+      blob_models[blob_key((*it)->color)].push_back(*it);
+}
+
+const std::vector<Model *> &World::BlobModels(const Color &col) const
+{
+  // for colors no model has
+  static const std::vector<Model *> none;
+
+  std::map<uint32_t, std::vector<Model *> >::const_iterator it(
+      blob_models.find(blob_key(col)));
+  return it == blob_models.end() ? none : it->second;
 }
 
 void World::LoadBlock(Worldfile *wf, int entity)
@@ -405,6 +657,15 @@ void World::LoadWorldPostHook()
 
   this->ppm = 1.0 / wf->ReadFloat(0, "resolution", 1.0 / this->ppm);
 
+  SetGridBits(wf->ReadInt(0, "region_bits", this->region_bits),
+              wf->ReadInt(0, "superregion_bits", this->superregion_bits));
+
+  const std::string raytrace(wf->ReadString(0, "raytrace", "grid"));
+  if (raytrace == "exact")
+    this->exact_raytrace = this->exact_enabled = true;
+  else if (raytrace != "grid")
+    PRINT_WARN1("raytrace \"%s\" is not \"grid\" or \"exact\"; using the grid", raytrace.c_str());
+
   this->show_clock = wf->ReadInt(0, "show_clock", this->show_clock);
 
   this->show_clock_interval = wf->ReadInt(0, "show_clock_interval", this->show_clock_interval);
@@ -418,8 +679,33 @@ void World::LoadWorldPostHook()
     this->worker_threads = 1;
   }
 
+  // read megabytes and seconds: easier for user
+  this->grid_memory = (size_t)(1e6 * wf->ReadFloat(0, "grid_memory", this->grid_memory / 1e6));
+  this->grid_idle = (usec_t)(1e6 * wf->ReadFloat(0, "grid_idle", this->grid_idle / 1e6));
+
+  // read msec instead of usec, as for update_interval
+  this->log_interval = (usec_t)(1e3 * wf->ReadFloat(0, "log_interval", this->log_interval / 1e3));
+
+  const double memory_report(wf->ReadFloat(0, "memory_report_interval", 0));
+  if (memory_report > 0)
+    this->memory_report_interval =
+        std::max((uint64_t)1, (uint64_t)(1e6 * memory_report / sim_interval));
+
   pending_update_callbacks.resize(worker_threads + 1);
+  updated_models.resize(worker_threads + 1);
   event_queues.resize(worker_threads + 1);
+  stats_slots.resize(worker_threads + 1);
+
+  // a clone would overwrite the original's trace
+  const std::string trace(wf->ReadString(0, "trace_file", ""));
+  if (!trace.empty() && clone_source == NULL) {
+    int spans(wf->ReadInt(0, "trace_spans", 1 << 18));
+    if (spans < 1) {
+      PRINT_WARN("trace_spans set to <1. Forcing to 1");
+      spans = 1;
+    }
+    StartTrace(trace, spans);
+  }
 
   // printf( "worker threads %d\n", worker_threads );
 
@@ -435,11 +721,18 @@ void World::LoadWorldPostHook()
     pthread_t pt;
     pthread_create(&pt, NULL, (func_ptr)World::update_thread_entry,
                    new std::pair<World *, int>(this, t + 1));
+    worker_ids.push_back(pt);
   }
 
   if (worker_threads > 1)
     printf("[threads %u]", worker_threads);
 
+  // the expensive part of loading large maps is independent of the
+  // rest of the world, so do it up front in parallel. Clones copy the
+  // geometry instead.
+  if (clone_source == NULL)
+    DecodeBitmaps();
+
   // Iterate through entitys and create objects of the appropriate type
   for (int entity(1); entity < wf->GetEntityCount(); ++entity) {
     const char *typestr = (char *)wf->GetEntityType(entity);
@@ -457,28 +750,171 @@ void World::LoadWorldPostHook()
 
   // call all controller init functions
   FOR_EACH (it, models) {
-    (*it)->blockgroup.CalcSize();
+    std::map<std::string, Model *>::const_iterator source;
+
+    if (clone_source
+        && (source = clone_source->models_by_name.find((*it)->Token()))
+               != clone_source->models_by_name.end())
+      (*it)->blockgroup.ShareShape(source->second->blockgroup);
+    else {
+      (*it)->blockgroup.CalcSize();
+      (*it)->blockgroup.Share(); // with any identical models loaded before
+    }
     (*it)->UnMap(); // clears both layers
     (*it)->Map(); // maps both layers
 
     // to here
   }
 
-  // the world is all done - run any init code for user's controllers
+  // the models have taken the decoded bitmaps they use
+  bitmap_polys.clear();
+
+  // the models were seeded when created, but may have been renamed since
   FOR_EACH (it, models)
-    (*it)->InitControllers();
+    (*it)->SeedRandom(random_seed);
+
+  // a clone would overwrite the original's log, and a replay
+  // probably its own
+  const std::string log_file(wf->ReadString(0, "log_file", ""));
+  if (!log_file.empty() && clone_source == NULL && !Replaying()) {
+    int ring_size(wf->ReadInt(0, "log_buffer", 1 << 15));
+    if (ring_size < 1) {
+      PRINT_WARN("log_buffer set to <1. Forcing to 1");
+      ring_size = 1;
+    }
+    StartLog(log_file, ring_size);
+  }
+
+  dissipation_cellsize = wf->ReadLength(0, "dissipation_resolution", dissipation_cellsize);
+  if (dissipation_cellsize <= 0) {
+    PRINT_WARN("dissipation_resolution set to <=0. Forcing to 1");
+    dissipation_cellsize = 1.0;
+  }
+
+  // like the log, a clone would overwrite the original's file
+  const std::string dissipation_name(wf->ReadString(0, "dissipation_file", ""));
+  if (!dissipation_name.empty() && clone_source == NULL) {
+    dissipation_file = dissipation_name;
+    EnableDissipation();
+  }
+
+  // two worlds can not share a segment
+  const std::string shm_name(wf->ReadString(0, "shm_name", ""));
+  if (!shm_name.empty() && clone_source == NULL) {
+    int frames(wf->ReadInt(0, "shm_frames", 4));
+    if (frames < 1) {
+      PRINT_WARN("shm_frames set to <1. Forcing to 1");
+      frames = 1;
+    }
+    StartBridge(shm_name, wf->ReadInt(0, "shm_lockstep", 0), frames);
+  }
+
+  // the world is all done - run any init code for user's controllers,
+  // unless the log is in charge. Replaying sensors runs them on what
+  // the sensors see at the recorded poses.
+  if (Replaying())
+    BindReplay();
+
+  if (!Replaying() || replay_sensors)
+    FOR_EACH (it, models)
+      (*it)->InitControllers();
 
   putchar('\n');
 }
 
-void World::UnLoad()
+/** A batch of bitmaps shared by the threads started in
+    World::DecodeBitmaps(). Each thread claims the next undecoded
+    image until none are left. */
+class BitmapJob {
+public:
+  std::vector<std::string> paths;
+  std::vector<std::vector<std::vector<point_t> > > polys;
+  std::vector<int> failed;
+  unsigned int next; ///< index of the next unclaimed image
+
+  BitmapJob() : paths(), polys(), failed(), next(0) {}
+};
+
+void *World::decode_bitmap_thread_entry(void *arg)
 {
-  if (wf)
-    delete wf;
+  BitmapJob *job(static_cast<BitmapJob *>(arg));
+
+  for (unsigned int i(__sync_fetch_and_add(&job->next, 1)); i < job->paths.size();
+       i = __sync_fetch_and_add(&job->next, 1))
+    job->failed[i] = polys_from_image_file(job->paths[i], job->polys[i]);
+
+  return NULL;
+}
+
+void World::DecodeBitmaps()
+{
+  BitmapJob job;
+
+  // find the distinct images named by model entities, and how many
+  // models use each
+  std::map<std::string, unsigned int> users;
+  for (int entity(1); entity < wf->GetEntityCount(); ++entity) {
+    const char *typestr(wf->GetEntityType(entity));
+    if (strcmp(typestr, "window") == 0 || strcmp(typestr, "block") == 0
+        || strcmp(typestr, "sensor") == 0 || !wf->PropertyExists(entity, "bitmap"))
+      continue;
+
+    const std::string bitmapfile(wf->ReadString(entity, "bitmap", ""));
+    if (bitmapfile == "")
+      continue;
+
+    const std::string full(BlockGroup::BitmapPath(bitmapfile, wf));
+    if (users[full]++ == 0)
+      job.paths.push_back(full);
+  }
+
+  if (job.paths.empty())
+    return;
 
-  FOR_EACH (it, children)
+  job.polys.resize(job.paths.size());
+  job.failed.resize(job.paths.size(), 0);
+
+  const unsigned int thread_count(std::min((size_t)worker_threads, job.paths.size()));
+
+  // the calling thread does its share of the work
+  std::vector<pthread_t> threads(thread_count - 1);
+  for (unsigned int t(0); t < threads.size(); ++t)
+    pthread_create(&threads[t], NULL, World::decode_bitmap_thread_entry, &job);
+
+  decode_bitmap_thread_entry(&job);
+
+  for (unsigned int t(0); t < threads.size(); ++t)
+    pthread_join(threads[t], NULL);
+
+  // failures are reported when the model tries to load the image again
+  for (unsigned int i(0); i < job.paths.size(); ++i)
+    if (!job.failed[i]) {
+      DecodedBitmap &bitmap(bitmap_polys[job.paths[i]]);
+      bitmap.polys.swap(job.polys[i]);
+      bitmap.users = users[job.paths[i]];
+    }
+}
+
+void World::UnLoad()
+{
+  // these hold pointers to the models about to be deleted. A replay
+  // is bound again to the models of the next Load().
+  StopLog();
+  StopBridge();
+  replay.Unbind();
+
+  // so that a replay started now waits for the next Load(), and the
+  // destructor does not delete them again
+  delete wf;
+  wf = NULL;
+
+  // each child removes itself from children as it is deleted. The
+  // ground model is one of them.
+  std::vector<Model *> doomed;
+  doomed.swap(children);
+  FOR_EACH (it, doomed)
     delete (*it);
-  children.clear();
+  ground = NULL;
 
   models_by_name.clear();
   models_by_wfentity.clear();
@@ -490,6 +926,33 @@ void World::UnLoad()
   token = "[unloaded]";
 }
 
+World *World::Clone() const
+{
+  if (wf == NULL) {
+    PRINT_ERR("can not clone a world that has not been loaded");
+    return NULL;
+  }
+
+  PRINT_DEBUG1("cloning world %s", Token());
+
+  World *clone(new World(Token(), ppm));
+  clone->SetToken(Token());
+  clone->wf = new Worldfile(*wf);
+  clone->clone_source = this;
+  clone->LoadWorldPostHook();
+  clone->clone_source = NULL;
+
+  Snapshot snap;
+  SaveSnapshot(snap);
+
+  if (!clone->RestoreSnapshot(snap)) {
+    delete clone;
+    return NULL;
+  }
+
+  return clone;
+}
+
 bool World::PastQuitTime()
 {
   return ((quit_time > 0) && (sim_time >= quit_time));
@@ -543,6 +1006,25 @@ int World::RemoveUpdateCallback(world_callback_t cb, void *user)
   return cb_list.size();
 }
 
+void World::AddBatchUpdateCallback(world_batch_callback_t cb, void *user)
+{
+  batch_cb_list.push_back(std::pair<world_batch_callback_t, void *>(cb, user));
+}
+
+int World::RemoveBatchUpdateCallback(world_batch_callback_t cb, void *user)
+{
+  std::pair<world_batch_callback_t, void *> p(cb, user);
+
+  FOR_EACH (it, batch_cb_list) {
+    if ((*it) == p) {
+      batch_cb_list.erase(it);
+      break;
+    }
+  }
+
+  return batch_cb_list.size();
+}
+
 void World::CallUpdateCallbacks()
 {
   // call model CB_UPDATE callbacks queued up by worker threads
@@ -550,29 +1032,50 @@ void World::CallUpdateCallbacks()
   int cbcount(0);
 
   for (size_t t(0); t < threads; ++t) {
-    std::queue<Model *> &q(pending_update_callbacks[t]);
+    std::vector<Model *> &pending(pending_update_callbacks[t]);
 
     // 			printf( "pending callbacks for thread %u: %u\n",
     // 							(unsigned int)t,
-    // 							(unsigned int)q.size()
+    // 							(unsigned int)pending.size()
     // );
 
-    cbcount += q.size();
+    cbcount += pending.size();
 
-    while (!q.empty()) {
-      q.front()->CallUpdateCallbacks();
-      q.pop();
-    }
+    // a callback may update a model and so add to the list
+    for (size_t i(0); i < pending.size(); ++i)
+      pending[i]->CallUpdateCallbacks();
+
+    // keep the capacity for the next update
+    pending.clear();
   }
   //	printf( "cb total %u (global %d)\n\n", (unsigned
   // int)cbcount,update_cb_count );
 
   assert(update_cb_count >= cbcount);
 
+  // batch callbacks, with the models of all the threads in one list
+  updated_batch.clear();
+  FOR_EACH (it, updated_models) {
+    updated_batch.insert(updated_batch.end(), it->begin(), it->end());
+    it->clear();
+  }
+
+  if (!updated_batch.empty())
+    for (std::list<std::pair<world_batch_callback_t, void *> >::iterator it(batch_cb_list.begin());
+         it != batch_cb_list.end();) {
+      if (((*it).first)(this, updated_batch, (*it).second))
+        it = batch_cb_list.erase(it);
+      else
+        ++it;
+    }
+
   // world callbacks
-  FOR_EACH (it, cb_list) {
+  for (std::list<std::pair<world_callback_t, void *> >::iterator it(cb_list.begin());
+       it != cb_list.end();) {
     if (((*it).first)(this, (*it).second))
       it = cb_list.erase(it);
+    else
+      ++it;
   }
 }
 
@@ -583,6 +1086,10 @@ void World::ConsumeQueue(unsigned int queue_num)
   if (queue.empty())
     return;
 
+  std::vector<WorldStats::ModelType> &types(stats_slots[queue_num].types);
+  const double first(stats_time());
+  double end(first);
+
   // printf( "event queue len %d\n", (int)queue.size() );
 
   // update everything on the event queue that happens at this time or earlier
@@ -598,8 +1105,24 @@ void World::ConsumeQueue(unsigned int queue_num)
     // printf( "@ %llu next event <%s %llu %s>\n",  sim_time, modelType.c_str(),
     // ev.time, ev.mod->Token() );
 
+    const double start(end);
     ev.cb(ev.mod, ev.arg); // call the event's callback on the model
+    end = stats_time();
+    const double elapsed(end - start);
+
+    // the events of models created since the last one need new counters
+    if (ev.mod->type_index >= types.size())
+      types.resize(ev.mod->type_index + 1);
+
+    ++types[ev.mod->type_index].events;
+    types[ev.mod->type_index].time += elapsed;
+
+    if (tracing)
+      Trace(queue_num, NULL, ev.mod->id, start, end);
   } while (!queue.empty());
+
+  if (tracing && end > first)
+    Trace(queue_num, "events", 0, first, end);
 }
 
 bool World::Update()
@@ -609,16 +1132,36 @@ bool World::Update()
   // puts( "World::Update()" );
 
   // if we've run long enough, exit
-  if (PastQuitTime() || World::quit_all || this->quit)
+  if (PastQuitTime() || World::quit_all || this->quit
+      || (Replaying() && updates > replay.LastTick())) {
+    Finish();
     return true;
+  }
+
+  // in lockstep, the client may not have allowed this update yet
+  if (shm_bridge.IsOpen() && !shm_bridge.BeginUpdate())
+    return false;
 
   if (show_clock && ((this->updates % show_clock_interval) == 0)) {
     printf("\r[Stage: %s]", ClockString().c_str());
     fflush(stdout);
   }
 
+  if (memory_report_interval && !IsGUI() && (updates % memory_report_interval) == 0) {
+    printf("\n[Memory: %s %s]\n", Token(), ClockString().c_str());
+    MemoryReport().Print(stdout);
+  }
+
+  const double start(stats_time());
+  double then(start);
+
   sim_time += sim_interval;
 
+  if (Replaying()) {
+    replay.Apply(updates);
+    then = EndPhase("replay", stats.replay_time, then);
+  }
+
   // rebuild the sets sorted by position on x,y axis
   models_with_fiducials_byx.clear();
   models_with_fiducials_byy.clear();
@@ -631,31 +1174,51 @@ bool World::Update()
   // printf( "x %lu y %lu\n", models_with_fiducials_byy.size(),
   //			models_with_fiducials_byx.size() );
 
-  // handle the zeroth queue synchronously in the main thread
-  ConsumeQueue(0);
+  // before the blobfinders read it in the worker threads
+  UpdateBlobModels();
 
-  // handle all the remaining queues asynchronously in worker threads
-  pthread_mutex_lock(&sync_mutex);
-  threads_working = worker_threads;
-  // unblock the workers - they are waiting on this condition var
-  // puts( "main thread signalling workers" );
-  pthread_cond_broadcast(&threads_start_cond);
-  pthread_mutex_unlock(&sync_mutex);
+  if (exact_enabled) {
+    UpdateBvh();
+    then = EndPhase("bvh", stats.bvh_time, then);
+  }
+
+  // a replay handles events only to update its sensors
+  const bool handle_events(!Replaying() || replay_sensors);
+
+  if (handle_events) {
+    // handle the zeroth queue synchronously in the main thread
+    ConsumeQueue(0);
+    then = EndPhase("queue", stats.queue_time, then);
+
+    // handle all the remaining queues asynchronously in worker threads
+    pthread_mutex_lock(&sync_mutex);
+    threads_working = worker_threads;
+    // unblock the workers - they are waiting on this condition var
+    // puts( "main thread signalling workers" );
+    pthread_cond_broadcast(&threads_start_cond);
+    pthread_mutex_unlock(&sync_mutex);
+  }
 
   // update the position of all position models based on their velocity
   // while sensor models are running in other threads
-  FOR_EACH (it, active_velocity)
-    (*it)->Move();
+  if (!Replaying()) {
+    FOR_EACH (it, active_velocity)
+      (*it)->Move();
+    then = EndPhase("move", stats.move_time, then);
+  }
 
-  pthread_mutex_lock(&sync_mutex);
-  // wait for all the last update job to complete - it will
-  // signal the worker_threads_done condition var
-  while (threads_working > 0) {
-    // puts( "main thread waiting for workers to finish" );
-    pthread_cond_wait(&threads_done_cond, &sync_mutex);
+  if (handle_events) {
+    pthread_mutex_lock(&sync_mutex);
+    // wait for all the last update job to complete - it will
+    // signal the worker_threads_done condition var
+    while (threads_working > 0) {
+      // puts( "main thread waiting for workers to finish" );
+      pthread_cond_wait(&threads_done_cond, &sync_mutex);
+    }
+    pthread_mutex_unlock(&sync_mutex);
+    // puts( "main thread awakes" );
+    then = EndPhase("wait", stats.wait_time, then);
   }
-  pthread_mutex_unlock(&sync_mutex);
-  // puts( "main thread awakes" );
 
   // TODO: allow threadsafe callbacks to be called in worker
   // threads
@@ -666,9 +1229,35 @@ bool World::Update()
 
   // world callbacks
   CallUpdateCallbacks();
+  then = EndPhase("callbacks", stats.callback_time, then);
+
+  FOR_EACH (it, dirty_contacts)
+    (*it)->UpdateContacts();
+  dirty_contacts.clear();
 
   FOR_EACH (it, active_energy)
     (*it)->UpdateCharge();
+  then = EndPhase("charge", stats.charge_time, then);
+
+  if (grid_memory && (updates % 10) == 0) {
+    EvictSuperRegions();
+    then = EndPhase("evict", stats.evict_time, then);
+  }
+
+  if (trajectory_log.IsOpen()) {
+    LogModels();
+    then = EndPhase("log", stats.log_time, then);
+  }
+
+  if (shm_bridge.IsOpen()) {
+    shm_bridge.EndUpdate(updates + 1, sim_time);
+    then = EndPhase("bridge", stats.bridge_time, then);
+  }
+
+  ++stats.updates;
+  stats.update_time += then - start;
+  if (tracing)
+    Trace(0, "update", 0, start, then);
 
   ++updates;
 
@@ -682,7 +1271,62 @@ unsigned int World::GetEventQueue(Model *) const
 
   if (worker_threads < 1)
     return 0;
-  return ((random() % worker_threads) + 1);
+  return (static_cast<unsigned int>(Random() * worker_threads) + 1);
+}
+
+void RandomGenerator::Seed(long seed)
+{
+  // the same layout as srand48()
+  state[0] = 0x330e;
+  state[1] = static_cast<unsigned short>(seed);
+  state[2] = static_cast<unsigned short>(seed >> 16);
+  have_spare = false;
+}
+
+// taken from http://en.wikipedia.org/wiki/Box%E2%80%93Muller_transform
+double RandomGenerator::Gaussian(double variance)
+{
+  if (have_spare) {
+    have_spare = false;
+    return sqrt(variance * rand1) * sin(rand2);
+  }
+
+  have_spare = true;
+
+  rand1 = erand48(state);
+  if (rand1 < 1e-100)
+    rand1 = 1e-100;
+  rand1 = -2 * log(rand1);
+  rand2 = erand48(state) * 2.0 * M_PI;
+
+  return sqrt(variance * rand1) * cos(rand2);
+}
+
+double World::Random() const
+{
+  pthread_mutex_lock(&random_mutex);
+  const double r(random.Uniform());
+  pthread_mutex_unlock(&random_mutex);
+  return r;
+}
+
+double World::RandomGaussian(double variance) const
+{
+  pthread_mutex_lock(&random_mutex);
+  const double noise(random.Gaussian(variance));
+  pthread_mutex_unlock(&random_mutex);
+  return noise;
+}
+
+void World::SeedRandom(long seed)
+{
+  pthread_mutex_lock(&random_mutex);
+  random_seed = seed;
+  random.Seed(seed);
+  pthread_mutex_unlock(&random_mutex);
+
+  FOR_EACH (it, models)
+    (*it)->SeedRandom(seed);
 }
 
 Model *World::GetModel(const std::string &name) const
@@ -733,6 +1377,7 @@ void World::Raytrace(const Pose &gpose, // global pose
 
   // set up a ray to trace
   Ray ray(mod, gpose, range, func, arg, ztest);
+  ray.exact = exact_raytrace;
 
   const size_t sample_count = results.size();
 
@@ -750,11 +1395,43 @@ RaytraceResult World::Raytrace(const Pose &gpose,
 			       const void *arg,
 			       const bool ztest)
 {
-  return Raytrace(Ray(mod, gpose, range, func, arg, ztest));
+  Ray ray(mod, gpose, range, func, arg, ztest);
+  ray.exact = exact_raytrace;
+  return Raytrace(ray);
 }
 
-RaytraceResult World::Raytrace(const Ray &r)
+RaytraceResult World::RaytraceExact(const Ray &r)
 {
+  RaytraceResult result(r.origin, NULL, Color(), r.range);
+
+  ++SlotFor(r.mod).rays;
+
+  meters_t range(r.range);
+  const BvhEdge *hit(NULL);
+
+  // the dynamic edges usually have the shorter search, and then
+  // narrow the search of the static ones
+  bvh_dynamic->Intersect(r, range, hit);
+  bvh_static->Intersect(r, range, hit);
+
+  if (hit) {
+    result.mod = hit->mod;
+    result.color = hit->mod->GetColor();
+    result.range = range;
+    result.z = hit->z;
+  }
+
+  return result;
+}
+
+template <uint32_t RBITS, uint32_t SBITS> RaytraceResult World::RaytraceGrid(const Ray &r)
+{
+  typedef Grid<RBITS, SBITS> G;
+
+  StatsSlot &slot(SlotFor(r.mod));
+  ++slot.rays;
+  uint64_t cells(0); // visited, added to the slot on return
+
   // rt_cells.clear();
   // rt_candidate_cells.clear();
 
@@ -792,10 +1469,10 @@ RaytraceResult World::Raytrace(const Ray &r)
   int32_t n(ax + ay); // the manhattan distance to the goal cell
 
   // the distances between region crossings in X and Y
-  const double xjumpx(sx * REGIONWIDTH);
-  const double xjumpy(sx * REGIONWIDTH * tana);
-  const double yjumpx(sy * REGIONWIDTH / tana);
-  const double yjumpy(sy * REGIONWIDTH);
+  const double xjumpx(sx * G::REGIONWIDTH);
+  const double xjumpy(sx * G::REGIONWIDTH * tana);
+  const double yjumpx(sy * G::REGIONWIDTH / tana);
+  const double yjumpy(sy * G::REGIONWIDTH);
 
   // manhattan distance between region crossings in X and Y
   const double xjumpdist(fabs(xjumpx) + fabs(xjumpy));
@@ -817,8 +1494,16 @@ RaytraceResult World::Raytrace(const Ray &r)
   // slow in debug builds. Add them in if chasing a suspected raytrace bug
   while (n > 0) // while we are still not at the ray end
   {
-    SuperRegion *sr(GetSuperRegion(point_int_t(GETSREG(globx), GETSREG(globy))));
-    Region *reg(sr ? sr->GetRegion(GETREG(globx), GETREG(globy)) : NULL);
+    SuperRegion *sr(GetSuperRegion(point_int_t(G::GETSREG(globx), G::GETSREG(globy))));
+
+    if (sr) {
+      if (sr->last_used != updates) // avoid writing a shared cache line
+        sr->last_used = updates;
+      if (sr->regions == NULL)
+        RestoreSuperRegion(sr);
+    }
+
+    Region *reg(sr ? sr->GetRegion(G::REGION(globx, globy)) : NULL);
 
     if (reg && reg->count) // if the region contains any objects
     {
@@ -829,15 +1514,17 @@ RaytraceResult World::Raytrace(const Ray &r)
       calculatecrossings = true;
 
       // convert from global cell to local cell coords
-      int32_t cx(GETCELL(globx));
-      int32_t cy(GETCELL(globy));
+      int32_t cx(G::GETCELL(globx));
+      int32_t cy(G::GETCELL(globy));
 
       // since reg->count was non-zero, we expect this pointer to be good
-      Cell *c(&reg->cells[cx + cy * REGIONWIDTH]);
+      Cell *c(&reg->cells[cx + cy * G::REGIONWIDTH]);
 
       // while within the bounds of this region and while some ray remains
       // we'll tweak the cell pointer directly to move around quickly
-      while ((cx >= 0) && (cx < REGIONWIDTH) && (cy >= 0) && (cy < REGIONWIDTH) && n > 0) {
+      while ((cx >= 0) && (cx < G::REGIONWIDTH) && (cy >= 0) && (cy < G::REGIONWIDTH) && n > 0) {
+        ++cells;
+
         FOR_EACH (it, c->blocks[layer]) {
           Block *block(*it);
           assert(block);
@@ -852,12 +1539,14 @@ RaytraceResult World::Raytrace(const Ray &r)
             result.pose = r.origin;
             result.mod = &block->group->mod;
             result.color = result.mod->GetColor();
+            result.z = block->global_z;
 
             if (ax > ay) // faster than the equivalent hypot() call
               result.range = fabs((globx - startx) / cosa) / ppm;
             else
               result.range = fabs((globy - starty) / sina) / ppm;
 
+            slot.cells += cells;
             return result;
           }
         }
@@ -873,7 +1562,7 @@ RaytraceResult World::Raytrace(const Ray &r)
         {
           globy += sy; // global coordinate
           exy -= bx;
-          c += sy * REGIONWIDTH; // move the cell up or down
+          c += sy * G::REGIONWIDTH; // move the cell up or down
           cy += sy; // cell coordinate for bounds checking
         }
         --n; // decrement the manhattan distance remaining
@@ -893,20 +1582,20 @@ RaytraceResult World::Raytrace(const Ray &r)
         // the current region
         const int32_t ix(globx);
         const int32_t iy(globy);
-        double regionx(ix / REGIONWIDTH * REGIONWIDTH);
-        double regiony(iy / REGIONWIDTH * REGIONWIDTH);
-        if ((globx < 0) && (ix % REGIONWIDTH))
-          regionx -= REGIONWIDTH;
-        if ((globy < 0) && (iy % REGIONWIDTH))
-          regiony -= REGIONWIDTH;
+        double regionx(ix / G::REGIONWIDTH * G::REGIONWIDTH);
+        double regiony(iy / G::REGIONWIDTH * G::REGIONWIDTH);
+        if ((globx < 0) && (ix % G::REGIONWIDTH))
+          regionx -= G::REGIONWIDTH;
+        if ((globy < 0) && (iy % G::REGIONWIDTH))
+          regiony -= G::REGIONWIDTH;
 
         // calculate the distance to the edge of the current region
         const double xdx(sx < 0 ? regionx - globx - 1.0 : // going left
-                             regionx + REGIONWIDTH - globx); // going right
+                             regionx + G::REGIONWIDTH - globx); // going right
         const double xdy(xdx * tana);
 
         const double ydy(sy < 0 ? regiony - globy - 1.0 : // going down
-                             regiony + REGIONWIDTH - globy); // going up
+                             regiony + G::REGIONWIDTH - globy); // going up
         const double ydx(ydy / tana);
 
         // these stored hit points are updated as we go along
@@ -959,6 +1648,7 @@ RaytraceResult World::Raytrace(const Ray &r)
     // rt_cells.push_back( point_int_t( globx, globy ));
   }
 
+  slot.cells += cells;
   return result;
 }
 
@@ -987,10 +1677,17 @@ void World::Reload(void)
 }
 
 // add a block to each cell described by a polygon in world coordinates
-void World::MapPoly(const std::vector<point_int_t> &pts, Block *block, unsigned int layer)
+template <uint32_t RBITS, uint32_t SBITS>
+void World::MapPolyGrid(const std::vector<point_int_t> &pts, Block *block, unsigned int layer)
 {
+  typedef Grid<RBITS, SBITS> G;
+
   const size_t pt_count(pts.size());
 
+  // with a memory limit, static blocks need not bring superregions
+  // into memory
+  const bool compact(grid_memory && IsStatic(&block->group->mod));
+
   for (size_t i(0); i < pt_count; ++i) {
     const point_int_t &start(pts[i]);
     const point_int_t &end(pts[(i + 1) % pt_count]);
@@ -1013,22 +1710,65 @@ void World::MapPoly(const std::vector<point_int_t> &pts, Block *block, unsigned
     int32_t globy(start.y);
 
     while (n) {
-      Region *reg(GetSuperRegionCreate(point_int_t(GETSREG(globx), GETSREG(globy)))
-                      ->GetRegion(GETREG(globx), GETREG(globy)));
-      assert(reg);
+      SuperRegion *sr(GetSuperRegionCreate(point_int_t(G::GETSREG(globx), G::GETSREG(globy))));
+      sr->last_used = updates;
+
+      // start new superregions evicted if they would hold only static blocks
+      if (compact && sr->count == 0 && sr->allocated == 0 && sr->regions)
+        sr->FreeRegions();
 
       // add all the required cells in this region before looking up
       // another region
-      int32_t cx(GETCELL(globx));
-      int32_t cy(GETCELL(globy));
+      int32_t cx(G::GETCELL(globx));
+      int32_t cy(G::GETCELL(globy));
+
+      if (sr->regions == NULL && compact) {
+        // record the cells in the compact list instead
+        pthread_mutex_lock(&grid_mutex);
+
+        if (sr->regions == NULL) {
+          const uint32_t base(G::REGION(globx, globy) * G::REGIONSIZE);
+
+          std::vector<uint32_t> &codes(sr->entries[block]);
+          if (codes.empty())
+            block->evicted_in.push_back(sr);
+
+          while ((cx >= 0) && (cx < G::REGIONWIDTH) && (cy >= 0) && (cy < G::REGIONWIDTH) && n > 0) {
+            codes.push_back((base + cx + cy * G::REGIONWIDTH) << 1 | layer);
+            ++sr->entry_count;
+
+            if (exy < 0) {
+              globx += sx;
+              exy += by;
+              cx += sx;
+            } else {
+              globy += sy;
+              exy -= bx;
+              cy += sy;
+            }
+            --n;
+          }
+        }
+
+        pthread_mutex_unlock(&grid_mutex);
+
+        if (sr->regions == NULL)
+          continue;
+      }
+
+      if (sr->regions == NULL)
+        RestoreSuperRegion(sr);
+
+      Region *reg(sr->GetRegion(G::REGION(globx, globy)));
+      assert(reg);
 
       // need to call Region::GetCell() before using a Cell pointer
       // directly, because the region allocates cells lazily, waiting
       // for a call of this method
-      Cell *c(reg->GetCell(cx, cy));
+      Cell *c(reg->GetCell(cx + cy * G::REGIONWIDTH));
 
       // while inside the region, manipulate the Cell pointer directly
-      while ((cx >= 0) && (cx < REGIONWIDTH) && (cy >= 0) && (cy < REGIONWIDTH) && n > 0) {
+      while ((cx >= 0) && (cx < G::REGIONWIDTH) && (cy >= 0) && (cy < G::REGIONWIDTH) && n > 0) {
 	assert( c != NULL );
 	
         // if the block is not already rendered in the cell
@@ -1046,7 +1786,7 @@ void World::MapPoly(const std::vector<point_int_t> &pts, Block *block, unsigned
         } else {
           globy += sy;
           exy -= bx;
-          c += sy * REGIONWIDTH;
+          c += sy * G::REGIONWIDTH;
           cy += sy;
         }
         --n;
@@ -1055,15 +1795,300 @@ void World::MapPoly(const std::vector<point_int_t> &pts, Block *block, unsigned
   }
 }
 
+// select the versions of Raytrace() and MapPoly() compiled for
+// region bits R and superregion bits S
+#define GRID_BITS(R, S)                                                                            \
+  if (rbits == R && sbits == S) {                                                                  \
+    raytrace_grid = &World::RaytraceGrid<R, S>;                                                    \
+    map_poly_grid = &World::MapPolyGrid<R, S>;                                                     \
+    found = true;                                                                                  \
+  }
+
+#define GRID_SBITS(R)                                                                              \
+  GRID_BITS(R, 4)                                                                                  \
+  GRID_BITS(R, 5)                                                                                  \
+  GRID_BITS(R, 6)
+
+bool World::SetGridBits(uint32_t rbits, uint32_t sbits)
+{
+  if (rbits == region_bits && sbits == superregion_bits)
+    return true;
+
+  if (!superregions.empty()) {
+    PRINT_WARN("the grid dimensions can not be changed after models are mapped");
+    return false;
+  }
+
+  bool found(false);
+
+  GRID_SBITS(3)
+  GRID_SBITS(4)
+  GRID_SBITS(5)
+  GRID_SBITS(6)
+  GRID_SBITS(7)
+
+  if (!found) {
+    PRINT_WARN2("no raytracer for region_bits %u and superregion_bits %u", rbits, sbits);
+    return false;
+  }
+
+  region_bits = rbits;
+  superregion_bits = sbits;
+  return true;
+}
+
+void World::AppendEdges(Block *block, unsigned int layer, std::vector<BvhEdge> &edges) const
+{
+  Model *mod(&block->group->mod);
+
+  // the same transform as the block's cells in the grid
+  double c, s;
+  const Pose gpose(mod->GlobalOrigin(c, s));
+
+  // edges of unmapped blocks are kept, so the hierarchy can be refit
+  if (block->rendered_cells[layer].empty() && block->evicted_in.empty())
+    mod = NULL;
+
+  const std::vector<point_t> &pts(block->Points());
+  const size_t count(pts.size());
+
+  for (size_t i(0); i < count; ++i) {
+    const point_t &a(pts[i]);
+    const point_t &b(pts[(i + 1) % count]);
+
+    edges.push_back(BvhEdge(gpose.x + a.x * c - a.y * s, gpose.y + a.x * s + a.y * c,
+                            gpose.x + b.x * c - b.y * s, gpose.y + b.x * s + b.y * c,
+                            block->global_z, mod));
+  }
+}
+
+void World::UpdateBvh()
+{
+  // rays read this layer during the update
+  const unsigned int layer((updates + 1) % 2);
+
+  std::vector<BvhEdge> edges;
+
+  if (bvh_dirty || bvh_static == NULL) {
+    bvh_dirty = false;
+
+    if (bvh_static == NULL) {
+      bvh_static = new Bvh();
+      bvh_dynamic = new Bvh();
+    }
+
+    bvh_blocks.clear();
+
+    FOR_EACH (it, models) {
+      std::vector<Block> &blocks((*it)->blockgroup.blocks);
+
+      if (IsStatic(*it))
+        FOR_EACH (block, blocks)
+          AppendEdges(&*block, layer, edges);
+      else
+        FOR_EACH (block, blocks)
+          bvh_blocks.push_back(&*block);
+    }
+
+    bvh_static->Build(edges);
+    edges.clear();
+  }
+
+  FOR_EACH (it, bvh_blocks)
+    AppendEdges(*it, layer, edges);
+
+  // refitting is cheap, but the boxes grow as the models move apart
+  if (edges.size() != bvh_dynamic->EdgeCount() || updates % 100 == 0)
+    bvh_dynamic->Build(edges);
+  else
+    bvh_dynamic->Refit(edges);
+}
+
+bool World::IsStatic(const Model *mod)
+{
+  for (; mod; mod = mod->parent)
+    if (dynamic_cast<const ModelPosition *>(mod))
+      return false;
+
+  return true;
+}
+
+/** Predicate for removing the cells of one superregion from a block's
+    list of rendered cells */
+class InSuperRegion {
+  const SuperRegion *sr;
+
+public:
+  explicit InSuperRegion(const SuperRegion *sr) : sr(sr) {}
+  bool operator()(const Cell *c) const { return c->region->superregion == sr; }
+};
+
+bool World::EvictSuperRegion(SuperRegion *sr)
+{
+  std::map<Block *, std::vector<uint32_t> > entries;
+  size_t entry_count(0);
+  std::map<const Model *, bool> is_static;
+
+  const int32_t regionsize(sr->RegionSize());
+  const int32_t superregionsize(sr->SuperRegionSize());
+
+  for (int32_t r(0); r < superregionsize; ++r) {
+    const Region &reg(sr->regions[r]);
+    if (reg.count == 0)
+      continue;
+
+    for (int32_t c(0); c < regionsize; ++c)
+      for (unsigned int layer(0); layer < 2; ++layer)
+        FOR_EACH (it, reg.cells[c].blocks[layer]) {
+          const Model *mod(&(*it)->group->mod);
+
+          std::map<const Model *, bool>::iterator found(is_static.find(mod));
+          if (found == is_static.end())
+            found = is_static.insert(std::make_pair(mod, IsStatic(mod))).first;
+
+          if (!found->second)
+            return false; // something here might move, so keep it all
+
+          entries[*it].push_back((r * regionsize + c) << 1 | layer);
+          ++entry_count;
+        }
+  }
+
+  pthread_mutex_lock(&grid_mutex);
+
+  // the blocks must forget the cells we are about to free
+  FOR_EACH (it, entries) {
+    Block *block(it->first);
+    for (unsigned int layer(0); layer < 2; ++layer) {
+      std::vector<Cell *> &cells(block->rendered_cells[layer]);
+      cells.erase(std::remove_if(cells.begin(), cells.end(), InSuperRegion(sr)), cells.end());
+    }
+    block->evicted_in.push_back(sr);
+  }
+
+  sr->entries.swap(entries);
+  sr->entry_count = entry_count;
+  sr->FreeRegions();
+
+  pthread_mutex_unlock(&grid_mutex);
+  return true;
+}
+
+void World::RestoreSuperRegion(SuperRegion *sr)
+{
+  pthread_mutex_lock(&grid_mutex);
+
+  // another thread may have beaten us to it
+  if (sr->regions == NULL) {
+    const int32_t regionsize(sr->RegionSize());
+    const int32_t superregionsize(sr->SuperRegionSize());
+    Region *regions(new Region[superregionsize]);
+
+    for (int32_t r(0); r < superregionsize; ++r)
+      regions[r].superregion = sr;
+
+    FOR_EACH (it, sr->entries) {
+      Block *block(it->first);
+
+      FOR_EACH (code, it->second) {
+        const uint32_t cell(*code >> 1);
+        regions[cell / regionsize].GetCell(cell % regionsize)->AddBlock(block, *code & 1);
+      }
+
+      EraseAll(sr, block->evicted_in);
+    }
+
+    sr->entries.clear();
+    sr->entry_count = 0;
+
+    // the regions must be complete before other threads can see them
+    __sync_synchronize();
+    sr->regions = regions;
+  }
+
+  pthread_mutex_unlock(&grid_mutex);
+}
+
+/** Predicate for removing the entries for one layer from an evicted
+    superregion */
+class OnLayer {
+  uint32_t layer;
+
+public:
+  explicit OnLayer(uint32_t layer) : layer(layer) {}
+  bool operator()(uint32_t code) const { return (code & 1) == layer; }
+};
+
+void World::PurgeEvicted(Block *block, unsigned int layer)
+{
+  pthread_mutex_lock(&grid_mutex);
+
+  for (size_t i(0); i < block->evicted_in.size();) {
+    SuperRegion *sr(block->evicted_in[i]);
+    std::map<Block *, std::vector<uint32_t> >::iterator it(sr->entries.find(block));
+
+    if (it != sr->entries.end()) {
+      std::vector<uint32_t> &codes(it->second);
+      const size_t before(codes.size());
+      codes.erase(std::remove_if(codes.begin(), codes.end(), OnLayer(layer)), codes.end());
+      sr->entry_count -= before - codes.size();
+
+      if (!codes.empty()) {
+        ++i;
+        continue;
+      }
+
+      sr->entries.erase(it);
+    }
+
+    block->evicted_in.erase(block->evicted_in.begin() + i);
+  }
+
+  pthread_mutex_unlock(&grid_mutex);
+}
+
+void World::EvictSuperRegions()
+{
+  size_t total(0);
+  std::vector<std::pair<uint64_t, SuperRegion *> > idle;
+  const uint64_t idle_updates(grid_idle / sim_interval);
+
+  FOR_EACH (it, superregions) {
+    SuperRegion *sr(it->second);
+    total += sr->MemoryEstimate();
+
+    if (sr->regions && updates - sr->last_used >= idle_updates)
+      idle.push_back(std::make_pair(sr->last_used, sr));
+  }
+
+  if (total <= grid_memory)
+    return;
+
+  // least recently used first
+  std::sort(idle.begin(), idle.end());
+
+  for (size_t i(0); i < idle.size() && total > grid_memory; ++i) {
+    SuperRegion *sr(idle[i].second);
+    const size_t before(sr->MemoryEstimate());
+
+    if (sr->count == 0) {
+      DestroySuperRegion(sr); // nothing worth keeping
+      total -= before;
+    } else if (EvictSuperRegion(sr))
+      total -= before - sr->MemoryEstimate();
+  }
+}
+
 SuperRegion *World::AddSuperRegion(const point_int_t &sup)
 {
   SuperRegion *sr(CreateSuperRegion(sup));
+  const uint32_t srbits(region_bits + superregion_bits);
 
   // set the lower left corner of the new superregion
-  Extend(point3_t((sup.x << SRBITS) / ppm, (sup.y << SRBITS) / ppm, 0));
+  Extend(point3_t((sup.x << srbits) / ppm, (sup.y << srbits) / ppm, 0));
 
   // top right corner of the new superregion
-  Extend(point3_t(((sup.x + 1) << SRBITS) / ppm, ((sup.y + 1) << SRBITS) / ppm, 0));
+  Extend(point3_t(((sup.x + 1) << srbits) / ppm, ((sup.y + 1) << srbits) / ppm, 0));
   return sr;
 }
 
@@ -1119,14 +2144,344 @@ void World::RegisterOption(Option *opt)
   option_table.insert(opt);
 }
 
-void World::Log(Model *)
+bool World::Event::operator<(const Event &other) const
 {
-  // LogEntry( sim_time, mod);
-  // printf( "log entry count %u\n", (unsigned int)LogEntry::Count() );
-  // LogEntry::Print();
+  return (time > other.time);
 }
 
-bool World::Event::operator<(const Event &other) const
+unsigned int World::TypeIndex(const std::string &type)
 {
-  return (time > other.time);
+  pthread_mutex_lock(&type_names_mutex);
+
+  unsigned int index(0);
+  while (index < type_names.size() && type_names[index] != type)
+    ++index;
+
+  if (index == type_names.size())
+    type_names.push_back(type);
+
+  pthread_mutex_unlock(&type_names_mutex);
+  return index;
+}
+
+World::StatsSlot &World::SlotFor(const Model *mod)
+{
+  // rays traced outside any model's update, or by a model whose queue
+  // is out of range, are counted by the main thread
+  if (mod == NULL || mod->event_queue_num >= stats_slots.size())
+    return stats_slots[0];
+  return stats_slots[mod->event_queue_num];
+}
+
+WorldStats World::GetStats() const
+{
+  WorldStats merged(stats);
+
+  pthread_mutex_lock(&type_names_mutex);
+
+  FOR_EACH (it, stats_slots) {
+    merged.rays += it->rays;
+    merged.cells += it->cells;
+
+    for (size_t t(0); t < it->types.size(); ++t)
+      if (it->types[t].events) {
+        WorldStats::ModelType &type(merged.types[type_names[t]]);
+        type.events += it->types[t].events;
+        type.time += it->types[t].time;
+      }
+  }
+
+  pthread_mutex_unlock(&type_names_mutex);
+  return merged;
+}
+
+void World::ResetStats()
+{
+  stats = WorldStats();
+
+  FOR_EACH (it, stats_slots) {
+    it->rays = 0;
+    it->cells = 0;
+    it->types.clear();
+  }
+}
+
+double World::EndPhase(const char *name, double &total, double then)
+{
+  const double now(stats_time());
+  total += now - then;
+  if (tracing)
+    Trace(0, name, 0, then, now);
+  return now;
+}
+
+void World::StartTrace(const std::string &filename, size_t spans)
+{
+  FOR_EACH (it, stats_slots) {
+    it->trace.assign(std::max(spans, (size_t)1), TraceSpan());
+    it->trace_count = 0;
+  }
+
+  trace_file = filename;
+  trace_start = stats_time();
+  tracing = true;
+}
+
+// returns s quoted as a JSON string
+static std::string json_string(const std::string &s)
+{
+  std::string quoted("\"");
+
+  FOR_EACH (it, s) {
+    const unsigned char c(*it);
+
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+      quoted += c;
+    } else if (c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      quoted += buf;
+    } else
+      quoted += c;
+  }
+
+  return quoted + '"';
+}
+
+bool World::WriteTrace()
+{
+  tracing = false;
+
+  FILE *out(fopen(trace_file.c_str(), "w"));
+  if (out == NULL) {
+    PRINT_ERR2("failed to open trace file \"%s\": %s", trace_file.c_str(), strerror(errno));
+    return false;
+  }
+
+  // one process per world, with a track for each thread
+  fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+               "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":%s}}",
+          json_string(Token()).c_str());
+
+  for (size_t t(0); t < stats_slots.size(); ++t) {
+    StatsSlot &slot(stats_slots[t]);
+
+    fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                 "\"args\":{\"name\":\"%s %u\"}}",
+            (unsigned int)t, t ? "worker" : "main", (unsigned int)t);
+
+    if (slot.trace.empty())
+      continue;
+
+    // the oldest spans have been overwritten if the ring wrapped
+    const uint64_t count(std::min(slot.trace_count, (uint64_t)slot.trace.size()));
+
+    for (uint64_t i(slot.trace_count - count); i < slot.trace_count; ++i) {
+      const TraceSpan &span(slot.trace[i % slot.trace.size()]);
+
+      fprintf(out, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,",
+              (unsigned int)t, 1e6 * (span.start - trace_start), 1e6 * (span.end - span.start));
+
+      if (span.name) {
+        fprintf(out, "\"name\":\"%s\"}", span.name);
+        continue;
+      }
+
+      // the model may have been destroyed since
+      std::map<id_t, Model *>::const_iterator mod(Model::modelsbyid.find(span.model));
+
+      if (mod != Model::modelsbyid.end() && mod->second)
+        fprintf(out, "\"name\":%s,\"args\":{\"model\":%s,\"id\":%u}}",
+                json_string(mod->second->GetModelType()).c_str(),
+                json_string(mod->second->Token()).c_str(), span.model);
+      else
+        fprintf(out, "\"name\":\"model\",\"args\":{\"id\":%u}}", span.model);
+    }
+
+    slot.trace.clear();
+  }
+
+  fprintf(out, "\n]}\n");
+
+  if (fclose(out) != 0) {
+    PRINT_ERR2("failed to write trace file \"%s\": %s", trace_file.c_str(), strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+WorldMemory World::MemoryReport() const
+{
+  WorldMemory report;
+
+  // create the categories in a fixed order
+  WorldMemory::Category &superregions(report["superregions"]);
+  WorldMemory::Category &regions(report["region cells"]);
+  WorldMemory::Category &cell_blocks(report["cell block lists"]);
+  WorldMemory::Category &evicted(report["evicted cell lists"]);
+  WorldMemory::Category &models(report["models"]);
+  WorldMemory::Category &blocks(report["blocks"]);
+  WorldMemory::Category &rendered(report["block rendered cells"]);
+  WorldMemory::Category &shapes(report["block shapes"]);
+  WorldMemory::Category &trails(report["trails"]);
+  WorldMemory::Category &dissipation(report["dissipation tiles"]);
+  WorldMemory::Category &events(report["events"]);
+  WorldMemory::Category &edges(report["exact raytrace edges"]);
+
+  FOR_EACH (it, this->superregions) {
+    const SuperRegion *sr(it->second);
+
+    ++superregions.count;
+    superregions.bytes += sizeof(SuperRegion);
+
+    evicted.count += sr->entry_count;
+    evicted.bytes += sr->entries.size() * sizeof(std::vector<uint32_t>)
+                     + sr->entry_count * sizeof(uint32_t);
+
+    if (sr->regions == NULL)
+      continue;
+
+    const int32_t count(sr->SuperRegionSize());
+    superregions.bytes += count * sizeof(Region);
+
+    for (int32_t r(0); r < count; ++r) {
+      const std::vector<Cell> &cells(sr->regions[r].cells);
+
+      if (cells.empty())
+        continue;
+
+      ++regions.count;
+      regions.bytes += cells.capacity() * sizeof(Cell);
+
+      FOR_EACH (c, cells)
+        for (unsigned int layer(0); layer < 2; ++layer) {
+          cell_blocks.count += c->blocks[layer].size();
+          cell_blocks.bytes += c->blocks[layer].capacity() * sizeof(Block *);
+        }
+    }
+  }
+
+  std::set<const BlockShape *> shapes_seen;
+
+  FOR_EACH (it, this->models) {
+    const Model *mod(*it);
+
+    ++models.count;
+    models.bytes += sizeof(Model);
+
+    trails.count += mod->trail.size();
+    trails.bytes += mod->trail.capacity() * sizeof(Model::TrailItem);
+
+    const BlockGroup &group(mod->blockgroup);
+
+    blocks.count += group.blocks.size();
+    blocks.bytes += group.blocks.capacity() * sizeof(Block);
+
+    FOR_EACH (b, group.blocks) {
+      for (unsigned int layer(0); layer < 2; ++layer) {
+        rendered.count += b->rendered_cells[layer].size();
+        rendered.bytes += b->rendered_cells[layer].capacity() * sizeof(Cell *);
+      }
+      rendered.bytes += b->evicted_in.capacity() * sizeof(SuperRegion *);
+    }
+
+    // shapes may be shared, so count each once
+    const BlockShape *shape(group.shape);
+    if (shape == NULL || !shapes_seen.insert(shape).second)
+      continue;
+
+    ++shapes.count;
+    shapes.bytes += sizeof(BlockShape) + shape->pts.capacity() * sizeof(std::vector<point_t>)
+                    + shape->z.capacity() * sizeof(Bounds);
+
+    FOR_EACH (p, shape->pts)
+      shapes.bytes += p->capacity() * sizeof(point_t);
+  }
+
+  if (this->dissipation) {
+    dissipation.count += this->dissipation->TileCount();
+    dissipation.bytes += this->dissipation->MemoryUsed();
+  }
+
+  FOR_EACH (it, event_queues) {
+    events.count += it->size();
+    events.bytes += it->size() * sizeof(Event);
+  }
+
+  if (bvh_static) {
+    edges.count += bvh_static->EdgeCount();
+    edges.bytes += bvh_static->MemoryUsed();
+  }
+
+  if (bvh_dynamic) {
+    edges.count += bvh_dynamic->EdgeCount();
+    edges.bytes += bvh_dynamic->MemoryUsed();
+  }
+
+  return report;
+}
+
+WorldMemory::Category &WorldMemory::operator[](const std::string &name)
+{
+  FOR_EACH (it, categories)
+    if (it->first == name)
+      return it->second;
+
+  categories.push_back(std::make_pair(name, Category()));
+  return categories.back().second;
+}
+
+uint64_t WorldMemory::TotalBytes() const
+{
+  uint64_t total(0);
+  FOR_EACH (it, categories)
+    total += it->second.bytes;
+  return total;
+}
+
+void WorldMemory::Print(FILE *out) const
+{
+  fprintf(out, "%-22s %12s %12s\n", "memory", "count", "MB");
+
+  FOR_EACH (it, categories)
+    fprintf(out, "%-22s %12llu %12.3f\n", it->first.c_str(),
+            (unsigned long long)it->second.count, it->second.bytes / 1e6);
+
+  fprintf(out, "%-22s %12s %12.3f\n", "total", "", TotalBytes() / 1e6);
+}
+
+WorldStats::WorldStats()
+    : updates(0), update_time(0), replay_time(0), bvh_time(0), queue_time(0), move_time(0),
+      wait_time(0), callback_time(0), charge_time(0), evict_time(0), log_time(0),
+      bridge_time(0), rays(0), cells(0), remaps(0), types()
+{
+}
+
+void WorldStats::Print(FILE *out) const
+{
+  const double per(updates ? 1e3 / updates : 0); // msec per update
+
+  fprintf(out, "updates %llu  %.3f sec  %.3f msec/update\n", (unsigned long long)updates,
+          update_time, update_time * per);
+
+  const char *names[] = { "replay",    "bvh",    "queue", "move", "wait",
+                          "callbacks", "charge", "evict", "log",  "bridge" };
+  const double times[] = { replay_time,   bvh_time,    queue_time, move_time, wait_time,
+                           callback_time, charge_time, evict_time, log_time,  bridge_time };
+
+  for (unsigned int i(0); i < sizeof(times) / sizeof(times[0]); ++i)
+    fprintf(out, "  %-10s %10.3f sec %8.3f msec/update %5.1f%%\n", names[i], times[i],
+            times[i] * per, update_time > 0 ? 100.0 * times[i] / update_time : 0);
+
+  fprintf(out, "rays %llu  cells %llu (%.1f/ray)  remaps %llu\n", (unsigned long long)rays,
+          (unsigned long long)cells, rays ? (double)cells / rays : 0, (unsigned long long)remaps);
+
+  fprintf(out, "%-16s %12s %12s %12s\n", "model type", "events", "sec", "usec/event");
+
+  FOR_EACH (it, types)
+    fprintf(out, "%-16s %12llu %12.3f %12.2f\n", it->first.c_str(),
+            (unsigned long long)it->second.events, it->second.time,
+            it->second.events ? 1e6 * it->second.time / it->second.events : 0);
 }
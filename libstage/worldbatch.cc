@@ -0,0 +1,256 @@
+/*
+  worldbatch.cc
+  steps several clones of a world in parallel, exchanging actions and
+  observations in flat arrays.
+*/
+
+#include <algorithm>
+#include <unistd.h> // for sysconf(3)
+
+#include "stage.hh"
+
+using namespace Stg;
+
+/** Orders models by name */
+class TokenLess {
+public:
+  bool operator()(const Model *a, const Model *b) const
+  {
+    return strcmp(a->Token(), b->Token()) < 0;
+  }
+};
+
+WorldBatch::WorldBatch(const World *world, unsigned int count,
+                       const std::vector<std::string> &names, unsigned int thread_count)
+    : worlds(), robot_names(names), robots(), rangers(), ranger_counts(), range_counts(),
+      observation_size(0), start(), ok(false), actions(NULL), observations(NULL), updates(0),
+      next(0), mutex(), start_cond(), done_cond(), job(0), working(0), exiting(false), threads()
+{
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&start_cond, NULL);
+  pthread_cond_init(&done_cond, NULL);
+
+  if (count == 0)
+    return;
+
+  if (robot_names.empty()) {
+    const std::set<Model *> all(world->GetAllModels());
+    std::vector<Model *> found;
+
+    FOR_EACH (it, all)
+      if (dynamic_cast<ModelPosition *>(*it))
+        found.push_back(*it);
+
+    std::sort(found.begin(), found.end(), TokenLess());
+
+    FOR_EACH (it, found)
+      robot_names.push_back((*it)->Token());
+  }
+
+  for (unsigned int w(0); w < count; ++w) {
+    // later worlds are cloned from the first, which is already subscribed
+    World *clone(w == 0 ? world->Clone() : worlds[0]->Clone());
+    if (clone == NULL)
+      return;
+
+    // every world gets a random number sequence of its own
+    clone->SeedRandom(lrand48());
+
+    worlds.push_back(clone);
+    robots.push_back(std::vector<ModelPosition *>());
+    rangers.push_back(std::vector<ModelRanger *>());
+
+    FOR_EACH (it, robot_names) {
+      ModelPosition *robot(dynamic_cast<ModelPosition *>(clone->GetModel(*it)));
+      if (robot == NULL) {
+        PRINT_ERR1("batch robot \"%s\" is not a position model", it->c_str());
+        return;
+      }
+
+      robots.back().push_back(robot);
+
+      std::vector<ModelRanger *> found;
+      robot->GetRangers(found);
+      rangers.back().insert(rangers.back().end(), found.begin(), found.end());
+
+      if (w == 0) {
+        robot->Subscribe();
+        FOR_EACH (rit, found)
+          (*rit)->Subscribe();
+
+        ranger_counts.push_back(found.size());
+        observation_size += 4;
+      }
+    }
+
+    if (w == 0) {
+      FOR_EACH (it, rangers.back()) {
+        unsigned int ranges(0);
+        FOR_EACH (sit, (*it)->GetSensors())
+          ranges += sit->sample_count;
+
+        range_counts.push_back(ranges);
+        observation_size += ranges;
+      }
+
+      worlds[0]->SaveSnapshot(start);
+    }
+  }
+
+  if (thread_count == 0)
+    thread_count = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+  thread_count = std::min(thread_count, count);
+
+  // the calling thread does its share of the work
+  threads.resize(thread_count - 1);
+  for (unsigned int t(0); t < threads.size(); ++t)
+    pthread_create(&threads[t], NULL, WorldBatch::thread_entry, this);
+
+  ok = true;
+}
+
+WorldBatch::~WorldBatch()
+{
+  pthread_mutex_lock(&mutex);
+  exiting = true;
+  pthread_cond_broadcast(&start_cond);
+  pthread_mutex_unlock(&mutex);
+
+  FOR_EACH (it, threads)
+    pthread_join(*it, NULL);
+
+  FOR_EACH (it, worlds)
+    delete *it;
+
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&start_cond);
+  pthread_cond_destroy(&done_cond);
+}
+
+void *WorldBatch::thread_entry(void *arg)
+{
+  WorldBatch *batch(static_cast<WorldBatch *>(arg));
+  unsigned int done(0); // the last job worked on
+
+  pthread_mutex_lock(&batch->mutex);
+
+  while (true) {
+    while (batch->job == done && !batch->exiting)
+      pthread_cond_wait(&batch->start_cond, &batch->mutex);
+
+    if (batch->exiting)
+      break;
+
+    done = batch->job;
+    pthread_mutex_unlock(&batch->mutex);
+
+    batch->Work();
+
+    pthread_mutex_lock(&batch->mutex);
+    if (--batch->working == 0)
+      pthread_cond_signal(&batch->done_cond);
+  }
+
+  pthread_mutex_unlock(&batch->mutex);
+  return NULL;
+}
+
+void WorldBatch::Work()
+{
+  for (unsigned int w(__sync_fetch_and_add(&next, 1)); w < worlds.size();
+       w = __sync_fetch_and_add(&next, 1))
+    StepWorld(w);
+}
+
+void WorldBatch::RunJob(const float *act, float *obs, unsigned int count)
+{
+  pthread_mutex_lock(&mutex);
+  actions = act;
+  observations = obs;
+  updates = count;
+  next = 0;
+  working = threads.size();
+  ++job;
+  pthread_cond_broadcast(&start_cond);
+  pthread_mutex_unlock(&mutex);
+
+  Work();
+
+  pthread_mutex_lock(&mutex);
+  while (working > 0)
+    pthread_cond_wait(&done_cond, &mutex);
+  pthread_mutex_unlock(&mutex);
+}
+
+void WorldBatch::StepWorld(unsigned int index)
+{
+  if (actions) {
+    const float *act(actions + index * ActionSize());
+
+    FOR_EACH (it, robots[index]) {
+      (*it)->SetSpeed(act[0], act[1], act[2]);
+      act += 3;
+    }
+  }
+
+  for (unsigned int u(0); u < updates; ++u)
+    worlds[index]->Update();
+
+  if (observations)
+    ObserveWorld(index, observations + index * observation_size);
+}
+
+void WorldBatch::ObserveWorld(unsigned int index, float *obs) const
+{
+  std::vector<ModelRanger *>::const_iterator ranger(rangers[index].begin());
+  std::vector<unsigned int>::const_iterator ranges(range_counts.begin());
+
+  for (unsigned int r(0); r < robots[index].size(); ++r) {
+    const ModelPosition *robot(robots[index][r]);
+    const Pose pose(robot->GetGlobalPose());
+
+    *obs++ = pose.x;
+    *obs++ = pose.y;
+    *obs++ = pose.a;
+    *obs++ = robot->Stalled() ? 1 : 0;
+
+    for (unsigned int i(0); i < ranger_counts[r]; ++i, ++ranger, ++ranges) {
+      // the sample counts may have changed since the batch was
+      // created, so pad or truncate to the size we promised
+      const ModelRanger::Scan scan((*ranger)->GetScan());
+      const unsigned int count(std::min(scan.count, *ranges));
+
+      if (count)
+        memcpy(obs, scan.ranges, count * sizeof(float));
+      if (count < *ranges)
+        memset(obs + count, 0, (*ranges - count) * sizeof(float));
+
+      obs += *ranges;
+    }
+  }
+}
+
+void WorldBatch::Step(const float *act, float *obs, unsigned int count)
+{
+  RunJob(act, obs, count);
+}
+
+void WorldBatch::Observe(float *obs)
+{
+  RunJob(NULL, obs, 0);
+}
+
+void WorldBatch::Reset(unsigned int index)
+{
+  if (!worlds[index]->RestoreSnapshot(start))
+    PRINT_ERR1("failed to reset batch world %u", index);
+
+  // the snapshot rewound the world to the first one's sequence
+  worlds[index]->SeedRandom(lrand48());
+}
+
+void WorldBatch::Reset()
+{
+  for (unsigned int w(0); w < worlds.size(); ++w)
+    Reset(w);
+}
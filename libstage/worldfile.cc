@@ -64,6 +64,16 @@ Worldfile::Worldfile()
 {
 }
 
+///////////////////////////////////////////////////////////////////////////
+// Copy constructor
+Worldfile::Worldfile(const Worldfile &other)
+    : tokens(other.tokens), macros(other.macros), entities(other.entities), properties(),
+      filename(other.filename), unit_length(other.unit_length), unit_angle(other.unit_angle)
+{
+  FOR_EACH (it, other.properties)
+    properties[it->first] = new CProperty(*it->second);
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Destructor
 Worldfile::~Worldfile()
@@ -69,9 +69,17 @@ class Worldfile {
 public:
   Worldfile();
 
+  // Copy the parsed contents of another worldfile, so that it can be
+  // read without loading the file again
+public:
+  Worldfile(const Worldfile &other);
+
 public:
   ~Worldfile();
 
+private:
+  Worldfile &operator=(const Worldfile &); // not implemented
+
   // replacement for fopen() that checks STAGEPATH dirs for the named file
   // (thanks to  Douglas S. Blank <dblank@brynmawr.edu>)
 protected:
@@ -107,6 +107,10 @@ repeatedly. Stepping leaves the simulation paused, so press 'p' to
 resume running. The initial paused/unpaused state can be set in the
 worldfile using the "paused" property.
 
+<h3>Replaying a trajectory log</h3> <p>When Stage is started with
+--replay, the '&lt;' and '&gt;' keys jump back and forward ten seconds
+in the log. The replay stops at the end of the log.
+
 <h3>Selecting models</h3> <p>Models can be selected by clicking on
 them with the left mouse button.  It is possible to select multiple
 models by holding the shift key and clicking on multiple models.
@@ -144,6 +148,8 @@ then select the option from the menu again to stop.
 
 */
 
+#include <errno.h>
+
 #include <FL/Fl_File_Chooser.H>
 #include <FL/Fl_Image.H>
 #include <FL/Fl_Output.H>
@@ -165,6 +171,15 @@ then select the option from the menu again to stop.
 
 using namespace Stg;
 
+// a paced simulation that falls further behind real time than this
+// carries on from now, rather than rushing to catch up
+static const usec_t SIM_BACKLOG_USEC(100000);
+
+static void UpdateCallback(WorldGui *world);
+
+// the world that DispatchEvent() locks. Only one world can have a GUI.
+static WorldGui *event_world(NULL);
+
 static const char *AboutText = "\n"
                                "Part of the Player Project\n"
                                "http://playerstage.org\n"
@@ -197,10 +212,18 @@ WorldGui::WorldGui(int width, int height, const char *caption)
       drawOptions(), fileMan(new FileManager()), interval_log(), speedup(1.0), // real time
       confirm_on_quit(true), mbar(new Fl_Menu_Bar(0, 0, width, 30)), oDlg(NULL), pause_time(false),
       real_time_interval(sim_interval), real_time_now(RealTimeNow()),
-      real_time_recorded(real_time_now), timing_interval(20)
+      real_time_recorded(real_time_now), timing_interval(20), sim_thread(),
+      sim_thread_running(false), sim_on_thread(false), sim_quit(false), sim_wake(false),
+      world_wanted(false), world_locks(0)
 {
   Fl::lock(); // start FLTK's thread safe behaviour
 
+  pthread_mutex_init(&sim_mutex, NULL);
+  pthread_cond_init(&sim_cond, NULL);
+  pthread_mutex_init(&world_mutex, NULL);
+
+  event_world = this;
+
   Fl::scheme("");
   resizable(canvas);
   caption_prefix = caption ? std::string(caption) : std::string(PROJECT) + " v" + Stg::Version();
@@ -233,7 +256,9 @@ WorldGui::WorldGui(int width, int height, const char *caption)
   mbar->add("Run/Faster", ']', (Fl_Callback *)fasterCb, this);
   mbar->add("Run/Slower", '[', (Fl_Callback *)slowerCb, this, FL_MENU_DIVIDER);
   mbar->add("Run/Realtime", '{', (Fl_Callback *)realtimeCb, this);
-  mbar->add("Run/Fast", '}', (Fl_Callback *)fasttimeCb, this);
+  mbar->add("Run/Fast", '}', (Fl_Callback *)fasttimeCb, this, FL_MENU_DIVIDER);
+  mbar->add("Run/Replay back", '<', (Fl_Callback *)replayBackCb, this);
+  mbar->add("Run/Replay forward", '>', (Fl_Callback *)replayForwardCb, this);
 
   mbar->add("&Help", 0, 0, 0, FL_SUBMENU);
   mbar->add("Help/Getting help...", 0, (Fl_Callback *)moreHelptCb, this, FL_MENU_DIVIDER);
@@ -247,6 +272,17 @@ WorldGui::WorldGui(int width, int height, const char *caption)
 
 WorldGui::~WorldGui()
 {
+  StopSimThread();
+  Fl::remove_timeout((Fl_Timeout_Handler)UpdateCallback, this);
+  Fl::remove_idle((Fl_Timeout_Handler)UpdateCallback, this);
+
+  if (event_world == this)
+    event_world = NULL;
+
+  pthread_mutex_destroy(&world_mutex);
+  pthread_cond_destroy(&sim_cond);
+  pthread_mutex_destroy(&sim_mutex);
+
   if (mbar)
     delete mbar;
   if (oDlg)
@@ -363,6 +399,9 @@ void WorldGui::LoadWorldGuiPostHook(usec_t load_start_time)
   if (debug)
     printf("[Load time %.3fsec]\n", (load_end_time - load_start_time) / 1e6);
 
+  // there is something to draw before the first update
+  PublishSnapshot();
+
   Show();
 }
 
@@ -401,12 +440,14 @@ bool WorldGui::Save(const char *filename)
 
 static void UpdateCallback(WorldGui *world)
 {
+  world->LockWorld();
   world->Update();
+  world->UnlockWorld();
 }
 
 bool WorldGui::Update()
 {
-  if (speedup > 0)
+  if (speedup > 0 && !sim_on_thread)
     Fl::repeat_timeout((sim_interval / 1e6) / speedup, (Fl_Timeout_Handler)UpdateCallback, this);
   // else we're called by an idle callback
 
@@ -427,14 +468,243 @@ bool WorldGui::Update()
       if ((*it)->trail.size() > 0 && updates % (*it)->trail_interval == 0)
       (*it)->UpdateTrail();
 
+  // read back what the cameras drew in this update. Worlds with
+  // cameras are not updated on the simulation thread.
+  if (!sim_on_thread)
+    canvas->camera_atlas.Readback();
+
+  // the canvas draws at most one snapshot a frame, so one it has not
+  // taken yet would be copied for nothing. The last one before the
+  // world stops is always drawn.
+  if (done || canvas->snapshots.Taken())
+    PublishSnapshot();
+  else {
+    ClearRays();
+    canvas->snapshots.Skip();
+  }
+
   if (done) {
     quit_time = 0; // allows us to continue by un-pausing
-    Stop();
+
+    // the FLTK timeouts belong to the GUI thread, which is woken to
+    // draw the final state
+    if (sim_on_thread) {
+      World::Stop();
+      Fl::awake();
+    } else
+      Stop();
   }
 
   return done;
 }
 
+void *WorldGui::SimThread(void *wg)
+{
+  static_cast<WorldGui *>(wg)->SimLoop();
+  return NULL;
+}
+
+void WorldGui::SimLoop()
+{
+  usec_t now(RealTimeNow());
+  usec_t due(now); // the real time of the next update, if paced
+
+  for (;;) {
+    // the mutex is not fair, so rather than taking the world's lock
+    // straight back, wait for the GUI thread if it asked for it
+    pthread_mutex_lock(&sim_mutex);
+    while (world_wanted && !sim_quit)
+      pthread_cond_wait(&sim_cond, &sim_mutex);
+    const bool finish(sim_quit);
+    pthread_mutex_unlock(&sim_mutex);
+
+    if (finish)
+      break;
+
+    pthread_mutex_lock(&world_mutex);
+
+    if (!sim_on_thread || paused || (speedup > 0 && now < due)) {
+      const usec_t until((!sim_on_thread || paused) ? 0 : due);
+      pthread_mutex_unlock(&world_mutex);
+
+      WaitSim(until);
+
+      now = RealTimeNow();
+      if (until == 0)
+        due = now;
+      continue;
+    }
+
+    Update();
+
+    const bool quit(TestQuit());
+    const double pace(speedup);
+
+    pthread_mutex_unlock(&world_mutex);
+
+    if (quit)
+      Fl::awake(); // so that World::Run() notices
+
+    now = RealTimeNow();
+
+    if (pace > 0) {
+      due += (usec_t)(sim_interval / pace);
+      if (due + SIM_BACKLOG_USEC < now)
+        due = now;
+    }
+  }
+}
+
+void WorldGui::WaitSim(usec_t until)
+{
+  pthread_mutex_lock(&sim_mutex);
+
+  while (!sim_wake) {
+    if (until == 0)
+      pthread_cond_wait(&sim_cond, &sim_mutex);
+    else {
+      struct timespec ts;
+      ts.tv_sec = until / 1000000;
+      ts.tv_nsec = (until % 1000000) * 1000;
+      if (pthread_cond_timedwait(&sim_cond, &sim_mutex, &ts) == ETIMEDOUT)
+        break;
+    }
+  }
+
+  sim_wake = false;
+  pthread_mutex_unlock(&sim_mutex);
+}
+
+void WorldGui::WakeSimThread()
+{
+  pthread_mutex_lock(&sim_mutex);
+  sim_wake = true;
+  pthread_cond_signal(&sim_cond);
+  pthread_mutex_unlock(&sim_mutex);
+}
+
+void WorldGui::LockWorld()
+{
+  if (world_locks++ > 0)
+    return; // held already
+
+  pthread_mutex_lock(&sim_mutex);
+  world_wanted = true;
+  pthread_mutex_unlock(&sim_mutex);
+
+  pthread_mutex_lock(&world_mutex);
+
+  pthread_mutex_lock(&sim_mutex);
+  world_wanted = false;
+  pthread_cond_broadcast(&sim_cond);
+  pthread_mutex_unlock(&sim_mutex);
+}
+
+void WorldGui::UnlockWorld()
+{
+  if (--world_locks > 0)
+    return;
+
+  // show what the GUI thread changed
+  if (dirty)
+    PublishSnapshot();
+
+  pthread_mutex_unlock(&world_mutex);
+}
+
+int WorldGui::DispatchEvent(int event, Fl_Window *window)
+{
+  if (event_world == NULL)
+    return Fl::handle_(event, window);
+
+  event_world->LockWorld();
+  const int handled(Fl::handle_(event, window));
+  event_world->UnlockWorld();
+
+  return handled;
+}
+
+void WorldGui::PublishSnapshot()
+{
+  const RenderShown shown(canvas->snapshots.Shown());
+  RenderSnapshot &snap(canvas->snapshots.Write());
+
+  size_t count(0);
+  FOR_EACH (it, World::children)
+    (*it)->CaptureRenderTree(snap.models, count, shown);
+  snap.models.resize(count);
+
+  snap.sim_time = sim_time;
+  snap.clock = ClockString();
+  snap.extent = GetExtent();
+  snap.rt_cells = rt_cells;
+  snap.rt_candidate_cells = rt_candidate_cells;
+
+  snap.rays.clear();
+  FOR_EACH (it, ray_list)
+    snap.rays.insert(snap.rays.end(), *it, *it + 4);
+  ClearRays();
+
+  snap.occupancy.Clear();
+  if (shown.occupancy)
+    CaptureOccupancy(snap.occupancy);
+
+  snap.voxels.Clear();
+  if (shown.voxels)
+    CaptureVoxels(snap.voxels);
+
+  canvas->snapshots.Publish();
+  dirty = false;
+}
+
+void WorldGui::StartSimThread()
+{
+  if (sim_thread_running)
+    return;
+
+  pthread_mutex_lock(&sim_mutex);
+  sim_quit = false;
+  sim_wake = false;
+  pthread_mutex_unlock(&sim_mutex);
+
+  if (pthread_create(&sim_thread, NULL, SimThread, this) != 0) {
+    PRINT_WARN("failed to start the simulation thread, so updating from the GUI instead");
+    return;
+  }
+
+  sim_thread_running = true;
+
+  LockWorld();
+  if (!paused)
+    SetTimeouts(); // move the updates onto the thread
+  UnlockWorld();
+}
+
+void WorldGui::StopSimThread()
+{
+  if (!sim_thread_running)
+    return;
+
+  pthread_mutex_lock(&sim_mutex);
+  sim_quit = true;
+  sim_wake = true;
+  pthread_cond_broadcast(&sim_cond);
+  pthread_mutex_unlock(&sim_mutex);
+
+  // it needs the world's lock to finish an update
+  if (world_locks > 0)
+    pthread_mutex_unlock(&world_mutex);
+  pthread_join(sim_thread, NULL);
+  if (world_locks > 0)
+    pthread_mutex_lock(&world_mutex);
+
+  sim_thread_running = false;
+  sim_on_thread = false;
+
+  if (!paused)
+    SetTimeouts(); // back to FLTK timeouts
+}
+
 std::string WorldGui::ClockString() const
 {
   std::string str = World::ClockString();
@@ -471,14 +741,14 @@ std::string WorldGui::EnergyString() const
   snprintf(str, 512,
 	   "Energy\n  stored:   %.0f / %.0f KJ\n  input:    %.0f "
 	   "KJ\n  output:   %.0f KJ at %.2f KW\n",
-           PowerPack::global_stored / 1e3, PowerPack::global_capacity / 1e3,
-           PowerPack::global_input / 1e3, PowerPack::global_dissipated / 1e3,
-           (PowerPack::global_dissipated / (sim_time / 1e6)) / 1e3);
+           energy.stored / 1e3, energy.capacity / 1e3,
+           energy.input / 1e3, energy.dissipated / 1e3,
+           (energy.dissipated / (sim_time / 1e6)) / 1e3);
   
   return std::string(str);
 }
 
-void WorldGui::DrawOccupancy() const
+void WorldGui::CaptureOccupancy(Gl::VertexBatch &batch) const
 {
   // 	int count=0;
   //   FOR_EACH( it, superregions )
@@ -490,22 +760,33 @@ void WorldGui::DrawOccupancy() const
   //  unsigned int layer( updates % 2 );
 
   FOR_EACH (it, superregions)
-    it->second->DrawOccupancy();
+    it->second->AppendOccupancy(batch);
+}
 
-  // 	 {
+void WorldGui::CaptureVoxels(Gl::VertexBatch &batch) const
+{
+  unsigned int layer(updates % 2);
 
-  // it->second->DrawOccupancy(0);
-  //    it->second->DrawOccupancy(1);
+  FOR_EACH (it, superregions)
+    it->second->AppendVoxels(batch, layer);
+}
 
-  //	 }
+void WorldGui::DrawOccupancy() const
+{
+  Gl::VertexBatch batch(GL_QUADS);
+  CaptureOccupancy(batch);
+
+  glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+  batch.Draw();
 }
 
 void WorldGui::DrawVoxels() const
 {
-  unsigned int layer(updates % 2);
+  Gl::VertexBatch batch(GL_QUADS);
+  CaptureVoxels(batch);
 
-  FOR_EACH (it, superregions)
-    it->second->DrawVoxels(layer);
+  glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+  batch.Draw();
 }
 
 void WorldGui::windowCb(Fl_Widget *, WorldGui *wg)
@@ -521,7 +802,9 @@ void WorldGui::windowCb(Fl_Widget *, WorldGui *wg)
   }
 
   puts("Stage: User closed window");
+  wg->LockWorld();
   wg->QuitAll();
+  wg->UnlockWorld();
 }
 
 void WorldGui::fileLoadCb(Fl_Widget *, WorldGui *wg)
@@ -544,6 +827,8 @@ void WorldGui::fileLoadCb(Fl_Widget *, WorldGui *wg)
     if (FileManager::readable(filename)) {
       // file is readable, clear and load
 
+      wg->LockWorld();
+
       // if (initialized) {
       wg->Stop();
       wg->UnLoad();
@@ -552,6 +837,8 @@ void WorldGui::fileLoadCb(Fl_Widget *, WorldGui *wg)
       // todo: make sure loading is successful
       wg->Load(filename);
       wg->Start(); // if (stopped)
+
+      wg->UnlockWorld();
     } else {
       fl_alert("Unable to read selected world file.");
     }
@@ -561,7 +848,9 @@ void WorldGui::fileLoadCb(Fl_Widget *, WorldGui *wg)
 void WorldGui::fileSaveCb(Fl_Widget *, WorldGui *wg)
 {
   // save to current file
+  wg->LockWorld();
   const bool success = wg->Save(NULL);
+  wg->UnlockWorld();
   if (!success) {
     fl_alert("Error saving world file.");
   }
@@ -593,37 +882,70 @@ void WorldGui::resetViewCb(Fl_Widget *, WorldGui *wg)
 
 void WorldGui::slowerCb(Fl_Widget *, WorldGui *wg)
 {
+  wg->LockWorld();
   if (wg->speedup <= 0) {
     wg->speedup = 100.0;
     wg->SetTimeouts();
   } else
     wg->speedup *= 0.8;
+  wg->UnlockWorld();
 }
 
 void WorldGui::fasterCb(Fl_Widget *, WorldGui *wg)
 {
+  wg->LockWorld();
   if (wg->speedup <= 0)
     putchar(7); // bell - can go no faster
   else
     wg->speedup *= 1.2;
+  wg->UnlockWorld();
 }
 
 void WorldGui::realtimeCb(Fl_Widget *, WorldGui *wg)
 {
   // puts( "real time" );
+  wg->LockWorld();
   wg->speedup = 1.0;
 
   if (!wg->paused)
     wg->SetTimeouts();
+  wg->UnlockWorld();
 }
 
 void WorldGui::fasttimeCb(Fl_Widget *, WorldGui *wg)
 {
   // puts( "fast time" );
+  wg->LockWorld();
   wg->speedup = -1;
 
   if (!wg->paused)
     wg->SetTimeouts();
+  wg->UnlockWorld();
+}
+
+void WorldGui::replayBackCb(Fl_Widget *, WorldGui *wg)
+{
+  wg->JumpReplay(-10.0);
+}
+
+void WorldGui::replayForwardCb(Fl_Widget *, WorldGui *wg)
+{
+  wg->JumpReplay(10.0);
+}
+
+void WorldGui::JumpReplay(double seconds)
+{
+  if (!Replaying()) {
+    putchar(7); // bell - nothing to jump in
+    return;
+  }
+
+  LockWorld();
+  const int64_t ticks((int64_t)updates + (int64_t)(seconds * 1e6 / sim_interval));
+  SeekReplay(ticks > 0 ? ticks : 0);
+  UnlockWorld();
+
+  canvas->redraw();
 }
 
 void WorldGui::Redraw()
@@ -636,7 +958,9 @@ void WorldGui::Start()
 {
   World::Start();
 
-  // start the timer that causes regular redraws
+  // start the timer that causes regular redraws, which may still run
+  // if the simulation thread stopped the world
+  Fl::remove_timeout((Fl_Timeout_Handler)Canvas::TimerCallback, canvas);
   Fl::add_timeout(((double)canvas->interval / 1000), (Fl_Timeout_Handler)Canvas::TimerCallback,
                   canvas);
 
@@ -649,7 +973,20 @@ void WorldGui::SetTimeouts()
   Fl::remove_idle((Fl_Timeout_Handler)UpdateCallback, this);
   Fl::remove_timeout((Fl_Timeout_Handler)UpdateCallback, this);
 
-  if (speedup > 0.0)
+  // cameras draw with the canvas's OpenGL context, which is only
+  // current in the GUI thread
+  sim_on_thread = sim_thread_running;
+  const std::set<Model *> all(GetAllModels());
+  FOR_EACH (it, all)
+    if (dynamic_cast<ModelCamera *>(*it)) {
+      sim_on_thread = false;
+      break;
+    }
+
+  if (sim_on_thread)
+    // the thread paces itself
+    WakeSimThread();
+  else if (speedup > 0.0)
     // attempt some multiple of real time
     Fl::add_timeout((sim_interval / 1e6) / speedup, (Fl_Timeout_Handler)UpdateCallback, this);
   else
@@ -661,6 +998,10 @@ void WorldGui::Stop()
 {
   World::Stop();
 
+  // the updates stop, so none will publish what the last one skipped
+  if (canvas->snapshots.Skipped())
+    PublishSnapshot();
+
   Fl::remove_timeout((Fl_Timeout_Handler)Canvas::TimerCallback);
   Fl::remove_timeout((Fl_Timeout_Handler)UpdateCallback);
   Fl::remove_idle((Fl_Timeout_Handler)UpdateCallback, this);
@@ -672,16 +1013,22 @@ void WorldGui::Stop()
 
 void WorldGui::pauseCb(Fl_Widget *, WorldGui *wg)
 {
+  wg->LockWorld();
   wg->TogglePause();
+  wg->UnlockWorld();
 }
 
 void WorldGui::onceCb(Fl_Widget *, WorldGui *wg)
 {
+  wg->LockWorld();
+
   // wg->paused = true;
   wg->Stop();
 
   // run exactly once
   wg->World::Update();
+
+  wg->UnlockWorld();
 }
 
 void WorldGui::viewOptionsCb(OptionsDlg *, WorldGui *wg)
@@ -841,7 +1188,9 @@ bool WorldGui::saveAsDialog()
 
   if (newFilename != NULL) {
     // todo: make sure file ends in .world
+    LockWorld();
     success = Save(newFilename);
+    UnlockWorld();
     if (!success) {
       fl_alert("Error saving world file.");
     }
@@ -879,12 +1228,6 @@ bool WorldGui::closeWindowQuery()
   }
 }
 
-void WorldGui::DrawBoundingBoxTree()
-{
-  FOR_EACH (it, World::children)
-    (*it)->DrawBoundingBoxTree();
-}
-
 void WorldGui::PushColor(Color col)
 {
   canvas->PushColor(col);
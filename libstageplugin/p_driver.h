@@ -132,7 +132,8 @@ public:
 
 class InterfaceRanger : public InterfaceModel {
 private:
-  int scan_id;
+  uint64_t scan_id; ///< the sequence number of the last scan published
+  std::vector<double> ranges, intensities; ///< kept to avoid allocating at each publish
 
 public:
   InterfaceRanger(player_devaddr_t addr, StgDriver *driver, ConfigFile *cf, int section);
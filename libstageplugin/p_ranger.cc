@@ -43,15 +43,20 @@ using namespace Stg;
 
 InterfaceRanger::InterfaceRanger(player_devaddr_t addr, StgDriver *driver, ConfigFile *cf,
                                  int section)
-    : InterfaceModel(addr, driver, cf, section, "ranger")
+    : InterfaceModel(addr, driver, cf, section, "ranger"), scan_id(0), ranges(), intensities()
 {
-  this->scan_id = 0;
 }
 
 void InterfaceRanger::Publish(void)
 {
   ModelRanger *rgr = dynamic_cast<ModelRanger *>(this->mod);
 
+  // publish each scan once
+  const ModelRanger::Scan scan = rgr->GetScan();
+  if (scan.sequence == this->scan_id)
+    return;
+  this->scan_id = scan.sequence;
+
   // the Player interface dictates that if multiple sensor poses are
   // given, then we have exactly one range reading per sensor. To give
   // multiple ranges from the same origin, only one sensor is allowed.
@@ -65,8 +70,6 @@ void InterfaceRanger::Publish(void)
   player_ranger_data_intns_t pintens;
   memset(&pintens, 0, sizeof(pintens));
 
-  std::vector<double> rv, iv;
-
   if (sensors.size() == 1) // a laser scanner type, with one beam origin and many ranges
   {
     prange.ranges_count = sensors[0].ranges.size();
@@ -75,19 +78,20 @@ void InterfaceRanger::Publish(void)
     pintens.intensities_count = sensors[0].intensities.size();
     pintens.intensities = pintens.intensities_count ? &sensors[0].intensities[0] : NULL;
   } else { // a sonar/IR type with one range per beam origin
-    FOR_EACH (it, sensors) {
-      if (it->ranges.size())
-        rv.push_back(it->ranges[0]);
+    this->ranges.clear();
+    this->intensities.clear();
 
-      if (it->intensities.size())
-        iv.push_back(it->intensities[0]);
-    }
+    FOR_EACH (it, sensors)
+      if (it->sample_count && it->offset < scan.count) {
+        this->ranges.push_back(scan.ranges[it->offset]);
+        this->intensities.push_back(scan.intensities[it->offset]);
+      }
 
-    prange.ranges_count = rv.size();
-    prange.ranges = rv.size() ? &rv[0] : NULL;
+    prange.ranges_count = this->ranges.size();
+    prange.ranges = this->ranges.size() ? &this->ranges[0] : NULL;
 
-    pintens.intensities_count = iv.size();
-    pintens.intensities = iv.size() ? &iv[0] : NULL;
+    pintens.intensities_count = this->intensities.size();
+    pintens.intensities = this->intensities.size() ? &this->intensities[0] : NULL;
   }
 
   if (prange.ranges_count)